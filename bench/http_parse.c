@@ -0,0 +1,126 @@
+/*
+ * Micro-benchmark of http_request_parse() and http_decode_uri().
+ *
+ * Each request is parsed as received in one packet, and in pieces of
+ * some bytes, which calls the parser after each piece as the request
+ * flow does after each recv().
+ *
+ * Usage: ./http_parse [loops]
+ *
+ */
+
+#include "olivehc.h"
+
+ohc_timer_t master_timer;
+
+static ohc_server_t bench_server = {
+	.max_ranges = 1,
+};
+
+static char *bench_requests[] = {
+	"GET /img/2013/05/a/b/c1234567.jpg?w=200&h=100 HTTP/1.1\r\n"
+	"Host: img.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"Range: bytes=0-1023\r\n"
+	"If-Modified-Since: Wed, 15 May 2013 08:00:00 GMT\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64)\r\n"
+	"Accept: */*\r\n"
+	"\r\n",
+
+	"PUT /img/2013/05/a/b/c1234567.jpg?w=200&h=100 HTTP/1.1\r\n"
+	"Host: img.example.com\r\n"
+	"Content-Length: 10240\r\n"
+	"Content-Type: image/jpeg\r\n"
+	"Cache-Control: max-age=86400\r\n"
+	"Last-Modified: Wed, 15 May 2013 08:00:00 GMT\r\n"
+	"ETag: \"51934a80-2800\"\r\n"
+	"OHC-Tag: img user-1234\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"Server: nginx\r\n"
+	"\r\n",
+};
+
+static char *bench_uris[] = {
+	"/img/2013/05/a/b/c1234567.jpg?w=200&h=100",
+	"/img/2013/05/%E4%B8%AD%E6%96%87/a/b/c1234567.jpg?w=200&h=100",
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_request_init(ohc_request_t *r)
+{
+	memset(r, 0, offsetof(ohc_request_t, _buffer));
+	r->server = &bench_server;
+	r->keepalive = 1;
+	r->content_length = -1;
+	r->buf_pos = r->_buffer;
+	r->parse_pos = NULL;
+}
+
+/* parse @req in pieces of @piece bytes. return the ns per request */
+static double bench_parse(ohc_request_t *r, char *req, int piece, int loops)
+{
+	ssize_t len = strlen(req), n;
+	double start;
+	int i, rc = OHC_AGAIN;
+
+	start = bench_now();
+	for(i = 0; i < loops; i++) {
+		bench_request_init(r);
+		while(r->buf_pos - r->_buffer < len) {
+			n = len - (r->buf_pos - r->_buffer);
+			if(n > piece) {
+				n = piece;
+			}
+			memcpy(r->buf_pos, req + (r->buf_pos - r->_buffer), n);
+			r->buf_pos += n;
+			rc = http_request_parse(r);
+		}
+		if(rc != OHC_DONE) {
+			fprintf(stderr, "parse fails: %s\n", r->error_reason);
+			exit(1);
+		}
+	}
+	return (bench_now() - start) / loops;
+}
+
+int main(int argc, char **argv)
+{
+	static ohc_request_t r;
+	char output[REQ_BUF_SIZE];
+	int pieces[] = {REQ_BUF_SIZE, 64, 16};
+	int loops = argc > 1 ? atoi(argv[1]) : 1000000;
+	ssize_t len;
+	double start;
+	int i, j;
+
+	if(http_init() != OHC_OK) {
+		fprintf(stderr, "error in http_init()\n");
+		return 1;
+	}
+	timer_init(&master_timer);
+
+	for(i = 0; i < sizeof(bench_requests) / sizeof(char *); i++) {
+		for(j = 0; j < sizeof(pieces) / sizeof(int); j++) {
+			printf("%.4s %4d-byte pieces: %8.1f ns\n", bench_requests[i],
+					pieces[j], bench_parse(&r, bench_requests[i],
+						pieces[j], loops));
+		}
+	}
+
+	for(i = 0; i < sizeof(bench_uris) / sizeof(char *); i++) {
+		len = strlen(bench_uris[i]);
+		start = bench_now();
+		for(j = 0; j < loops; j++) {
+			http_decode_uri(bench_uris[i], len, output);
+		}
+		printf("decode %ld-byte uri:     %8.1f ns\n", len,
+				(bench_now() - start) / loops);
+	}
+	return 0;
+}
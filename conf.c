@@ -118,19 +118,41 @@ static const char *conf_new_device(ohc_conf_command_t *cmd, void *data, char *ar
 	bzero(device, sizeof(ohc_device_t));
 
 	device->fd = -1;
+	device->weight = 100;
 	strcpy(device->filename, arg);
 	list_add_tail(&device->dnode, &conf_cycle.devices);
 	return OHC_CONF_OK;
 }
 
+/* set weight of the last device */
+static const char *conf_device_weight(ohc_conf_command_t *cmd, void *data, char *arg)
+{
+	ohc_device_t *device;
+
+	if(list_empty(&conf_cycle.devices)) {
+		return "no device before";
+	}
+	device = list_entry(conf_cycle.devices.prev, ohc_device_t, dnode);
+	return conf_set_int(cmd, device, arg);
+}
+
 static const char *conf_new_server(ohc_conf_command_t *cmd, void *data, char *arg)
 {
 	ohc_server_t *server;
 	struct list_head *p;
-	char *endp;
-	long port = strtol(arg, &endp, 0);
-	if(*endp != '\0' || port < 0 || port > 65535) {
-		return "invalid port";
+	char *endp, *path = "";
+	long port = 0;
+
+	if(strncmp(arg, "unix:", 5) == 0) {
+		path = arg + 5;
+		if(*path == '\0' || strlen(path) >= SERVER_PATH_MAX) {
+			return "invalid unix socket path";
+		}
+	} else {
+		port = strtol(arg, &endp, 0);
+		if(*endp != '\0' || port < 0 || port > 65535) {
+			return "invalid port";
+		}
 	}
 
 	if(!list_empty(&reserved_servers)) {
@@ -145,7 +167,7 @@ static const char *conf_new_server(ohc_conf_command_t *cmd, void *data, char *ar
 	}
 
 	*server = default_server;
-	server->listen_port = (unsigned short)port;
+	server_set_listen(server, (unsigned short)port, path);
 	server->listen_fd = -1;
 	list_add_tail(&server->snode, &conf_cycle.servers);
 
@@ -176,10 +198,30 @@ static ohc_conf_command_t g_commands[] = {
 		conf_set_flag,
 		offsetof(ohc_conf_t, device_check_270G)
 	},
+	{	"journal_dir",
+		conf_set_path,
+		offsetof(ohc_conf_t, journal_dir)
+	},
+	{	"journal_checkpoint_interval",
+		conf_set_int,
+		offsetof(ohc_conf_t, journal_checkpoint_interval)
+	},
+	{	"item_table",
+		conf_set_path,
+		offsetof(ohc_conf_t, item_table)
+	},
+	{	"prewarm_items",
+		conf_set_int,
+		offsetof(ohc_conf_t, prewarm_items)
+	},
 	{	"device",
 		conf_new_device,
 		0
 	},
+	{	"device_weight",
+		conf_device_weight,
+		offsetof(ohc_device_t, weight)
+	},
 
 	/* server */
 	{	"listen",
@@ -226,6 +268,14 @@ static ohc_conf_command_t g_commands[] = {
 		conf_set_int,
 		offsetof(ohc_server_t, expire_force)
 	},
+	{	"stale_while_revalidate",
+		conf_set_int,
+		offsetof(ohc_server_t, stale_while_revalidate)
+	},
+	{	"grace",
+		conf_set_int,
+		offsetof(ohc_server_t, grace)
+	},
 	{	"keepalive_timeout",
 		conf_set_int,
 		offsetof(ohc_server_t, keepalive_timeout)
@@ -234,6 +284,22 @@ static ohc_conf_command_t g_commands[] = {
 		conf_set_size,
 		offsetof(ohc_server_t, item_max_size)
 	},
+	{	"small_item_size",
+		conf_set_size,
+		offsetof(ohc_server_t, small_item_size)
+	},
+	{	"chunk_size",
+		conf_set_size,
+		offsetof(ohc_server_t, chunk_size)
+	},
+	{	"max_ranges",
+		conf_set_int,
+		offsetof(ohc_server_t, max_ranges)
+	},
+	{	"prefix_depth",
+		conf_set_int,
+		offsetof(ohc_server_t, prefix_depth)
+	},
 	{	"key_include_host",
 		conf_set_flag,
 		offsetof(ohc_server_t, key_include_host)
@@ -254,6 +320,14 @@ static ohc_conf_command_t g_commands[] = {
 		conf_set_flag,
 		offsetof(ohc_server_t, shutdown_if_not_store)
 	},
+	{	"read_while_write",
+		conf_set_flag,
+		offsetof(ohc_server_t, read_while_write)
+	},
+	{	"memcached",
+		conf_set_flag,
+		offsetof(ohc_server_t, memcached)
+	},
 	{	"passby_enable",
 		conf_set_flag,
 		offsetof(ohc_server_t, passby_enable)
@@ -442,6 +516,10 @@ ohc_conf_t *conf_parse(const char *filename)
 	conf_cycle.device_badblock_percent = 1;
 	conf_cycle.device_check_270G = 1;
 	strcpy(conf_cycle.error_log, "error.log");
+	conf_cycle.journal_dir[0] = '\0';
+	conf_cycle.journal_checkpoint_interval = 3600;
+	conf_cycle.item_table[0] = '\0';
+	conf_cycle.prewarm_items = 0;
 
 	/* init default_server */
 	bzero(&default_server, sizeof(default_server));
@@ -452,7 +530,13 @@ ohc_conf_t *conf_parse(const char *filename)
 	default_server.request_timeout = 60;
 	default_server.keepalive_timeout = 60;
 	default_server.item_max_size = 100 << 20; /*100M*/
+	default_server.small_item_size = 0;
+	default_server.chunk_size = 0;
+	default_server.max_ranges = 16;
+	default_server.prefix_depth = 0;
 	default_server.expire_default = 259200;  /*3days*/
+	default_server.stale_while_revalidate = 0;
+	default_server.grace = 0;
 	default_server.expire_force = 0;
 	default_server.sndbuf = 0;
 	default_server.rcvbuf = 0;
@@ -461,6 +545,8 @@ ohc_conf_t *conf_parse(const char *filename)
 	default_server.key_include_query = 0;
 	default_server.key_include_host = 0;
 	default_server.key_include_ohc_key = 0;
+	default_server.read_while_write = 0;
+	default_server.memcached = 0;
 	default_server.passby_enable = 0;
 	default_server.passby_begin_item_nr = 1000*1000;
 	default_server.passby_begin_consumed = 100L << 30; /*100G*/
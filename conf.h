@@ -15,8 +15,12 @@ struct ohc_conf_s {
 	int		device_badblock_percent;
 	ohc_flag_t	device_check_270G;
 	time_t		quit_timeout;
+	int		journal_checkpoint_interval;
+	int		prewarm_items;
 
 	char		error_log[PATH_LENGTH];
+	char		journal_dir[PATH_LENGTH];
+	char		item_table[PATH_LENGTH];
 	FILE		*error_filp;
 
 	struct list_head	servers;
@@ -7,15 +7,24 @@
 
 #include "device.h"
 
-/* init in device_conf_load() */
-static ohc_ipbucket_t free_blocks;
-
 static LIST_HEAD(devices);
 static LIST_HEAD(deleted_devices);
 
 static int device_badblock_percent;
 static int device_check_270G;
 
+/* set after starting loading items, so devices added later are new */
+static int device_started = 0;
+
+/* set after the devices in item table are attached */
+static int device_attached = 0;
+
+/* the number of devices in loading */
+static int device_loading_nr = 0;
+
+/* the device where the last block was allocated */
+static ohc_device_t *device_last_placed = NULL;
+
 /* this makes things complicated, but it's useful for saving
  * memory, in ohc_item_t and ohc_free_block_t. */
 static idx_pointer_t device_indexs = IDX_POINTER_INIT();
@@ -31,27 +40,32 @@ inline ohc_device_t *device_of_item(ohc_item_t *item)
 	return idx_pointer_get(&device_indexs, item->device_index);
 }
 
+inline ohc_device_t *device_of_page(ohc_page_t *page)
+{
+	return idx_pointer_get(&device_indexs, page->device_index);
+}
+
 
 static inline void device_ipbucket_add(ohc_free_block_t *fblock)
 {
-	ipbucket_add(&free_blocks, &fblock->bucket_node, fblock->block_size);
+	ipbucket_add(&device_of_fblock(fblock)->tab->free_blocks,
+			&fblock->bucket_node, fblock->block_size);
 }
 
 static inline void device_ipbucket_update(ohc_free_block_t *fblock)
 {
-	ipbucket_update(&free_blocks, &fblock->bucket_node, fblock->block_size);
+	ipbucket_update(&device_of_fblock(fblock)->tab->free_blocks,
+			&fblock->bucket_node, fblock->block_size);
 }
 
 /* add a free block (with @offset and @size) into @device's order list,
  * before @base. */
 static ohc_free_block_t *device_fblock_insert(ohc_device_t *device,
-		struct list_head *base, off_t offset, size_t size)
+		struct tlist_head *base, off_t offset, size_t size)
 {
-	static ohc_slab_t free_block_slab = OHC_SLAB_INIT(ohc_free_block_t);
-
 	ohc_free_block_t *fblock;
 
-	fblock = slab_alloc(&free_block_slab);
+	fblock = table_alloc();
 	if(fblock == NULL) {
 		return NULL;
 	}
@@ -59,10 +73,10 @@ static ohc_free_block_t *device_fblock_insert(ohc_device_t *device,
 	fblock->device_index = device->index;
 	fblock->offset = offset;
 	fblock->block_size = size;
-	list_add_tail(&fblock->order_node, base);
+	tlist_add_tail(&fblock->order_node, base);
 	device_ipbucket_add(fblock);
 
-	device->fblock_nr++;
+	device->tab->fblock_nr++;
 	return fblock;
 }
 
@@ -70,10 +84,10 @@ static ohc_free_block_t *device_fblock_insert(ohc_device_t *device,
 static void device_fblock_delete(ohc_free_block_t *fblock)
 {
 	ohc_device_t *device = device_of_fblock(fblock);
-	device->fblock_nr--;
+	device->tab->fblock_nr--;
 	ipbucket_del(&fblock->bucket_node);
-	list_del(&fblock->order_node);
-	slab_free(fblock);
+	tlist_del(&fblock->order_node);
+	table_free(fblock);
 }
 
 /* remove the conf_device from conf_cycle.devices list,
@@ -86,22 +100,39 @@ static void device_add(ohc_device_t *conf_device)
 	list_del(&d->dnode);
 	list_add_tail(&d->dnode, &devices);
 
-	INIT_LIST_HEAD(&d->order_head);
+	/* attached to the reused item table, with its items */
+	if(d->tab != NULL) {
+		return;
+	}
+
 	conf_device->index = idx_pointer_add(&device_indexs, conf_device);
-	if(d->capacity != 0) {
-		if(device_fblock_insert(d, &d->order_head, 0, d->capacity) == NULL) {
+	d->tab = table_device_init(d->index, d);
+	if(d->capacity > OHC_FM_LABEL_SIZE) {
+		if(device_fblock_insert(d, &d->tab->order_head, OHC_FM_LABEL_SIZE,
+					d->capacity - OHC_FM_LABEL_SIZE) == NULL) {
 			conf_device->kicked = 1;
+			d->tab->inuse = 0;
 			log_error_admin(0, "add device %s [NOMEM]", d->filename);
 			return;
 		}
 	}
 
+	/* replaced by the loaded one, if any */
+	d->tab->secret = format_new_secret();
+
+	if(device_started) {
+		d->tab->ready = 1;
+		format_mark_used(d);
+		journal_open(d, 0);
+	}
+
 	/* other fields were set to zero, when malloc the conf_server */
 }
 
 static void device_update(ohc_device_t *d, ohc_device_t *conf_device)
 {
 	strcpy(d->filename, conf_device->filename);
+	d->weight = conf_device->weight;
 
 	/* keep in order */
 	list_del(&d->dnode);
@@ -110,6 +141,11 @@ static void device_update(ohc_device_t *d, ohc_device_t *conf_device)
 
 static void device_delete(ohc_device_t *d)
 {
+	if(d == device_last_placed) {
+		device_last_placed = NULL;
+	}
+	journal_close(d, 1);
+	format_rewrite_cancel(d);
 	list_del(&d->dnode);
 
 	if(d->kicked) {
@@ -122,18 +158,31 @@ static void device_delete(ohc_device_t *d)
 
 static void device_destroy(ohc_device_t *d)
 {
-	struct list_head *p, *safe;
+	struct tlist_head *p, *safe;
 	ohc_free_block_t *fblock;
 	ohc_item_t *item;
-	int count = 0;
+	int count = 0, chunked;
+
+	/* wait for device_format_load_step() to stop the loading */
+	if(d->loading) {
+		return;
+	}
 
-	list_for_each_safe(p, safe, &d->order_head) {
-		fblock = list_entry(p, ohc_free_block_t, order_node);
+	tlist_for_each_safe(p, safe, &d->tab->order_head) {
+		fblock = tlist_entry(p, ohc_free_block_t, order_node);
 		if(fblock->fblock) {
 			device_fblock_delete(fblock);
+		} else if(fblock->is_page) {
+			page_evict(tlist_entry(p, ohc_page_t, order_node));
 		} else {
-			item = list_entry(p, ohc_item_t, order_node);
+			item = tlist_entry(p, ohc_item_t, order_node);
+
+			/* @safe may be deleted with the chunks, so restart */
+			chunked = item->chunked && !item->deleted;
 			server_item_delete(item);
+			if(chunked) {
+				safe = tlist_next(&d->tab->order_head);
+			}
 		}
 
 		if(count++ >= LOOP_LIMIT) {
@@ -148,11 +197,12 @@ static void device_destroy(ohc_device_t *d)
 		d->fd = -1;
 	}
 
-	if(!list_empty(&d->order_head)) {
+	if(!tlist_empty(&d->tab->order_head)) {
 		return;
 	}
 
 	list_del(&d->dnode);
+	d->tab->inuse = 0;
 	idx_pointer_delete(&device_indexs, d->index);
 	free(d);
 }
@@ -162,15 +212,22 @@ static void device_destroy(ohc_device_t *d)
  * for show status and re-load configure. */
 static void device_kick(ohc_device_t *device)
 {
-	ohc_device_t *bad_dev = malloc(sizeof(ohc_device_t));
+	ohc_device_t *bad_dev;
+
+	/* with a copy of the counters, for status */
+	bad_dev = malloc(sizeof(ohc_device_t) + sizeof(ohc_table_device_t));
 	if(bad_dev == NULL) {
 		return;
 	}
 
 	*bad_dev = *device;
+	bad_dev->tab = (ohc_table_device_t *)(bad_dev + 1);
+	*bad_dev->tab = *device->tab;
 
 	bad_dev->kicked = 1;
-	INIT_LIST_HEAD(&bad_dev->order_head);
+	bad_dev->journal = NULL;
+	bad_dev->loading = 0;
+	bad_dev->loader = NULL;
 
 	list_add(&bad_dev->dnode, &device->dnode);
 	device_delete(device);
@@ -308,21 +365,62 @@ fail:
 	return OHC_ERROR;
 }
 
-void device_conf_load(ohc_conf_t *conf_cycle)
+/* At the first loading, the devices in reused item table take their
+ * indexes back, if they are not changed since then. Others there are
+ * deleted, with their items. */
+static void device_table_attach(ohc_conf_t *conf_cycle)
 {
-	struct list_head *p, *safe;
+	struct list_head *p;
 	ohc_device_t *d;
+	int index;
+
+	list_for_each(p, &conf_cycle->devices) {
+		d = list_entry(p, ohc_device_t, dnode);
+		index = table_device_find(d->dev, d->inode, d->capacity);
+		if(index < 0 || !format_check_used(d, table_device(index)->secret)) {
+			continue;
+		}
+		d->index = index;
+		d->tab = table_device(index);
+		idx_pointer_set(&device_indexs, index, d);
+	}
+
+	for(index = 0; index < DEVICES_LIMIT; index++) {
+		if(!table_device(index)->inuse
+				|| idx_pointer_get(&device_indexs, index) != NULL) {
+			continue;
+		}
 
-	/* init free_blocks. executes only once */
-	static int first = 1;
-	if(first) {
-		first = 0;
-		ipbucket_init(&free_blocks);
+		d = calloc(1, sizeof(ohc_device_t));
+		if(d == NULL) {
+			log_error_run(0, "NoMem for devices in item_table");
+			exit(1);
+		}
+		d->index = index;
+		d->tab = table_device(index);
+		d->dev = d->tab->dev;
+		d->inode = d->tab->inode;
+		d->capacity = d->tab->capacity;
+		d->fd = -1;
+		d->deleted = 1;
+		idx_pointer_set(&device_indexs, index, d);
+		list_add(&d->dnode, &deleted_devices);
 	}
+}
+
+void device_conf_load(ohc_conf_t *conf_cycle)
+{
+	struct list_head *p, *safe;
+	ohc_device_t *d;
 
 	device_badblock_percent = conf_cycle->device_badblock_percent;
 	device_check_270G = conf_cycle->device_check_270G;
 
+	if(!device_attached) {
+		device_table_attach(conf_cycle);
+		device_attached = 1;
+	}
+
 	list_for_each_safe(p, safe, &devices) {
 		d = list_entry(p, ohc_device_t, dnode);
 		if(d->conf == NULL) {
@@ -353,42 +451,71 @@ void device_conf_rollback(ohc_conf_t *conf_cycle)
 	}
 }
 
-static void device_delete_item(ohc_device_t *d, struct list_head *p)
+static void device_delete_item(ohc_device_t *d, struct tlist_head *p)
 {
-	if(p == &d->order_head) {
+	if(p == &d->tab->order_head) {
 		return;
 	}
 
-	ohc_free_block_t *fblock = list_entry(p, ohc_free_block_t, order_node);
+	ohc_free_block_t *fblock = tlist_entry(p, ohc_free_block_t, order_node);
 	if(fblock->fblock) {
 		return;
 	}
+	if(fblock->is_page) {
+		page_evict(tlist_entry(p, ohc_page_t, order_node));
+		return;
+	}
 
-	ohc_item_t *item = list_entry(p, ohc_item_t, order_node);
+	ohc_item_t *item = tlist_entry(p, ohc_item_t, order_node);
 	if(item->putting || item->used) { /* do not delete hot item */
 		return;
 	}
 	server_item_delete(item);
 }
 
+/* return an almost biggest free block of all devices */
+static ohc_free_block_t *device_biggest_fblock(void)
+{
+	ohc_free_block_t *fblock, *biggest = NULL;
+	struct list_head *p;
+	struct tlist_head *q;
+	ohc_device_t *d;
+
+	list_for_each(p, &devices) {
+		d = list_entry(p, ohc_device_t, dnode);
+		if(d->kicked || d->loading) {
+			continue;
+		}
+
+		q = ipbucket_biggest(&d->tab->free_blocks);
+		if(q == NULL) {
+			continue;
+		}
+		fblock = tlist_entry(q, ohc_free_block_t, bucket_node);
+		if(biggest == NULL || fblock->block_size > biggest->block_size) {
+			biggest = fblock;
+		}
+	}
+	return biggest;
+}
+
 /* delete items to extend free block, to make a big one */
 int device_free_block_extend(size_t target)
 {
 	ohc_free_block_t *fblock;
 	ohc_device_t *d;
-	struct list_head *p, *next;
+	struct tlist_head *next;
 	size_t last = 0;
 	int i;
 
 	target = ipbucket_block_size(target);
 
 	for(i = 0; i < LOOP_LIMIT; i++) {
-		p = ipbucket_biggest(&free_blocks);
-		if(p == NULL) {
+		fblock = device_biggest_fblock();
+		if(fblock == NULL) {
 			return OHC_ERROR;
 		}
 
-		fblock = list_entry(p, ohc_free_block_t, bucket_node);
 		if(fblock->block_size >= target) {
 			return OHC_OK;
 		}
@@ -399,63 +526,120 @@ int device_free_block_extend(size_t target)
 		last = fblock->block_size;
 
 		d = device_of_fblock(fblock);
-		if(d->deleted) {
-			device_fblock_delete(fblock);
-			continue;
-		}
 
 		/* device_delete_item() makes @fblock invalid, so
 		 * we have to remember @next before call it. */
-		next = fblock->order_node.next;
-		device_delete_item(d, fblock->order_node.prev);
+		next = tlist_next(&fblock->order_node);
+		device_delete_item(d, tlist_prev(&fblock->order_node));
 		device_delete_item(d, next);
 	}
 	return OHC_ERROR;
 }
 
-/* @server module call this to allocate a free block for a new item.
- * Set @item's @device and @offset member, and return free-block's
- * size, if alloc successfully.
- * Return 0 if fail. */
-size_t device_get_free_block(ohc_item_t *item)
+/* Score of @device for placing a new block, the higher the better.
+ * Idle device, with less write latency and more free space, wins. */
+static long device_placement_score(ohc_device_t *device)
+{
+	long free_permille = (device->capacity - device->tab->consumed)
+			* 1000 / device->capacity;
+
+	return device->weight * free_permille
+		/ (1 + device->used)
+		/ (1 + device->write_latency / 1000);
+}
+
+static inline int device_placeable(ohc_device_t *d)
+{
+	/* the free space of loading device is not known yet */
+	return !d->kicked && !d->loading && d->weight != 0 && d->capacity != 0;
+}
+
+/* whether any device can take new items now */
+int device_available(void)
 {
-	ohc_free_block_t *fblock;
-	ohc_device_t *device;
 	struct list_head *p;
-	size_t bsize;
-	int try = 0;
 
-try_again:
-	p = ipbucket_get(&free_blocks, item->length);
-	if(p == NULL) {
-		return 0;
+	list_for_each(p, &devices) {
+		if(device_placeable(list_entry(p, ohc_device_t, dnode))) {
+			return 1;
+		}
 	}
-	fblock = list_entry(p, ohc_free_block_t, bucket_node);
-	device = device_of_fblock(fblock);
+	return 0;
+}
 
-	if(device->deleted) {
-		device_fblock_delete(fblock);
-		if(try++ < LOOP_LIMIT) {
-			goto try_again;
+/* choose the device to place a new block in @length. We start from
+ * the device after the last placed one, so the devices with the same
+ * score are used in turn. */
+static ohc_device_t *device_placement(size_t length)
+{
+	struct list_head *start, *p;
+	ohc_device_t *d, *best = NULL;
+	long score, best_score = -1;
+
+	start = device_last_placed ? &device_last_placed->dnode : &devices;
+	p = start;
+	do {
+		p = p->next;
+		if(p == &devices) {
+			continue;
 		}
-		return 0;
+
+		d = list_entry(p, ohc_device_t, dnode);
+		if(!device_placeable(d)) {
+			continue;
+		}
+		if(ipbucket_fit(&d->tab->free_blocks, length) == NULL) {
+			continue;
+		}
+
+		score = device_placement_score(d);
+		if(score > best_score) {
+			best_score = score;
+			best = d;
+		}
+	} while(p != start);
+
+	if(best != NULL) {
+		device_last_placed = best;
+	}
+	return best;
+}
+
+/* allocate a free block in @length for @order_node, which is an item
+ * or a page. Set @offset, and return the device, if alloc successfully.
+ * Return NULL if fail. */
+static ohc_device_t *device_alloc_block(size_t length,
+		struct tlist_head *order_node, size_t *offset)
+{
+	ohc_free_block_t *fblock;
+	ohc_device_t *device;
+	struct tlist_head *p;
+	size_t bsize;
+
+	device = device_placement(length);
+	if(device == NULL) {
+		return NULL;
 	}
+	journal_before_alloc(device);
 
-	bsize = ipbucket_block_size(item->length);
+	p = ipbucket_get(&device->tab->free_blocks, length);
+	fblock = tlist_entry(p, ohc_free_block_t, bucket_node);
+
+	bsize = ipbucket_block_size(length);
 	if(fblock->block_size > bsize) {
 		/* fblock is bigger than needed, so cut bsize from rear */
 
-		item->offset = fblock->offset + fblock->block_size - bsize;
-		list_add(&item->order_node, &fblock->order_node);
+		*offset = fblock->offset + fblock->block_size - bsize;
+		tlist_add(order_node, &fblock->order_node);
 
 		fblock->block_size -= bsize;
 		device_ipbucket_add(fblock);
 
 	} else if(fblock->block_size == bsize) {
 		/* fit exactly */
-		item->offset = fblock->offset;
+		*offset = fblock->offset;
 
-		list_add(&item->order_node, &fblock->order_node);
+		tlist_add(order_node, &fblock->order_node);
 		device_fblock_delete(fblock);
 	} else {
 		/* should not be here */
@@ -463,34 +647,68 @@ try_again:
 		exit(1);
 	}
 
-	device->item_nr++;
-	device->consumed += bsize;
+	device->tab->consumed += bsize;
+	return device;
+}
+
+/* @server module call this to allocate a free block for a new item.
+ * Set @item's @device and @offset member, and return free-block's
+ * size, if alloc successfully.
+ * Return 0 if fail. */
+size_t device_get_free_block(ohc_item_t *item)
+{
+	ohc_device_t *device;
+	size_t offset;
+
+	device = device_alloc_block(item_block_length(item),
+			&item->order_node, &offset);
+	if(device == NULL) {
+		return 0;
+	}
+
+	device->tab->item_nr++;
+	item->offset = offset + item_head_size(item);
 	item->device_index = device->index;
-	return bsize;
+	return ipbucket_block_size(item_block_length(item));
 }
 
-/* @server module call this to free a free block when delete a item */
-size_t device_return_free_block(ohc_item_t *item)
+/* @page module call this to allocate a free block for a new page. */
+size_t device_get_page_block(ohc_page_t *page)
+{
+	ohc_device_t *device;
+	size_t offset;
+
+	device = device_alloc_block(OHC_PAGE_SIZE, &page->order_node, &offset);
+	if(device == NULL) {
+		return 0;
+	}
+
+	page->offset = offset;
+	page->device_index = device->index;
+	return ipbucket_block_size(OHC_PAGE_SIZE);
+}
+
+/* recycle the block (with @offset and @length) of @order_node */
+static size_t device_free_block(ohc_device_t *device, struct tlist_head *order,
+		size_t offset, size_t length, int badblock)
 {
 	ohc_free_block_t *prev = NULL, *next = NULL;
-	ohc_device_t *device = device_of_item(item);
 	off_t bsize;
 	int badp;
-	struct list_head *order = &item->order_node;
 	int forward = 0, backward = 0;
 
-	bsize = ipbucket_block_size(item->length);
+	bsize = ipbucket_block_size(length);
 
 	/* just delete item from order-list, if the device is deleted or bad. */
 	if(device->deleted) {
 		goto done;
 	}
-	if(item->badblock) {
-		device->badblock += bsize;
-		badp = device->badblock * 100 / device->capacity;
+	if(badblock) {
+		device->tab->badblock += bsize;
+		badp = device->tab->badblock * 100 / device->capacity;
 		if(badp > device_badblock_percent) {
 			log_error_run(0, "kick device '%s', badblock:%ld(%d%%)",
-					device->filename, device->badblock, badp);
+					device->filename, device->tab->badblock, badp);
 			device_kick(device);
 		}
 		goto done;
@@ -498,13 +716,13 @@ size_t device_return_free_block(ohc_item_t *item)
 
 	/* ok, now recycle the item's block */
 
-	if(order->prev != &device->order_head) {
-		prev = list_entry(order->prev, ohc_free_block_t, order_node);
-		forward = prev->fblock && (prev->offset + prev->block_size == item->offset);
+	if(tlist_prev(order) != &device->tab->order_head) {
+		prev = tlist_entry(tlist_prev(order), ohc_free_block_t, order_node);
+		forward = prev->fblock && (prev->offset + prev->block_size == offset);
 	}
-	if(order->next != &device->order_head) {
-		next = list_entry(order->next, ohc_free_block_t, order_node);
-		backward = next->fblock && (next->offset == item->offset + bsize);
+	if(tlist_next(order) != &device->tab->order_head) {
+		next = tlist_entry(tlist_next(order), ohc_free_block_t, order_node);
+		backward = next->fblock && (next->offset == offset + bsize);
 	}
 
 	if(forward && backward) {
@@ -524,31 +742,59 @@ size_t device_return_free_block(ohc_item_t *item)
 
 	} else {
 		/* we don't care the return value here */
-		device_fblock_insert(device, order, item->offset, bsize);
+		device_fblock_insert(device, order, offset, bsize);
 	}
 
-	device->item_nr--;
-	device->consumed -= bsize;
+	device->tab->consumed -= bsize;
 
 done:
-	list_del(order);
+	tlist_del(order);
 	return bsize;
 }
 
-/* @format module call this to cut a free-block from the beginning
- * of the remaining space */
-size_t device_cut_free_block(ohc_item_t *item)
+/* @server module call this to free a free block when delete a item */
+size_t device_return_free_block(ohc_item_t *item)
+{
+	ohc_device_t *device = device_of_item(item);
+
+	journal_delete_item(item);
+	format_item_invalidate(item);
+
+	if(item->packed) {
+		device->tab->item_nr--;
+		return page_return_item(item);
+	}
+
+	if(!device->deleted && !item->badblock) {
+		device->tab->item_nr--;
+	}
+	return device_free_block(device, &item->order_node,
+			item_block_offset(item), item_block_length(item),
+			item->badblock);
+}
+
+/* @page module call this to free the block of a page */
+size_t device_return_page_block(ohc_page_t *page)
+{
+	return device_free_block(device_of_page(page), &page->order_node,
+			page->offset, OHC_PAGE_SIZE, page->badblock);
+}
+
+/* cut a block (with @offset and @length) for @order_node from the
+ * beginning of the remaining space of @device */
+static size_t device_cut_block(ohc_device_t *device, struct tlist_head *order,
+		size_t offset, size_t length)
 {
 	ohc_free_block_t *current;
 	size_t bsize, step, gap;
-	ohc_device_t *device = device_of_item(item);
 
-	current = list_entry(device->order_head.prev, ohc_free_block_t, order_node);
-	bsize = ipbucket_block_size(item->length);
-	gap = item->offset - current->offset;
+	current = tlist_entry(tlist_prev(&device->tab->order_head),
+			ohc_free_block_t, order_node);
+	bsize = ipbucket_block_size(length);
+	gap = offset - current->offset;
 	step = bsize + gap;
 
-	if(item->offset < current->offset || current->block_size < step) {
+	if(offset < current->offset || current->block_size < step) {
 		log_error_run(0, "wrong olivehc dump device %s", device->filename);
 		return 0;
 	}
@@ -559,24 +805,46 @@ size_t device_cut_free_block(ohc_item_t *item)
 				current->offset, gap);
 	}
 
-	list_add_tail(&item->order_node, &current->order_node);
+	tlist_add_tail(order, &current->order_node);
 
 	/* we don't call ipbucket_update(current) here, while call it
 	 * in device_load_post() later. */
 	current->offset += step;
 	current->block_size -= step;
 
-	device->item_nr++;
-	device->consumed += bsize;
+	device->tab->consumed += bsize;
 	return bsize;
 }
 
+/* @format module call this to cut a free-block from the beginning
+ * of the remaining space */
+size_t device_cut_free_block(ohc_item_t *item)
+{
+	ohc_device_t *device = device_of_item(item);
+	size_t bsize;
+
+	bsize = device_cut_block(device, &item->order_node,
+			item_block_offset(item), item_block_length(item));
+	if(bsize != 0) {
+		device->tab->item_nr++;
+	}
+	return bsize;
+}
+
+/* @page module call this to cut a free-block for a loaded page */
+size_t device_cut_page_block(ohc_page_t *page)
+{
+	return device_cut_block(device_of_page(page), &page->order_node,
+			page->offset, OHC_PAGE_SIZE);
+}
+
 /* @format module call this, after finish loading items of a device,
  * to update the remaining space */
 void device_load_post(ohc_device_t *device)
 {
 	ohc_free_block_t *current;
-	current = list_entry(device->order_head.prev, ohc_free_block_t, order_node);
+	current = tlist_entry(tlist_prev(&device->tab->order_head),
+			ohc_free_block_t, order_node);
 
 	if(current->block_size == 0) {
 		device_fblock_delete(current);
@@ -585,28 +853,192 @@ void device_load_post(ohc_device_t *device)
 	}
 }
 
+/* start loading items of all devices at starting. The dumps are read
+ * in parallel threads, and loaded in device_format_load_step().
+ * The devices attached to reused item table have their items already.
+ * If upgrading, the items are received from the old process. */
 void device_format_load(void)
 {
+	ohc_format_thread_t *loaders[DEVICES_LIMIT];
 	struct list_head *p;
 	ohc_device_t *d;
+	int channel, n = 0;
+
+	channel = upgrade_channel();
+
+	server_table_recover();
 
 	list_for_each(p, &devices) {
 		d = list_entry(p, ohc_device_t, dnode);
-		format_load_device(d);
+		if(d->tab->ready) {
+			continue;
+		}
+		if(channel != -1) {
+			d->loader = format_load_prepare(d);
+			if(d->loader != NULL) {
+				loaders[n++] = d->loader;
+			}
+		} else {
+			d->loader = format_load_start(d);
+		}
+		d->loading = 1;
+		device_loading_nr++;
+	}
+	device_started = 1;
+
+	if(channel != -1) {
+		format_load_stream(channel, loaders, n);
+	}
+}
+
+static ohc_device_t *device_next_loading(void)
+{
+	struct list_head *p;
+	ohc_device_t *d;
+
+	list_for_each(p, &devices) {
+		d = list_entry(p, ohc_device_t, dnode);
+		if(d->loading) {
+			return d;
+		}
+	}
+	list_for_each(p, &deleted_devices) {
+		d = list_entry(p, ohc_device_t, dnode);
+		if(d->loading) {
+			return d;
+		}
+	}
+	return NULL;
+}
+
+/* Master thread calls this in each loop while loading, to load a batch
+ * of items. We are serving while loading, and the loading devices are
+ * not used for new items.
+ * Return OHC_AGAIN if there are more items to load, OHC_DECLINE if
+ * waiting for reading dump, or OHC_DONE if all devices are loaded. */
+int device_format_load_step(void)
+{
+	static ohc_device_t *current = NULL;
+	ohc_device_t *d;
+	int rc, replayed;
+
+	if(device_loading_nr == 0) {
+		return server_load_finish();
+	}
+
+	/* load devices one by one */
+	if(current == NULL) {
+		current = device_next_loading();
+	}
+	d = current;
+
+	if(!d->deleted && !format_load_ready(d->loader)) {
+		return OHC_DECLINE;
+	}
+
+	rc = format_load_continue(d->loader, d->deleted, &replayed);
+	if(rc == OHC_AGAIN) {
+		return OHC_AGAIN;
+	}
+
+	/* the dump in device is newer than journal, if any, since the
+	 * dump is cleared after loaded. */
+	if(!d->deleted) {
+		journal_open(d, rc == OHC_OK && replayed);
+	}
+	d->tab->ready = 1;
+
+	d->loader = NULL;
+	d->loading = 0;
+	current = NULL;
+	if(--device_loading_nr == 0) {
+		return server_load_finish();
+	}
+	return OHC_AGAIN;
+}
+
+int device_loading(void)
+{
+	return device_loading_nr != 0;
+}
+
+/* finish loading at first, otherwise the items not loaded
+ * are lost after store */
+static void device_format_load_finish(void)
+{
+	int rc;
+
+	while((rc = device_format_load_step()) != OHC_DONE) {
+		if(rc == OHC_DECLINE) {
+			usleep(1000);
+		}
 	}
 }
 
 void device_format_store(void)
+{
+	ohc_device_t *stores[DEVICES_LIMIT];
+	struct list_head *p;
+	ohc_device_t *d;
+	ohc_server_listens_t listens;
+	int n = 0;
+
+	device_format_load_finish();
+	format_rewrite_flush();
+
+	server_dump_listens(&listens);
+	journal_quit();
+
+	/* no dump for devices with journal, or in persistent item table.
+	 * Others are stored in one pass of the items, which are not
+	 * changed in storing. */
+	list_for_each(p, &devices) {
+		d = list_entry(p, ohc_device_t, dnode);
+		if(d->journal) {
+			journal_close(d, 0);
+		} else if(!d->kicked && !table_persistent()) {
+			stores[n++] = d;
+		}
+	}
+
+	if(n != 0) {
+		format_store_finish(format_store_start(&listens, stores, n));
+	}
+}
+
+/* send items of all devices to the new process by @fd in upgrading,
+ * instead of dumping into devices. The journals are closed, and the
+ * new process opens them after loading. A persistent item table is
+ * taken by the new process after we quit, so nothing to send. */
+void device_format_handoff(int fd)
 {
 	struct list_head *p;
 	ohc_device_t *d;
-	unsigned short server_ports[SERVERS_LIMIT];
+	ohc_server_listens_t listens;
+
+	if(table_persistent()) {
+		device_format_store();
+		return;
+	}
+
+	device_format_load_finish();
+	format_rewrite_flush();
 
-	server_dump_ports(server_ports);
+	server_dump_listens(&listens);
+	journal_quit();
 
 	list_for_each(p, &devices) {
 		d = list_entry(p, ohc_device_t, dnode);
-		format_store_device(server_ports, d);
+		if(d->kicked) {
+			continue;
+		}
+		journal_close(d, 0);
+		if(format_store_stream(fd, &listens, d) != OHC_OK) {
+			/* the new process fails, so dump them as quiting */
+			log_error_run(errno, "send items of device %s", d->filename);
+			device_format_store();
+			return;
+		}
 	}
 }
 
@@ -622,16 +1054,28 @@ void device_routine(void)
 	}
 }
 
+/* @request module call this in worker threads, after pwrite */
+void device_write_latency(ohc_device_t *device, long latency)
+{
+	if(latency < 0) { /* the clock was set back */
+		return;
+	}
+	device->write_latency = (device->write_latency * 7 + latency) / 8;
+}
+
 void device_status(FILE *filp)
 {
 	struct list_head *p;
 	ohc_device_t *d;
 
-	fputs("\n+ device capacity consumed badblock status\n", filp);
+	fputs("\n+ device capacity consumed badblock status "
+			"weight requests write_latency\n", filp);
 	list_for_each(p, &devices) {
 		d = list_entry(p, ohc_device_t, dnode);
-		fprintf(filp, "++ %s %ld %ld %ld %s\n",
-				d->filename, d->capacity, d->consumed,
-				d->badblock, d->kicked ? "kicked" : "ok");
+		fprintf(filp, "++ %s %ld %ld %ld %s %d %d %ld\n",
+				d->filename, d->capacity, d->tab->consumed,
+				d->tab->badblock, d->kicked ? "kicked"
+					: (d->loading ? "loading" : "ok"),
+				d->weight, d->used, d->write_latency);
 	}
 }
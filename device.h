@@ -13,30 +13,45 @@
 struct ohc_device_s {
 	unsigned	deleted:1;
 	unsigned	kicked:1;
+	unsigned	loading:1;
 
 	int		fd;
 	int		index;
 	int		used;
+	int		weight;
 	char		filename[PATH_LENGTH];
 	dev_t		dev;
 	ino_t		inode;
-	long		item_nr;
-	long		fblock_nr;
 	size_t		capacity;
-	size_t		consumed;
-	size_t		badblock;
 
-	struct list_head	order_head;
+	/* the part kept in item table, with free blocks, order-list
+	 * and counters. A copy for kicked device. */
+	ohc_table_device_t	*tab;
+
+	/* EWMA of pwrite latency in microseconds. Updated by worker
+	 * threads without lock, since it's just a hint. */
+	long		write_latency;
+
+	/* heads queued to rewrite, see format_item_rewrite() */
+	long		rewrites;
+
+	/* journal records to sync before writing, see journal_wait() */
+	uint64_t	journal_barrier;
+
+	ohc_journal_t		*journal;
+	ohc_format_thread_t	*loader;
 	struct list_head	dnode;
 
 	struct ohc_device_s	*conf;
 };
 
+/* Free blocks are in the item table, and linked by positions in it. */
 typedef struct {
-	/* @order_node and @fblock must be together, to
-	 * distinguish ohc_item_t and ohc_free_block_t. */
-	struct list_head	order_node;
+	/* @order_node, @fblock and @is_page must be together, to
+	 * distinguish ohc_item_t, ohc_page_t and ohc_free_block_t. */
+	struct tlist_head	order_node;
 	unsigned		fblock:1;
+	unsigned		is_page:1;
 
 	short			device_index;
 
@@ -44,12 +59,13 @@ typedef struct {
 	unsigned long		offset:40;
 
 	off_t			block_size;
-	struct list_head	bucket_node;
+	struct tlist_head	bucket_node;
 } ohc_free_block_t;
 
 #define DEVICES_LIMIT IPT_ARRAY_SIZE
 
 ohc_device_t *device_of_item(ohc_item_t *item);
+ohc_device_t *device_of_page(ohc_page_t *page);
 
 int device_conf_check(ohc_conf_t *conf_cycle);
 void device_conf_load(ohc_conf_t *conf_cycle);
@@ -59,10 +75,18 @@ int device_free_block_extend(size_t target);
 size_t device_get_free_block(ohc_item_t *item);
 size_t device_return_free_block(ohc_item_t *item);
 size_t device_cut_free_block(ohc_item_t *item);
+size_t device_get_page_block(ohc_page_t *page);
+size_t device_return_page_block(ohc_page_t *page);
+size_t device_cut_page_block(ohc_page_t *page);
+void device_write_latency(ohc_device_t *device, long latency);
 void device_load_post(ohc_device_t *device);
 
 void device_format_load(void);
+int device_format_load_step(void);
+int device_loading(void);
+int device_available(void);
 void device_format_store(void);
+void device_format_handoff(int fd);
 void device_routine(void);
 void device_status(FILE *filp);
 
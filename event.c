@@ -1,6 +1,18 @@
 /*
  * Utils for request event management.
  *
+ * A socket is registered once into the epoll of the thread which owns
+ * the request, master or worker, for both read and write in edge-
+ * triggered mode. It's re-registered only when the request moves
+ * between threads. The edges are recorded in @ready_read and
+ * @ready_write, and the handler is called only for the event it's
+ * waiting for.
+ *
+ * event_add_read() and event_add_write() are called after recv/send
+ * blocks, so the socket is drained and the next edge is waited for.
+ * event_add_keepalive() and event_post() are called without blocking,
+ * so the readiness is checked again by EPOLL_CTL_MOD if it may be ready.
+ *
  * Author: Wu Bingzheng
  *
  */
@@ -10,30 +22,32 @@
 #define OHC_EV_READ  1
 #define OHC_EV_WRITE 2
 
-static int event_add(ohc_request_t *r, req_handler_f *handler, int event, time_t timeout)
+#define EVENT_EPOLL_MASK	(EPOLLIN | EPOLLOUT | EPOLLET)
+
+static int event_add(ohc_request_t *r, req_handler_f *handler, int event, long timeout)
 {
-	uint32_t epoll_ev = (event == OHC_EV_READ) ? EPOLLIN : EPOLLOUT;
 	int epoll_fd = r->worker_thread ? r->worker_thread->epoll_fd : master_epoll_fd;
+	int ready = (event == OHC_EV_READ) ? r->ready_read : r->ready_write;
 	ohc_timer_t *timer;
 
-	if(r->events == event) {
-		timer_update(&r->tnode, timeout);
-
-	} else if(r->events) {
-		if(epoll_mod(epoll_fd, r->sock_fd, epoll_ev, r) != 0) {
+	if(!r->registered) {
+		if(epoll_add(epoll_fd, r->sock_fd, EVENT_EPOLL_MASK, r) != 0) {
 			return OHC_ERROR;
 		}
-		if(timer_update(&r->tnode, timeout) != 0) {
+		r->registered = 1;
+
+	} else if(ready) {
+		/* reported again at once, if still ready */
+		if(epoll_mod(epoll_fd, r->sock_fd, EVENT_EPOLL_MASK, r) != 0) {
 			return OHC_ERROR;
 		}
+	}
+
+	if(r->events) {
+		timer_update(&r->tnode, timeout * 1000);
 	} else {
 		timer = r->worker_thread ? &r->worker_thread->timer : &master_timer;
-		if(epoll_add(epoll_fd, r->sock_fd, epoll_ev, r) != 0) {
-			return OHC_ERROR;
-		}
-		if(timer_add(timer, &r->tnode, timeout) != 0) {
-			return OHC_ERROR;
-		}
+		timer_add(timer, &r->tnode, timeout * 1000);
 	}
 
 	r->events = event;
@@ -43,11 +57,13 @@ static int event_add(ohc_request_t *r, req_handler_f *handler, int event, time_t
 
 int event_add_read(ohc_request_t *r, req_handler_f *handler)
 {
+	r->ready_read = 0;
 	return event_add(r, handler, OHC_EV_READ, r->server->recv_timeout);
 }
 
 int event_add_write(ohc_request_t *r, req_handler_f *handler)
 {
+	r->ready_write = 0;
 	return event_add(r, handler, OHC_EV_WRITE, r->server->send_timeout);
 }
 
@@ -56,14 +72,49 @@ int event_add_keepalive(ohc_request_t *r, req_handler_f *handler)
 	return event_add(r, handler, OHC_EV_READ, r->server->keepalive_timeout);
 }
 
-void event_del(ohc_request_t *r)
+/* call @handler in next loop, since the socket is writable */
+int event_post(ohc_request_t *r, req_handler_f *handler)
+{
+	r->ready_write = 1;
+	return event_add(r, handler, OHC_EV_WRITE, r->server->send_timeout);
+}
+
+/* @epoll_events of @r is ready */
+void event_process(ohc_request_t *r, uint32_t epoll_events)
+{
+	if(epoll_events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		r->ready_read = 1;
+	}
+	if(epoll_events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+		r->ready_write = 1;
+	}
+
+	if((r->events == OHC_EV_READ && r->ready_read)
+			|| (r->events == OHC_EV_WRITE && r->ready_write)) {
+		r->event_handler(r);
+	}
+}
+
+/* stop waiting, but keep the socket registered */
+void event_cancel(ohc_request_t *r)
 {
 	if(r->events) {
+		timer_del(&r->tnode);
+		r->events = 0;
+	}
+}
+
+/* unregister the socket, before @r moves to another thread */
+void event_del(ohc_request_t *r)
+{
+	event_cancel(r);
+
+	if(r->registered) {
 		int epoll_fd = r->worker_thread ? r->worker_thread->epoll_fd : master_epoll_fd;
 		epoll_del(epoll_fd, r->sock_fd);
 
-		timer_del(&r->tnode);
-
-		r->events = 0;
+		r->registered = 0;
+		r->ready_read = 0;
+		r->ready_write = 0;
 	}
 }
@@ -13,6 +13,9 @@
 int event_add_read(ohc_request_t *r, req_handler_f *handler);
 int event_add_write(ohc_request_t *r, req_handler_f *handler);
 int event_add_keepalive(ohc_request_t *r, req_handler_f *handler);
+int event_post(ohc_request_t *r, req_handler_f *handler);
+void event_process(ohc_request_t *r, uint32_t epoll_events);
+void event_cancel(ohc_request_t *r);
 void event_del(ohc_request_t *r);
 
 #endif
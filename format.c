@@ -5,6 +5,8 @@
  *
  */
 
+#include <sys/time.h>
+#include <openssl/md5.h>
 #include "format.h"
 
 /*
@@ -15,22 +17,103 @@
  *     ohc_format_item_t[]
  *     items-body
  *     ...
+ *
+ * The records are in LRU order, the most recent first, following the
+ * pages. They are sorted by offset again when loading.
+ *
+ * Each item's body is after its ohc_item_head_t. When the items are
+ * loaded, the superblock is replaced by ohc_format_label_t. If there
+ * is no dump since crash, the items are recovered by scanning the heads.
  */
 
 
 #define OHC_FM_MAGIC		0x2143484556494c4fL /* OLIVEHC! */
-#define OHC_FM_VERSION		1
+#define OHC_FM_VERSION		6 /* 2: add ohc_format_item_t.flags
+				     3: add ohc_item_head_t
+				     4: add hits and rank, in LRU order
+				     5: add validator
+				     6: add unix socket paths of servers */
+#define OHC_FM_USED		"FeiLiWuShi"
+#define OHC_FM_USED_LEN		10
+
+/* superblock of version 1 and 2 is without @secret, and there are
+ * server ports only before version 6 */
+#define OHC_FM_INFO_SIZE_V5	(sizeof(ohc_superblock_t) + SERVER_PORTS_SIZE)
+#define OHC_FM_INFO_SIZE_V2	(OHC_FM_INFO_SIZE_V5 - sizeof(uint64_t))
+#define format_info_size(version) \
+	((version) < 3 ? OHC_FM_INFO_SIZE_V2 \
+	 : (version) < 6 ? OHC_FM_INFO_SIZE_V5 : OHC_FM_INFO_SIZE)
+#define format_info_listens(info) \
+	((ohc_server_listens_t *)((info) + sizeof(ohc_superblock_t)))
+
+#define OHC_IH_MAGIC		0x4d455449 /* ITEM */
 
+#define OHC_FM_CHS_FEED 0x57eb0b4eecfeb465L
+
+/* the mark of device in use, with the device's secret */
 typedef struct {
-	uint64_t	magic;
-	int		version;
+	char		used[16]; /* OHC_FM_USED */
+	uint64_t	secret;
 	uint64_t	checksum;
-	long		item_nr;
-} ohc_superblock_t;
+} ohc_format_label_t;
 
-#define SERVER_PORTS_SIZE (sizeof(unsigned short) * SERVERS_LIMIT)
-#define OHC_FM_INFO_SIZE (sizeof(ohc_superblock_t) + SERVER_PORTS_SIZE)
-#define OHC_FM_CHS_FEED 0x57eb0b4eecfeb465L
+/* buffer size of reading and writing records */
+#define FORMAT_IO_SIZE (4 * 1024 * 1024)
+
+/* items loaded each time in format_load_continue() */
+#define FORMAT_LOAD_BATCH 10000
+
+/* header of each device's dump sent in upgrading */
+typedef struct {
+	char		filename[PATH_LENGTH];
+	uint64_t	length;
+} ohc_format_stream_t;
+
+/* a thread to load or store a device */
+struct ohc_format_thread_s {
+	ohc_device_t		*device;
+	pthread_t		tid;
+	int			threaded;
+	int			rc;
+
+	/* store */
+	ohc_server_listens_t	*listens;
+	ohc_device_t		**stores;
+	int			store_nr;
+
+	/* load */
+	int			fd;
+	int			version;
+	unsigned char		info[OHC_FM_INFO_SIZE];
+	uint64_t		secret;
+	long			item_nr;
+	long			loaded;
+	int			streamed; /* received in upgrading */
+	ohc_format_item_t	*records;
+	int			replayed; /* from checkpoint and journal */
+	int			scanned;
+	volatile int		done;
+
+	/* the current servers when starting, and the head ports of the
+	 * unix socket ones, for scanning */
+	ohc_server_listens_t	servers;
+	unsigned short		unix_ports[SERVER_UNIX_LIMIT];
+};
+
+/* items found in scanning a device */
+typedef struct {
+	unsigned char	hash_id[16];
+	int64_t		stored;
+	long		index;
+} ohc_scan_item_t;
+
+typedef struct {
+	ohc_format_thread_t	*ft;
+	long			size; /* of ft->records */
+	ohc_scan_item_t		*found;
+	long			found_nr;
+	int			server_nr; /* indexes assigned */
+} ohc_format_scan_t;
 
 static uint64_t format_checksum(void *buf, size_t len)
 {
@@ -44,158 +127,1571 @@ static uint64_t format_checksum(void *buf, size_t len)
 	return checksum;
 }
 
-int format_store_device(unsigned short *server_ports, ohc_device_t *device)
+/* MD5 of @head keyed by the device's @secret. The data in items'
+ * bodies is from clients, so a plain checksum could be forged. */
+static uint32_t format_item_head_checksum(ohc_item_head_t *head,
+		uint64_t secret)
 {
-	struct list_head *p;
-	ohc_superblock_t superb;
-	ohc_item_t *item;
-	ohc_free_block_t *fblock;
-	ohc_format_item_t fm_item;
-	ohc_server_t *server;
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	uint32_t saved = head->checksum, checksum;
+	MD5_CTX ctx;
 
-	FILE *filp = fdopen(device->fd, "r+");
-	if(filp == NULL) {
-		return OHC_ERROR;
+	head->checksum = 0;
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, &secret, sizeof(secret));
+	MD5_Update(&ctx, head, sizeof(ohc_item_head_t));
+	MD5_Final(digest, &ctx);
+	head->checksum = saved;
+
+	memcpy(&checksum, digest, sizeof(checksum));
+	return checksum;
+}
+
+/* the port in heads of a unix socket server's items, see OHC_IH_UNIX */
+static unsigned short format_path_port(const char *path)
+{
+	unsigned char digest[MD5_DIGEST_LENGTH];
+
+	MD5((const unsigned char *)path, strlen(path), digest);
+	return (digest[0] << 8) | digest[1];
+}
+
+static int format_item_head_check(ohc_item_head_t *head, uint64_t secret)
+{
+	return head->magic == OHC_IH_MAGIC
+		&& head->headers_len <= head->length
+		&& head->checksum == format_item_head_checksum(head, secret);
+}
+
+/* build @item's head in master thread */
+void format_item_head(ohc_item_head_t *head, ohc_item_t *item,
+		unsigned short flags)
+{
+	ohc_server_t *s = server_of_item(item);
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	head->magic = OHC_IH_MAGIC;
+	head->flags = 0;
+	memcpy(head->hash_id, item->hnode.id, 16);
+	head->stored = (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+	head->length = item->length;
+	head->expire = item->expire;
+	head->headers_len = item->headers_len;
+	head->server_port = s->listen_port;
+	head->page_pos = item->packed ? page_item_pos(item) : 0;
+	if(s->listen_path[0]) {
+		head->server_port = format_path_port(s->listen_path);
+		flags |= OHC_IH_UNIX;
+	}
+	if(item->packed) {
+		flags |= OHC_IH_PACKED;
+	}
+	if(item->chunked) {
+		flags |= OHC_IH_CHUNKED;
 	}
+	format_item_head_flags(head, device_of_item(item), flags);
+}
 
-	/* init superblock */
-	superb.magic = OHC_FM_MAGIC;
-	superb.version = OHC_FM_VERSION;
-	superb.checksum = 0;
-	superb.item_nr = 0;
+/* reset the flags of @head in @device, besides OHC_IH_PACKED,
+ * OHC_IH_CHUNKED and OHC_IH_UNIX. Worker threads call this. */
+void format_item_head_flags(ohc_item_head_t *head, ohc_device_t *device,
+		unsigned short flags)
+{
+	head->flags = (head->flags & (OHC_IH_PACKED | OHC_IH_CHUNKED
+				| OHC_IH_UNIX)) | flags;
+	head->checksum = format_item_head_checksum(head, device->tab->secret);
+}
 
-	/* servers */
-	if(fseek(filp, sizeof(superb), SEEK_SET) < 0) {
-		return OHC_ERROR;
+/* Heads to rewrite on disk. The master thread only queues them, and
+ * the rewriter thread writes them, since a write smaller than a page
+ * may read the page first, and blocks the master.
+ * A rewrite must be on disk before the block is written again by a new
+ * item, so workers flush the queue before writing into a device with
+ * pending rewrites, see format_rewrite_wait(). */
+typedef struct {
+	ohc_device_t		*device;
+	off_t			offset;
+	ohc_item_head_t		head;
+} ohc_head_rewrite_t;
+
+static pthread_mutex_t rewrite_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t rewrite_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rewrite_cond = PTHREAD_COND_INITIALIZER;
+static ohc_head_rewrite_t *rewrite_queue = NULL;
+static int rewrite_nr = 0;
+static int rewrite_size = 0;
+
+/* 0 not started, 1 started, -1 failed to start */
+static int rewrite_threaded = 0;
+
+/* write a queued head, but keep the stored time of the head on disk,
+ * which decides the newest in scanning */
+static void format_rewrite_write(ohc_head_rewrite_t *rw)
+{
+	ohc_device_t *device = rw->device;
+	ohc_item_head_t old;
+
+	if(pread(device->fd, &old, sizeof(old), rw->offset) == sizeof(old)
+			&& format_item_head_check(&old, device->tab->secret)
+			&& memcmp(old.hash_id, rw->head.hash_id, 16) == 0) {
+		rw->head.stored = old.stored;
+		rw->head.checksum = format_item_head_checksum(&rw->head,
+				device->tab->secret);
+	}
+
+	if(pwrite(device->fd, &rw->head, sizeof(rw->head), rw->offset)
+			!= sizeof(rw->head)) {
+		log_error_run(errno, "rewrite item head in device %s", device->filename);
+	}
+	__sync_fetch_and_sub(&device->rewrites, 1);
+}
+
+/* write all queued heads. The caller holds @rewrite_flush_lock. */
+static void format_rewrite_flush_locked(void)
+{
+	ohc_head_rewrite_t *queue;
+	int i, nr;
+
+	pthread_mutex_lock(&rewrite_queue_lock);
+	queue = rewrite_queue;
+	nr = rewrite_nr;
+	rewrite_queue = NULL;
+	rewrite_nr = 0;
+	rewrite_size = 0;
+	pthread_mutex_unlock(&rewrite_queue_lock);
+
+	for(i = 0; i < nr; i++) {
+		format_rewrite_write(&queue[i]);
+	}
+	free(queue);
+}
+
+static void *format_rewrite_routine(void *data)
+{
+	pthread_detach(pthread_self());
+
+	while(1) {
+		pthread_mutex_lock(&rewrite_queue_lock);
+		while(rewrite_nr == 0) {
+			pthread_cond_wait(&rewrite_cond, &rewrite_queue_lock);
+		}
+		pthread_mutex_unlock(&rewrite_queue_lock);
+
+		pthread_mutex_lock(&rewrite_flush_lock);
+		format_rewrite_flush_locked();
+		pthread_mutex_unlock(&rewrite_flush_lock);
+	}
+	return NULL;
+}
+
+/* write all queued heads now, e.g. before dumping in quit */
+void format_rewrite_flush(void)
+{
+	pthread_mutex_lock(&rewrite_flush_lock);
+	format_rewrite_flush_locked();
+	pthread_mutex_unlock(&rewrite_flush_lock);
+}
+
+/* Worker threads call this before writing into @device. The queued
+ * heads may be in the block being written, if the block is freed and
+ * allocated again after they are queued. */
+void format_rewrite_wait(ohc_device_t *device)
+{
+	if(device->rewrites != 0) {
+		format_rewrite_flush();
+	}
+}
+
+/* drop @device's queued heads, before it's deleted */
+void format_rewrite_cancel(ohc_device_t *device)
+{
+	int i, n = 0;
+
+	pthread_mutex_lock(&rewrite_flush_lock);
+	pthread_mutex_lock(&rewrite_queue_lock);
+	for(i = 0; i < rewrite_nr; i++) {
+		if(rewrite_queue[i].device != device) {
+			rewrite_queue[n++] = rewrite_queue[i];
+		}
+	}
+	rewrite_nr = n;
+	device->rewrites = 0;
+	pthread_mutex_unlock(&rewrite_queue_lock);
+	pthread_mutex_unlock(&rewrite_flush_lock);
+}
+
+/* queue a rewrite of @item's head on disk with @flags, in master thread */
+static void format_item_rewrite(ohc_item_t *item, unsigned short flags)
+{
+	ohc_device_t *device = device_of_item(item);
+	ohc_head_rewrite_t rewrite, *queue;
+	pthread_t tid;
+
+	if(item->headless || item->badblock || device->deleted || device->kicked) {
+		return;
+	}
+
+	if(rewrite_threaded == 0) {
+		rewrite_threaded = (pthread_create(&tid, NULL,
+					format_rewrite_routine, NULL) == 0) ? 1 : -1;
+	}
+
+	rewrite.device = device;
+	rewrite.offset = item_block_offset(item);
+	format_item_head(&rewrite.head, item, flags);
+	__sync_fetch_and_add(&device->rewrites, 1);
+
+	pthread_mutex_lock(&rewrite_queue_lock);
+	if(rewrite_nr == rewrite_size) {
+		queue = realloc(rewrite_queue, (rewrite_size ? rewrite_size * 2 : 64)
+				* sizeof(ohc_head_rewrite_t));
+		if(queue == NULL) {
+			pthread_mutex_unlock(&rewrite_queue_lock);
+
+			/* no memory to queue it, so write it here, after
+			 * the queued ones, which may be of the same block */
+			pthread_mutex_lock(&rewrite_flush_lock);
+			format_rewrite_flush_locked();
+			format_rewrite_write(&rewrite);
+			pthread_mutex_unlock(&rewrite_flush_lock);
+			return;
+		}
+		rewrite_queue = queue;
+		rewrite_size = rewrite_size ? rewrite_size * 2 : 64;
+	}
+
+	rewrite_queue[rewrite_nr++] = rewrite;
+	if(rewrite_nr == 1) {
+		pthread_cond_signal(&rewrite_cond);
+	}
+	pthread_mutex_unlock(&rewrite_queue_lock);
+
+	/* no thread, write it here */
+	if(rewrite_threaded == -1) {
+		format_rewrite_flush();
+	}
+}
+
+/* Mark @item deleted on disk, when its block is freed, so that it's
+ * not recovered by scanning. Items are never freed in putting, so it
+ * does not race with the worker writing the head. */
+void format_item_invalidate(ohc_item_t *item)
+{
+	format_item_rewrite(item, OHC_IH_DELETED);
+}
+
+/* Mark the partial @item finished on disk, when its last range is
+ * filled. The creating PUT, the only one writing the head, is done,
+ * so there is no race. */
+void format_item_complete(ohc_item_t *item)
+{
+	format_item_rewrite(item, 0);
+}
+
+/* Rewrite the head with @item's new expire, after TOUCH. Items in
+ * putting are not touched, so there is no race either. */
+void format_item_touch(ohc_item_t *item)
+{
+	format_item_rewrite(item, 0);
+}
+
+/* mark @device in use, so it's scanned if no dump when starting */
+void format_mark_used(ohc_device_t *device)
+{
+	ohc_format_label_t label;
+
+	bzero(&label, sizeof(label));
+	memcpy(label.used, OHC_FM_USED, OHC_FM_USED_LEN);
+	label.secret = device->tab->secret;
+	label.checksum = format_checksum(&label, sizeof(label)) ^ OHC_FM_CHS_FEED;
+
+	if(pwrite(device->fd, &label, sizeof(label), 0) != sizeof(label)) {
+		log_error_run(errno, "mark device %s", device->filename);
+	}
+}
+
+/* check the mark of device in use in @buffer, and get the @secret */
+static int format_check_label(unsigned char *buffer, uint64_t *secret)
+{
+	ohc_format_label_t *label = (ohc_format_label_t *)buffer;
+
+	if(memcmp(label->used, OHC_FM_USED, OHC_FM_USED_LEN) != 0
+			|| format_checksum(label, sizeof(*label)) != OHC_FM_CHS_FEED) {
+		return 0;
+	}
+	*secret = label->secret;
+	return 1;
+}
+
+/* Whether @device is marked in use, with the @secret. It's checked
+ * before attaching the device in reused item table, in case the device
+ * has been used by others, e.g. formatted by an olivehc without the
+ * item table. */
+int format_check_used(ohc_device_t *device, uint64_t secret)
+{
+	unsigned char buffer[sizeof(ohc_format_label_t)];
+	uint64_t used_secret;
+
+	if(pread(device->fd, buffer, sizeof(buffer), 0) != sizeof(buffer)) {
+		return 0;
+	}
+	return format_check_label(buffer, &used_secret) && used_secret == secret;
+}
+
+/* a random secret for a new device */
+uint64_t format_new_secret(void)
+{
+	struct timeval now;
+	uint64_t secret = 0;
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if(fd >= 0) {
+		if(read(fd, &secret, sizeof(secret)) != sizeof(secret)) {
+			secret = 0;
+		}
+		close(fd);
+	}
+
+	/* weaker, but better than nothing */
+	if(secret == 0) {
+		gettimeofday(&now, NULL);
+		secret = ((uint64_t)now.tv_sec << 32) ^ now.tv_usec
+			^ ((uint64_t)getpid() << 16) ^ (uintptr_t)&now;
 	}
-	if(fwrite(server_ports, SERVER_PORTS_SIZE, 1, filp) < 1) {
+	return secret;
+}
+
+void format_item_record(ohc_format_item_t *fm_item, ohc_item_t *item,
+		unsigned short flags)
+{
+	memcpy(fm_item->hash_id, item->hnode.id, 16);
+	fm_item->expire = item->expire;
+	fm_item->length = item->length;
+	fm_item->headers_len = item->headers_len;
+	fm_item->server_index = item->server_index;
+	fm_item->offset = item->offset;
+	fm_item->flags = flags | (item->headless ? OHC_FM_HEADLESS : 0)
+			| (item->etag ? OHC_FM_ETAG : 0)
+			| (item->chunked ? OHC_FM_CHUNKED : 0);
+	fm_item->hits = item->hits;
+	fm_item->rank = OHC_FM_NO_RANK;
+	fm_item->validator = item->validator;
+}
+
+void format_page_record(ohc_format_item_t *fm_item, ohc_page_t *page,
+		unsigned short flags)
+{
+	bzero(fm_item, sizeof(ohc_format_item_t));
+	fm_item->offset = page->offset;
+	fm_item->length = OHC_PAGE_SIZE;
+	fm_item->expire = INT32_MAX;
+	fm_item->server_index = page->server_index;
+	fm_item->flags = OHC_FM_PAGE | flags;
+	fm_item->rank = OHC_FM_NO_RANK;
+}
+
+static int format_write_full(int fd, const void *buf, size_t len)
+{
+	ssize_t rc;
+	size_t done;
+
+	for(done = 0; done < len; done += rc) {
+		rc = write(fd, (const char *)buf + done, len - done);
+		if(rc <= 0) {
+			return OHC_ERROR;
+		}
+	}
+	return OHC_OK;
+}
+
+/* write @len bytes of @data to @out */
+static int format_output(ohc_format_output_t *out, const void *data, size_t len)
+{
+	if(out->filp) {
+		return fwrite(data, len, 1, out->filp) == 1 ? OHC_OK : OHC_ERROR;
+	}
+
+	if(out->len + len > out->size) {
+		if(format_write_full(out->fd, out->buffer, out->len) != OHC_OK) {
+			return OHC_ERROR;
+		}
+		out->len = 0;
+	}
+	memcpy(out->buffer + out->len, data, len);
+	out->len += len;
+	return OHC_OK;
+}
+
+/* write out the buffer of @out, and move to @offset */
+static int format_output_seek(ohc_format_output_t *out, off_t offset)
+{
+	if(out->filp) {
+		return fseek(out->filp, offset, SEEK_SET) == 0 ? OHC_OK : OHC_ERROR;
+	}
+
+	if(format_write_full(out->fd, out->buffer, out->len) != OHC_OK) {
 		return OHC_ERROR;
 	}
+	out->len = 0;
+	return lseek(out->fd, offset, SEEK_SET) == offset ? OHC_OK : OHC_ERROR;
+}
+
+/* store @device into the stdio stream @filp at @base */
+void format_output_file(ohc_format_output_t *out, ohc_device_t *device,
+		FILE *filp, off_t base)
+{
+	bzero(out, sizeof(ohc_format_output_t));
+	out->device = device;
+	out->filp = filp;
+	out->base = base;
+}
 
-	/* items */
-	list_for_each(p, &device->order_head) {
-		fblock = list_entry(p, ohc_free_block_t, order_node);
-		if(fblock->fblock) {
+/* store @device into @fd at @base, by @buffer of @size. No stdio or
+ * malloc is used, so it's safe in a child process after fork() in a
+ * multi-thread process. */
+void format_output_fd(ohc_format_output_t *out, ohc_device_t *device,
+		int fd, off_t base, char *buffer, size_t size)
+{
+	bzero(out, sizeof(ohc_format_output_t));
+	out->device = device;
+	out->fd = fd;
+	out->base = base;
+	out->buffer = buffer;
+	out->size = size;
+}
+
+static inline int format_item_dump(ohc_item_t *item)
+{
+	return server_item_valid(item) && !item->partial && !item->shadow
+		&& server_of_item(item)->server_dump;
+}
+
+/* store the pages with items to dump. return the number of records */
+static long format_store_pages(ohc_format_output_t *out)
+{
+	struct tlist_head *p, *q;
+	ohc_free_block_t *fblock;
+	ohc_format_item_t fm_item;
+	ohc_page_t *page;
+	long count = 0;
+
+	tlist_for_each(p, &out->device->tab->order_head) {
+		fblock = tlist_entry(p, ohc_free_block_t, order_node);
+		if(!fblock->is_page) {
 			continue;
 		}
 
-		item = list_entry(p, ohc_item_t, order_node);
-		if(!server_item_valid(item)) {
+		page = tlist_entry(p, ohc_page_t, order_node);
+		tlist_for_each(q, &page->item_head) {
+			if(format_item_dump(tlist_entry(q, ohc_item_t, order_node))) {
+				break;
+			}
+		}
+		if(q == &page->item_head) {
 			continue;
 		}
 
-		server = server_of_item(item);
-		if(!server->server_dump) {
-			continue;
+		format_page_record(&fm_item, page, 0);
+		if(format_output(out, &fm_item, sizeof(ohc_format_item_t)) != OHC_OK) {
+			return -1;
 		}
+		count++;
+	}
+	return count;
+}
 
-		memcpy(fm_item.hash_id, item->hnode.id, 16);
-		fm_item.expire = item->expire;
-		fm_item.length = item->length;
-		fm_item.headers_len = item->headers_len;
-		fm_item.server_index = server->index;
-		fm_item.offset = item->offset;
-		if(fwrite(&fm_item, sizeof(ohc_format_item_t), 1, filp) < 1) {
-			return OHC_ERROR;
+/* begin to store @out: server listens and pages, before items */
+static void format_store_begin(ohc_format_output_t *out,
+		ohc_server_listens_t *listens)
+{
+	ohc_superblock_t *superb = &out->superb;
+
+	superb->magic = OHC_FM_MAGIC;
+	superb->version = OHC_FM_VERSION;
+	superb->checksum = 0;
+	superb->item_nr = -1;
+	superb->secret = out->device->tab->secret;
+
+	if(format_output_seek(out, out->base + sizeof(ohc_superblock_t)) != OHC_OK
+			|| format_output(out, listens, sizeof(*listens)) != OHC_OK) {
+		return;
+	}
+	superb->item_nr = format_store_pages(out);
+}
+
+/* finish storing @out: the superblock at last */
+static void format_store_end(ohc_format_output_t *out,
+		ohc_server_listens_t *listens)
+{
+	ohc_superblock_t *superb = &out->superb;
+
+	if(superb->item_nr < 0) {
+		return;
+	}
+
+	superb->checksum ^= format_checksum(superb, sizeof(ohc_superblock_t));
+	superb->checksum ^= format_checksum(listens, sizeof(*listens));
+	superb->checksum ^= OHC_FM_CHS_FEED;
+
+	if(format_output_seek(out, out->base) != OHC_OK
+			|| format_output(out, superb, sizeof(ohc_superblock_t)) != OHC_OK
+			|| (!out->filp && format_write_full(out->fd, out->buffer,
+					out->len) != OHC_OK)) {
+		superb->item_nr = -1;
+	}
+}
+
+/* Store superblock, @listens, pages and items of @n devices into
+ * @outs. The items are stored in LRU order, in one pass of all LRU
+ * lists for all devices, so the rank is counted in items of all
+ * devices and comparable between them. No malloc here, see
+ * format_output_fd(). The number of records, or -1 if fail, is left
+ * in each output's superb.item_nr. */
+void format_store_outputs(ohc_format_output_t *outs, int n,
+		ohc_server_listens_t *listens)
+{
+	ohc_format_output_t *by_device[DEVICES_LIMIT];
+	struct tlist_head *heads[SERVERS_LIMIT + 1];
+	struct tlist_head *p;
+	ohc_format_output_t *out;
+	ohc_format_item_t fm_item;
+	ohc_item_t *item;
+	uint32_t rank = 0;
+	int i, hn;
+
+	if(n == 0) {
+		return;
+	}
+
+	bzero(by_device, sizeof(by_device));
+	for(i = 0; i < n; i++) {
+		format_store_begin(&outs[i], listens);
+		by_device[outs[i].device->index] = &outs[i];
+	}
+
+	hn = server_lru_heads(heads);
+	for(i = 0; i < hn; i++) {
+		tlist_for_each(p, heads[i]) {
+			item = tlist_entry(p, ohc_item_t, lru_node);
+			out = by_device[item->device_index];
+			if(out != NULL && out->superb.item_nr >= 0
+					&& format_item_dump(item)) {
+				format_item_record(&fm_item, item,
+						item->packed ? OHC_FM_PACKED : 0);
+				fm_item.rank = rank;
+				if(format_output(out, &fm_item, sizeof(fm_item)) == OHC_OK) {
+					out->superb.item_nr++;
+				} else {
+					out->superb.item_nr = -1;
+				}
+			}
+			rank++;
 		}
+	}
 
-		superb.item_nr++;
+	for(i = 0; i < n; i++) {
+		format_store_end(&outs[i], listens);
 	}
+}
 
-	if(superb.item_nr == 0) {
-		return OHC_ERROR;
+/* store superblock, @listens and items of @device into @filp
+ * at @base. return the number of records, or -1 if fail. */
+long format_store_file(FILE *filp, off_t base, ohc_server_listens_t *listens,
+		ohc_device_t *device)
+{
+	ohc_format_output_t out;
+
+	format_output_file(&out, device, filp, base);
+	format_store_outputs(&out, 1, listens);
+	return out.superb.item_nr;
+}
+
+/* store devices in a thread, see format_store_start() */
+static void *format_store_routine(void *arg)
+{
+	ohc_format_thread_t *ft = arg;
+	ohc_format_output_t *outs;
+	char *buffers;
+	int i;
+
+	ft->rc = OHC_ERROR;
+
+	/* big buffer for sequential writing of each device */
+	outs = malloc(ft->store_nr * sizeof(ohc_format_output_t));
+	buffers = malloc((size_t)ft->store_nr * FORMAT_IO_SIZE);
+	if(outs == NULL || buffers == NULL) {
+		goto out;
+	}
+	for(i = 0; i < ft->store_nr; i++) {
+		format_output_fd(&outs[i], ft->stores[i], ft->stores[i]->fd, 0,
+				buffers + (size_t)i * FORMAT_IO_SIZE, FORMAT_IO_SIZE);
 	}
 
-	/* superblock */
-	superb.checksum ^= format_checksum(&superb, sizeof(superb));
-	superb.checksum ^= format_checksum(server_ports, SERVER_PORTS_SIZE);
-	superb.checksum ^= OHC_FM_CHS_FEED;
+	format_store_outputs(outs, ft->store_nr, ft->listens);
 
-	if(fseek(filp, 0, SEEK_SET) < 0) {
-		return OHC_ERROR;
+	ft->rc = OHC_OK;
+	for(i = 0; i < ft->store_nr; i++) {
+		if(outs[i].superb.item_nr < 0) {
+			log_error_run(0, "store device %s fails", ft->stores[i]->filename);
+			ft->rc = OHC_ERROR;
+		}
 	}
-	if(fwrite(&superb, sizeof(ohc_superblock_t), 1, filp) < 1) {
-		return OHC_ERROR;
+out:
+	free(outs);
+	free(buffers);
+	return NULL;
+}
+
+/* start a thread to store the @n @devices. The items must not be
+ * changed until format_store_finish(). */
+ohc_format_thread_t *format_store_start(ohc_server_listens_t *listens,
+		ohc_device_t **devices, int n)
+{
+	ohc_format_thread_t *ft;
+
+	ft = malloc(sizeof(ohc_format_thread_t));
+	if(ft == NULL) {
+		return NULL;
 	}
+	ft->stores = devices;
+	ft->store_nr = n;
+	ft->listens = listens;
+	ft->records = NULL;
 
-	fclose(filp);
+	/* store it in current thread, if fail to create thread */
+	ft->threaded = (pthread_create(&ft->tid, NULL, format_store_routine, ft) == 0);
+	if(!ft->threaded) {
+		format_store_routine(ft);
+	}
+	return ft;
+}
+
+static int format_read_full(int fd, void *buf, size_t len)
+{
+	ssize_t rc;
+	size_t done;
+
+	for(done = 0; done < len; done += rc) {
+		rc = read(fd, (char *)buf + done, len - done);
+		if(rc <= 0) {
+			return OHC_ERROR;
+		}
+	}
 	return OHC_OK;
 }
 
-int format_load_device(ohc_device_t *device)
+/* send @device's dump to the new process by @fd in upgrading. The dump
+ * is built in memory, since the superblock is written at last. */
+int format_store_stream(int fd, ohc_server_listens_t *listens,
+		ohc_device_t *device)
 {
-	unsigned char buffer[OHC_FM_INFO_SIZE];
-	unsigned short *server_ports;
-	ohc_superblock_t *superb;
-	ohc_server_t *server;
-	ohc_server_t *disk_servers[SERVERS_LIMIT];
-	ohc_format_item_t fm_item;
+	ohc_format_stream_t header;
+	char *buffer = NULL;
+	size_t length = 0;
 	FILE *filp;
-	long i;
-	off_t override;
+	long count;
 	int rc = OHC_ERROR;
 
-	time_t now = timer_now(&master_timer);
-
-	filp = fopen(device->filename, "r+");
+	filp = open_memstream(&buffer, &length);
 	if(filp == NULL) {
 		return OHC_ERROR;
 	}
-	if(fread(buffer, OHC_FM_INFO_SIZE, 1, filp) < 1) {
+
+	/* the size of memstream is the position when closing */
+	count = format_store_file(filp, 0, listens, device);
+	if(count < 0 || fseek(filp, OHC_FM_INFO_SIZE
+				+ count * sizeof(ohc_format_item_t), SEEK_SET) < 0) {
+		fclose(filp);
 		goto out;
 	}
-	superb = (ohc_superblock_t *)&buffer[0];
-	server_ports = (unsigned short *)(superb + 1);
+	fclose(filp);
 
-	/* check */
-	if(superb->magic != OHC_FM_MAGIC || superb->version != OHC_FM_VERSION) {
-		goto out;
+	bzero(&header, sizeof(header));
+	strncpy(header.filename, device->filename, PATH_LENGTH - 1);
+	header.length = length;
+	if(format_write_full(fd, &header, sizeof(header)) == OHC_OK
+			&& format_write_full(fd, buffer, length) == OHC_OK) {
+		rc = OHC_OK;
 	}
+out:
+	free(buffer);
+	return rc;
+}
 
-	if(format_checksum(buffer, OHC_FM_INFO_SIZE) != OHC_FM_CHS_FEED) {
-		goto out;
+int format_store_finish(ohc_format_thread_t *ft)
+{
+	int rc;
+
+	if(ft == NULL) {
+		return OHC_ERROR;
+	}
+	if(ft->threaded) {
+		pthread_join(ft->tid, NULL);
+	}
+
+	rc = ft->rc;
+	free(ft);
+	return rc;
+}
+
+/* check superblock in @buffer of @size. return the number of records,
+ * or -1 if fail. The @buffer of old versions is converted in place. */
+static long format_check_header(unsigned char *buffer, size_t size,
+		int *version)
+{
+	ohc_superblock_t *superb = (ohc_superblock_t *)buffer;
+	size_t info_size;
+
+	/* check. version 1 is compatible, without flags */
+	if(superb->magic != OHC_FM_MAGIC || superb->version > OHC_FM_VERSION) {
+		return -1;
+	}
+
+	info_size = format_info_size(superb->version);
+	if(size < info_size
+			|| format_checksum(buffer, info_size) != OHC_FM_CHS_FEED) {
+		return -1;
+	}
+
+	if(superb->item_nr < 0) {
+		return -1;
 	}
 
-	/* build @disk_servers */
+	/* versions 1 and 2 are without secret, and the items are
+	 * without heads */
+	if(superb->version < 3) {
+		memmove(buffer + sizeof(ohc_superblock_t),
+				buffer + OHC_FM_INFO_SIZE_V2 - SERVER_PORTS_SIZE,
+				SERVER_PORTS_SIZE);
+		superb->secret = 0;
+	}
+
+	/* before version 6, without unix socket servers */
+	if(superb->version < 6) {
+		bzero(buffer + OHC_FM_INFO_SIZE_V5,
+				OHC_FM_INFO_SIZE - OHC_FM_INFO_SIZE_V5);
+	}
+
+	*version = superb->version;
+	return superb->item_nr;
+}
+
+/* build @disk_servers by the server listens in @buffer */
+static void format_disk_servers(unsigned char *buffer, ohc_server_t **disk_servers)
+{
+	ohc_server_listens_t *listens = format_info_listens(buffer);
+	unsigned short *ports = listens->ports;
+	char *path;
+	short index;
+	int i;
+
 	for(i = 0; i < SERVERS_LIMIT; i++) {
-		if(server_ports[i] != 0) {
-			disk_servers[i] = server_by_port(server_ports[i]);
+		disk_servers[i] = ports[i] ? server_by_listen(ports[i], "") : NULL;
+	}
+	for(i = 0; i < SERVER_UNIX_LIMIT; i++) {
+		index = listens->unixes[i].index;
+		path = listens->unixes[i].path;
+		if(path[0] != '\0' && strnlen(path, SERVER_PATH_MAX) < SERVER_PATH_MAX
+				&& index >= 0 && index < SERVERS_LIMIT) {
+			disk_servers[index] = server_by_listen(0, path);
 		}
 	}
+}
 
-	/* load items! */
-	override = OHC_FM_INFO_SIZE + superb->item_nr * sizeof(ohc_format_item_t);
-	if(fseek(filp, OHC_FM_INFO_SIZE, SEEK_SET) < 0) {
-		goto out;
+/* read and check superblock and server listens in @filp at @base into
+ * @info, in size of OHC_FM_INFO_SIZE. @filp is left at the first
+ * record. return the number of records, or -1 if fail. */
+long format_read_header(FILE *filp, off_t base, unsigned char *info,
+		int *version)
+{
+	size_t size;
+	long item_nr;
+
+	if(fseek(filp, base, SEEK_SET) < 0) {
+		return -1;
+	}
+	size = fread(info, 1, OHC_FM_INFO_SIZE, filp);
+	item_nr = format_check_header(info, size, version);
+	if(item_nr < 0) {
+		return -1;
+	}
+	if(fseek(filp, base + format_info_size(*version), SEEK_SET) < 0) {
+		return -1;
+	}
+	return item_nr;
+}
+
+/* the size of record in dump of @version */
+size_t format_record_size(int version)
+{
+	/* before version 4, without @hits and @rank */
+	return version < 4 ? OHC_FM_RECORD_V3 : sizeof(ohc_format_item_t);
+}
+
+/* convert @nr records of old @version in @records, which are read
+ * in format_record_size(@version) but have room for the current. */
+void format_records_upgrade(ohc_format_item_t *records, long nr, int version)
+{
+	size_t size = format_record_size(version);
+	ohc_format_item_t *fm_item;
+	long i;
+
+	if(version >= 5) {
+		return;
+	}
+
+	/* backward, since the new records are larger */
+	for(i = nr - 1; i >= 0; i--) {
+		fm_item = &records[i];
+		memmove(fm_item, (char *)records + i * size, size);
+		fm_item->validator = 0;
+		if(version >= 4) {
+			continue;
+		}
+		fm_item->hits = 0;
+		fm_item->rank = OHC_FM_NO_RANK;
+		if(version == 1) {
+			fm_item->flags = 0;
+		}
+		if(version < 3) {
+			fm_item->flags |= OHC_FM_HEADLESS;
+		}
+	}
+}
+
+/* by offset, and a page is before its packed items */
+static int format_record_cmp(const void *a, const void *b)
+{
+	const ohc_format_item_t *x = a;
+	const ohc_format_item_t *y = b;
+
+	if(x->offset != y->offset) {
+		return x->offset < y->offset ? -1 : 1;
+	}
+	return (y->flags & OHC_FM_PAGE) - (x->flags & OHC_FM_PAGE);
+}
+
+/* load a record. records before @override are overwritten by dump. */
+void format_load_item(ohc_device_t *device, ohc_server_t **disk_servers,
+		ohc_format_item_t *fm_item, off_t override)
+{
+	ohc_server_t *server;
+
+	if(fm_item->offset < override) {
+		return;
+	}
+
+	if(fm_item->server_index < 0 || fm_item->server_index >= SERVERS_LIMIT) {
+		return;
+	}
+	server = disk_servers[fm_item->server_index];
+	if(server == NULL) {
+		return;
+	}
+
+	/* stale items are kept too */
+	if(fm_item->expire + server_stale_time(server)
+			<= timer_now(&master_timer)) {
+		return;
+	}
+
+	server_load_fm_item(server, device, fm_item);
+}
+
+/* the path of the current unix socket server whose head port is
+ * @port, or NULL if none or not unique */
+static char *format_scan_path(ohc_format_thread_t *ft, unsigned short port)
+{
+	char *path = NULL;
+	int i;
+
+	for(i = 0; i < SERVER_UNIX_LIMIT; i++) {
+		if(ft->servers.unixes[i].path[0] != '\0'
+				&& ft->unix_ports[i] == port) {
+			if(path != NULL) {
+				return NULL;
+			}
+			path = ft->servers.unixes[i].path;
+		}
 	}
-	for(i = 0; i < superb->item_nr; i++) {
-		if(fread(&fm_item, sizeof(ohc_format_item_t), 1, filp) < 1) {
-			goto out;
+	return path;
+}
+
+/* the server index in scanning, by @head's port, or the unix socket
+ * path which makes it. Indexes are assigned in ft->info, as the
+ * server listens in dump. */
+static short format_scan_server(ohc_format_scan_t *scan, ohc_item_head_t *head)
+{
+	ohc_server_listens_t *listens = format_info_listens(scan->ft->info);
+	char *path;
+	int i;
+
+	if(head->flags & OHC_IH_UNIX) {
+		path = format_scan_path(scan->ft, head->server_port);
+		if(path == NULL) {
+			return -1;
 		}
+		for(i = 0; i < SERVER_UNIX_LIMIT; i++) {
+			if(listens->unixes[i].path[0] == '\0') {
+				break;
+			}
+			if(strcmp(listens->unixes[i].path, path) == 0) {
+				return listens->unixes[i].index;
+			}
+		}
+		if(i == SERVER_UNIX_LIMIT || scan->server_nr == SERVERS_LIMIT) {
+			return -1;
+		}
+		strcpy(listens->unixes[i].path, path);
+		listens->unixes[i].index = scan->server_nr;
+		return scan->server_nr++;
+	}
 
-		if(fm_item.offset < override || fm_item.expire <= now) {
+	if(head->server_port == 0) {
+		return -1;
+	}
+	for(i = 0; i < scan->server_nr; i++) {
+		if(listens->ports[i] == head->server_port) {
+			return i;
+		}
+	}
+	if(scan->server_nr == SERVERS_LIMIT) {
+		return -1;
+	}
+	listens->ports[scan->server_nr] = head->server_port;
+	return scan->server_nr++;
+}
+
+/* add a record in scanning. Add a page at @offset if @head is NULL. */
+static int format_scan_add(ohc_format_scan_t *scan, ohc_item_head_t *head,
+		off_t offset, short server_index)
+{
+	ohc_format_thread_t *ft = scan->ft;
+	ohc_format_item_t *fm_item;
+	ohc_scan_item_t *found;
+
+	if(ft->item_nr == scan->size) {
+		scan->size = scan->size ? scan->size * 2 : 1024;
+		fm_item = realloc(ft->records, scan->size * sizeof(ohc_format_item_t));
+		if(fm_item == NULL) {
+			return OHC_ERROR;
+		}
+		ft->records = fm_item;
+
+		found = realloc(scan->found, scan->size * sizeof(ohc_scan_item_t));
+		if(found == NULL) {
+			return OHC_ERROR;
+		}
+		scan->found = found;
+	}
+
+	fm_item = &ft->records[ft->item_nr];
+	bzero(fm_item, sizeof(ohc_format_item_t));
+	fm_item->server_index = server_index;
+	fm_item->offset = offset;
+	fm_item->rank = OHC_FM_NO_RANK;
+	if(head == NULL) {
+		fm_item->length = OHC_PAGE_SIZE;
+		fm_item->expire = INT32_MAX;
+		fm_item->flags = OHC_FM_PAGE;
+		ft->item_nr++;
+		return OHC_OK;
+	}
+
+	memcpy(fm_item->hash_id, head->hash_id, 16);
+	fm_item->offset += OHC_ITEM_HEAD_SIZE;
+	fm_item->length = head->length;
+	fm_item->expire = head->expire;
+	fm_item->headers_len = head->headers_len;
+	fm_item->flags = (head->flags & OHC_IH_PACKED) ? OHC_FM_PACKED : 0;
+	if(head->flags & OHC_IH_CHUNKED) {
+		fm_item->flags |= OHC_FM_CHUNKED;
+	}
+
+	found = &scan->found[scan->found_nr++];
+	memcpy(found->hash_id, head->hash_id, 16);
+	found->stored = head->stored;
+	found->index = ft->item_nr++;
+	return OHC_OK;
+}
+
+/* scan the packed items in the page @buffer at @offset. return the
+ * number of items found, or -1 if fail. */
+static long format_scan_page(ohc_format_scan_t *scan, char *buffer, off_t offset)
+{
+	ohc_item_head_t *head;
+	size_t pos = 0, slot;
+	short server_index;
+	long count = 0;
+
+	while(pos + OHC_ITEM_HEAD_SIZE <= OHC_PAGE_SIZE) {
+		head = (ohc_item_head_t *)(buffer + pos);
+		if(!format_item_head_check(head, scan->ft->secret)
+				|| !(head->flags & OHC_IH_PACKED)
+				|| head->page_pos != pos) {
+			break;
+		}
+		slot = page_slot_size(OHC_ITEM_HEAD_SIZE + head->length);
+		if(pos + slot > OHC_PAGE_SIZE) {
+			break;
+		}
+
+		if(!(head->flags & (OHC_IH_PUTTING | OHC_IH_DELETED))) {
+			server_index = format_scan_server(scan, head);
+			if(count == 0 && format_scan_add(scan, NULL, offset,
+						server_index) != OHC_OK) {
+				return -1;
+			}
+			if(format_scan_add(scan, head, offset + pos,
+						server_index) != OHC_OK) {
+				return -1;
+			}
+			count++;
+		}
+		pos += slot;
+	}
+	return count;
+}
+
+static int format_scan_cmp(const void *a, const void *b)
+{
+	const ohc_scan_item_t *x = a;
+	const ohc_scan_item_t *y = b;
+	int rc;
+
+	rc = memcmp(x->hash_id, y->hash_id, 16);
+	if(rc != 0) {
+		return rc;
+	}
+	return x->stored > y->stored ? -1 : (x->stored < y->stored);
+}
+
+static int format_scan_recent_cmp(const void *a, const void *b)
+{
+	const ohc_scan_item_t *x = a;
+	const ohc_scan_item_t *y = b;
+
+	return x->stored > y->stored ? -1 : (x->stored < y->stored);
+}
+
+/* An item may be found twice, e.g. it was replaced while being sent
+ * when crash. The newest wins, and the others are dropped.
+ * Without LRU in dump, the items are ranked by their stored time. */
+static void format_scan_unique(ohc_format_scan_t *scan)
+{
+	ohc_scan_item_t *found = scan->found;
+	long i;
+
+	qsort(found, scan->found_nr, sizeof(ohc_scan_item_t), format_scan_cmp);
+	for(i = 1; i < scan->found_nr; i++) {
+		if(memcmp(found[i].hash_id, found[i - 1].hash_id, 16) == 0) {
+			scan->ft->records[found[i].index].server_index = -1;
+		}
+	}
+
+	qsort(found, scan->found_nr, sizeof(ohc_scan_item_t), format_scan_recent_cmp);
+	for(i = 0; i < scan->found_nr; i++) {
+		scan->ft->records[found[i].index].rank = i;
+	}
+}
+
+/* Recover items by scanning the heads in the device, if there is no
+ * dump. Blocks are aligned by IPB_1ST, so we check each IPB_1ST, and
+ * skip the blocks of items found. A page is recognized by the head
+ * of its first packed item, and its items are linked by their heads.
+ * The block of a deleted item, or a page without live items, is free.
+ * It may be allocated again from its rear, so it's scanned on, but
+ * only the heads newer than the deleted one are taken in it. */
+static int format_scan_device(ohc_format_thread_t *ft)
+{
+	ohc_format_scan_t scan;
+	ohc_item_head_t *head;
+	off_t capacity = ft->device->capacity;
+	off_t pos, base = 0, free_end = 0;
+	int64_t free_stored = 0;
+	short server_index;
+	size_t need, length = 0, done, step;
+	ssize_t rc;
+	long count;
+	char *buffer;
+	int ret = OHC_ERROR;
+
+	buffer = malloc(FORMAT_IO_SIZE);
+	if(buffer == NULL) {
+		return OHC_ERROR;
+	}
+	bzero(&scan, sizeof(scan));
+	scan.ft = ft;
+	bzero(ft->info, OHC_FM_INFO_SIZE);
+
+	posix_fadvise(ft->fd, 0, capacity, POSIX_FADV_SEQUENTIAL);
+	for(pos = OHC_FM_LABEL_SIZE; pos + OHC_ITEM_HEAD_SIZE <= capacity; ) {
+
+		/* read on, if the buffer does not cover a page at @pos */
+		need = capacity - pos < OHC_PAGE_SIZE ? capacity - pos : OHC_PAGE_SIZE;
+		if(pos + need > base + length) {
+			step = capacity - pos < FORMAT_IO_SIZE ? capacity - pos : FORMAT_IO_SIZE;
+			for(done = 0; done < step; done += rc) {
+				rc = pread(ft->fd, buffer + done, step - done, pos + done);
+				if(rc <= 0) {
+					goto out;
+				}
+			}
+			base = pos;
+			length = step;
+		}
+
+		head = (ohc_item_head_t *)(buffer + (pos - base));
+		if(!format_item_head_check(head, ft->secret)
+				|| (pos < free_end && head->stored <= free_stored)) {
+			pos += IPB_1ST;
 			continue;
 		}
 
-		server = disk_servers[fm_item.server_index];
-		if(server == NULL) {
+		if(head->flags & OHC_IH_PACKED) {
+			if(head->page_pos != 0 || need < OHC_PAGE_SIZE) {
+				pos += IPB_1ST;
+				continue;
+			}
+			count = format_scan_page(&scan, (char *)head, pos);
+			if(count < 0) {
+				goto out;
+			}
+			if(count != 0) {
+				pos += OHC_PAGE_SIZE;
+				continue;
+			}
+			step = OHC_PAGE_SIZE;
+
+		} else {
+			step = ipbucket_block_size(OHC_ITEM_HEAD_SIZE + head->length);
+			if(pos + step > capacity) {
+				pos += IPB_1ST;
+				continue;
+			}
+			if(!(head->flags & OHC_IH_DELETED)) {
+				if(!(head->flags & OHC_IH_PUTTING)) {
+					server_index = format_scan_server(&scan, head);
+					if(format_scan_add(&scan, head, pos, server_index) != OHC_OK) {
+						goto out;
+					}
+				}
+				pos += step;
+				continue;
+			}
+		}
+
+		/* a free block. The heads in it older than it are stale. */
+		if(pos >= free_end) {
+			free_stored = head->stored;
+		}
+		if(pos + step > free_end) {
+			free_end = pos + step;
+		}
+		pos += IPB_1ST;
+	}
+
+	format_scan_unique(&scan);
+	ret = OHC_OK;
+
+out:
+	free(scan.found);
+	free(buffer);
+	return ret;
+}
+
+/* take the @item_nr records read from a dump into ft->records */
+static void format_take_records(ohc_format_thread_t *ft, long item_nr)
+{
+	format_records_upgrade(ft->records, item_nr, ft->version);
+
+	/* dumped in LRU order, while loaded in offset order */
+	if(ft->version >= 4) {
+		qsort(ft->records, item_nr, sizeof(ohc_format_item_t),
+				format_record_cmp);
+	}
+
+	ft->item_nr = item_nr;
+	ft->secret = ((ohc_superblock_t *)ft->info)->secret;
+}
+
+/* read the dump of @ft's device. return OHC_OK if there is one. */
+static int format_read_dump(ohc_format_thread_t *ft)
+{
+	size_t length, done, step, info_size;
+	ssize_t rc;
+	long item_nr;
+
+	ft->fd = open(ft->device->filename, O_RDWR);
+	if(ft->fd < 0) {
+		return OHC_ERROR;
+	}
+
+	if(pread(ft->fd, ft->info, OHC_FM_INFO_SIZE, 0) != OHC_FM_INFO_SIZE) {
+		return OHC_ERROR;
+	}
+	item_nr = format_check_header(ft->info, OHC_FM_INFO_SIZE, &ft->version);
+	if(item_nr < 0) {
+		return OHC_ERROR;
+	}
+	info_size = format_info_size(ft->version);
+
+	length = item_nr * format_record_size(ft->version);
+	if(length > ft->device->capacity) {
+		return OHC_ERROR;
+	}
+	ft->records = malloc(item_nr * sizeof(ohc_format_item_t));
+	if(ft->records == NULL && length != 0) {
+		return OHC_ERROR;
+	}
+
+	/* large sequential reads */
+	posix_fadvise(ft->fd, info_size, length, POSIX_FADV_SEQUENTIAL);
+	for(done = 0; done < length; done += rc) {
+		step = length - done < FORMAT_IO_SIZE ? length - done : FORMAT_IO_SIZE;
+		rc = pread(ft->fd, (char *)ft->records + done, step,
+				info_size + done);
+		if(rc <= 0) {
+			free(ft->records);
+			ft->records = NULL;
+			return OHC_ERROR;
+		}
+	}
+
+	format_take_records(ft, item_nr);
+	return OHC_OK;
+}
+
+/* read the records of a device in a thread, see format_load_start().
+ * They are read from the dump, or the checkpoint and journal files if
+ * no dump, or found by scanning the device if neither. Only read here,
+ * and the items are loaded in master thread. ft->rc is OHC_DECLINE if
+ * nothing to load. */
+static void *format_load_routine(void *arg)
+{
+	ohc_format_thread_t *ft = arg;
+	long item_nr;
+	int used;
+
+	ft->rc = OHC_OK;
+	bzero(ft->info, OHC_FM_INFO_SIZE);
+	if(format_read_dump(ft) == OHC_OK) {
+		return NULL;
+	}
+
+	/* the device was in use, but no dump, e.g. crashed */
+	used = format_check_label(ft->info, &ft->secret);
+
+	item_nr = journal_read_device(ft->device, ft->info, &ft->version,
+			&ft->records);
+	if(item_nr >= 0) {
+		ft->item_nr = item_nr;
+		ft->replayed = 1;
+
+		/* the checkpoint's, or the label's if no checkpoint */
+		if(((ohc_superblock_t *)ft->info)->secret != 0) {
+			ft->secret = ((ohc_superblock_t *)ft->info)->secret;
+		}
+		return NULL;
+	}
+
+	ft->rc = OHC_DECLINE;
+	if(used && ft->fd >= 0) {
+		ft->version = OHC_FM_VERSION;
+		ft->scanned = 1;
+		ft->rc = format_scan_device(ft);
+	}
+	return NULL;
+}
+
+static void format_load_done(ohc_format_thread_t *ft)
+{
+	/* make sure the results are visible before @done */
+	__sync_synchronize();
+	ft->done = 1;
+}
+
+static void *format_load_thread(void *arg)
+{
+	ohc_format_thread_t *ft = arg;
+
+	format_load_routine(ft);
+	format_load_done(ft);
+	return NULL;
+}
+
+/* prepare to load @device, see format_load_start() and
+ * format_load_stream(). */
+ohc_format_thread_t *format_load_prepare(ohc_device_t *device)
+{
+	ohc_format_thread_t *ft;
+
+	ft = malloc(sizeof(ohc_format_thread_t));
+	if(ft == NULL) {
+		return NULL;
+	}
+	ft->device = device;
+	ft->streamed = 0;
+	ft->records = NULL;
+	ft->item_nr = 0;
+	ft->loaded = 0;
+	ft->scanned = 0;
+	ft->done = 0;
+	ft->threaded = 0;
+	ft->fd = -1;
+	ft->replayed = 0;
+	ft->secret = 0;
+	return ft;
+}
+
+/* start a thread to read the dump of @device. All devices are read
+ * in parallel, and then loaded by format_load_continue() one by one. */
+ohc_format_thread_t *format_load_start(ohc_device_t *device)
+{
+	ohc_format_thread_t *ft;
+	int i;
+
+	ft = format_load_prepare(device);
+	if(ft == NULL) {
+		return NULL;
+	}
+
+	/* for the unix socket servers' items in scanning */
+	server_dump_listens(&ft->servers);
+	for(i = 0; i < SERVER_UNIX_LIMIT; i++) {
+		ft->unix_ports[i] = format_path_port(ft->servers.unixes[i].path);
+	}
+
+	/* read it in current thread, if fail to create thread */
+	ft->threaded = (pthread_create(&ft->tid, NULL, format_load_thread, ft) == 0);
+	if(!ft->threaded) {
+		format_load_thread(ft);
+	}
+	return ft;
+}
+
+/* take the dump @buffer of @length received in upgrading */
+static void format_load_buffer(ohc_format_thread_t *ft, char *buffer,
+		size_t length)
+{
+	size_t info_size, size;
+	long item_nr;
+
+	ft->rc = OHC_ERROR;
+	if(length < OHC_FM_INFO_SIZE_V2) {
+		return;
+	}
+	bzero(ft->info, OHC_FM_INFO_SIZE);
+	memcpy(ft->info, buffer, length < OHC_FM_INFO_SIZE
+			? length : OHC_FM_INFO_SIZE);
+	item_nr = format_check_header(ft->info, length, &ft->version);
+	if(item_nr < 0) {
+		return;
+	}
+	info_size = format_info_size(ft->version);
+	size = item_nr * format_record_size(ft->version);
+	if(size > length - info_size) {
+		return;
+	}
+
+	ft->records = malloc(item_nr * sizeof(ohc_format_item_t));
+	if(ft->records == NULL && item_nr != 0) {
+		return;
+	}
+	memcpy(ft->records, buffer + info_size, size);
+	format_take_records(ft, item_nr);
+	ft->streamed = 1;
+	ft->rc = OHC_OK;
+}
+
+typedef struct {
+	int			fd;
+	int			nr;
+	ohc_format_thread_t	*fts[];
+} ohc_format_stream_ctx_t;
+
+/* receive the dumps of devices from the old process one by one. The
+ * devices not received, e.g. new in configure or the old process
+ * fails, are read from devices. */
+static void *format_stream_routine(void *arg)
+{
+	ohc_format_stream_ctx_t *ctx = arg;
+	ohc_format_stream_t header;
+	ohc_format_thread_t *ft;
+	char *buffer;
+	int i;
+
+	while(format_read_full(ctx->fd, &header, sizeof(header)) == OHC_OK) {
+		header.filename[PATH_LENGTH - 1] = '\0';
+		buffer = malloc(header.length);
+		if(buffer == NULL && header.length != 0) {
+			break;
+		}
+		if(format_read_full(ctx->fd, buffer, header.length) != OHC_OK) {
+			free(buffer);
+			break;
+		}
+
+		ft = NULL;
+		for(i = 0; i < ctx->nr; i++) {
+			if(!ctx->fts[i]->done && strcmp(ctx->fts[i]->device->filename,
+						header.filename) == 0) {
+				ft = ctx->fts[i];
+				break;
+			}
+		}
+		if(ft == NULL) {
+			free(buffer);
 			continue;
 		}
 
-		server_load_fm_item(server, device, &fm_item);
+		format_load_buffer(ft, buffer, header.length);
+		free(buffer);
+		if(ft->rc != OHC_OK) {
+			free(ft->records);
+			ft->records = NULL;
+			format_load_routine(ft);
+		}
+		format_load_done(ft);
 	}
-	device_load_post(device);
+	close(ctx->fd);
 
-	/* clear the magic */
-	if(fseek(filp, 0, SEEK_SET) < 0) {
-		goto out;
+	for(i = 0; i < ctx->nr; i++) {
+		ft = ctx->fts[i];
+		if(!ft->done) {
+			format_load_routine(ft);
+			format_load_done(ft);
+		}
+	}
+	free(ctx);
+	return NULL;
+}
+
+/* receive the dumps of devices of @fts from the old process by @fd
+ * in a thread, in upgrading. */
+void format_load_stream(int fd, ohc_format_thread_t **fts, int nr)
+{
+	ohc_format_stream_ctx_t *ctx;
+	pthread_t tid;
+	int i;
+
+	ctx = malloc(sizeof(ohc_format_stream_ctx_t)
+			+ nr * sizeof(ohc_format_thread_t *));
+	if(ctx == NULL) {
+		log_error_run(errno, "NoMem for upgrade");
+		close(fd);
+		for(i = 0; i < nr; i++) {
+			format_load_routine(fts[i]);
+			format_load_done(fts[i]);
+		}
+		return;
 	}
-	if(fwrite("FeiLiWuShi", 10, 1, filp) < 1) {
+	ctx->fd = fd;
+	ctx->nr = nr;
+	memcpy(ctx->fts, fts, nr * sizeof(ohc_format_thread_t *));
+
+	/* receive it in current thread, if fail to create thread */
+	if(pthread_create(&tid, NULL, format_stream_routine, ctx) == 0) {
+		pthread_detach(tid);
+	} else {
+		format_stream_routine(ctx);
+	}
+}
+
+/* whether the thread finishes reading */
+int format_load_ready(ohc_format_thread_t *ft)
+{
+	return ft == NULL || ft->done;
+}
+
+/* Load the items read by the thread, FORMAT_LOAD_BATCH items at most
+ * each time, so the master can serve requests between the batches.
+ * Return OHC_AGAIN if not finished, or OHC_DECLINE if nothing to load.
+ * @replayed is set at the end, if the items are from the checkpoint
+ * and journal files, but not dump.
+ * Stop loading if @abort is set, e.g. the device is deleted. */
+int format_load_continue(ohc_format_thread_t *ft, int abort,
+		int *replayed)
+{
+	ohc_server_t *disk_servers[SERVERS_LIMIT];
+	ohc_device_t *device;
+	off_t override;
+	long i, end;
+	int rc = OHC_ERROR;
+
+	*replayed = 0;
+	if(ft == NULL) {
+		return OHC_ERROR;
+	}
+	/* the streamed one is not owned by a thread, so wait for it */
+	if(!ft->done && (!abort || !ft->threaded)) {
+		return OHC_AGAIN;
+	}
+	if(ft->threaded) {
+		pthread_join(ft->tid, NULL);
+		ft->threaded = 0;
+	}
+
+	device = ft->device;
+	if(abort || ft->rc != OHC_OK) {
+		if(ft->loaded != 0) {
+			page_load_post();
+		}
+		if(!abort && ft->rc == OHC_DECLINE) {
+			format_mark_used(device);
+			rc = OHC_DECLINE;
+		}
 		goto out;
 	}
+
+	/* servers may be deleted between batches, so build
+	 * @disk_servers each time */
+	format_disk_servers(ft->info, disk_servers);
+	/* before any head of the loaded items is rewritten */
+	if(ft->loaded == 0 && ft->secret != 0) {
+		device->tab->secret = ft->secret;
+	}
+
+	/* load items! The items overwritten by dump are dropped. */
+	override = (ft->replayed || ft->scanned || ft->streamed) ? 0
+		: format_info_size(ft->version)
+		+ ft->item_nr * format_record_size(ft->version);
+	end = ft->loaded + FORMAT_LOAD_BATCH;
+	if(end > ft->item_nr) {
+		end = ft->item_nr;
+	}
+	for(i = ft->loaded; i < end; i++) {
+		format_load_item(device, disk_servers, &ft->records[i], override);
+	}
+	ft->loaded = end;
+	if(ft->loaded < ft->item_nr) {
+		return OHC_AGAIN;
+	}
+
+	page_load_post();
+	device_load_post(device);
 	rc = OHC_OK;
 
+	/* the dump is stale since now */
+	if(ft->scanned) {
+		log_error_run(0, "recover %ld items of device %s by scanning",
+				device->tab->item_nr, device->filename);
+	} else if(ft->streamed) {
+		log_error_run(0, "take %ld items of device %s from the old process",
+				device->tab->item_nr, device->filename);
+	} else {
+		format_mark_used(device);
+	}
+	*replayed = ft->replayed;
+
 out:
-	fclose(filp);
+	if(ft->fd != -1) {
+		close(ft->fd);
+	}
+	free(ft->records);
+	free(ft);
 	return rc;
 }
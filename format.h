@@ -9,8 +9,77 @@
 #ifndef _OHC_FORMAT_H_
 #define _OHC_FORMAT_H_
 
+#include <stdint.h>
+
+/* ohc_item_head_t.flags */
+#define OHC_IH_PACKED	0x1
+#define OHC_IH_PUTTING	0x2 /* the body is not finished */
+#define OHC_IH_DELETED	0x4
+#define OHC_IH_CHUNKED	0x8 /* the head of a chunked item */
+#define OHC_IH_UNIX	0x10 /* server_port is made from unix socket path */
+
+/* Header of item on disk, just before the response headers and body,
+ * so that items can be recovered by scanning the device if there is
+ * no dump. It's written with OHC_IH_PUTTING before the body, and
+ * re-written when the body is finished.
+ * It's defined before including olivehc.h, since other modules'
+ * headers need it, e.g. ohc_request_t. */
+struct ohc_item_head_s {
+	uint32_t	magic;
+	uint32_t	checksum;
+	unsigned char	hash_id[16];
+	int64_t		stored; /* in microseconds, the newest wins */
+	uint32_t	length;
+	int32_t		expire;
+	unsigned short	headers_len;
+	unsigned short	server_port;
+	unsigned short	page_pos; /* offset in page, for packed item */
+	unsigned short	flags;
+};
+
+#define OHC_ITEM_HEAD_SIZE	sizeof(struct ohc_item_head_s)
+
 #include "olivehc.h"
 
+/* ohc_format_item_t.flags */
+#define OHC_FM_PAGE	0x1 /* a page, followed by its packed items */
+#define OHC_FM_PACKED	0x2 /* a packed item, in the previous page */
+#define OHC_FM_DELETE	0x4 /* journal only, the item or page is deleted */
+#define OHC_FM_HEADLESS	0x8 /* the item has no ohc_item_head_t on disk */
+#define OHC_FM_ETAG	0x10 /* @validator is ETag, see ohc_item_t */
+#define OHC_FM_CHUNKED	0x20 /* the head of a chunked item */
+
+/* the beginning of device is reserved for the superblock of dump, or
+ * the mark of device in use */
+#define OHC_FM_LABEL_SIZE	IPB_1ST
+
+typedef struct ohc_format_thread_s ohc_format_thread_t;
+
+typedef struct {
+	uint64_t	magic;
+	int		version;
+	uint64_t	checksum;
+	long		item_nr;
+	uint64_t	secret; /* since version 3, see ohc_table_device_t.secret */
+} ohc_superblock_t;
+
+/* superblock and server listens, at the beginning of a dump */
+#define SERVER_PORTS_SIZE (sizeof(unsigned short) * SERVERS_LIMIT)
+#define OHC_FM_INFO_SIZE (sizeof(ohc_superblock_t) + sizeof(ohc_server_listens_t))
+
+/* output of storing a device, a stdio stream, or an fd with a buffer.
+ * Set by format_output_file() or format_output_fd(). */
+typedef struct {
+	ohc_device_t		*device;
+	FILE			*filp;
+	int			fd;
+	char			*buffer;
+	size_t			size;
+	size_t			len;
+	off_t			base;
+	ohc_superblock_t	superb;
+} ohc_format_output_t;
+
 /* ohc_item_t on disk */
 struct ohc_format_item_s {
 	unsigned char	hash_id[16];
@@ -19,9 +88,65 @@ struct ohc_format_item_s {
 	int32_t		expire;
 	unsigned short	headers_len;
 	short		server_index;
+	unsigned short	flags;
+	unsigned short	hits;
+
+	/* position in LRU when dumped, 0 for the most recent */
+	uint32_t	rank;
+
+	uint32_t	validator;
 };
 
-int format_store_device(unsigned short *ports, ohc_device_t *device);
-int format_load_device(ohc_device_t *device);
+#define OHC_FM_NO_RANK	UINT32_MAX
+
+/* sizeof(ohc_format_item_t) before version 4 */
+#define OHC_FM_RECORD_V3	40
+
+void format_item_head(ohc_item_head_t *head, ohc_item_t *item,
+		unsigned short flags);
+void format_item_head_flags(ohc_item_head_t *head, ohc_device_t *device,
+		unsigned short flags);
+void format_item_invalidate(ohc_item_t *item);
+void format_item_complete(ohc_item_t *item);
+void format_item_touch(ohc_item_t *item);
+void format_rewrite_flush(void);
+void format_rewrite_wait(ohc_device_t *device);
+void format_rewrite_cancel(ohc_device_t *device);
+void format_mark_used(ohc_device_t *device);
+int format_check_used(ohc_device_t *device, uint64_t secret);
+uint64_t format_new_secret(void);
+
+void format_item_record(ohc_format_item_t *fm_item, ohc_item_t *item,
+		unsigned short flags);
+void format_page_record(ohc_format_item_t *fm_item, ohc_page_t *page,
+		unsigned short flags);
+
+void format_output_file(ohc_format_output_t *out, ohc_device_t *device,
+		FILE *filp, off_t base);
+void format_output_fd(ohc_format_output_t *out, ohc_device_t *device,
+		int fd, off_t base, char *buffer, size_t size);
+void format_store_outputs(ohc_format_output_t *outs, int n,
+		ohc_server_listens_t *listens);
+long format_store_file(FILE *filp, off_t base, ohc_server_listens_t *listens,
+		ohc_device_t *device);
+ohc_format_thread_t *format_store_start(ohc_server_listens_t *listens,
+		ohc_device_t **devices, int n);
+int format_store_finish(ohc_format_thread_t *ft);
+
+long format_read_header(FILE *filp, off_t base, unsigned char *info,
+		int *version);
+size_t format_record_size(int version);
+void format_records_upgrade(ohc_format_item_t *records, long nr, int version);
+void format_load_item(ohc_device_t *device, ohc_server_t **disk_servers,
+		ohc_format_item_t *fm_item, off_t override);
+int format_store_stream(int fd, ohc_server_listens_t *listens,
+		ohc_device_t *device);
+
+ohc_format_thread_t *format_load_prepare(ohc_device_t *device);
+ohc_format_thread_t *format_load_start(ohc_device_t *device);
+void format_load_stream(int fd, ohc_format_thread_t **fts, int nr);
+int format_load_ready(ohc_format_thread_t *ft);
+int format_load_continue(ohc_format_thread_t *ft, int abort,
+		int *replayed);
 
 #endif
@@ -5,6 +5,7 @@
  *
  */
 
+#include <openssl/md5.h>
 #include "http.h"
 
 
@@ -39,6 +40,38 @@ static int http_parse_ohc_key(ohc_request_t *r, char *p, ssize_t len)
 	return OHC_OK;
 }
 
+/* "bytes a-b/total" of PUT, to fill a part of the item */
+static int http_parse_put_content_range(ohc_request_t *r, char *p, ssize_t len)
+{
+	char *endp;
+
+	if(strncmp(p, "bytes ", 6)) {
+		goto fail;
+	}
+	p += 6;
+	r->range_start = strtol(p, &endp, 10);
+	if(endp == p || *endp != '-') {
+		goto fail;
+	}
+	p = endp + 1;
+	r->range_end = strtol(p, &endp, 10);
+	if(endp == p || *endp != '/') {
+		goto fail;
+	}
+	p = endp + 1;
+	r->range_total = strtol(p, &endp, 10);
+	if(endp == p || r->range_start < 0 || r->range_start > r->range_end
+			|| r->range_end >= r->range_total) {
+		goto fail;
+	}
+
+	r->range_put = 1;
+	return OHC_OK;
+fail:
+	r->error_reason = "InvalidContentRange";
+	return OHC_ERROR;
+}
+
 static int http_parse_put_cache_control(ohc_request_t *r, char *p, ssize_t len)
 {
 	char *value, *endp;
@@ -79,11 +112,14 @@ static int http_parse_put_expires(ohc_request_t *r, char *p, ssize_t len)
 	return OHC_DECLINE;
 }
 
+/* parse "bytes=a-b, c-d, ...". If the ranges are more than the server's
+ * @max_ranges, ignore them and response the whole item. */
 static int http_parse_get_range(ohc_request_t *r, char *p, ssize_t len)
 {
 	ssize_t start, end;
 	char *begin = p;
 	char *q;
+	int nr = 0;
 
 	r->range.base = begin;
 	r->range.len = len;
@@ -93,57 +129,176 @@ static int http_parse_get_range(ohc_request_t *r, char *p, ssize_t len)
 	}
 	p += 6;
 
-	/* start */
-	q = p;
-	start = 0;
-	while (*p >= '0' && *p <= '9') {
-		start = start * 10 + *p++ - '0';
-	}
-	if(p == q) {
-		start = RANGE_NO_SET;
-	}
+	while(1) {
+		while(*p == ' ') p++;
 
-	/* - */
-	if(*p++ != '-') {
-		goto fail;
-	}
+		/* start */
+		q = p;
+		start = 0;
+		while (*p >= '0' && *p <= '9') {
+			start = start * 10 + *p++ - '0';
+		}
+		if(p == q) {
+			start = RANGE_NO_SET;
+		}
 
-	/* end */
-	q = p;
-	end = 0;
-	while (*p >= '0' && *p <= '9') {
-		end = end * 10 + *p++ - '0';
-	}
-	if(p == q) {
-		end = RANGE_NO_SET;
-	}
+		/* - */
+		if(*p++ != '-') {
+			goto fail;
+		}
 
-	/* check */
-	if(start == RANGE_NO_SET && end == RANGE_NO_SET) {
-		goto fail;
-	}
-	if(start != RANGE_NO_SET && end != RANGE_NO_SET && start > end) {
-		goto fail;
+		/* end */
+		q = p;
+		end = 0;
+		while (*p >= '0' && *p <= '9') {
+			end = end * 10 + *p++ - '0';
+		}
+		if(p == q) {
+			end = RANGE_NO_SET;
+		}
+
+		/* check */
+		if(start == RANGE_NO_SET && end == RANGE_NO_SET) {
+			goto fail;
+		}
+		if(start != RANGE_NO_SET && end != RANGE_NO_SET && start > end) {
+			goto fail;
+		}
+
+		if(nr < REQ_RANGES_LIMIT) {
+			r->ranges[nr].start = start;
+			r->ranges[nr].end = end;
+		}
+		nr++;
+
+		while(*p == ' ') p++;
+		if(*p == '\r') {
+			break;
+		}
+		if(*p++ != ',') {
+			goto fail;
+		}
 	}
 
-	while(*p == ' ') p++;
-	if(*p == ',') {
-		/* not surport multi-range */
+	if(nr > r->server->max_ranges) {
 		return OHC_OK;
 	}
-	if(*p != '\r') {
-		goto fail;
-	}
 
 	r->range_set = 1;
-	r->range_start = start;
-	r->range_end = end;
+	r->range_nr = nr;
 	return OHC_OK;
 fail:
 	r->error_reason = "InvalidRange";
 	return OHC_ERROR;
 }
 
+/* hash of an entity-tag, while "W/" is ignored for weak comparison.
+ * Never 0, which means no validator. */
+static uint32_t http_etag_hash(char *p, ssize_t len)
+{
+	unsigned char md5[16];
+	uint32_t hash;
+
+	if(len > 2 && strncmp(p, "W/", 2) == 0) {
+		p += 2;
+		len -= 2;
+	}
+	MD5((unsigned char *)p, len, md5);
+	memcpy(&hash, md5, sizeof(hash));
+	return hash ? hash : 1;
+}
+
+/* ETag and Last-Modified are kept in item as validator, and they are
+ * stored as other headers too. ETag is preferred, since If-None-Match
+ * takes precedence over If-Modified-Since. */
+static int http_parse_put_etag(ohc_request_t *r, char *p, ssize_t len)
+{
+	r->validator = http_etag_hash(p, len);
+	r->validator_etag = 1;
+	return OHC_DECLINE;
+}
+
+static int http_parse_put_last_modified(ohc_request_t *r, char *p, ssize_t len)
+{
+	time_t t;
+
+	if(r->validator_etag) {
+		return OHC_DECLINE;
+	}
+	t = timer_parse_rfc1123(p);
+	if(t != (time_t)-1 && t > 0 && t <= UINT32_MAX) {
+		r->validator = t;
+	}
+	return OHC_DECLINE;
+}
+
+static int http_parse_get_if_none_match(ohc_request_t *r, char *p, ssize_t len)
+{
+	r->if_none_match.base = p;
+	r->if_none_match.len = len;
+	return OHC_OK;
+}
+
+/* invalid date, or later than now, is ignored */
+static int http_parse_get_if_modified_since(ohc_request_t *r, char *p, ssize_t len)
+{
+	time_t t = timer_parse_rfc1123(p);
+
+	if(t != (time_t)-1 && t <= timer_now(&master_timer)) {
+		r->if_modified_since = t;
+	}
+	return OHC_OK;
+}
+
+static int http_parse_get_ohc_grace(ohc_request_t *r, char *p, ssize_t len)
+{
+	r->grace = 1;
+	return OHC_OK;
+}
+
+/* the client waits for "100 Continue" before sending the body, so we
+ * can reply at once if not going to store it. */
+static int http_parse_put_expect(ohc_request_t *r, char *p, ssize_t len)
+{
+	if(len != 12 || strncasecmp(p, "100-continue", 12) != 0) {
+		r->error_reason = "UnknownExpectation";
+		r->http_code = 417;
+		return OHC_ERROR;
+	}
+	r->expect_continue = 1;
+	return OHC_OK;
+}
+
+/* tags of the item in PUT, or to purge in PURGE, see tag.c */
+static int http_parse_tags(ohc_request_t *r, char *p, ssize_t len)
+{
+	r->tags.base = p;
+	r->tags.len = len;
+	return OHC_OK;
+}
+
+static int http_parse_delete_prefix(ohc_request_t *r, char *p, ssize_t len)
+{
+	r->purge_prefix = 1;
+	return OHC_OK;
+}
+
+/* the operation of BATCH, on the keys in body */
+static int http_parse_batch(ohc_request_t *r, char *p, ssize_t len)
+{
+	if(len == 6 && strncasecmp(p, "exists", 6) == 0) {
+		r->batch = REQ_BATCH_EXISTS;
+	} else if(len == 6 && strncasecmp(p, "delete", 6) == 0) {
+		r->batch = REQ_BATCH_DELETE;
+	} else if(len == 5 && strncasecmp(p, "touch", 5) == 0) {
+		r->batch = REQ_BATCH_TOUCH;
+	} else {
+		r->error_reason = "UnknownBatch";
+		return OHC_ERROR;
+	}
+	return OHC_OK;
+}
+
 static int http_parse_connection(ohc_request_t *r, char *p, ssize_t len)
 {
 	if(strncmp(p, "close", 5) == 0) {
@@ -152,25 +307,140 @@ static int http_parse_connection(ohc_request_t *r, char *p, ssize_t len)
 	return OHC_OK;
 }
 
+/* request headers that we care, indexed by perfect hash of name */
+enum http_headers {
+	HTTP_HEADER_UNKNOWN,
+	HTTP_HEADER_HOST,
+	HTTP_HEADER_OHC_KEY,
+	HTTP_HEADER_CONNECTION,
+	HTTP_HEADER_RANGE,
+	HTTP_HEADER_IF_NONE_MATCH,
+	HTTP_HEADER_IF_MODIFIED_SINCE,
+	HTTP_HEADER_OHC_GRACE,
+	HTTP_HEADER_CONTENT_LENGTH,
+	HTTP_HEADER_CONTENT_RANGE,
+	HTTP_HEADER_CACHE_CONTROL,
+	HTTP_HEADER_EXPIRES,
+	HTTP_HEADER_ETAG,
+	HTTP_HEADER_LAST_MODIFIED,
+	HTTP_HEADER_EXPECT,
+	HTTP_HEADER_OHC_TAG,
+	HTTP_HEADER_SURROGATE_KEY,
+	HTTP_HEADER_OHC_PREFIX,
+	HTTP_HEADER_OHC_BATCH,
+	HTTP_HEADER_NR
+};
+
+static string_t http_header_names[HTTP_HEADER_NR] = {
+	[HTTP_HEADER_HOST] = STRING_INIT("Host"),
+	[HTTP_HEADER_OHC_KEY] = STRING_INIT("OHC-Key"),
+	[HTTP_HEADER_CONNECTION] = STRING_INIT("Connection"),
+	[HTTP_HEADER_RANGE] = STRING_INIT("Range"),
+	[HTTP_HEADER_IF_NONE_MATCH] = STRING_INIT("If-None-Match"),
+	[HTTP_HEADER_IF_MODIFIED_SINCE] = STRING_INIT("If-Modified-Since"),
+	[HTTP_HEADER_OHC_GRACE] = STRING_INIT("OHC-Grace"),
+	[HTTP_HEADER_CONTENT_LENGTH] = STRING_INIT("Content-Length"),
+	[HTTP_HEADER_CONTENT_RANGE] = STRING_INIT("Content-Range"),
+	[HTTP_HEADER_CACHE_CONTROL] = STRING_INIT("Cache-Control"),
+	[HTTP_HEADER_EXPIRES] = STRING_INIT("Expires"),
+	[HTTP_HEADER_ETAG] = STRING_INIT("ETag"),
+	[HTTP_HEADER_LAST_MODIFIED] = STRING_INIT("Last-Modified"),
+	[HTTP_HEADER_EXPECT] = STRING_INIT("Expect"),
+	[HTTP_HEADER_OHC_TAG] = STRING_INIT("OHC-Tag"),
+	[HTTP_HEADER_SURROGATE_KEY] = STRING_INIT("Surrogate-Key"),
+	[HTTP_HEADER_OHC_PREFIX] = STRING_INIT("OHC-Prefix"),
+	[HTTP_HEADER_OHC_BATCH] = STRING_INIT("OHC-Batch"),
+};
+
+/* from hash of name to enum http_headers, built by http_init() */
+#define HTTP_HEADER_HASH_SIZE	64
+static unsigned char http_header_table[HTTP_HEADER_HASH_SIZE];
+
+/* by the length, and the first and last letters in any case. It's
+ * perfect for the names above, and http_init() checks this. */
+static inline int http_header_hash(const char *name, ssize_t len)
+{
+	return (len + (name[0] | 0x20) + ((name[len - 1] | 0x20) << 2))
+			& (HTTP_HEADER_HASH_SIZE - 1);
+}
+
+static int http_header_lookup(const char *name, ssize_t len)
+{
+	int id;
+
+	if(len == 0) {
+		return HTTP_HEADER_UNKNOWN;
+	}
+	id = http_header_table[http_header_hash(name, len)];
+	if(http_header_names[id].len != len
+			|| strncasecmp(name, http_header_names[id].base, len) != 0) {
+		return HTTP_HEADER_UNKNOWN;
+	}
+	return id;
+}
+
+int http_init(void)
+{
+	string_t *name;
+	int i, h;
+
+	for(i = HTTP_HEADER_UNKNOWN + 1; i < HTTP_HEADER_NR; i++) {
+		name = &http_header_names[i];
+		h = http_header_hash(name->base, name->len);
+		if(http_header_table[h] != HTTP_HEADER_UNKNOWN
+				&& http_header_table[h] != i) {
+			return OHC_ERROR;
+		}
+		http_header_table[h] = i;
+	}
+	return OHC_OK;
+}
+
+/* handlers of headers for each method, by enum http_headers */
 #define GENERAL_HEADERS \
-	{STRING_INIT("Host:"), http_parse_host}, \
-	{STRING_INIT("OHC-Key:"),  http_parse_ohc_key}, \
-	{STRING_INIT("Connection:"),  http_parse_connection}, \
-	{STRING_INIT(""),  NULL}, 
+	[HTTP_HEADER_HOST] = http_parse_host, \
+	[HTTP_HEADER_OHC_KEY] = http_parse_ohc_key, \
+	[HTTP_HEADER_CONNECTION] = http_parse_connection,
+
+static http_parse_f *http_request_header_get[HTTP_HEADER_NR] = {
+	[HTTP_HEADER_RANGE] = http_parse_get_range,
+	[HTTP_HEADER_IF_NONE_MATCH] = http_parse_get_if_none_match,
+	[HTTP_HEADER_IF_MODIFIED_SINCE] = http_parse_get_if_modified_since,
+	[HTTP_HEADER_OHC_GRACE] = http_parse_get_ohc_grace,
+	GENERAL_HEADERS
+};
+
+static http_parse_f *http_request_header_put[HTTP_HEADER_NR] = {
+	[HTTP_HEADER_CONTENT_LENGTH] = http_parse_put_content_length,
+	[HTTP_HEADER_CONTENT_RANGE] = http_parse_put_content_range,
+	[HTTP_HEADER_CACHE_CONTROL] = http_parse_put_cache_control,
+	[HTTP_HEADER_EXPIRES] = http_parse_put_expires,
+	[HTTP_HEADER_ETAG] = http_parse_put_etag,
+	[HTTP_HEADER_LAST_MODIFIED] = http_parse_put_last_modified,
+	[HTTP_HEADER_EXPECT] = http_parse_put_expect,
+	[HTTP_HEADER_OHC_TAG] = http_parse_tags,
+	[HTTP_HEADER_SURROGATE_KEY] = http_parse_tags,
+	GENERAL_HEADERS
+};
 
-static struct http_header_s http_request_header_get[] = {
-	{STRING_INIT("Range:"), http_parse_get_range},
+static http_parse_f *http_request_header_delete[HTTP_HEADER_NR] = {
+	[HTTP_HEADER_OHC_TAG] = http_parse_tags,
+	[HTTP_HEADER_OHC_PREFIX] = http_parse_delete_prefix,
 	GENERAL_HEADERS
 };
 
-static struct http_header_s http_request_header_put[] = {
-	{STRING_INIT("Content-Length:"), http_parse_put_content_length},
-	{STRING_INIT("Cache-Control:"), http_parse_put_cache_control},
-	{STRING_INIT("Expires"), http_parse_put_expires},
+static http_parse_f *http_request_header_touch[HTTP_HEADER_NR] = {
+	[HTTP_HEADER_CONTENT_LENGTH] = http_parse_put_content_length,
+	[HTTP_HEADER_CACHE_CONTROL] = http_parse_put_cache_control,
+	[HTTP_HEADER_EXPIRES] = http_parse_put_expires,
 	GENERAL_HEADERS
 };
 
-static struct http_header_s http_request_header_delete[] = {
+static http_parse_f *http_request_header_batch[HTTP_HEADER_NR] = {
+	[HTTP_HEADER_CONTENT_LENGTH] = http_parse_put_content_length,
+	[HTTP_HEADER_OHC_BATCH] = http_parse_batch,
+	[HTTP_HEADER_CACHE_CONTROL] = http_parse_put_cache_control,
+	[HTTP_HEADER_EXPIRES] = http_parse_put_expires,
 	GENERAL_HEADERS
 };
 
@@ -202,24 +472,36 @@ struct http_method_s http_methods[] = {
 	{STRING_INIT("POST "), http_request_header_put},
 	{STRING_INIT("PURGE "), http_request_header_delete},
 	{STRING_INIT("DELETE "), http_request_header_delete},
+	{STRING_INIT("TOUCH "), http_request_header_touch},
+	{STRING_INIT("BATCH "), http_request_header_batch},
 	{STRING_INIT("XXX "), NULL}
 };
 
 
-/* parse HTTP request. do not mark the status if not complete, so 
- * work fast for one-packet-request, and slowly for others. */
+/* parse HTTP request. If not complete, the position of the header line
+ * in parsing is kept in @parse_pos, and the parse goes on from there
+ * after more data is received. The lines are found by memchr(), which
+ * is vectorized in libc. */
 int http_request_parse(ohc_request_t *r)
 {
-	struct http_header_s *headers = NULL, *h;
+	http_parse_f **headers, *handler;
 	struct http_method_s *method;
-	char *p, *q;
+	char *p, *q, *end, *line_end;
 	char *name, *value_base;
 	ssize_t value_len;
 	int rc = OHC_OK;
 	int is_store;
 
+	end = r->buf_pos;
+	*end = '\0';
+
+	if(r->parse_pos != NULL) {
+		p = r->parse_pos;
+		headers = http_methods[r->method].data;
+		goto headers;
+	}
+
 	p = r->_buffer;
-	*r->buf_pos = '\0';
 	r->put_header_nr = 0;
 	r->put_headers[0].base = NULL;
 	r->put_headers[0].len = 0;
@@ -230,20 +512,31 @@ int http_request_parse(ohc_request_t *r)
 		if(strncmp(p, method->str.base, method->str.len) == 0) {
 			r->method = method - http_methods;
 			p += method->str.len;
-			headers = method->data;
 			break;
 		}
 	}
 	if(method->data == NULL) {
+		/* maybe the method is not received all */
+		for(method = http_methods; method->data; method++) {
+			if(end - p < method->str.len
+					&& strncmp(p, method->str.base, end - p) == 0) {
+				return OHC_AGAIN;
+			}
+		}
 		r->error_reason = "UnknownMethod";
 		goto fail;
 	}
-	is_store = (headers == http_request_header_put);
+	headers = method->data;
+
+	if((line_end = memchr(p, '\n', end - p)) == NULL) {
+		return OHC_AGAIN;
+	}
 
 	/* uri */
 	while(*p == ' ') p++;
-	if((q = strchr(p, ' ')) == NULL) {
-		goto not_complete;
+	if((q = memchr(p, ' ', line_end - p)) == NULL) {
+		r->error_reason = "NotHTTP";
+		goto fail;
 	}
 	r->uri.base = p;
 	r->uri.len = q - p;
@@ -251,51 +544,56 @@ int http_request_parse(ohc_request_t *r)
 
 	/* HTTP/1.1 */
 	while(*p == ' ') p++;
-	if(strncasecmp(p, "HTTP/", 5) != 0) {
+	if(strncasecmp(p, "HTTP/", 5) != 0 || line_end[-1] != '\r') {
 		r->error_reason = "NotHTTP";
 		goto fail;
 	}
-	if((q = strchr(p + 5, '\r')) == NULL) {
-		goto not_complete;
-	}
-	p = q + 2;
+	p = line_end + 1;
+
+headers:
+	is_store = (headers == http_request_header_put);
 
-	/* headers */
 	while(1) {
+		r->parse_pos = p;
+
 		while(*p == ' ') p++;
 		if(*p == '\r' && *(p+1) == '\n') {
 			break;
 		}
 
+		if((line_end = memchr(p, '\n', end - p)) == NULL) {
+			return OHC_AGAIN;
+		}
+		if(line_end[-1] != '\r') {
+			r->error_reason = "InvalidHeader";
+			goto fail;
+		}
+
 		/* header name */
-		if((q = strchr(p, ':')) == NULL) {
-			goto not_complete;
+		if((q = memchr(p, ':', line_end - p)) == NULL) {
+			r->error_reason = "InvalidHeader";
+			goto fail;
 		}
 		name = p;
+		handler = headers[http_header_lookup(name, q - name)];
 		p = q + 1;
 
 		/* header value */
 		while(*p == ' ') p++;
-		if((q = strchr(p, '\r')) == NULL || *(q+1) == '\0') {
-			goto not_complete;
-		}
 		value_base = p;
-		value_len = q - p;
-		p = q + 2;
-
-		for(h = headers; h->handler; h++) {
-			if(strncasecmp(name, h->name.base, h->name.len) == 0) {
-
-				rc = h->handler(r, value_base, value_len);
-				if(rc == OHC_ERROR) {
-					goto fail;
-				}
-				break;
+		value_len = line_end - 1 - p;
+		p = line_end + 1;
+
+		rc = OHC_OK;
+		if(handler != NULL) {
+			rc = handler(r, value_base, value_len);
+			if(rc == OHC_ERROR) {
+				goto fail;
 			}
 		}
 
 		/* if PUT/POST, record the un-handled headers */
-		if(is_store && (h->handler == NULL || rc == OHC_DECLINE)) {
+		if(is_store && (handler == NULL || rc == OHC_DECLINE)) {
 
 			http_add_put_headers(r, name, p - name);
 			r->put_header_length += p - name;
@@ -313,24 +611,58 @@ int http_request_parse(ohc_request_t *r)
 			goto fail;
 		}
 
+		if(r->range_put && r->content_length != r->range_end - r->range_start + 1) {
+			r->error_reason = "InvalidContentRange";
+			goto fail;
+		}
+
+		/* no need to wait, if the body is pre-read all */
+		if(r->buf_pos - p - 2 == r->content_length) {
+			r->expect_continue = 0;
+		}
+
 		/* add the pre-read body */
 		http_add_put_headers(r, p, r->buf_pos - p);
 
-		r->put_header_length += http_make_200_response_header(r->content_length, NULL);
+		r->put_header_length += http_make_200_response_header(r->range_put
+				? r->range_total : r->content_length, NULL);
 		r->put_header_length += 2; /* "\r\n" */
 	}
 
-	return OHC_DONE;
-
-not_complete:
-	if(strstr(p, "\r\n\r\n")) {
+	/* TOUCH updates the expire only */
+	if(headers == http_request_header_touch && r->content_length > 0) {
+		r->error_reason = "BodyInTouch";
 		goto fail;
 	}
-	return OHC_AGAIN;
+
+	/* BATCH has keys in body */
+	if(headers == http_request_header_batch) {
+		if(r->batch == 0) {
+			r->error_reason = "NoBatchOperation";
+			goto fail;
+		}
+		if(r->content_length == -1) {
+			r->error_reason = "NoContentLengthinBatch";
+			goto fail;
+		}
+		if(r->content_length > REQ_BATCH_BODY_MAX) {
+			r->error_reason = "BatchTooLarge";
+			r->http_code = 413;
+			goto fail;
+		}
+		if(r->buf_pos - p - 2 > r->content_length) {
+			r->error_reason = "BodyLargerThanDeclared";
+			goto fail;
+		}
+	}
+
+	return OHC_DONE;
 
 fail:
 	r->keepalive = 0;
-	r->http_code = 400;
+	if(r->http_code == 0) {
+		r->http_code = 400;
+	}
 	return OHC_ERROR;
 }
 
@@ -345,12 +677,14 @@ string_t *http_code_page(int code)
 		int code;
 		string_t page;
 	} http_pages[] = {
+		HTTP_PAGE_NOLEN (100, "Continue"),
 		HTTP_PAGE_NOLEN (201, "Created"),
 		HTTP_PAGE_NOLEN (204, "No Content"),
 		HTTP_PAGE_CONLEN(400, "Bad Request"),
 		HTTP_PAGE_CONLEN(404, "Not Found"),
 		HTTP_PAGE_CONLEN(413, "Request Entity Too Large"),
 		HTTP_PAGE_CONLEN(416, "Requested Range Not Satisfiable"),
+		HTTP_PAGE_CONLEN(417, "Expectation Failed"),
 		HTTP_PAGE_CONLEN(500, "Internal Server Error"),
 	};
 	int i;
@@ -374,6 +708,138 @@ ssize_t http_make_206_response_header(ssize_t range_start, ssize_t range_end,
 			range_start, range_end, body_len);
 }
 
+/* normalize @ranges by @body_len, drop the unsatisfiable ones, and
+ * coalesce the overlapping or adjacent ones in ascending order.
+ * Return the number of ranges left. */
+int http_ranges_settle(ohc_range_t *ranges, int nr, ssize_t body_len)
+{
+	ohc_range_t *range, tmp;
+	int i, j, n = 0;
+
+	for(i = 0; i < nr; i++) {
+		range = &ranges[i];
+		if(range->start == RANGE_NO_SET) {
+			range->start = range->end > body_len
+				? 0 : body_len - range->end;
+			range->end = body_len - 1;
+		} else if(range->end == RANGE_NO_SET || range->end >= body_len) {
+			range->end = body_len - 1;
+		}
+		if(range->start >= body_len) {
+			continue;
+		}
+
+		/* insertion sort, by start */
+		tmp = *range;
+		for(j = n; j > 0 && ranges[j-1].start > tmp.start; j--) {
+			ranges[j] = ranges[j-1];
+		}
+		ranges[j] = tmp;
+		n++;
+	}
+	if(n == 0) {
+		return 0;
+	}
+
+	for(i = 1, j = 0; i < n; i++) {
+		if(ranges[i].start <= ranges[j].end + 1) {
+			if(ranges[i].end > ranges[j].end) {
+				ranges[j].end = ranges[i].end;
+			}
+		} else {
+			ranges[++j] = ranges[i];
+		}
+	}
+	return j + 1;
+}
+
+ssize_t http_make_multi_206_response_header(ssize_t content_length,
+		const char *boundary, char *output)
+{
+	return sprintf(output, "HTTP/1.1 206 Partial Content\r\n"
+			"Content-Length: %ld\r\n"
+			"Content-Type: multipart/byteranges; boundary=%s\r\n",
+			content_length, boundary);
+}
+
+/* the header of a part in multipart/byteranges response, or the closing
+ * boundary if @range is NULL. @output is at least HTTP_PART_HEADER_SIZE. */
+ssize_t http_make_part_header(ohc_range_t *range, ssize_t body_len,
+		const char *boundary, const char *type, char *output)
+{
+	ssize_t len;
+
+	if(range == NULL) {
+		return sprintf(output, "\r\n--%s--\r\n", boundary);
+	}
+
+	len = sprintf(output, "\r\n--%s\r\n", boundary);
+	if(type[0] != '\0') {
+		len += sprintf(output + len, "Content-Type: %s\r\n", type);
+	}
+	len += sprintf(output + len, "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+			range->start, range->end, body_len);
+	return len;
+}
+
+/* make the 304 response, if @item is not modified according to the
+ * conditional GET. Only the validator in memory is checked, so there
+ * is no disk read. Return 0 if not 304.
+ *
+ * If-None-Match is weak comparison, and the matched entity-tag is sent
+ * back as ETag. If-Modified-Since is ignored if If-None-Match exists. */
+ssize_t http_make_304_response_header(ohc_request_t *r, ohc_item_t *item,
+		char *output)
+{
+#define RESP_304 "HTTP/1.1 304 Not Modified\r\n"
+	char *p, *q, *end, *tag;
+
+	if(r->if_none_match.base != NULL) {
+		p = r->if_none_match.base;
+		end = p + r->if_none_match.len;
+		while(p < end) {
+			if(*p == ' ' || *p == ',') {
+				p++;
+				continue;
+			}
+			if(*p == '*') {
+				return sprintf(output, RESP_304 "\r\n");
+			}
+
+			tag = p;
+			if(end - p > 2 && strncmp(p, "W/", 2) == 0) {
+				p += 2;
+			}
+			if(*p != '"' || (q = memchr(p + 1, '"', end - p - 1)) == NULL) {
+				return 0;
+			}
+			p = q + 1;
+
+			if(item->etag && http_etag_hash(tag, p - tag) == item->validator) {
+				return sprintf(output, RESP_304 "ETag: %.*s\r\n\r\n",
+						(int)(p - tag), tag);
+			}
+		}
+		return 0;
+	}
+
+	if(r->if_modified_since != 0 && !item->etag && item->validator != 0
+			&& item->validator <= r->if_modified_since) {
+		return sprintf(output, RESP_304 "\r\n");
+	}
+	return 0;
+}
+
+/* the hint to refresh the item in background, see server_item_stale() */
+ssize_t http_make_refresh_header(int refresh, char *output)
+{
+	if(refresh == 0) {
+		return 0;
+	}
+	return sprintf(output, "OHC-Refresh: %s\r\n",
+			refresh == REQ_REFRESH_EARLY ? "early" : "stale");
+}
+
 ssize_t http_make_200_response_header(ssize_t content_length, char *output)
 {
 #define RESP_200_CONLEN "HTTP/1.1 200 OK\r\nContent-Length: "
@@ -384,22 +850,27 @@ ssize_t http_make_200_response_header(ssize_t content_length, char *output)
 	}
 }
 
+/* copy the runs without '%' by memcpy() */
 ssize_t http_decode_uri(const char *uri, ssize_t len, char *output)
 {
+	const char *p = uri, *end = uri + len, *q;
+	char *o = output;
 	int a, b;
-	ssize_t i, output_len = 0;
-
-	for(i = 0; i < len; i++) {
-		if(uri[i] == '%') {
-			a = char2hex(uri[i+1]);
-			b = char2hex(uri[i+2]);
-			if(a >= 0 && b >= 0) {
-				output[output_len++] = (a << 4) + b;
-				i += 2;
-				continue;
-			}
+
+	while((q = memchr(p, '%', end - p)) != NULL) {
+		memcpy(o, p, q - p);
+		o += q - p;
+		p = q + 1;
+
+		if(end - p >= 2 && (a = char2hex(p[0])) >= 0
+				&& (b = char2hex(p[1])) >= 0) {
+			*o++ = (a << 4) + b;
+			p += 2;
+		} else {
+			*o++ = '%';
 		}
-		output[output_len++] = uri[i];
 	}
-	return output_len;
+	memcpy(o, p, end - p);
+	o += end - p;
+	return o - output;
 }
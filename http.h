@@ -18,6 +18,8 @@ enum http_methods {
 	OHC_HTTP_METHOD_POST,
 	OHC_HTTP_METHOD_PURGE,
 	OHC_HTTP_METHOD_DELETE,
+	OHC_HTTP_METHOD_TOUCH,
+	OHC_HTTP_METHOD_BATCH,
 	OHC_HTTP_METHOD_INVALID,
 };
 
@@ -29,11 +31,23 @@ extern struct http_method_s http_methods[];
 
 #define RANGE_NO_SET	-1
 
+/* the boundary, Content-Type and Content-Range of a part */
+#define HTTP_PART_HEADER_SIZE	(REQ_RANGE_TYPE_SIZE + 200)
+
+int http_init(void);
 int http_request_parse(ohc_request_t *r);
 string_t *http_code_page(int code);
 ssize_t http_decode_uri(const char *uri, ssize_t len, char *output);
 ssize_t http_make_200_response_header(ssize_t content_length, char *output);
+ssize_t http_make_refresh_header(int refresh, char *output);
+ssize_t http_make_304_response_header(ohc_request_t *r, ohc_item_t *item,
+		char *output);
 ssize_t http_make_206_response_header(ssize_t range_start, ssize_t range_end,
 		ssize_t body_len, char *output);
+int http_ranges_settle(ohc_range_t *ranges, int nr, ssize_t body_len);
+ssize_t http_make_multi_206_response_header(ssize_t content_length,
+		const char *boundary, char *output);
+ssize_t http_make_part_header(ohc_range_t *range, ssize_t body_len,
+		const char *boundary, const char *type, char *output);
 
 #endif
@@ -0,0 +1,1074 @@
+/*
+ * Journal of items adding and deleting, with periodic checkpoints,
+ * so that items survive a crash.
+ *
+ * Files of each device, in journal_dir:
+ *
+ *     NAME.ckpt          generation + the same format as device dump
+ *     NAME.journal.GEN   ohc_format_item_t[], with OHC_FM_DELETE
+ *
+ * where NAME is the device's filename with '/' replaced by '_'.
+ *
+ * A checkpoint in generation C includes all records in journal files
+ * before C. So at starting, we load the checkpoint, and replay the
+ * journal files from C, one by one, until the first missing one.
+ *
+ * Checkpoints are written by a child process, which has a snapshot of
+ * items. Before fork, a new journal file is opened, so the records
+ * after fork are written in the new one. The parent has worker threads,
+ * so the child writes by a buffer allocated before fork, without stdio
+ * or malloc.
+ *
+ * The master thread only hands the records to the journal thread, which
+ * writes and syncs them. Before syncing a batch with adding records, the
+ * device is synced, so the items' data is on disk before their records.
+ * The deleting records must be on disk before the freed blocks are
+ * written again, so workers wait for them, see journal_wait().
+ *
+ */
+
+#include "journal.h"
+#include <sys/wait.h>
+#include <pthread.h>
+
+static char journal_dir[PATH_LENGTH];
+static time_t journal_checkpoint_interval;
+
+static LIST_HEAD(journals);
+
+/* set after the devices are loaded at starting */
+static int journal_started = 0;
+
+static time_t journal_checkpoint_time = 0;
+static int journal_checkpoint_forced = 0;
+static pid_t journal_checkpoint_pid = 0;
+static ohc_server_listens_t journal_listens;
+
+/* outputs of checkpoints, and their buffers in JOURNAL_CKPT_BUFFER.
+ * They are allocated before fork, since the child can not malloc. */
+static ohc_format_output_t *journal_ckpt_outs = NULL;
+static char *journal_ckpt_buffers = NULL;
+static int journal_ckpt_size = 0;
+
+/* @journal_lock protects the journals list, the records handed to the
+ * journal thread, and the following */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t journal_synced_cond = PTHREAD_COND_INITIALIZER;
+static int journal_requested = 0;
+
+/* records handed to the journal thread, and synced, ever */
+static uint64_t journal_handed = 0;
+static uint64_t journal_synced = 0;
+
+/* 0 not started, 1 started, -1 failed to start */
+static int journal_threaded = 0;
+
+/* loading order of the records, see journal_read_device() */
+typedef struct {
+	off_t	key;
+	long	index;
+} ohc_journal_order_t;
+
+
+static void journal_prefix(char *prefix, ohc_device_t *device)
+{
+	char *p;
+	int len;
+
+	len = sprintf(prefix, "%s/", journal_dir);
+	sprintf(prefix + len, "%s", device->filename);
+
+	for(p = prefix + len; *p != '\0'; p++) {
+		if(*p == '/') {
+			*p = '_';
+		}
+	}
+}
+
+static inline void journal_ckpt_path(char *path, char *prefix, int tmp)
+{
+	snprintf(path, JOURNAL_PATH_LENGTH, "%s.ckpt%s", prefix, tmp ? ".tmp" : "");
+}
+
+static inline void journal_file_path(char *path, char *prefix, uint64_t gen)
+{
+	snprintf(path, JOURNAL_PATH_LENGTH, "%s.journal.%lu", prefix, gen);
+}
+
+/* return the generation of @prefix's checkpoint, or 0 if not exist */
+static uint64_t journal_ckpt_generation(char *prefix)
+{
+	char path[JOURNAL_PATH_LENGTH];
+	uint64_t gen;
+	FILE *filp;
+
+	journal_ckpt_path(path, prefix, 0);
+	filp = fopen(path, "r");
+	if(filp == NULL) {
+		return 0;
+	}
+	if(fread(&gen, sizeof(gen), 1, filp) < 1) {
+		gen = 0;
+	}
+	fclose(filp);
+	return gen;
+}
+
+/* unlink journal files from generation @from, until the first
+ * missing one, or until @to */
+static void journal_unlink_files(char *prefix, uint64_t from, uint64_t to)
+{
+	char path[JOURNAL_PATH_LENGTH];
+
+	for(; from != to; from++) {
+		journal_file_path(path, prefix, from);
+		if(unlink(path) < 0) {
+			break;
+		}
+	}
+}
+
+static int journal_order_cmp(const void *a, const void *b)
+{
+	const ohc_journal_order_t *x = a;
+	const ohc_journal_order_t *y = b;
+
+	if(x->key != y->key) {
+		return x->key < y->key ? -1 : 1;
+	}
+
+	/* the latter record wins */
+	return x->index < y->index ? -1 : 1;
+}
+
+/* read all records in @filp to @records, which is expanded if need.
+ * Records are read in @rsize, and upgraded later. */
+static long journal_read_records(FILE *filp, ohc_format_item_t **records,
+		long nr, long *size, size_t rsize)
+{
+	ohc_format_item_t *p;
+	size_t n;
+
+	while(1) {
+		if(nr == *size) {
+			*size = *size ? *size * 2 : 1024;
+			p = realloc(*records, *size * sizeof(ohc_format_item_t));
+			if(p == NULL) {
+				return -1;
+			}
+			*records = p;
+		}
+
+		/* an incomplete record at the end is dropped */
+		n = fread((char *)*records + nr * rsize, rsize, *size - nr, filp);
+		nr += n;
+		if(nr < *size) {
+			return nr;
+		}
+	}
+}
+
+/* read @device's checkpoint and journal files, called by the loading
+ * thread. The records are sorted by offset, and only the latest one of
+ * each item or page is kept, if not deleted, so they are loaded the
+ * same as a dump. @info is filled by the checkpoint's header.
+ * return the number of records in @result, or -1 if fail or no
+ * checkpoint. */
+long journal_read_device(ohc_device_t *device, unsigned char *info,
+		int *version, ohc_format_item_t **result)
+{
+	ohc_format_item_t *records = NULL, *rec;
+	ohc_journal_order_t *order = NULL;
+	char prefix[JOURNAL_PREFIX_LENGTH], path[JOURNAL_PATH_LENGTH];
+	long nr, size, i, count = -1;
+	uint64_t gen;
+	size_t rsize;
+	FILE *filp;
+
+	*result = NULL;
+	if(journal_dir[0] == '\0') {
+		return -1;
+	}
+
+	/* checkpoint */
+	journal_prefix(prefix, device);
+	journal_ckpt_path(path, prefix, 0);
+	filp = fopen(path, "r");
+	if(filp == NULL) {
+		return -1;
+	}
+	if(fread(&gen, sizeof(gen), 1, filp) < 1) {
+		goto out;
+	}
+	size = format_read_header(filp, sizeof(gen), info, version);
+	if(size < 0) {
+		goto out;
+	}
+	records = malloc(size * sizeof(ohc_format_item_t));
+	if(size != 0 && records == NULL) {
+		goto out;
+	}
+	rsize = format_record_size(*version);
+	nr = fread(records, rsize, size, filp);
+	if(nr < size) {
+		goto out;
+	}
+	fclose(filp);
+
+	/* journal files */
+	for(; ; gen++) {
+		journal_file_path(path, prefix, gen);
+		filp = fopen(path, "r");
+		if(filp == NULL) {
+			break;
+		}
+		nr = journal_read_records(filp, &records, nr, &size, rsize);
+		fclose(filp);
+		if(nr < 0) {
+			filp = NULL;
+			goto out;
+		}
+	}
+	filp = NULL;
+
+	/* the journal files after an old checkpoint are old too */
+	format_records_upgrade(records, nr, *version);
+
+	/* sort by offset, and a page is loaded before its packed items */
+	order = malloc(nr * sizeof(ohc_journal_order_t));
+	if(nr != 0 && order == NULL) {
+		goto out;
+	}
+	for(i = 0; i < nr; i++) {
+		order[i].key = (records[i].offset << 1)
+			| !(records[i].flags & OHC_FM_PAGE);
+		order[i].index = i;
+	}
+	qsort(order, nr, sizeof(ohc_journal_order_t), journal_order_cmp);
+
+	*result = malloc(nr * sizeof(ohc_format_item_t));
+	if(nr != 0 && *result == NULL) {
+		goto out;
+	}
+	count = 0;
+	for(i = 0; i < nr; i++) {
+		if(i + 1 < nr && order[i].key == order[i + 1].key) {
+			continue;
+		}
+		rec = &records[order[i].index];
+		if(rec->flags & OHC_FM_DELETE) {
+			continue;
+		}
+		(*result)[count++] = *rec;
+	}
+
+out:
+	if(filp) {
+		fclose(filp);
+	}
+	free(records);
+	free(order);
+	if(count < 0) {
+		log_error_run(0, "load journal of device %s fails", device->filename);
+	}
+	return count;
+}
+
+/* open a checkpoint temp file, and write @gen at its beginning.
+ * return the fd, or -1 if fail. */
+static int journal_ckpt_open(ohc_journal_t *j, uint64_t gen)
+{
+	char path[JOURNAL_PATH_LENGTH];
+	int fd;
+
+	journal_ckpt_path(path, j->prefix, 1);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+		log_error_run(errno, "open checkpoint %s", path);
+		return -1;
+	}
+	if(write(fd, &gen, sizeof(gen)) != sizeof(gen)) {
+		log_error_run(errno, "write checkpoint %s", path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* make sure there are @n outputs of checkpoints */
+static int journal_ckpt_reserve(int n)
+{
+	ohc_format_output_t *outs;
+	char *buffers;
+
+	if(n <= journal_ckpt_size) {
+		return OHC_OK;
+	}
+
+	outs = realloc(journal_ckpt_outs, n * sizeof(ohc_format_output_t));
+	if(outs == NULL) {
+		return OHC_ERROR;
+	}
+	journal_ckpt_outs = outs;
+
+	buffers = realloc(journal_ckpt_buffers, (size_t)n * JOURNAL_CKPT_BUFFER);
+	if(buffers == NULL) {
+		return OHC_ERROR;
+	}
+	journal_ckpt_buffers = buffers;
+	journal_ckpt_size = n;
+	return OHC_OK;
+}
+
+/* write items of devices into the @n checkpoint temp files, in one
+ * pass of items. This is called in child process, so only async-
+ * signal-safe calls here, and no log. The items' data is synced at
+ * first. */
+static int journal_ckpt_write(ohc_format_output_t *outs, int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++) {
+		if(fdatasync(outs[i].device->fd) < 0) {
+			return OHC_ERROR;
+		}
+	}
+
+	format_store_outputs(outs, n, &journal_listens);
+
+	for(i = 0; i < n; i++) {
+		if(outs[i].superb.item_nr < 0 || fdatasync(outs[i].fd) < 0) {
+			return OHC_ERROR;
+		}
+	}
+	return OHC_OK;
+}
+
+/* the checkpoint temp file is ready, commit it */
+static int journal_ckpt_commit(ohc_journal_t *j, uint64_t gen)
+{
+	char tmp_path[JOURNAL_PATH_LENGTH], path[JOURNAL_PATH_LENGTH];
+
+	journal_ckpt_path(tmp_path, j->prefix, 1);
+	journal_ckpt_path(path, j->prefix, 0);
+	if(rename(tmp_path, path) < 0) {
+		log_error_run(errno, "rename checkpoint %s", tmp_path);
+		return OHC_ERROR;
+	}
+
+	journal_unlink_files(j->prefix, j->checkpoint, gen);
+	j->checkpoint = gen;
+	return OHC_OK;
+}
+
+/* create @j's journal file in generation @gen. return the fd, or -1 */
+static int journal_file_create(ohc_journal_t *j, uint64_t gen)
+{
+	char path[JOURNAL_PATH_LENGTH];
+	int fd;
+
+	journal_file_path(path, j->prefix, gen);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if(fd < 0) {
+		log_error_run(errno, "open journal %s", path);
+	}
+	return fd;
+}
+
+/* write @nr @records into @j's journal file @fd, and sync them. Called
+ * by the journal thread without lock. */
+static int journal_write_records(ohc_journal_t *j, int fd,
+		ohc_format_item_t *records, long nr)
+{
+	char *buf = (char *)records;
+	size_t len = nr * sizeof(ohc_format_item_t);
+	ssize_t rc;
+	long i;
+
+	for(i = 0; i < nr; i++) {
+		if(!(records[i].flags & OHC_FM_DELETE)) {
+			break;
+		}
+	}
+	if(i < nr && fdatasync(j->device->fd) < 0) {
+		log_error_run(errno, "sync device %s for journal", j->device->filename);
+		return OHC_ERROR;
+	}
+
+	while(len > 0) {
+		rc = write(fd, buf, len);
+		if(rc <= 0) {
+			log_error_run(errno, "write journal of device %s",
+					j->device->filename);
+			return OHC_ERROR;
+		}
+		buf += rc;
+		len -= rc;
+	}
+
+	if(fdatasync(fd) < 0) {
+		log_error_run(errno, "sync journal of device %s", j->device->filename);
+		return OHC_ERROR;
+	}
+	return OHC_OK;
+}
+
+/* write the records of the previous file of @j if @previous, or the
+ * current file. The caller holds @journal_lock, which is released
+ * during writing. */
+static void journal_write_queue(ohc_journal_t *j, int previous)
+{
+	ohc_format_item_t *queue;
+	char path[JOURNAL_PATH_LENGTH];
+	long nr;
+	int fd, rc;
+
+	if(previous) {
+		queue = j->switch_queue;
+		nr = j->switch_nr;
+		fd = j->switch_fd;
+		j->switch_queue = NULL;
+		j->switch_nr = 0;
+	} else {
+		queue = j->queue;
+		nr = j->queue_nr;
+		fd = j->fd;
+		j->queue = NULL;
+		j->queue_nr = 0;
+		j->queue_size = 0;
+	}
+	j->busy = 1;
+	pthread_mutex_unlock(&journal_lock);
+
+	rc = journal_write_records(j, fd, queue, nr);
+	free(queue);
+	if(previous) {
+		close(fd);
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	j->busy = 0;
+	if(previous) {
+		j->switch_fd = -1;
+	}
+	if(rc != OHC_OK) {
+		/* no replay after restart, before the master removes
+		 * the files, see journal_routine() */
+		j->failed = 1;
+		journal_ckpt_path(path, j->prefix, 0);
+		unlink(path);
+	}
+	pthread_cond_broadcast(&journal_synced_cond);
+}
+
+/* write and sync the handed records of all journals. Called by the
+ * journal thread, or the master if there is no thread. The caller
+ * holds @journal_lock. */
+static void journal_write_all(void)
+{
+	struct list_head *p;
+	ohc_journal_t *j;
+	uint64_t target = journal_handed;
+
+	list_for_each(p, &journals) {
+		j = list_entry(p, ohc_journal_t, jnode);
+		if(!j->failed && j->switch_fd != -1) {
+			journal_write_queue(j, 1);
+		}
+		if(!j->failed && j->queue_nr != 0) {
+			journal_write_queue(j, 0);
+		}
+	}
+
+	journal_synced = target;
+	pthread_cond_broadcast(&journal_synced_cond);
+}
+
+static void *journal_thread_routine(void *arg)
+{
+	pthread_detach(pthread_self());
+
+	pthread_mutex_lock(&journal_lock);
+	while(1) {
+		while(!journal_requested) {
+			pthread_cond_wait(&journal_cond, &journal_lock);
+		}
+		journal_requested = 0;
+		journal_write_all();
+	}
+	return NULL;
+}
+
+/* ask the journal thread to write and sync the handed records, and
+ * wait for it if @wait. Without the thread, do it here. */
+static void journal_request(int wait)
+{
+	uint64_t target;
+
+	pthread_mutex_lock(&journal_lock);
+	if(journal_threaded == -1) {
+		journal_write_all();
+		pthread_mutex_unlock(&journal_lock);
+		return;
+	}
+
+	target = journal_handed;
+	journal_requested = 1;
+	pthread_cond_signal(&journal_cond);
+	while(wait && journal_synced < target) {
+		pthread_cond_wait(&journal_synced_cond, &journal_lock);
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/* whether the journal thread fails in writing @j */
+static int journal_failed(ohc_journal_t *j)
+{
+	int failed;
+
+	pthread_mutex_lock(&journal_lock);
+	failed = j->failed;
+	pthread_mutex_unlock(&journal_lock);
+	return failed;
+}
+
+/* stop @j and remove its files */
+static void journal_remove(ohc_journal_t *j)
+{
+	char path[JOURNAL_PATH_LENGTH];
+
+	/* stop the journal thread writing @j. The checkpoint is removed
+	 * before the dropped records are taken as synced. */
+	pthread_mutex_lock(&journal_lock);
+	while(j->busy) {
+		pthread_cond_wait(&journal_synced_cond, &journal_lock);
+	}
+	journal_ckpt_path(path, j->prefix, 0);
+	unlink(path);
+	j->failed = 1;
+	pthread_mutex_unlock(&journal_lock);
+
+	journal_ckpt_path(path, j->prefix, 1);
+	unlink(path);
+	journal_unlink_files(j->prefix, j->checkpoint, j->generation + 1);
+
+	if(j->fd != -1) {
+		close(j->fd);
+		j->fd = -1;
+	}
+	if(j->switch_fd != -1) {
+		close(j->switch_fd);
+		j->switch_fd = -1;
+	}
+	if(j->pending_fd != -1) {
+		close(j->pending_fd);
+		j->pending_fd = -1;
+	}
+	free(j->queue);
+	free(j->switch_queue);
+	j->queue = j->switch_queue = NULL;
+	j->queue_nr = j->switch_nr = 0;
+	j->broken = 1;
+	j->buf_nr = 0;
+	j->deletes = 0;
+}
+
+/* the journal can not be trusted any more, remove its files, so
+ * we will not load wrong items after restart. */
+static void journal_fail(ohc_journal_t *j)
+{
+	log_error_run(0, "journal of device %s is broken, and disabled",
+			j->device->filename);
+	journal_remove(j);
+}
+
+/* hand the buffered records to the journal thread */
+static void journal_flush(ohc_journal_t *j)
+{
+	ohc_format_item_t *queue;
+	long size;
+
+	if(j->buf_nr == 0 || j->broken) {
+		return;
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	if(j->queue_nr + j->buf_nr > j->queue_size) {
+		size = j->queue_size ? j->queue_size * 2 : JOURNAL_BUFFER_NR * 4;
+		queue = realloc(j->queue, size * sizeof(ohc_format_item_t));
+		if(queue == NULL) {
+			pthread_mutex_unlock(&journal_lock);
+			log_error_run(0, "NoMem");
+			journal_fail(j);
+			return;
+		}
+		j->queue = queue;
+		j->queue_size = size;
+	}
+	memcpy(j->queue + j->queue_nr, j->buffer,
+			j->buf_nr * sizeof(ohc_format_item_t));
+	j->queue_nr += j->buf_nr;
+	journal_handed += j->buf_nr;
+	pthread_mutex_unlock(&journal_lock);
+
+	j->records += j->buf_nr;
+	j->buf_nr = 0;
+	j->deletes = 0;
+}
+
+/* start journal for @device, after its items are loaded. If @replayed,
+ * the items are loaded from the checkpoint and journal files, so we go
+ * on with them. Otherwise the files do not match the items, e.g. they
+ * are loaded from dump, so the files are removed, and a checkpoint is
+ * made by child process soon. Before it's done, the items are lost
+ * after crash, as there is no checkpoint. */
+void journal_open(ohc_device_t *device, int replayed)
+{
+	ohc_journal_t *j;
+	uint64_t gen;
+	long records = 0;
+	struct stat st;
+	pthread_t tid;
+	char path[JOURNAL_PATH_LENGTH];
+
+	journal_started = 1;
+	if(journal_dir[0] == '\0') {
+		return;
+	}
+
+	if(journal_threaded == 0) {
+		journal_threaded = (pthread_create(&tid, NULL,
+					journal_thread_routine, NULL) == 0) ? 1 : -1;
+	}
+
+	/* the buffer follows the journal */
+	j = malloc(sizeof(ohc_journal_t)
+			+ sizeof(ohc_format_item_t) * JOURNAL_BUFFER_NR);
+	if(j == NULL) {
+		log_error_run(errno, "alloc journal for device %s", device->filename);
+		return;
+	}
+	bzero(j, sizeof(ohc_journal_t));
+	j->buffer = (ohc_format_item_t *)(j + 1);
+	j->device = device;
+	j->switch_fd = -1;
+	j->pending_fd = -1;
+	journal_prefix(j->prefix, device);
+
+	/* the next generation of the existing files */
+	j->checkpoint = journal_ckpt_generation(j->prefix);
+	for(gen = j->checkpoint; ; gen++) {
+		journal_file_path(path, j->prefix, gen);
+		if(stat(path, &st) < 0) {
+			break;
+		}
+		records += st.st_size / sizeof(ohc_format_item_t);
+	}
+
+	if(!replayed) {
+		journal_ckpt_path(path, j->prefix, 0);
+		unlink(path);
+		journal_unlink_files(j->prefix, j->checkpoint, gen);
+		j->checkpoint = gen;
+		records = 0;
+		journal_checkpoint_force();
+	}
+
+	j->fd = journal_file_create(j, gen);
+	if(j->fd == -1) {
+		goto fail;
+	}
+	j->generation = gen;
+	j->records = records;
+
+	/* remove stale files after the new generation, if any */
+	journal_unlink_files(j->prefix, gen + 1, 0);
+
+	pthread_mutex_lock(&journal_lock);
+	list_add_tail(&j->jnode, &journals);
+	pthread_mutex_unlock(&journal_lock);
+	device->journal = j;
+	journal_checkpoint_time = timer_now(&master_timer);
+	return;
+
+fail:
+	log_error_run(0, "open journal of device %s fails", device->filename);
+	free(j);
+}
+
+/* stop the journal for @device. Remove its files if @remove is set,
+ * e.g. the device is deleted. */
+void journal_close(ohc_device_t *device, int remove)
+{
+	ohc_journal_t *j = device->journal;
+
+	if(j == NULL) {
+		return;
+	}
+
+	if(remove) {
+		journal_remove(j);
+	} else {
+		journal_flush(j);
+		journal_request(1);
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	while(j->busy) {
+		pthread_cond_wait(&journal_synced_cond, &journal_lock);
+	}
+	list_del(&j->jnode);
+	pthread_mutex_unlock(&journal_lock);
+
+	if(j->fd != -1) {
+		close(j->fd);
+	}
+	if(j->switch_fd != -1) {
+		close(j->switch_fd);
+	}
+	if(j->pending_fd != -1) {
+		close(j->pending_fd);
+	}
+	free(j->queue);
+	free(j->switch_queue);
+	free(j);
+	device->journal = NULL;
+}
+
+/* stop the checkpoint child process, at quiting */
+void journal_quit(void)
+{
+	if(journal_checkpoint_pid > 0) {
+		kill(journal_checkpoint_pid, SIGKILL);
+		waitpid(journal_checkpoint_pid, NULL, 0);
+		journal_checkpoint_pid = 0;
+	}
+}
+
+static void journal_append(ohc_journal_t *j, ohc_format_item_t *fm_item)
+{
+	if(j->broken) {
+		return;
+	}
+
+	j->buffer[j->buf_nr++] = *fm_item;
+	if(fm_item->flags & OHC_FM_DELETE) {
+		j->deletes++;
+	}
+
+	if(j->buf_nr == JOURNAL_BUFFER_NR) {
+		journal_flush(j);
+	}
+}
+
+/* @server module call this, when an item is stored completely */
+void journal_add_item(ohc_item_t *item)
+{
+	ohc_journal_t *j = device_of_item(item)->journal;
+	ohc_format_item_t fm_item;
+
+	if(j == NULL || !server_of_item(item)->server_dump) {
+		return;
+	}
+
+	format_item_record(&fm_item, item, item->packed ? OHC_FM_PACKED : 0);
+	journal_append(j, &fm_item);
+}
+
+/* @device module call this, when an item's block is freed */
+void journal_delete_item(ohc_item_t *item)
+{
+	ohc_journal_t *j = device_of_item(item)->journal;
+	ohc_format_item_t fm_item;
+
+	if(j == NULL) {
+		return;
+	}
+
+	format_item_record(&fm_item, item, OHC_FM_DELETE
+			| (item->packed ? OHC_FM_PACKED : 0));
+	journal_append(j, &fm_item);
+}
+
+void journal_add_page(ohc_page_t *page)
+{
+	ohc_journal_t *j = device_of_page(page)->journal;
+	ohc_format_item_t fm_item;
+
+	if(j == NULL) {
+		return;
+	}
+
+	format_page_record(&fm_item, page, 0);
+	journal_append(j, &fm_item);
+}
+
+void journal_delete_page(ohc_page_t *page)
+{
+	ohc_journal_t *j = device_of_page(page)->journal;
+	ohc_format_item_t fm_item;
+
+	if(j == NULL) {
+		return;
+	}
+
+	format_page_record(&fm_item, page, OHC_FM_DELETE);
+	journal_append(j, &fm_item);
+}
+
+/* @device module call this before allocating a block. The delete
+ * records must be synced before the freed blocks are written again,
+ * otherwise the deleted items may be loaded with wrong data. So they
+ * are handed to the journal thread, and the workers wait for them
+ * before writing into @device, see journal_wait(). */
+void journal_before_alloc(ohc_device_t *device)
+{
+	ohc_journal_t *j = device->journal;
+
+	if(j != NULL && j->deletes != 0) {
+		journal_flush(j);
+		if(journal_threaded == -1) {
+			journal_request(1);
+		}
+		device->journal_barrier = journal_handed;
+	}
+}
+
+/* Worker threads call this before writing into @device, to wait for
+ * the delete records handed before the block is allocated. */
+void journal_wait(ohc_device_t *device)
+{
+	uint64_t barrier = device->journal_barrier;
+
+	if(barrier <= journal_synced) {
+		return;
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	while(journal_synced < barrier) {
+		journal_requested = 1;
+		pthread_cond_signal(&journal_cond);
+		pthread_cond_wait(&journal_synced_cond, &journal_lock);
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
+
+/* @server module call this, when items are invalid without deleting,
+ * e.g. server cleared. */
+void journal_checkpoint_force(void)
+{
+	journal_checkpoint_forced = 1;
+}
+
+static void journal_checkpoint_start(void)
+{
+	struct list_head *p;
+	ohc_journal_t *j;
+	pid_t pid;
+	int fd, switching, n;
+
+	n = 0;
+	list_for_each(p, &journals) {
+		n++;
+	}
+	if(journal_ckpt_reserve(n) != OHC_OK) {
+		log_error_run(errno, "alloc checkpoint buffers");
+		return;
+	}
+
+	server_dump_listens(&journal_listens);
+	n = 0;
+
+	/* switch to new journal files */
+	list_for_each(p, &journals) {
+		j = list_entry(p, ohc_journal_t, jnode);
+		if(j->broken) {
+			continue;
+		}
+
+		/* the journal thread has not finished the last switching */
+		pthread_mutex_lock(&journal_lock);
+		switching = j->switch_fd != -1;
+		pthread_mutex_unlock(&journal_lock);
+		if(switching) {
+			continue;
+		}
+
+		journal_flush(j);
+		if(j->broken) {
+			continue;
+		}
+		j->pending_fd = journal_ckpt_open(j, j->generation + 1);
+		if(j->pending_fd == -1) {
+			continue;
+		}
+		fd = journal_file_create(j, j->generation + 1);
+		if(fd == -1) {
+			close(j->pending_fd);
+			j->pending_fd = -1;
+			continue;
+		}
+
+		/* the handed records go to the previous file */
+		pthread_mutex_lock(&journal_lock);
+		j->switch_queue = j->queue;
+		j->switch_nr = j->queue_nr;
+		j->switch_fd = j->fd;
+		j->queue = NULL;
+		j->queue_nr = 0;
+		j->queue_size = 0;
+		j->fd = fd;
+		pthread_mutex_unlock(&journal_lock);
+
+		j->generation++;
+		j->records = 0;
+		j->pending = j->generation;
+
+		format_output_fd(&journal_ckpt_outs[n], j->device, j->pending_fd,
+				sizeof(uint64_t), journal_ckpt_buffers
+				+ (size_t)n * JOURNAL_CKPT_BUFFER, JOURNAL_CKPT_BUFFER);
+		n++;
+	}
+
+	pid = fork();
+	if(pid == 0) {
+		/* child process. write checkpoints and exit */
+		_exit(journal_ckpt_write(journal_ckpt_outs, n) == OHC_OK ? 0 : 1);
+	}
+
+	if(pid < 0) {
+		log_error_run(errno, "fork for checkpoint");
+	}
+	list_for_each(p, &journals) {
+		j = list_entry(p, ohc_journal_t, jnode);
+		if(j->pending_fd == -1) {
+			continue;
+		}
+		close(j->pending_fd);
+		j->pending_fd = -1;
+		if(pid < 0) {
+			j->pending = 0;
+		}
+	}
+
+	journal_checkpoint_pid = pid > 0 ? pid : 0;
+	journal_checkpoint_time = timer_now(&master_timer);
+	journal_checkpoint_forced = 0;
+}
+
+/* check the checkpoint child process */
+static void journal_checkpoint_wait(void)
+{
+	struct list_head *p;
+	ohc_journal_t *j;
+	int status;
+	pid_t pid;
+
+	pid = waitpid(journal_checkpoint_pid, &status, WNOHANG);
+	if(pid == 0) {
+		return;
+	}
+	journal_checkpoint_pid = 0;
+
+	if(pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		log_error_run(0, "checkpoint process fails");
+	}
+
+	list_for_each(p, &journals) {
+		j = list_entry(p, ohc_journal_t, jnode);
+		if(j->pending == 0) {
+			continue;
+		}
+		if(pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0
+				&& !j->broken) {
+			/* in lock, not to race with the journal thread
+			 * removing the checkpoint if it fails */
+			pthread_mutex_lock(&journal_lock);
+			if(!j->failed) {
+				journal_ckpt_commit(j, j->pending);
+			}
+			pthread_mutex_unlock(&journal_lock);
+		}
+		j->pending = 0;
+	}
+}
+
+/* whether a checkpoint is needed */
+static int journal_checkpoint_check(void)
+{
+	ohc_server_listens_t listens;
+	struct list_head *p;
+	ohc_journal_t *j;
+
+	if(journal_checkpoint_forced) {
+		return 1;
+	}
+	if(journal_checkpoint_interval != 0 && timer_now(&master_timer)
+			- journal_checkpoint_time >= journal_checkpoint_interval) {
+		return 1;
+	}
+
+	/* server indexes in records are valid only with the listens */
+	server_dump_listens(&listens);
+	if(memcmp(&listens, &journal_listens, sizeof(listens)) != 0) {
+		return 1;
+	}
+
+	/* do not let the journal be much bigger than the checkpoint */
+	list_for_each(p, &journals) {
+		j = list_entry(p, ohc_journal_t, jnode);
+		if(j->records > j->device->tab->item_nr * 2 + 100000) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* regular routine, called by master thread. Hand the records to the
+ * journal thread to sync, and make checkpoints. */
+void journal_routine(void)
+{
+	struct list_head *p;
+	ohc_journal_t *j;
+
+	list_for_each(p, &journals) {
+		j = list_entry(p, ohc_journal_t, jnode);
+		if(!j->broken && journal_failed(j)) {
+			journal_fail(j);
+		} else {
+			journal_flush(j);
+		}
+	}
+	journal_request(0);
+
+	if(journal_checkpoint_pid > 0) {
+		journal_checkpoint_wait();
+		return;
+	}
+
+	if(!list_empty(&journals) && journal_checkpoint_check()) {
+		journal_checkpoint_start();
+	}
+}
+
+int journal_conf_check(ohc_conf_t *conf_cycle)
+{
+	if(journal_started && strcmp(conf_cycle->journal_dir, journal_dir) != 0) {
+		log_error_admin(0, "journal_dir can not be changed by reload");
+		return OHC_ERROR;
+	}
+
+	if(conf_cycle->journal_dir[0] != '\0'
+			&& access(conf_cycle->journal_dir, W_OK | X_OK) < 0) {
+		log_error_admin(errno, "journal_dir %s", conf_cycle->journal_dir);
+		return OHC_ERROR;
+	}
+	return OHC_OK;
+}
+
+void journal_conf_load(ohc_conf_t *conf_cycle)
+{
+	strcpy(journal_dir, conf_cycle->journal_dir);
+	journal_checkpoint_interval = conf_cycle->journal_checkpoint_interval;
+}
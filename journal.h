@@ -0,0 +1,81 @@
+/*
+ * Journal of items adding and deleting, with periodic checkpoints,
+ * so that items survive a crash.
+ *
+ */
+
+#ifndef _OHC_JOURNAL_H_
+#define _OHC_JOURNAL_H_
+
+#include "olivehc.h"
+
+#define JOURNAL_BUFFER_NR	256
+
+/* buffer of writing checkpoint in child process */
+#define JOURNAL_CKPT_BUFFER	(1024 * 1024)
+
+/* journal_dir, '/' and the device's filename */
+#define JOURNAL_PREFIX_LENGTH	(PATH_LENGTH * 2)
+/* the prefix and ".journal.<gen>" or ".ckpt.tmp" */
+#define JOURNAL_PATH_LENGTH	(JOURNAL_PREFIX_LENGTH + 32)
+
+struct ohc_journal_s {
+	ohc_device_t		*device;
+	struct list_head	jnode;
+
+	int		fd;
+	unsigned	broken:1;
+
+	/* generation of the current journal file, and of the
+	 * last checkpoint. The journal files between them are
+	 * replayed after the checkpoint. */
+	uint64_t	generation;
+	uint64_t	checkpoint;
+
+	/* the checkpoint being written by child process */
+	uint64_t	pending;
+	int		pending_fd;
+
+	/* records written since the last checkpoint */
+	long		records;
+
+	char		prefix[JOURNAL_PREFIX_LENGTH];
+
+	/* Records handed to the journal thread, and the ones for the
+	 * previous file at switching. They, @fd, @busy and @failed are
+	 * protected by journal_lock. */
+	ohc_format_item_t	*queue;
+	long			queue_nr;
+	long			queue_size;
+	ohc_format_item_t	*switch_queue;
+	long			switch_nr;
+	int			switch_fd;
+	int			busy; /* being written by the journal thread */
+	int			failed;
+
+	/* records not written yet, in JOURNAL_BUFFER_NR */
+	int			deletes;
+	int			buf_nr;
+	ohc_format_item_t	*buffer;
+};
+
+int journal_conf_check(ohc_conf_t *conf_cycle);
+void journal_conf_load(ohc_conf_t *conf_cycle);
+
+long journal_read_device(ohc_device_t *device, unsigned char *info,
+		int *version, ohc_format_item_t **result);
+void journal_open(ohc_device_t *device, int replayed);
+void journal_close(ohc_device_t *device, int remove);
+void journal_quit(void);
+
+void journal_add_item(ohc_item_t *item);
+void journal_delete_item(ohc_item_t *item);
+void journal_add_page(ohc_page_t *page);
+void journal_delete_page(ohc_page_t *page);
+void journal_before_alloc(ohc_device_t *device);
+void journal_wait(ohc_device_t *device);
+
+void journal_checkpoint_force(void);
+void journal_routine(void);
+
+#endif
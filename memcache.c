@@ -0,0 +1,332 @@
+/*
+ * Parse memcached text protocol, make its replies.
+ *
+ * A server with `memcached on` speaks memcached text protocol instead
+ * of HTTP. The commands are mapped to the HTTP methods on the same item
+ * store, so they go through the same paths in @request and @server:
+ *
+ *   get <key>*                                 GET, of each key
+ *   set <key> <flags> <exptime> <bytes>        PUT
+ *   add <key> <flags> <exptime> <bytes>        POST
+ *   delete <key>                               DELETE
+ *   touch <key> <exptime>                      TOUCH
+ *   version, quit
+ *
+ * The key is used as is, without decoding or Host. The value is stored
+ * as an HTTP item in the same devices, with the flags in OHC-Flags header
+ * if not 0, and it's sent by sendfile too.
+ *
+ * Commands can be pipelined. The "\r\n" after the data block of set is
+ * skipped with the next command if it's not pre-read.
+ *
+ */
+
+#include "memcache.h"
+
+/* arguments of a command at most, except get */
+#define MEMCACHE_ARGS_MAX	7
+
+#define MEMCACHE_FLAGS_HEADER	"OHC-Flags: "
+
+/* split [p, end) into @args by space. return the number, or
+ * MEMCACHE_ARGS_MAX + 1 if too many, e.g. keys of get */
+static int memcache_split(char *p, char *end, string_t *args)
+{
+	int n = 0;
+
+	while(1) {
+		while(p < end && *p == ' ') {
+			p++;
+		}
+		if(p == end) {
+			return n;
+		}
+		if(n == MEMCACHE_ARGS_MAX) {
+			return n + 1;
+		}
+		args[n].base = p;
+		while(p < end && *p != ' ') {
+			p++;
+		}
+		args[n].len = p - args[n].base;
+		n++;
+	}
+}
+
+static int memcache_number(string_t *arg, long *n)
+{
+	char *endp;
+
+	*n = strtol(arg->base, &endp, 10);
+	return (endp == arg->base || endp != arg->base + arg->len) ? OHC_ERROR : OHC_OK;
+}
+
+static int memcache_is(string_t *arg, char *word)
+{
+	return arg->len == strlen(word) && memcmp(arg->base, word, arg->len) == 0;
+}
+
+/* exptime of memcached: 0 for expire_default, relative seconds if not
+ * larger than 30 days, and absolute Unix time otherwise. The negative
+ * or past one expires the item at once. */
+static void memcache_expire(ohc_request_t *r, long exptime)
+{
+	time_t now = timer_now(&master_timer);
+
+	if(exptime == 0) {
+		r->expire = 0;
+	} else if(exptime < 0) {
+		r->expire = now;
+	} else if(exptime <= MEMCACHE_RELATIVE_MAX) {
+		r->expire = now + exptime;
+	} else {
+		r->expire = (exptime < now) ? now : exptime;
+	}
+}
+
+/* set and add. The flags are stored as header, and the data block
+ * follows the command line, as the body of PUT. */
+static int memcache_parse_store(ohc_request_t *r, string_t *args, int nr, char *data)
+{
+	long flags, exptime, bytes;
+	ssize_t avail;
+
+	if(nr != 5 && nr != 6) {
+		return OHC_ERROR;
+	}
+	if(memcache_number(&args[2], &flags) != OHC_OK || flags < 0 || flags > UINT32_MAX
+			|| memcache_number(&args[3], &exptime) != OHC_OK
+			|| memcache_number(&args[4], &bytes) != OHC_OK || bytes < 0) {
+		return OHC_ERROR;
+	}
+	if(bytes > (r->server->item_max_size ? r->server->item_max_size
+				: MEMCACHE_BYTES_MAX)) {
+		r->error_reason = "TooBigItem";
+		return OHC_ERROR;
+	}
+
+	memcache_expire(r, exptime);
+	r->content_length = bytes;
+
+	r->put_headers[0].base = r->mc_line;
+	r->put_headers[0].len = flags
+		? sprintf(r->mc_line, MEMCACHE_FLAGS_HEADER "%ld\r\n\r\n", flags)
+		: sprintf(r->mc_line, "\r\n");
+	r->put_header_nr = 1;
+	r->put_header_length = r->put_headers[0].len
+		+ http_make_200_response_header(bytes, NULL);
+
+	/* the pre-read data */
+	avail = r->buf_pos - data;
+	if(avail - 2 >= bytes) {
+		if(data[bytes] != '\r' || data[bytes + 1] != '\n') {
+			r->error_reason = "BadDataChunk";
+			r->keepalive = 0;
+			return OHC_ERROR;
+		}
+		r->mc_next = data + bytes + 2;
+	} else {
+		r->mc_next = r->buf_pos;
+	}
+	if(avail > bytes) {
+		avail = bytes;
+	}
+	if(avail > 0) {
+		r->put_headers[1].base = data;
+		r->put_headers[1].len = avail;
+		r->put_header_nr = 2;
+	}
+	return OHC_OK;
+}
+
+/* parse a command in @r's buffer. return OHC_DONE, OHC_AGAIN if it's
+ * not complete, or OHC_ERROR. The error is replied by memcache_reply(),
+ * and the connection is kept if @keepalive is not cleared. */
+int memcache_request_parse(ohc_request_t *r)
+{
+	string_t args[MEMCACHE_ARGS_MAX];
+	char *p, *end, *line_end;
+	long exptime;
+	int nr;
+
+	p = r->_buffer;
+	*r->buf_pos = '\0';
+	r->put_header_nr = 0;
+	r->put_header_length = 0;
+
+	/* e.g. the "\r\n" after the data block of last set */
+	while(p < r->buf_pos && (*p == '\r' || *p == '\n')) {
+		p++;
+	}
+
+	line_end = memchr(p, '\n', r->buf_pos - p);
+	if(line_end == NULL) {
+		return OHC_AGAIN;
+	}
+	r->mc_next = line_end + 1;
+	end = (line_end > p && line_end[-1] == '\r') ? line_end - 1 : line_end;
+
+	nr = memcache_split(p, end, args);
+	if(nr == 0) {
+		r->error_reason = "UnknownCommand";
+		goto fail;
+	}
+	if(nr > 1 && args[1].len > MEMCACHE_KEY_MAX) {
+		r->error_reason = "KeyTooLong";
+		goto fail;
+	}
+	if(nr > 1) {
+		r->uri = args[1];
+	}
+	if(nr <= MEMCACHE_ARGS_MAX && memcache_is(&args[nr - 1], "noreply")) {
+		r->mc_noreply = 1;
+		nr--;
+	}
+
+	if(memcache_is(&args[0], "get")) {
+		if(nr < 2) {
+			goto invalid;
+		}
+		r->method = OHC_HTTP_METHOD_GET;
+		r->mc_keys.base = args[1].base;
+		r->mc_keys.len = end - args[1].base;
+		r->mc_noreply = 0;
+
+	} else if(memcache_is(&args[0], "set") || memcache_is(&args[0], "add")) {
+		r->method = (args[0].base[0] == 's') ? OHC_HTTP_METHOD_PUT
+				: OHC_HTTP_METHOD_POST;
+		if(memcache_parse_store(r, args, nr, line_end + 1) != OHC_OK) {
+			r->keepalive = 0;
+			goto invalid;
+		}
+
+	} else if(memcache_is(&args[0], "delete")) {
+		if(nr != 2) {
+			goto invalid;
+		}
+		r->method = OHC_HTTP_METHOD_DELETE;
+
+	} else if(memcache_is(&args[0], "touch")) {
+		if(nr != 3 || memcache_number(&args[2], &exptime) != OHC_OK) {
+			goto invalid;
+		}
+		r->method = OHC_HTTP_METHOD_TOUCH;
+		memcache_expire(r, exptime);
+
+	} else if(memcache_is(&args[0], "version")) {
+		r->http_code = 200;
+
+	} else if(memcache_is(&args[0], "quit")) {
+		r->mc_noreply = 1;
+		r->keepalive = 0;
+
+	} else {
+		r->error_reason = "UnknownCommand";
+		goto fail;
+	}
+	return OHC_DONE;
+
+invalid:
+	if(r->error_reason == NULL) {
+		r->error_reason = "InvalidCommand";
+	}
+fail:
+	r->http_code = 400;
+	return OHC_ERROR;
+}
+
+/* take the next key of get into @uri. return OHC_DONE if no more.
+ * Too long keys are skipped, as missed. */
+int memcache_next_key(ohc_request_t *r)
+{
+	char *p = r->mc_keys.base;
+	char *end = p + r->mc_keys.len;
+
+	while(1) {
+		while(p < end && *p == ' ') {
+			p++;
+		}
+		if(p == end) {
+			r->mc_keys.len = 0;
+			return OHC_DONE;
+		}
+		r->uri.base = p;
+		while(p < end && *p != ' ') {
+			p++;
+		}
+		r->uri.len = p - r->uri.base;
+		if(r->uri.len <= MEMCACHE_KEY_MAX) {
+			break;
+		}
+	}
+
+	r->mc_keys.len = end - p;
+	r->mc_keys.base = p;
+	return OHC_OK;
+}
+
+/* make the "VALUE" line of @r->item into @mc_line, with the flags in
+ * the stored @headers, which is terminated by '\0'. */
+ssize_t memcache_make_value_line(ohc_request_t *r, char *headers)
+{
+	unsigned long flags = 0;
+	char *p;
+
+	p = strstr(headers, "\r\n" MEMCACHE_FLAGS_HEADER);
+	if(p != NULL) {
+		flags = strtoul(p + 2 + sizeof(MEMCACHE_FLAGS_HEADER) - 1, NULL, 10);
+	}
+
+	return sprintf(r->mc_line, "VALUE %.*s %lu %ld\r\n", (int)r->uri.len,
+			r->uri.base, flags, r->body_len);
+}
+
+/* the reply of @r by its method and @http_code, or NULL if none */
+string_t *memcache_reply(ohc_request_t *r)
+{
+	static string_t reply_end = STRING_INIT("END\r\n");
+	static string_t reply_stored = STRING_INIT("STORED\r\n");
+	static string_t reply_not_stored = STRING_INIT("NOT_STORED\r\n");
+	static string_t reply_deleted = STRING_INIT("DELETED\r\n");
+	static string_t reply_touched = STRING_INIT("TOUCHED\r\n");
+	static string_t reply_not_found = STRING_INIT("NOT_FOUND\r\n");
+	static string_t reply_version = STRING_INIT("VERSION OliveHC\r\n");
+	static string_t reply_error = STRING_INIT("ERROR\r\n");
+	static string_t reply_client_error = STRING_INIT("CLIENT_ERROR bad command line format\r\n");
+	static string_t reply_bad_data = STRING_INIT("CLIENT_ERROR bad data chunk\r\n");
+	static string_t reply_server_error = STRING_INIT("SERVER_ERROR internal error\r\n");
+
+	if(r->mc_noreply) {
+		return NULL;
+	}
+
+	switch(r->http_code) {
+	case 400:
+		if(r->error_reason == NULL) {
+			return &reply_client_error;
+		}
+		if(strcmp(r->error_reason, "UnknownCommand") == 0) {
+			return &reply_error;
+		}
+		if(strcmp(r->error_reason, "BadDataChunk") == 0) {
+			return &reply_bad_data;
+		}
+		return &reply_client_error;
+	case 500:
+		return &reply_server_error;
+	}
+
+	switch(r->method) {
+	case OHC_HTTP_METHOD_GET:
+		return &reply_end;
+	case OHC_HTTP_METHOD_PUT:
+	case OHC_HTTP_METHOD_POST:
+		return (r->http_code == 201) ? &reply_stored : &reply_not_stored;
+	case OHC_HTTP_METHOD_DELETE:
+		return (r->http_code == 204) ? &reply_deleted : &reply_not_found;
+	case OHC_HTTP_METHOD_TOUCH:
+		return (r->http_code == 204) ? &reply_touched : &reply_not_found;
+	default:
+		return (r->http_code == 200) ? &reply_version : NULL;
+	}
+}
@@ -0,0 +1,27 @@
+/*
+ * Parse memcached text protocol, make its replies.
+ *
+ */
+
+#ifndef _OHC_MEMCACHE_H_
+#define _OHC_MEMCACHE_H_
+
+#include "olivehc.h"
+#include "request.h"
+
+/* the longest key of memcached */
+#define MEMCACHE_KEY_MAX	250
+
+/* exptime larger than this is an absolute Unix time */
+#define MEMCACHE_RELATIVE_MAX	(60 * 60 * 24 * 30)
+
+/* the largest data block if item_max_size is not set. sendfile(2)
+ * supports 40bits offset only, see ohc_item_t. */
+#define MEMCACHE_BYTES_MAX	(1L << 40)
+
+int memcache_request_parse(ohc_request_t *r);
+int memcache_next_key(ohc_request_t *r);
+ssize_t memcache_make_value_line(ohc_request_t *r, char *headers);
+string_t *memcache_reply(ohc_request_t *r);
+
+#endif
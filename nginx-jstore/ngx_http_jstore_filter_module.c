@@ -26,6 +26,7 @@ typedef struct {
 typedef struct {
     ngx_str_t    target;
     off_t        max_size;
+    off_t        expect_size;
     ngx_flag_t   check_cacheable;
 } ngx_http_jstore_loc_conf_t;
 
@@ -46,6 +47,14 @@ static ngx_command_t ngx_http_jstore_commands[] = {
         offsetof(ngx_http_jstore_loc_conf_t, max_size),
         NULL
     },
+    {
+        ngx_string("jstore_expect_size"),
+        NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+        ngx_conf_set_off_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_jstore_loc_conf_t, expect_size),
+        NULL
+    },
     {
         ngx_string("jstore_check_cacheable"),
         NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
@@ -184,6 +193,62 @@ ngx_http_jstore_check_cacheable(ngx_http_request_t *r)
     return 1;
 }
 
+/* copy the upstream's response headers as the subrequest's request
+ * headers. Add "Expect: 100-continue" if the body is large, so OliveHC
+ * can reply at once if it does not store the item. The headers are
+ * shared without Expect, if fail. */
+static void
+ngx_http_jstore_subrequest_headers(ngx_http_request_t *r, ngx_http_request_t *sr,
+        off_t length)
+{
+    ngx_http_jstore_loc_conf_t *jlcf;
+    ngx_list_part_t *part;
+    ngx_table_elt_t *h, *nh;
+    ngx_uint_t i;
+
+    jlcf = ngx_http_get_module_loc_conf(r, ngx_http_jstore_filter_module);
+    if(jlcf->expect_size == 0 || length < jlcf->expect_size) {
+        goto share;
+    }
+
+    if(ngx_list_init(&sr->headers_in.headers, r->pool, 20,
+                sizeof(ngx_table_elt_t)) != NGX_OK) {
+        goto share;
+    }
+
+    part = &r->upstream->headers_in.headers.part;
+    h = part->elts;
+    for(i = 0; /* void */; i++) {
+        if(i >= part->nelts) {
+            if(part->next == NULL) {
+                break;
+            }
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        nh = ngx_list_push(&sr->headers_in.headers);
+        if(nh == NULL) {
+            goto share;
+        }
+        *nh = h[i];
+    }
+
+    nh = ngx_list_push(&sr->headers_in.headers);
+    if(nh == NULL) {
+        goto share;
+    }
+    nh->hash = 1;
+    ngx_str_set(&nh->key, "Expect");
+    ngx_str_set(&nh->value, "100-continue");
+    nh->lowcase_key = (u_char *)"expect";
+    return;
+
+share:
+    sr->headers_in.headers = r->upstream->headers_in.headers;
+}
+
 static ngx_int_t
 ngx_http_jstore_header_filter(ngx_http_request_t *r)
 {
@@ -355,7 +420,7 @@ ngx_http_jstore_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     sr->method_name.len = JSUBR_METHOD_LEN;
 
     /* request headers */
-    sr->headers_in.headers = u->headers_in.headers;
+    ngx_http_jstore_subrequest_headers(r, sr, ctx->copied_length);
     sr->headers_in.content_length_n = ctx->copied_length;
 
     /* $proxy_internal_body_length is cacheable, and the subrequest
@@ -399,6 +464,7 @@ ngx_http_jstore_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_jstore_loc_conf_t *conf = child;
 
     ngx_conf_merge_value(conf->max_size, prev->max_size, 100<<20); /* 100M */
+    ngx_conf_merge_off_value(conf->expect_size, prev->expect_size, 0);
     ngx_conf_merge_value(conf->check_cacheable, prev->check_cacheable, 1);
     return NGX_CONF_OK;
 }
@@ -414,6 +480,7 @@ ngx_http_jstore_create_loc_conf(ngx_conf_t *cf)
 
     jlcf->target.data = NULL;
     jlcf->max_size = NGX_CONF_UNSET_SIZE;
+    jlcf->expect_size = NGX_CONF_UNSET;
     jlcf->check_cacheable = NGX_CONF_UNSET;
     return jlcf;
 }
@@ -17,7 +17,7 @@ ohc_timer_t master_timer;
 LIST_HEAD(master_requests);
 FILE *error_filp;
 FILE *admin_out_filp;
-static time_t quit_time = 0;
+static uint64_t quit_time = 0;
 
 static int olivehc_global_conf_check(ohc_conf_t *conf_cycle)
 {
@@ -65,8 +65,11 @@ static int olivehc_load_conf(void)
 	CONF_CHECK(device_conf_check);
 	CONF_CHECK(server_conf_check);
 	CONF_CHECK(worker_conf_check);
+	CONF_CHECK(journal_conf_check);
+	CONF_CHECK(table_conf_check); /* at last, since it's opened at first time */
 
 	olivehc_global_conf_load(conf_cycle);
+	journal_conf_load(conf_cycle);
 	device_conf_load(conf_cycle);
 	server_conf_load(conf_cycle);
 	worker_conf_load(conf_cycle);
@@ -87,11 +90,37 @@ static void olivehc_quit(void)
 		return;
 	}
 
-	quit_time = timer_now(&master_timer) + quit_timeout;
+	quit_time = timer_msec(&master_timer) + quit_timeout * 1000;
+	upgrade_abort();
 	server_stop_service();
 	worker_quit(quit_time);
 }
 
+/* start the new binary, and quit after it's ready, see
+ * olivehc_upgrade_handler() */
+static int olivehc_upgrade(int admin_fd)
+{
+	if(quit_time != 0) {
+		log_error_admin(0, "in quiting");
+		return OHC_ERROR;
+	}
+	return upgrade_start(admin_fd);
+}
+
+/* the new process is ready, so quit and hand off to it */
+static void olivehc_upgrade_handler(int admin_fd)
+{
+	if(upgrade_handler() != OHC_OK) {
+		return;
+	}
+
+	/* the new process takes the admin port */
+	epoll_del(master_epoll_fd, admin_fd);
+	close(admin_fd);
+
+	olivehc_quit();
+}
+
 static void olivehc_status(FILE *filp)
 {
 	device_status(filp);
@@ -134,15 +163,22 @@ static void olivehc_admin_handler(int admin_fd)
 		olivehc_quit();
 		fputs("Quiting...\n", admin_out_filp);
 
+	} else if(strncmp(buf, "upgrade", 7) == 0) {
+		rc = olivehc_upgrade(admin_fd);
+		if(rc == OHC_OK) {
+			fputs("Upgrading...\n", admin_out_filp);
+		}
+
 	} else if(strncmp(buf, "clear ", 6) == 0) {
-		rc = server_clear((unsigned short)atoi(buf + 6));
+		buf[strcspn(buf, "\r\n")] = '\0';
+		rc = server_clear(buf + 6);
 		if(rc == OHC_OK) {
 			fputs("Server cleared!\n", admin_out_filp);
 		}
 
 	} else {
 		fputs("Invalid command!\n", admin_out_filp);
-		fputs("Usage: status|reload|quit|clear SERVER\n", admin_out_filp);
+		fputs("Usage: status|reload|quit|upgrade|clear SERVER\n", admin_out_filp);
 	}
 
 	fclose(admin_out_filp);
@@ -157,18 +193,34 @@ static void olivehc_master_entry(int admin_fd)
 	struct epoll_event events[MAX_EVENTS];
 	struct list_head *p, *expires, *safep;
 	ohc_timer_node_t *tnode;
-	int rc, i, type;
+	int rc, i, type, timeout;
 	void *ptr;
 	ohc_request_t *r;
 	time_t last, now;
-	last = timer_now(&master_timer);
+	last = timer_msec(&master_timer) / 1000;
 
 
 	device_format_load();
 
-	while(quit_time == 0 || !request_check_quit(quit_time > last)) {
+	while(quit_time == 0 || !request_check_quit(quit_time > timer_msec(&master_timer))) {
+
+		/* load items from devices, while serving */
+		switch(device_format_load_step()) {
+		case OHC_AGAIN:
+			timeout = 0;
+			break;
+		case OHC_DECLINE:
+			timeout = 10;
+			break;
+		default:
+			timeout = 1000;
+		}
+		timeout = timer_closest(&master_timer, timeout);
 
-		rc = epoll_wait(master_epoll_fd, events, MAX_EVENTS, 1000);
+		/* the item table is not changed while waiting */
+		table_busy(0);
+		rc = epoll_wait(master_epoll_fd, events, MAX_EVENTS, timeout);
+		table_busy(1);
 		if(rc == -1 && errno != EINTR) {
 			log_error_run(errno, "master epoll_wait");
 		}
@@ -192,9 +244,12 @@ static void olivehc_master_entry(int admin_fd)
 				worker_request_recycle((ohc_worker_t *)ptr);
 				break;
 
+			case EVENT_TYPE_UPGRADE:
+				olivehc_upgrade_handler(admin_fd);
+				break;
+
 			default: /* socket */
-				r = ptr;
-				r->event_handler(r);
+				event_process(ptr, events[i].events);
 			}
 		}
 
@@ -209,17 +264,24 @@ static void olivehc_master_entry(int admin_fd)
 		}
 
 		/* routines */
-		now = timer_now(&master_timer);
+		now = timer_msec(&master_timer) / 1000;
 		if(now != last) {
 			last = now;
 
 			server_routine();
 			device_routine();
+			journal_routine();
+			upgrade_routine();
 			fflush(error_filp);
 		}
 	}
 
-	device_format_store();
+	if(upgrade_started()) {
+		upgrade_handoff();
+	} else {
+		device_format_store();
+	}
+	table_close();
 }
 
 int main(int argc, char **argv)
@@ -227,7 +289,7 @@ int main(int argc, char **argv)
 	char *pid_filename = "olivehc.pid";
 	int admin_port = 5210;
 	char *prefix = NULL;
-	int daemon_mode = 1, ch;
+	int daemon_mode = 1, ch, rc;
 	int admin_fd;
 
 	char *help = "Usage: olivehc [-hvb][-c conf_file][-p prefix][-a admin][-i pid]\n"
@@ -269,6 +331,12 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* for upgrade, before changing directory */
+	if(upgrade_prepare(argv) != OHC_OK) {
+		perror("error in get current directory");
+		return 1;
+	}
+
 	if(prefix) {
 		if(chdir(prefix) < 0) {
 			perror("error in set prefix");
@@ -300,6 +368,11 @@ int main(int argc, char **argv)
 	/* master timer */
 	timer_init(&master_timer);
 
+	if(http_init() != OHC_OK) {
+		fprintf(stderr, "error in init HTTP header table\n");
+		return 1;
+	}
+
 	/* master epoll */
 	master_epoll_fd = epoll_create(100);
 	if(master_epoll_fd < 0) {
@@ -307,12 +380,19 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	/* admin port */
-	admin_fd = tcp_bind(admin_port);
-	if(admin_fd < 0) {
-		perror("error in bind admin port");
+	/* admin port, which is taken from the old process if upgrading */
+	rc = upgrade_init(&admin_fd);
+	if(rc == OHC_ERROR) {
+		perror("error in upgrade");
 		return 1;
 	}
+	if(rc == OHC_DECLINE) {
+		admin_fd = tcp_bind(admin_port);
+		if(admin_fd < 0) {
+			perror("error in bind admin port");
+			return 1;
+		}
+	}
     /* constant 1000 */
 	tcp_listen(admin_fd);
 	if(epoll_add_read(master_epoll_fd, admin_fd, (void *)EVENT_TYPE_LISTEN) < 0) {
@@ -327,6 +407,7 @@ int main(int argc, char **argv)
 	if(olivehc_load_conf() == OHC_ERROR) {
 		return 1;
 	}
+	upgrade_ready();
 
 	/* pid file */
 	FILE *pid_filp = fopen(pid_filename, "w");
@@ -340,8 +421,10 @@ int main(int argc, char **argv)
 	/* run olivehc! */
 	olivehc_master_entry(admin_fd);
 
-	/* quit */
-	unlink(pid_filename);
+	/* quit. The pid file belongs to the new process if upgraded. */
+	if(!upgrade_started()) {
+		unlink(pid_filename);
+	}
 	return 0;
 }
 
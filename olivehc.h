@@ -18,11 +18,15 @@
 
 #define PATH_LENGTH	1024
 
+/* the length of unix socket path, as sun_path in sockaddr_un */
+#define SERVER_PATH_MAX	108
+
 #define LOOP_LIMIT	1000
 
 #define EVENT_TYPE_SOCKET	0
 #define EVENT_TYPE_LISTEN	1
 #define EVENT_TYPE_PIPE		2
+#define EVENT_TYPE_UPGRADE	3
 #define EVENT_TYPE_MASK		3UL
 
 typedef char ohc_flag_t;
@@ -53,6 +57,7 @@ typedef char ohc_flag_t;
 
 /* utils */
 #include "utils/list.h"
+#include "utils/tlist.h"
 #include "utils/socktcp.h"
 #include "utils/string.h"
 #include "utils/slab.h"
@@ -64,12 +69,21 @@ typedef char ohc_flag_t;
 
 
 typedef struct ohc_request_s ohc_request_t;
+typedef struct ohc_range_s ohc_range_t;
 typedef struct ohc_item_s ohc_item_t;
+typedef struct ohc_putting_s ohc_putting_t;
 typedef struct ohc_server_s ohc_server_t;
 typedef struct ohc_device_s ohc_device_t;
+typedef struct ohc_page_s ohc_page_t;
+typedef struct ohc_journal_s ohc_journal_t;
 typedef struct ohc_worker_s ohc_worker_t;
 typedef struct ohc_format_item_s ohc_format_item_t;
+typedef struct ohc_item_head_s ohc_item_head_t;
+typedef struct ohc_format_thread_s ohc_format_thread_t;
 typedef struct ohc_conf_s ohc_conf_t;
+typedef struct ohc_table_server_s ohc_table_server_t;
+typedef struct ohc_server_listens_s ohc_server_listens_t;
+typedef struct ohc_table_device_s ohc_table_device_t;
 typedef void req_handler_f(ohc_request_t *r);
 
 extern int master_epoll_fd;
@@ -79,9 +93,15 @@ extern struct list_head master_requests;
 #include "conf.h"
 #include "format.h"
 #include "http.h"
+#include "table.h"
+#include "memcache.h"
 #include "server.h"
 #include "worker.h"
 #include "device.h"
+#include "page.h"
+#include "journal.h"
+#include "tag.h"
+#include "upgrade.h"
 #include "request.h"
 #include "event.h"
 
@@ -0,0 +1,274 @@
+/*
+ * Pack small items into shared pages.
+ *
+ * Each item takes a block at least of IPB_1ST bytes, which wastes too
+ * much space for small items. So small items of a server are packed
+ * into a shared page, which takes one free block.
+ *
+ * Items are appended at the page's tail, and the space is not reused
+ * until all items in the page are deleted, then the page's block is
+ * returned to device. If a page becomes sparse, the remaining items
+ * are evicted together, to return the page's block.
+ *
+ */
+
+#include "page.h"
+
+/* Pages whose live items take less than half are linked on item
+ * table's sparse pages, and evicted later. */
+
+/* the last loaded page, for loading its items */
+static ohc_page_t *loading_page = NULL;
+
+static inline ohc_server_t *server_of_page(ohc_page_t *page)
+{
+	return server_by_index(page->server_index);
+}
+
+static inline ohc_page_t *page_of_item(ohc_item_t *item)
+{
+	return tpos_ptr(item->page);
+}
+
+static ohc_page_t *page_new(ohc_server_t *s)
+{
+	ohc_page_t *page;
+
+	page = table_alloc();
+	if(page == NULL) {
+		return NULL;
+	}
+
+	/* others are zero by table_alloc() */
+	page->is_page = 1;
+	page->server_index = s->index;
+	INIT_TLIST_HEAD(&page->item_head);
+	INIT_TLIST_HEAD(&page->sparse_node);
+	return page;
+}
+
+/* the page's block is accounted in its server's @consumed here, while
+ * the packed items are not accounted. */
+static void page_free(ohc_page_t *page)
+{
+	ohc_server_t *s = server_of_page(page);
+
+	if(page == loading_page) {
+		loading_page = NULL;
+	}
+	tlist_del(&page->sparse_node);
+	journal_delete_page(page);
+	s->tab->consumed -= device_return_page_block(page);
+	table_free(page);
+}
+
+/* @server module call this to allocate space for a small item in
+ * @s's open page. A new page is opened, if the open page has no
+ * enough space. */
+int page_get_slot(ohc_server_t *s, ohc_item_t *item)
+{
+	ohc_page_t *page = tpos_ptr(s->tab->open_page);
+	size_t slot = page_slot_size(item_block_length(item));
+	size_t bsize;
+
+	if(page != NULL && (page->tail + slot > OHC_PAGE_SIZE
+				|| device_of_page(page)->deleted)) {
+		page_close(s);
+		page = NULL;
+	}
+
+	if(page == NULL) {
+		page = page_new(s);
+		if(page == NULL) {
+			return OHC_ERROR;
+		}
+		bsize = device_get_page_block(page);
+		if(bsize == 0) {
+			table_free(page);
+			return OHC_ERROR;
+		}
+		s->tab->open_page = tpos_of(page);
+		s->tab->consumed += bsize;
+		journal_add_page(page);
+	}
+
+	item->packed = 1;
+	item->page = tpos_of(page);
+	item->offset = page->offset + page->tail + item_head_size(item);
+	item->device_index = page->device_index;
+	tlist_add_tail(&item->order_node, &page->item_head);
+
+	page->tail += slot;
+	page->live += slot;
+	page->item_nr++;
+	device_of_page(page)->tab->item_nr++;
+	return OHC_OK;
+}
+
+/* offset of packed @item's block in its page */
+size_t page_item_pos(ohc_item_t *item)
+{
+	return item_block_offset(item) - page_of_item(item)->offset;
+}
+
+/* @device module call this, when deleting a packed item. Always
+ * return 0, since the packed items are not accounted. */
+size_t page_return_item(ohc_item_t *item)
+{
+	ohc_page_t *page = page_of_item(item);
+	ohc_server_t *s = server_of_page(page);
+
+	tlist_del(&item->order_node);
+	page->live -= page_slot_size(item_block_length(item));
+	page->item_nr--;
+	if(item->badblock) {
+		page->badblock = 1;
+	}
+
+	/* the open page is kept, even if empty */
+	if(item->page == s->tab->open_page || page == loading_page) {
+		return 0;
+	}
+
+	if(page->item_nr == 0) {
+		page_free(page);
+		return 0;
+	}
+
+	if(page->live * 2 < OHC_PAGE_SIZE && tlist_empty(&page->sparse_node)) {
+		tlist_add_tail(&page->sparse_node, table_sparse_pages());
+	}
+	return 0;
+}
+
+/* close @s's open page, so no more items will be put in. */
+void page_close(ohc_server_t *s)
+{
+	ohc_page_t *page = tpos_ptr(s->tab->open_page);
+
+	if(page == NULL) {
+		return;
+	}
+	s->tab->open_page = 0;
+
+	if(page->item_nr == 0) {
+		page_free(page);
+	} else if(page->live * 2 < OHC_PAGE_SIZE) {
+		tlist_add_tail(&page->sparse_node, table_sparse_pages());
+	}
+}
+
+/* page-level eviction: delete all items in @page, except the hot ones.
+ * The page is freed when the last item is deleted. */
+void page_evict(ohc_page_t *page)
+{
+	struct tlist_head *p;
+	ohc_item_t *item;
+	ohc_server_t *s = server_of_page(page);
+	int i, item_nr = page->item_nr;
+
+	if(tpos_of(page) == s->tab->open_page) {
+		s->tab->open_page = 0;
+	}
+	if(item_nr == 0) {
+		page_free(page);
+		return;
+	}
+
+	/* the page is freed at the last item, so we do not use
+	 * tlist_for_each_safe() here, which touches the list head
+	 * after the last item. */
+	p = tlist_next(&page->item_head);
+	for(i = 0; i < item_nr; i++) {
+		item = tlist_entry(p, ohc_item_t, order_node);
+		p = tlist_next(p);
+
+		if(item->putting || item->used) { /* do not delete hot item */
+			continue;
+		}
+		server_item_delete(item);
+	}
+}
+
+/* evict sparse pages, called by @server module */
+void page_reclaim(void)
+{
+	ohc_page_t *page;
+	int count = 0;
+	struct tlist_head *sparse_pages = table_sparse_pages();
+
+	while(!tlist_empty(sparse_pages) && count++ < LOOP_LIMIT) {
+		page = tlist_entry(tlist_next(sparse_pages), ohc_page_t, sparse_node);
+		tlist_del_init(&page->sparse_node);
+		page_evict(page);
+	}
+}
+
+/* @server module call this, when load a page from device. */
+int page_load(ohc_server_t *s, ohc_device_t *device, off_t offset)
+{
+	ohc_page_t *page;
+	size_t bsize;
+
+	page_load_post();
+
+	page = page_new(s);
+	if(page == NULL) {
+		return OHC_ERROR;
+	}
+	page->device_index = device->index;
+	page->offset = offset;
+
+	bsize = device_cut_page_block(page);
+	if(bsize == 0) {
+		table_free(page);
+		return OHC_ERROR;
+	}
+	s->tab->consumed += bsize;
+
+	/* loaded page is not open, so no more items will be put in */
+	page->tail = OHC_PAGE_SIZE;
+	loading_page = page;
+	return OHC_OK;
+}
+
+/* @server module call this, when load a packed item, which must be
+ * in the last loaded page. */
+int page_load_item(ohc_server_t *s, ohc_item_t *item)
+{
+	ohc_page_t *page = loading_page;
+	size_t slot = page_slot_size(item_block_length(item));
+
+	if(page == NULL || page->server_index != s->index
+			|| page->device_index != item->device_index
+			|| item_block_offset(item) < page->offset
+			|| item_block_offset(item) + slot > page->offset + OHC_PAGE_SIZE) {
+		return OHC_ERROR;
+	}
+
+	item->packed = 1;
+	item->page = tpos_of(page);
+	tlist_add_tail(&item->order_node, &page->item_head);
+	page->live += slot;
+	page->item_nr++;
+	device_of_page(page)->tab->item_nr++;
+	return OHC_OK;
+}
+
+/* finish loading the last loaded page. @format module call this
+ * after finish loading items of a device. */
+void page_load_post(void)
+{
+	ohc_page_t *page = loading_page;
+
+	loading_page = NULL;
+	if(page == NULL) {
+		return;
+	}
+
+	if(page->item_nr == 0) {
+		page_free(page);
+	} else if(page->live * 2 < OHC_PAGE_SIZE) {
+		tlist_add_tail(&page->sparse_node, table_sparse_pages());
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ * Pack small items into shared pages.
+ *
+ */
+
+#ifndef _OHC_PAGE_H_
+#define _OHC_PAGE_H_
+
+#include "olivehc.h"
+
+/* each page takes one free block, and small items are allocated
+ * in it one by one, aligned by OHC_PAGE_ALIGN. */
+#define OHC_PAGE_SIZE	4096
+#define OHC_PAGE_ALIGN	16
+
+/* Pages are in the item table, and linked by positions in it. */
+struct ohc_page_s {
+	/* packed items are linked on @item_head by their @order_node,
+	 * and point back to the page by their @page. */
+	struct tlist_head	item_head;
+
+	/* @order_node, @fblock and @is_page must be together, to be linked
+	 * in device's order-list, see ohc_free_block_t. */
+	struct tlist_head	order_node;
+	unsigned		fblock:1;
+	unsigned		is_page:1;
+
+	unsigned		badblock:1;
+
+	short			device_index;
+	short			server_index;
+
+	/* since sendfile(2) supports only 0x4020010000, so 40bits is enough */
+	unsigned long		offset:40;
+
+	/* bytes allocated from the beginning, and bytes of live items */
+	unsigned short		tail;
+	unsigned short		live;
+	unsigned short		item_nr;
+
+	struct tlist_head	sparse_node;
+};
+
+static inline size_t page_slot_size(size_t length)
+{
+	return (length + OHC_PAGE_ALIGN - 1) & ~(OHC_PAGE_ALIGN - 1);
+}
+
+int page_get_slot(ohc_server_t *s, ohc_item_t *item);
+size_t page_item_pos(ohc_item_t *item);
+size_t page_return_item(ohc_item_t *item);
+void page_evict(ohc_page_t *page);
+void page_reclaim(void);
+void page_close(ohc_server_t *s);
+
+int page_load(ohc_server_t *s, ohc_device_t *device, off_t offset);
+int page_load_item(ohc_server_t *s, ohc_item_t *item);
+void page_load_post(void);
+
+#endif
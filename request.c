@@ -6,14 +6,21 @@
  */
 
 #define _XOPEN_SOURCE 500 /* for pwrite */
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <strings.h>
 #include "request.h"
 
 static int connections_total = 0;
 
 static void request_read_request_header(ohc_request_t *r);
 
+/* no TCP_CORK on unix socket */
 static inline void request_cork_set(ohc_request_t *r)
 {
+	if(r->server->listen_path[0]) {
+		return;
+	}
 	set_cork(r->sock_fd, 1);
 	r->cork = 1;
 }
@@ -29,6 +36,11 @@ static inline void request_cork_clear(ohc_request_t *r)
 static void request_reset(ohc_request_t *r)
 {
 	r->item = NULL;
+	r->chunks = NULL;
+	r->chunk_heads = NULL;
+	r->chunk_nr = 0;
+	r->body_len = 0;
+	r->putting = NULL;
 	r->worker_thread = NULL;
 	r->events = 0;
 	r->keepalive = r->server->keepalive_timeout ? 1 : 0;
@@ -36,7 +48,22 @@ static void request_reset(ohc_request_t *r)
 	r->connection_broken = 0;
 	r->cork = 0;
 	r->range_set = 0;
+	r->range_put = 0;
+	r->range_create = 0;
 	r->disk_error = 0;
+	r->validator_etag = 0;
+	r->expect_continue = 0;
+	r->purge_prefix = 0;
+	r->grace = 0;
+	r->refresh = 0;
+	r->batch = 0;
+	r->batch_buf = NULL;
+	r->mc_noreply = 0;
+	r->mc_next = NULL;
+	r->pipelined = 0;
+	r->validator = 0;
+	r->if_none_match.base = NULL;
+	r->if_modified_since = 0;
 	r->output_size = 0;
 	r->input_size = 0;
 	r->event_handler = NULL;
@@ -45,6 +72,7 @@ static void request_reset(ohc_request_t *r)
 	r->host.base = NULL;
 	r->ohc_key.base = NULL;
 	r->range.base = NULL;
+	r->tags.base = NULL;
 	r->content_length = -1;
 	r->http_code = 0;
 	r->expire = 0;
@@ -52,7 +80,9 @@ static void request_reset(ohc_request_t *r)
 	r->error_reason = NULL;
 	r->error_number = 0;
 	r->buf_pos = r->_buffer;
+	r->parse_pos = NULL;
 	r->process_size = 0;
+	r->put_shift = 0;
 
 	/* other members will be set later */
 }
@@ -82,15 +112,43 @@ interupted:
 	return OHC_OK;
 }
 
+/* the chunk of @r->item at @pos, and @pos is set to the offset in it */
+static ohc_item_t *request_chunk_at(ohc_request_t *r, off_t *pos)
+{
+	ohc_item_t *head = r->item;
+	off_t chunk_size, index;
+
+	if(r->chunks == NULL || *pos < head->length) {
+		return head;
+	}
+
+	chunk_size = head->length - head->headers_len;
+	index = (*pos - head->headers_len) / chunk_size;
+	*pos -= head->headers_len + index * chunk_size;
+	return r->chunks[index];
+}
+
+/* Send the item from @start, which is the offset from the stored
+ * headers, to @length, from @process_size. The segments in different
+ * chunks are sent by separate sendfile. */
 static int request_send_file(ohc_request_t *r, off_t start, off_t length)
 {
+	ohc_item_t *item;
+	ohc_device_t *device;
 	ssize_t rc;
-	off_t off;
-	ohc_device_t *device = device_of_item(r->item);
+	off_t off, seg;
 
+next:
 	off = start + r->process_size;
+	item = request_chunk_at(r, &off);
+	device = device_of_item(item);
+	seg = item->length - off;
+	if(seg > length - r->process_size) {
+		seg = length - r->process_size;
+	}
+	off += item->offset;
 interupted:
-	rc = sendfile(r->sock_fd, device->fd, &off, length - r->process_size);
+	rc = sendfile(r->sock_fd, device->fd, &off, seg);
 	if(rc == -1) {
 		if(errno == EAGAIN) {
 			return OHC_AGAIN;
@@ -101,10 +159,10 @@ interupted:
 
 		if(errno == EIO) {
 			r->disk_error = 1;
-			log_error_run(errno, "sendfile server:%d, "
+			log_error_run(errno, "sendfile server:%s, "
 					"device:%s, off:%ld, len:%ld",
-					r->server->listen_port, device->filename,
-					off, length - r->process_size);
+					r->server->listen_name, device->filename,
+					off, seg);
 		} else {
 			r->connection_broken = 1;
 		}
@@ -115,42 +173,165 @@ interupted:
 
 	r->output_size += rc;
 	r->process_size += rc;
-	if(length != r->process_size) {
+	if(rc < seg) {
 		return OHC_AGAIN;
 	}
+	if(length != r->process_size) {
+		goto next;
+	}
 
 	return OHC_OK;
 }
 
+/* Send the left of @buffer, from @process_size. Return OHC_AGAIN if
+ * blocked, and the breakpoint is recorded in @process_size. */
+static int request_send_rest(ohc_request_t *r, char *buffer, ssize_t length)
+{
+	ssize_t rc;
 
-static int request_write_disk(ohc_request_t *r, char *buffer, off_t length)
+interupted:
+	rc = send(r->sock_fd, buffer + r->process_size,
+			length - r->process_size, 0);
+	if(rc < 0) {
+		if(errno == EAGAIN) {
+			return OHC_AGAIN;
+		}
+		if(errno == EINTR) {
+			goto interupted;
+		}
+		r->error_reason = "SendError";
+		r->error_number = errno;
+		r->connection_broken = 1;
+		return OHC_ERROR;
+	}
+
+	r->output_size += rc;
+	r->process_size += rc;
+	return (r->process_size == length) ? OHC_OK : OHC_AGAIN;
+}
+
+/* Read the beginning @length bytes of an item into @buffer.
+ * Packed items are small, so we read them into memory by one pread,
+ * and send them with the response header by one writev, instead of
+ * several sendfile. */
+static int request_read_item(ohc_request_t *r, char *buffer, size_t length)
 {
-	ohc_item_t *item = r->item;
-	ohc_device_t *device;
-	int rc;
+	ssize_t rc;
+	ohc_device_t *device = device_of_item(r->item);
 
-	/* item may be NULL, if we are not going to store the item,
-	 * such as the item is too big, or store it as passby. */
-	if(item == NULL) {
-		goto out;
+interupted:
+	rc = pread(device->fd, buffer, length, r->item->offset);
+	if(rc != length) {
+		if(rc < 0 && errno == EINTR) {
+			goto interupted;
+		}
+		log_error_run(errno, "pread server:%s, device:%s, "
+				"off:%ld, len:%ld, ret:%ld",
+				r->server->listen_name, device->filename,
+				r->item->offset, length, rc);
+		r->disk_error = 1;
+		r->error_reason = "ReadDiskError";
+		r->error_number = errno;
+		return OHC_ERROR;
 	}
+	return OHC_OK;
+}
 
-	device = device_of_item(item);
-	rc = pwrite(device->fd, buffer, length, item->offset + r->process_size);
+/* Send @iov, which is read from a packed item, at the beginning of
+ * response. Return the sent size, or -1 if error. */
+static ssize_t request_send_iovec(ohc_request_t *r, struct iovec *iov, int iovcnt)
+{
+	ssize_t rc;
+
+interupted:
+	rc = writev(r->sock_fd, iov, iovcnt);
+	if(rc < 0) {
+		if(errno == EINTR) {
+			goto interupted;
+		}
+		if(errno == EAGAIN) {
+			return 0;
+		}
+		r->error_reason = "SendError";
+		r->error_number = errno;
+		r->connection_broken = 1;
+		return -1;
+	}
+
+	r->output_size += rc;
+	return rc;
+}
+
+/* write @buffer into @item's block at @offset */
+static int request_pwrite(ohc_request_t *r, ohc_item_t *item, char *buffer,
+		off_t length, off_t offset)
+{
+	ohc_device_t *device = device_of_item(item);
+	struct timeval begin, end;
+	int rc;
+
+	format_rewrite_wait(device);
+	journal_wait(device);
+
+	gettimeofday(&begin, NULL);
+	rc = pwrite(device->fd, buffer, length, offset);
+	gettimeofday(&end, NULL);
+	device_write_latency(device, (end.tv_sec - begin.tv_sec) * 1000000
+			+ (end.tv_usec - begin.tv_usec));
 	if(rc != length) {
-		log_error_run(errno, "pwrite, server:%d, device:%s, "
+		log_error_run(errno, "pwrite, server:%s, device:%s, "
 				"off:%ld, len:%ld, ret:%ld",
-				r->server->listen_port, device->filename,
-				item->offset + r->process_size, length, rc);
+				r->server->listen_name, device->filename,
+				offset, length, rc);
 		r->http_code = 500;
 		r->disk_error = 1;
 		r->error_reason = "WriteDiskError";
 		r->error_number = errno;
 		return OHC_ERROR;
 	}
+	return OHC_OK;
+}
+
+/* tell the GETs reading the item in putting how much is written */
+static void request_putting_update(ohc_request_t *r)
+{
+	if(r->putting) {
+		/* make sure the data is visible before @size */
+		__sync_synchronize();
+		r->putting->size = r->process_size;
+		__sync_synchronize();
+		worker_wake_waiting();
+	}
+}
+
+static int request_write_disk(ohc_request_t *r, char *buffer, off_t length)
+{
+	ohc_item_t *item;
+	off_t pos, seg;
+
+	/* item may be NULL, if we are not going to store the item,
+	 * such as the item is too big, or store it as passby. */
+	if(r->item == NULL) {
+		r->process_size += length;
+		return OHC_OK;
+	}
 
-out:
-	r->process_size += length;
+	/* split into chunks */
+	while(length > 0) {
+		pos = r->process_size + r->put_shift;
+		item = request_chunk_at(r, &pos);
+		seg = item->length - pos;
+		if(seg > length) {
+			seg = length;
+		}
+		if(request_pwrite(r, item, buffer, seg, item->offset + pos) != OHC_OK) {
+			return OHC_ERROR;
+		}
+		buffer += seg;
+		length -= seg;
+		r->process_size += seg;
+	}
+	request_putting_update(r);
 	return OHC_OK;
 }
 
@@ -158,9 +339,11 @@ static void request_do_finalize(ohc_request_t *r)
 {
 	ohc_server_t *s = r->server;
 	FILE *fp = s->access_filp;
+	ssize_t pipelined;
 
 	server_request_finalize(r);
-	event_del(r);
+	event_cancel(r);
+	free(r->batch_buf);
 	s->output_size_current_period += r->output_size;
 	s->input_size_current_period += r->input_size;
 
@@ -169,7 +352,8 @@ static void request_do_finalize(ohc_request_t *r)
 		
 		fprintf(fp, "%s %s %d %ld %s%s %s %s %s",
 			timer_format_log(&master_timer),
-			inet_ntoa(r->client.sin_addr),
+			r->client.sin_family == AF_INET
+				? inet_ntoa(r->client.sin_addr) : "unix",
 			r->http_code,
 			timer_now(&master_timer) - r->start_time,
 			http_methods[r->method].str.base,
@@ -193,7 +377,22 @@ static void request_do_finalize(ohc_request_t *r)
 	}
 
 	if(r->keepalive && !r->connection_broken) {
+		/* pipelined memcached commands, which are processed when
+		 * the socket is writable, i.e. in next loop, but not
+		 * recursively */
+		pipelined = r->mc_next ? r->buf_pos - r->mc_next : 0;
+		if(pipelined > 0) {
+			memmove(r->_buffer, r->mc_next, pipelined);
+		}
+
 		request_reset(r);
+
+		if(pipelined > 0) {
+			r->buf_pos += pipelined;
+			r->pipelined = 1;
+			event_post(r, request_read_request_header);
+			return;
+		}
 		event_add_keepalive(r, request_read_request_header);
 		return;
 	}
@@ -209,8 +408,11 @@ static void request_finalize(ohc_request_t *r)
 {
 	if(!r->connection_broken && r->output_size == 0) {
 		/* don't check @request_send_buffer's return, for simple.*/
-		string_t *page = http_code_page(r->http_code);
-		request_send_buffer(r, page->base, page->len);
+		string_t *page = r->server->memcached ? memcache_reply(r)
+				: http_code_page(r->http_code);
+		if(page != NULL) {
+			request_send_buffer(r, page->base, page->len);
+		}
 	}
 
 	if(r->worker_thread) {
@@ -226,14 +428,21 @@ static void request_put_read_request_body(ohc_request_t *r)
 #define RECV_BUF_SIZE (100*1024)
 	char buf[RECV_BUF_SIZE];
 	size_t item_len = r->content_length + r->put_header_length;
+	size_t size;
+	int i;
 
 	r->step = "ReadBody";
 
 	/* receive from socket, and write into disk file */
 	while(r->process_size < item_len) {
 
-		/* receive */
-		rc = recv(r->sock_fd, buf, RECV_BUF_SIZE, 0);
+		/* receive. Not beyond the data block of memcached, since
+		 * the following commands may be pipelined. */
+		size = RECV_BUF_SIZE;
+		if(r->server->memcached && size > item_len - r->process_size) {
+			size = item_len - r->process_size;
+		}
+		rc = recv(r->sock_fd, buf, size, 0);
 		if(rc == -1) {
 			if(errno == EAGAIN) {
 				goto again;
@@ -266,6 +475,21 @@ static void request_put_read_request_body(ohc_request_t *r)
 		}
 	}
 
+	/* the body is finished, so re-write the head. The partial item's
+	 * head is re-written by master when all ranges are filled. */
+	if(r->item != NULL && !r->range_put) {
+		for(i = 1; i < r->chunk_nr; i++) {
+			format_item_head_flags(&r->chunk_heads[i],
+					device_of_item(r->chunks[i]), 0);
+			request_pwrite(r, r->chunks[i], (char *)&r->chunk_heads[i],
+					OHC_ITEM_HEAD_SIZE, item_block_offset(r->chunks[i]));
+		}
+		format_item_head_flags(&r->item_head,
+				device_of_item(r->item), 0);
+		request_pwrite(r, r->item, (char *)&r->item_head, OHC_ITEM_HEAD_SIZE,
+				item_block_offset(r->item));
+	}
+
 finish:
 	request_finalize(r);
 	return;
@@ -278,39 +502,98 @@ again:
 
 static void request_put_read_request_body_preread(ohc_request_t *r)
 {
-	ssize_t len;
+	ssize_t len, hlen;
 	ssize_t rc;
-	char buffer[REQ_BUF_SIZE];
+	char buffer[OHC_ITEM_HEAD_SIZE + REQ_BUF_SIZE];
+	char *headers = buffer + OHC_ITEM_HEAD_SIZE;
 	int i;
 	string_t *s;
 
 	r->step = "PreReadBody";
 
-	len = http_make_200_response_header(r->content_length, buffer);
+	len = http_make_200_response_header(r->range_put ? r->range_total
+			: r->content_length, headers);
 	for(i = 0; i < r->put_header_nr; i++) {
 		s = &r->put_headers[i];
-		memcpy(buffer + len, s->base, s->len);
+		memcpy(headers + len, s->base, s->len);
 		len += s->len;
 	}
 
-	rc = request_write_disk(r, buffer, len);
-	if(rc == OHC_ERROR) {
-		request_finalize(r);
-		return;
+	/* write the item's head and the headers by one pwrite, with the
+	 * pre-read body. But for PUT with Content-Range, the headers are
+	 * written only if it creates the item, and the body is written
+	 * at the range's place. */
+	hlen = r->range_put ? r->put_header_length : len;
+	if(r->item != NULL && (!r->range_put || r->range_create)) {
+		memcpy(buffer, &r->item_head, OHC_ITEM_HEAD_SIZE);
+		rc = request_pwrite(r, r->item, buffer, OHC_ITEM_HEAD_SIZE + hlen,
+				item_block_offset(r->item));
+		if(rc == OHC_ERROR) {
+			request_finalize(r);
+			return;
+		}
+	}
+	r->process_size += hlen;
+	request_putting_update(r);
+
+	/* the chunks' heads, in putting too */
+	for(i = 1; i < r->chunk_nr; i++) {
+		rc = request_pwrite(r, r->chunks[i], (char *)&r->chunk_heads[i],
+				OHC_ITEM_HEAD_SIZE, item_block_offset(r->chunks[i]));
+		if(rc == OHC_ERROR) {
+			request_finalize(r);
+			return;
+		}
+	}
+
+	if(r->range_put) {
+		r->put_shift = r->range_start - r->put_header_length
+			+ (r->item ? r->item->headers_len : r->put_header_length);
+		rc = request_write_disk(r, headers + hlen, len - hlen);
+		if(rc == OHC_ERROR) {
+			request_finalize(r);
+			return;
+		}
 	}
 
 	request_put_read_request_body(r);
 }
 
+/* send a packed item. If blocked, send the left by sendfile later. */
+static int request_get_write_response_packed(ohc_request_t *r, size_t length)
+{
+	char buffer[OHC_PAGE_SIZE];
+	struct iovec iov;
+	ssize_t rc;
+
+	if(request_read_item(r, buffer, length) != OHC_OK) {
+		return OHC_ERROR;
+	}
+
+	iov.iov_base = buffer;
+	iov.iov_len = length;
+	rc = request_send_iovec(r, &iov, 1);
+	if(rc < 0) {
+		return OHC_ERROR;
+	}
+
+	r->process_size += rc;
+	return (rc == length) ? OHC_OK : OHC_AGAIN;
+}
+
 static void request_get_write_response(ohc_request_t *r)
 {
 	int rc;
+	size_t length = r->item->headers_len
+			+ (r->method == OHC_HTTP_METHOD_HEAD ? 0 : r->body_len);
 
 	r->step = "WriteResponse";
 
-	rc = request_send_file(r, r->item->offset,
-			(r->method == OHC_HTTP_METHOD_HEAD)
-			? r->item->headers_len : r->item->length);
+	if(r->item->packed && r->process_size == 0) {
+		rc = request_get_write_response_packed(r, length);
+	} else {
+		rc = request_send_file(r, 0, length);
+	}
 
 	if(rc == OHC_AGAIN) {
 		event_add_write(r, request_get_write_response);
@@ -319,13 +602,55 @@ static void request_get_write_response(ohc_request_t *r)
 	}
 }
 
+/* send the item in putting as far as it's written, and wait for more
+ * if all written is sent, until the PUT finishs. If the PUT fails, the
+ * connection is closed, since the response is not complete. */
+static void request_get_write_response_putting(ohc_request_t *r)
+{
+	ohc_putting_t *putting = r->putting;
+	size_t length = r->item->headers_len
+			+ (r->method == OHC_HTTP_METHOD_HEAD ? 0 : r->body_len);
+	size_t written;
+	int aborted, rc = OHC_OK;
+
+	r->step = "WritePutting";
+
+	/* the size is final if aborted */
+	aborted = putting->aborted;
+	__sync_synchronize();
+	written = putting->size;
+	if(written > length) {
+		written = length;
+	}
+
+	if(written > r->process_size) {
+		rc = request_send_file(r, 0, written);
+	}
+	if(rc == OHC_AGAIN) {
+		event_add_write(r, request_get_write_response_putting);
+		return;
+	}
+	if(rc == OHC_ERROR || r->process_size == length) {
+		request_finalize(r);
+		return;
+	}
+
+	if(aborted) {
+		r->error_reason = "PutAborted";
+		r->connection_broken = 1;
+		request_finalize(r);
+		return;
+	}
+	worker_request_wait(r, request_get_write_response_putting);
+}
+
 static void request_get_write_response_206_body(ohc_request_t *r)
 {
 	int rc;
 
 	r->step = "WriteBody";
 
-	rc = request_send_file(r, r->item->offset + r->item->headers_len + r->range_start,
+	rc = request_send_file(r, r->item->headers_len + r->range_start,
 			r->range_end - r->range_start + 1);
 
 	request_cork_clear(r);
@@ -340,13 +665,12 @@ static void request_get_write_response_206_body(ohc_request_t *r)
 static void request_get_write_response_206_header_disk(ohc_request_t *r)
 {
 	ohc_item_t *item = r->item;
-	ssize_t body_len = item->length - item->headers_len;
-	ssize_t off = http_make_200_response_header(body_len, NULL);
+	ssize_t off = http_make_200_response_header(r->body_len, NULL);
 	int rc;
 
 	r->step = "WriteHeaderDisk";
 
-	rc = request_send_file(r, item->offset + off, item->headers_len - off);
+	rc = request_send_file(r, off, item->headers_len - off);
 
 	if(rc == OHC_AGAIN) {
 		request_cork_clear(r);
@@ -370,35 +694,223 @@ static void request_get_write_response_206_header_disk(ohc_request_t *r)
 	}
 }
 
+/* send the 206 response of a packed item, by one pread and one writev.
+ * If blocked in body, send the left by sendfile later. */
+static void request_get_write_response_206_packed(ohc_request_t *r,
+		char *header, ssize_t header_len)
+{
+	ohc_item_t *item = r->item;
+	char buffer[OHC_PAGE_SIZE];
+	struct iovec iov[3];
+	ssize_t off = http_make_200_response_header(r->body_len, NULL);
+	ssize_t rc, head_size, total;
+	int iovcnt = 2;
+
+	r->step = "WritePacked";
+
+	if(request_read_item(r, buffer, (r->method == OHC_HTTP_METHOD_HEAD)
+				? item->headers_len
+				: item->headers_len + r->range_end + 1) != OHC_OK) {
+		request_finalize(r);
+		return;
+	}
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_len;
+	iov[1].iov_base = buffer + off;
+	iov[1].iov_len = item->headers_len - off;
+	head_size = total = iov[0].iov_len + iov[1].iov_len;
+	if(r->method != OHC_HTTP_METHOD_HEAD) {
+		iov[2].iov_base = buffer + item->headers_len + r->range_start;
+		iov[2].iov_len = r->range_end - r->range_start + 1;
+		total += iov[2].iov_len;
+		iovcnt = 3;
+	}
+
+	rc = request_send_iovec(r, iov, iovcnt);
+	if(rc < 0) {
+		request_finalize(r);
+		return;
+	}
+
+	/* as request_send_buffer(), we assume that the headers are not blocked */
+	if(rc < head_size) {
+		log_error_run(0, "request_send_iovec() blocks: %ld %ld", head_size, rc);
+		r->error_reason = "SendError";
+		r->connection_broken = 1;
+		request_finalize(r);
+		return;
+	}
+
+	if(rc == total) {
+		request_finalize(r);
+		return;
+	}
+
+	r->process_size = rc - head_size;
+	event_add_write(r, request_get_write_response_206_body);
+}
+
+/* send the parts of multipart/byteranges response one by one. Each
+ * part is a generated header and a sendfile segment, and the closing
+ * boundary is at last. */
+static void request_get_write_response_multi_body(ohc_request_t *r)
+{
+	ohc_item_t *item = r->item;
+	ohc_range_t *range;
+	char buffer[HTTP_PART_HEADER_SIZE];
+	ssize_t length;
+	int rc;
+
+	r->step = "WriteParts";
+
+	while(1) {
+		range = (r->range_index < r->range_nr)
+			? &r->ranges[r->range_index] : NULL;
+
+		if(!r->range_body) {
+			length = http_make_part_header(range, r->body_len,
+					r->range_boundary, r->range_type, buffer);
+			rc = request_send_rest(r, buffer, length);
+			if(rc != OHC_OK) {
+				break;
+			}
+			r->process_size = 0;
+			if(range == NULL) {
+				break;
+			}
+			r->range_body = 1;
+		}
+
+		rc = request_send_file(r, item->headers_len + range->start,
+				range->end - range->start + 1);
+		if(rc != OHC_OK) {
+			break;
+		}
+		r->process_size = 0;
+		r->range_body = 0;
+		r->range_index++;
+	}
+
+	if(rc == OHC_AGAIN) {
+		event_add_write(r, request_get_write_response_multi_body);
+	} else { /* rc == OHC_OK || rc == OHC_ERROR */
+		request_cork_clear(r);
+		request_finalize(r);
+	}
+}
+
+/* send the header of multipart/byteranges response. The stored headers
+ * are read from the item, and the Content-Type is moved into parts. */
+static void request_get_write_response_multi_header(ohc_request_t *r)
+{
+	ohc_item_t *item = r->item;
+	ssize_t off = http_make_200_response_header(r->body_len, NULL);
+	char stored[REQ_BUF_SIZE + 100];
+	char buffer[REQ_BUF_SIZE + 300];
+	char part[HTTP_PART_HEADER_SIZE];
+	char *p, *q, *end, *value;
+	ssize_t length, total;
+	int i;
+
+	r->step = "WriteHeaderMulti";
+
+	if(request_read_item(r, stored, item->headers_len) != OHC_OK) {
+		request_finalize(r);
+		return;
+	}
+
+	for(i = 0; i < 8; i++) {
+		sprintf(r->range_boundary + i * 2, "%02x", item->hnode.id[i]);
+	}
+
+	/* pick Content-Type out of the stored headers */
+	r->range_type[0] = '\0';
+	length = 0;
+	p = stored + off;
+	end = stored + item->headers_len;
+	while(p < end) {
+		q = memchr(p, '\n', end - p);
+		q = q ? q + 1 : end;
+		if(strncasecmp(p, "Content-Type:", 13) == 0) {
+			value = p + 13;
+			while(*value == ' ') value++;
+			if(q - value - 2 > 0 && q - value - 2 < REQ_RANGE_TYPE_SIZE) {
+				memcpy(r->range_type, value, q - value - 2);
+				r->range_type[q - value - 2] = '\0';
+			}
+		} else {
+			memmove(stored + off + length, p, q - p);
+			length += q - p;
+		}
+		p = q;
+	}
+
+	/* Content-Length */
+	total = http_make_part_header(NULL, r->body_len, r->range_boundary,
+			r->range_type, part);
+	for(i = 0; i < r->range_nr; i++) {
+		total += http_make_part_header(&r->ranges[i], r->body_len,
+				r->range_boundary, r->range_type, part);
+		total += r->ranges[i].end - r->ranges[i].start + 1;
+	}
+
+	total = http_make_multi_206_response_header(total, r->range_boundary, buffer);
+	total += http_make_refresh_header(r->refresh, buffer + total);
+	memcpy(buffer + total, stored + off, length);
+	total += length;
+
+	if(r->method == OHC_HTTP_METHOD_HEAD) {
+		request_send_buffer(r, buffer, total);
+		request_finalize(r);
+		return;
+	}
+
+	request_cork_set(r);
+	if(request_send_buffer(r, buffer, total) != OHC_OK) {
+		request_cork_clear(r);
+		request_finalize(r);
+		return;
+	}
+
+	r->process_size = 0;
+	r->range_index = 0;
+	r->range_body = 0;
+	request_get_write_response_multi_body(r);
+}
+
 static void request_get_write_response_206_header_mem(ohc_request_t *r)
 {
 	int rc;
 	char buffer[1000];
 	ssize_t length;
-	ssize_t body_len = r->item->length - r->item->headers_len;
+	ssize_t body_len = r->body_len;
 
 	r->step = "WriteHeaderMem";
 
-	if(r->range_start == RANGE_NO_SET) {
-		r->range_start = r->range_end > body_len
-			? 0 : body_len - r->range_end;
-		r->range_end = body_len - 1;
-	} else if(r->range_end == RANGE_NO_SET) {
-		r->range_end = body_len - 1;
-	} else if(r->range_end >= body_len) {
-		r->range_end = body_len - 1;
-	} else {}
-
-	if(r->range_start >= body_len) {
+	r->range_nr = http_ranges_settle(r->ranges, r->range_nr, body_len);
+	if(r->range_nr == 0) {
 		r->http_code = 416;
 		request_finalize(r);
 		return;
 	}
-
-	request_cork_set(r);
+	if(r->range_nr > 1) {
+		request_get_write_response_multi_header(r);
+		return;
+	}
+	r->range_start = r->ranges[0].start;
+	r->range_end = r->ranges[0].end;
 
 	length = http_make_206_response_header(r->range_start,
 			r->range_end, body_len, buffer);
+	length += http_make_refresh_header(r->refresh, buffer + length);
+
+	if(r->item->packed) {
+		request_get_write_response_206_packed(r, buffer, length);
+		return;
+	}
+
+	request_cork_set(r);
 	rc = request_send_buffer(r, buffer, length);
 	if(rc != OHC_OK) {
 		request_finalize(r);
@@ -408,16 +920,257 @@ static void request_get_write_response_206_header_mem(ohc_request_t *r)
 	request_get_write_response_206_header_disk(r);
 }
 
-static void request_read_request_header(ohc_request_t *r)
+/* send the 200 response with the refresh hint. As the 206 response,
+ * the status line and Content-Length are made in memory, and the left
+ * stored headers and the body are sent from disk. */
+static void request_get_write_response_refresh(ohc_request_t *r)
+{
+	char buffer[200];
+	ssize_t length;
+
+	r->step = "WriteHeaderRefresh";
+
+	length = http_make_200_response_header(r->body_len, buffer);
+	length += http_make_refresh_header(r->refresh, buffer + length);
+
+	request_cork_set(r);
+	if(request_send_buffer(r, buffer, length) != OHC_OK) {
+		request_cork_clear(r);
+		request_finalize(r);
+		return;
+	}
+
+	r->range_start = 0;
+	r->range_end = r->body_len - 1;
+	request_get_write_response_206_header_disk(r);
+}
+
+/* send the response of BATCH in @batch_buf, from @process_size */
+static void request_batch_write_response(ohc_request_t *r)
+{
+	int rc;
+
+	r->step = "WriteBatch";
+
+	rc = request_send_rest(r, r->batch_buf, r->batch_len);
+	if(rc == OHC_AGAIN) {
+		event_add_write(r, request_batch_write_response);
+	} else { /* rc == OHC_OK || rc == OHC_ERROR */
+		request_finalize(r);
+	}
+}
+
+/* run the BATCH on the keys in @batch_buf. The response body is made
+ * after REQ_BATCH_HEADER_SIZE of the output buffer, and the header
+ * just before it. */
+static void request_batch_process(ohc_request_t *r)
+{
+	char header[REQ_BATCH_HEADER_SIZE];
+	char *output, *p, *end;
+	ssize_t len, hlen, nr = 1;
+
+	r->step = "ProcessBatch";
+
+	end = r->batch_buf + r->batch_len;
+	for(p = r->batch_buf; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+		nr++;
+	}
+
+	output = malloc(REQ_BATCH_HEADER_SIZE + nr * SERVER_BATCH_LINE);
+	if(output == NULL) {
+		r->http_code = 500;
+		r->error_reason = "NoMem";
+		request_finalize(r);
+		return;
+	}
+
+	len = server_request_batch_handler(r, r->batch_buf, r->batch_len,
+			output + REQ_BATCH_HEADER_SIZE);
+	free(r->batch_buf);
+	r->batch_buf = output;
+	if(len < 0) {
+		r->http_code = 400;
+		request_finalize(r);
+		return;
+	}
+
+	hlen = http_make_200_response_header(len, header);
+	hlen += sprintf(header + hlen, "\r\n");
+	memcpy(output + REQ_BATCH_HEADER_SIZE - hlen, header, hlen);
+
+	r->http_code = 200;
+	r->process_size = REQ_BATCH_HEADER_SIZE - hlen;
+	r->batch_len = REQ_BATCH_HEADER_SIZE + len;
+	request_batch_write_response(r);
+}
+
+/* receive the keys of BATCH into @batch_buf, which is small, so in
+ * master without worker. */
+static void request_batch_read_request_body(ohc_request_t *r)
+{
+	ssize_t rc;
+
+	r->step = "ReadBatch";
+
+	while(r->batch_len < r->content_length) {
+		rc = recv(r->sock_fd, r->batch_buf + r->batch_len,
+				r->content_length - r->batch_len, 0);
+		if(rc == -1) {
+			if(errno == EAGAIN) {
+				event_add_read(r, request_batch_read_request_body);
+				return;
+			}
+			if(errno == EINTR) {
+				continue;
+			}
+			r->connection_broken = 1;
+			r->error_reason = "ReceiveError";
+			r->error_number = errno;
+			request_finalize(r);
+			return;
+		}
+		if(rc == 0) {
+			r->error_reason = "ClientClose";
+			r->connection_broken = 1;
+			request_finalize(r);
+			return;
+		}
+		r->batch_len += rc;
+		r->input_size += rc;
+	}
+
+	request_batch_process(r);
+}
+
+/* send "END" of memcached get */
+static void request_memcache_write_end(ohc_request_t *r)
 {
+	string_t *page = memcache_reply(r);
 	int rc;
 
+	r->step = "WriteEnd";
+
+	rc = request_send_rest(r, page->base, page->len);
+	if(rc == OHC_AGAIN) {
+		event_add_write(r, request_memcache_write_end);
+	} else { /* rc == OHC_OK || rc == OHC_ERROR */
+		request_finalize(r);
+	}
+}
+
+static void request_memcache_get_next(ohc_request_t *r);
+
+/* send a value of memcached get: the "VALUE" line, the body by sendfile,
+ * and "\r\n", by @mc_step. Then back to master for the next key. */
+static void request_memcache_write_value(ohc_request_t *r)
+{
+	char headers[REQ_BUF_SIZE];
+	ssize_t len;
+	int rc = OHC_OK;
+
+	r->step = "WriteValue";
+
+	switch(r->mc_step) {
+	case 0:
+		if(r->mc_line_len == 0) {
+			len = r->item->headers_len;
+			if(len > REQ_BUF_SIZE - 1) {
+				len = REQ_BUF_SIZE - 1;
+			}
+			if(request_read_item(r, headers, len) != OHC_OK) {
+				rc = OHC_ERROR;
+				break;
+			}
+			headers[len] = '\0';
+			r->mc_line_len = memcache_make_value_line(r, headers);
+			request_cork_set(r);
+		}
+		rc = request_send_rest(r, r->mc_line, r->mc_line_len);
+		if(rc != OHC_OK) {
+			break;
+		}
+		r->process_size = 0;
+		r->mc_step = 1;
+		/* fall through */
+	case 1:
+		rc = request_send_file(r, r->item->headers_len, r->body_len);
+		if(rc != OHC_OK) {
+			break;
+		}
+		r->process_size = 0;
+		r->mc_step = 2;
+		/* fall through */
+	case 2:
+		rc = request_send_rest(r, "\r\n", 2);
+	}
+
+	if(rc == OHC_AGAIN) {
+		event_add_write(r, request_memcache_write_value);
+		return;
+	}
+	request_cork_clear(r);
+	if(rc == OHC_ERROR) {
+		request_finalize(r);
+		return;
+	}
+	worker_request_return(r, request_memcache_get_next);
+}
+
+/* serve the keys of memcached get one by one. The item of the last
+ * key is released here, after its value is sent by worker. Items in
+ * putting are missed, since the value can not be sent partly. */
+static void request_memcache_get_next(ohc_request_t *r)
+{
+	r->step = "GetNext";
+
+	server_request_finalize(r);
+
+	while(memcache_next_key(r) == OHC_OK) {
+		if(server_request_get_handler(r) != OHC_OK) {
+			continue;
+		}
+		if(r->putting) {
+			server_request_finalize(r);
+			continue;
+		}
+
+		r->process_size = 0;
+		r->mc_step = 0;
+		r->mc_line_len = 0;
+		if(worker_request_dispatch(r, request_memcache_write_value) != OHC_OK) {
+			r->http_code = 500;
+			r->error_reason = "TooBusy";
+			r->error_number = errno;
+			request_finalize(r);
+		}
+		return;
+	}
+
+	r->http_code = 200;
+	r->process_size = 0;
+	request_memcache_write_end(r);
+}
+
+static void request_read_request_header(ohc_request_t *r)
+{
+	char buffer[REQ_BUF_SIZE + 100];
+	char *body;
+	ssize_t length, size;
+	string_t *page;
+	int rc, received = 0;
+
 	r->step = "ReadHeader";
 
+	if(r->pipelined) {
+		r->pipelined = 0;
+		r->active = 1;
+		goto parse;
+	}
+
 	/* receive */
 interupted:
-	rc = recv(r->sock_fd, r->buf_pos,
-			r->_buffer + REQ_BUF_SIZE - r->buf_pos - 1, 0);
+	size = r->_buffer + REQ_BUF_SIZE - r->buf_pos - 1;
+	rc = recv(r->sock_fd, r->buf_pos, size, 0);
 	if(rc == -1) {
 		if(errno == EAGAIN) {
 			goto again;
@@ -439,9 +1192,17 @@ interupted:
 	r->active = 1;
 	r->buf_pos += rc;
 	r->input_size += rc;
+	received = 1;
+
+	/* drained, see event_add_keepalive() */
+	if(rc < size) {
+		r->ready_read = 0;
+	}
 
 	/* http parse */
-	rc = http_request_parse(r);
+parse:
+	rc = r->server->memcached ? memcache_request_parse(r)
+			: http_request_parse(r);
 	if(rc == OHC_AGAIN) {
 
 		/* request is too huge */
@@ -451,6 +1212,10 @@ interupted:
 			goto fail;
 		}
 
+		/* the pipelined command is not complete */
+		if(!received) {
+			goto interupted;
+		}
 		goto again;
 	}
 	if(rc == OHC_ERROR) {
@@ -462,15 +1227,35 @@ interupted:
 	switch(r->method) {
 	case OHC_HTTP_METHOD_GET:
 	case OHC_HTTP_METHOD_HEAD:
+		if(r->server->memcached) {
+			request_memcache_get_next(r);
+			break;
+		}
+
 		rc = server_request_get_handler(r);
 		if(rc == OHC_ERROR) {
 			r->http_code = 404;
 			goto fail;
 		}
 
-		if(r->range_set) {
+		/* conditional GET, answered without worker or disk */
+		length = http_make_304_response_header(r, r->item, buffer);
+		if(length > 0) {
+			r->http_code = 304;
+			request_send_buffer(r, buffer, length);
+			request_finalize(r);
+			break;
+		}
+
+		if(r->putting) {
+			r->http_code = 200;
+			rc = worker_request_dispatch(r, request_get_write_response_putting);
+		} else if(r->range_set) {
 			r->http_code = 206;
 			rc = worker_request_dispatch(r, request_get_write_response_206_header_mem);
+		} else if(r->refresh) {
+			r->http_code = 200;
+			rc = worker_request_dispatch(r, request_get_write_response_refresh);
 		} else {
 			r->http_code = 200;
 			rc = worker_request_dispatch(r, request_get_write_response);
@@ -492,7 +1277,10 @@ interupted:
 		}
 		if(rc == OHC_DECLINE) {
 			r->http_code = 204;
-			if(r->server->shutdown_if_not_store) {
+
+			/* if the client waits for "100 Continue", reply now and
+			 * close, since it may send the body or not. */
+			if(r->server->shutdown_if_not_store || r->expect_continue) {
 				r->keepalive = 0;
 				goto fail;
 			}
@@ -500,6 +1288,16 @@ interupted:
 			r->http_code = 201;
 		}
 
+		/* the interim response is not counted in @output_size,
+		 * so the final one is still sent by request_finalize(). */
+		if(r->expect_continue) {
+			page = http_code_page(100);
+			if(request_send_buffer(r, page->base, page->len) != OHC_OK) {
+				goto fail;
+			}
+			r->output_size -= page->len;
+		}
+
 		rc = worker_request_dispatch(r, request_put_read_request_body_preread);
 		if(rc == OHC_ERROR) {
 			r->http_code = 500;
@@ -511,7 +1309,22 @@ interupted:
 
 	case OHC_HTTP_METHOD_PURGE:
 	case OHC_HTTP_METHOD_DELETE:
-		rc = server_request_delete_handler(r);
+		if(r->method == OHC_HTTP_METHOD_PURGE
+				&& (r->tags.base || r->purge_prefix)) {
+			rc = tag_purge(r);
+		} else {
+			rc = server_request_delete_handler(r);
+		}
+		if(rc == OHC_ERROR) {
+			r->http_code = 404;
+			goto fail;
+		}
+		r->http_code = 204;
+		request_finalize(r);
+		break;
+
+	case OHC_HTTP_METHOD_TOUCH:
+		rc = server_request_touch_handler(r);
 		if(rc == OHC_ERROR) {
 			r->http_code = 404;
 			goto fail;
@@ -520,8 +1333,24 @@ interupted:
 		request_finalize(r);
 		break;
 
-	default:
-		;
+	case OHC_HTTP_METHOD_BATCH:
+		r->batch_buf = malloc(r->content_length + 1);
+		if(r->batch_buf == NULL) {
+			r->http_code = 500;
+			r->error_reason = "NoMem";
+			goto fail;
+		}
+
+		/* the pre-read keys */
+		body = strstr(r->_buffer, "\r\n\r\n") + 4;
+		r->batch_len = r->buf_pos - body;
+		memcpy(r->batch_buf, body, r->batch_len);
+
+		request_batch_read_request_body(r);
+		break;
+
+	default: /* memcached version and quit */
+		request_finalize(r);
 	}
 
 	return;
@@ -542,7 +1371,8 @@ void request_process_entry(ohc_server_t *s, int sock_fd, struct sockaddr_in *cli
 	ohc_request_t *r;
 
 	if(s->connections >= s->connections_limit) {
-		log_error_run(0, "exceed connections limit in server %d", s->listen_port);
+		log_error_run(0, "exceed connections limit in server %s",
+				s->listen_name);
 		close(sock_fd);
 		return;
 	}
@@ -561,6 +1391,9 @@ void request_process_entry(ohc_server_t *s, int sock_fd, struct sockaddr_in *cli
 	r->server = s;
 	r->sock_fd = sock_fd;
 	r->client = *client;
+	r->registered = 0;
+	r->ready_read = 0;
+	r->ready_write = 0;
 
 	request_reset(r);
 
@@ -11,6 +11,38 @@
 #include "olivehc.h"
 
 #define REQ_BUF_SIZE	4096
+
+/* at most ranges in one GET, and the server's @max_ranges is not
+ * larger than this */
+#define REQ_RANGES_LIMIT	32
+
+/* the stored Content-Type longer than this is not in the parts of
+ * multipart/byteranges response */
+/* ohc_request_t.refresh, the client should refresh the item */
+#define REQ_REFRESH_EARLY	1 /* near expire */
+#define REQ_REFRESH_STALE	2 /* expired, but still served */
+
+#define REQ_RANGE_TYPE_SIZE	100
+
+/* ohc_request_t.batch, the operation of BATCH request */
+#define REQ_BATCH_EXISTS	1
+#define REQ_BATCH_DELETE	2
+#define REQ_BATCH_TOUCH		3
+
+/* the body of BATCH request at most */
+#define REQ_BATCH_BODY_MAX	(1024 * 1024)
+
+/* room for the header of BATCH response */
+#define REQ_BATCH_HEADER_SIZE	100
+
+/* a "VALUE" line of memcached, or the stored header of flags */
+#define REQ_MC_LINE_SIZE	300
+
+struct ohc_range_s {
+	ssize_t		start;
+	ssize_t		end;
+};
+
 /* a request, include its downstream connection */
 struct ohc_request_s {
 	ohc_server_t	*server;
@@ -20,19 +52,38 @@ struct ohc_request_s {
 	ohc_worker_t	*worker_thread;
 
 	unsigned	events:2;
+	unsigned	registered:1; /* in the epoll of its thread, see event.c */
+	unsigned	ready_read:1;
+	unsigned	ready_write:1;
 	unsigned	keepalive:1;
 	unsigned	active:1;
 	unsigned	connection_broken:1;
 	unsigned	cork:1;
 	unsigned	range_set:1;
+	unsigned	range_body:1;
+	unsigned	range_put:1; /* PUT with Content-Range */
+	unsigned	range_create:1; /* the PUT with Content-Range creates item */
 	unsigned	disk_error:1;
+	unsigned	validator_etag:1;
+	unsigned	expect_continue:1; /* PUT with "Expect: 100-continue" */
+	unsigned	purge_prefix:1; /* PURGE with OHC-Prefix, see tag.c */
+	unsigned	grace:1; /* GET with OHC-Grace, see server_item_stale() */
+	unsigned	refresh:2; /* REQ_REFRESH_*, hint in response */
+	unsigned	batch:2; /* REQ_BATCH_* */
+	unsigned	mc_noreply:1; /* memcached command with "noreply" */
+	unsigned	mc_step:2; /* of sending a value, see memcache.c */
+	unsigned	pipelined:1; /* the next command is in buffer */
 
 	/* request line and headers */
 	int		method;
 	ssize_t		content_length;
 	ssize_t		range_start;
 	ssize_t		range_end;
+	ssize_t		range_total; /* in PUT with Content-Range */
 	string_t	range;
+	string_t	tags; /* OHC-Tag or Surrogate-Key */
+	ohc_range_t	ranges[REQ_RANGES_LIMIT];
+	int		range_nr;
 	string_t	uri;
 	string_t	host;
 	string_t	ohc_key;
@@ -40,13 +91,50 @@ struct ohc_request_s {
 	int		put_header_nr;
 	int		put_header_length;
 	time_t		expire;
+	uint32_t	validator; /* ETag or Last-Modified of PUT */
+	string_t	if_none_match;
+	time_t		if_modified_since;
+
+	/* written before the item, by worker thread */
+	ohc_item_head_t	item_head;
+
+	/* chunks of a chunked item, and their heads in PUT.
+	 * @chunks[0] is @item. See server_chunks_put(). */
+	ohc_item_t	**chunks;
+	ohc_item_head_t	*chunk_heads;
+	int		chunk_nr;
+
+	/* the body length of the whole item */
+	ssize_t		body_len;
+
+	/* the written size of item in putting, see ohc_putting_t */
+	ohc_putting_t	*putting;
 
 	time_t		start_time;
 
+	/* BATCH request, the keys in body, and then the response */
+	char		*batch_buf;
+	ssize_t		batch_len;
+
+	/* memcached, the keys left of get, and the next command */
+	string_t	mc_keys;
+	char		*mc_next;
+	ssize_t		mc_line_len;
+	char		mc_line[REQ_MC_LINE_SIZE];
+
+	/* multipart/byteranges response, the part in sending */
+	int		range_index;
+	char		range_boundary[17];
+	char		range_type[REQ_RANGE_TYPE_SIZE];
+
 	/* in GET, record sendfile process size;
 	 * in PUT, record recv item process size. */
 	size_t		process_size;
 
+	/* in PUT with Content-Range, from @process_size to the position
+	 * in item */
+	off_t		put_shift;
+
 	size_t		output_size;
 	size_t		input_size;
 
@@ -60,6 +148,9 @@ struct ohc_request_s {
 	char		*buf_pos;
 	char		_buffer[REQ_BUF_SIZE];
 
+	/* the header line to go on parsing, see http_request_parse() */
+	char		*parse_pos;
+
 	int			sock_fd;
 	struct sockaddr_in	client;
 
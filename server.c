@@ -6,15 +6,64 @@
  *
  */
 
+#include <openssl/md5.h>
 #include "server.h"
 
 
-static ohc_slab_t item_slab = OHC_SLAB_INIT(ohc_item_t);
+/* sequence of stored items, see @seq in ohc_item_s */
+static unsigned item_seq = 0;
 
 static LIST_HEAD(servers);
 static LIST_HEAD(deleted_servers);
 
-static LIST_HEAD(shared_lru_head);
+/* set after the servers in item table are attached */
+static int server_attached = 0;
+
+/* ranks re-ordered in each loop, after loaded */
+#define SERVER_REORDER_BATCH 10000
+
+/* ID of an item deleted while loading items from devices, so the
+ * old one in device will not be loaded later. */
+typedef struct {
+	ohc_hash_node_t		hnode;
+	struct list_head	node;
+} ohc_load_deleted_t;
+
+static ohc_slab_t load_deleted_slab = OHC_SLAB_INIT(ohc_load_deleted_t);
+
+/* the filled ranges of a partial item, which is filled by PUTs with
+ * Content-Range. In the server's @partials, by the item's ID. */
+typedef struct {
+	ohc_hash_node_t		hnode;
+	unsigned		creating:1; /* the PUT creating the item is in process */
+	int			nr;
+	ohc_range_t		filled[SERVER_PARTIAL_RANGES + 1];
+} ohc_partial_t;
+
+static ohc_slab_t partial_slab = OHC_SLAB_INIT(ohc_partial_t);
+
+static ohc_slab_t putting_slab = OHC_SLAB_INIT(ohc_putting_t);
+
+/* LRU position of an item loaded from dump. The LRU is re-ordered by
+ * them after all devices are loaded. @device_index, @offset and @hits
+ * are used to check whether the item is changed since loaded. */
+typedef struct {
+	unsigned char	hash_id[16];
+	uint32_t	rank;
+	short		server_index;
+	short		device_index;
+	off_t		offset;
+	unsigned short	hits;
+} ohc_load_rank_t;
+
+static ohc_load_rank_t *load_ranks = NULL;
+static long load_rank_nr = 0;
+static long load_rank_size = 0;
+static long load_rank_done = 0;
+static int load_finished = 0;
+
+/* the number of hottest items to be read into page cache after loaded */
+static long prewarm_items;
 
 /* this makes things complicated, but it's useful for saving
  * memory, in ohc_item_t. */
@@ -25,15 +74,41 @@ ohc_server_t *server_of_item(ohc_item_t *item)
 	return idx_pointer_get(&server_indexs, item->server_index);
 }
 
-void server_dump_ports(unsigned short *ports)
+ohc_server_t *server_by_index(int index)
+{
+	return idx_pointer_get(&server_indexs, index);
+}
+
+void server_dump_listens(ohc_server_listens_t *listens)
 {
 	struct list_head *p;
 	ohc_server_t *s;
+	int n = 0;
 
-	bzero(ports, sizeof(unsigned short) * SERVERS_LIMIT);
+	bzero(listens, sizeof(ohc_server_listens_t));
 	list_for_each(p, &servers) {
 		s = list_entry(p, ohc_server_t, snode);
-		ports[s->index] = s->listen_port;
+		if(s->listen_path[0] == '\0') {
+			listens->ports[s->index] = s->listen_port;
+		} else if(n < SERVER_UNIX_LIMIT) {
+			listens->unixes[n].index = s->index;
+			strcpy(listens->unixes[n++].path, s->listen_path);
+		}
+	}
+}
+
+/* set @s's listen, a TCP @port, or a unix socket @path if not empty */
+void server_set_listen(ohc_server_t *s, unsigned short port,
+		const char *path)
+{
+	if(path[0] == '\0') {
+		s->listen_port = port;
+		s->listen_path[0] = '\0';
+		sprintf(s->listen_name, "%d", port);
+	} else {
+		s->listen_port = 0;
+		strcpy(s->listen_path, path);
+		sprintf(s->listen_name, "unix:%s", path);
 	}
 }
 
@@ -92,9 +167,16 @@ static void server_create(ohc_server_t *conf_server)
 
 	server_listen_start(conf_server);
 	server_listen_set(conf_server);
-	INIT_LIST_HEAD(&conf_server->lru_head);
 	INIT_LIST_HEAD(&conf_server->passby_lru_head);
-	conf_server->index = idx_pointer_add(&server_indexs, conf_server);
+	INIT_LIST_HEAD(&conf_server->tag_head);
+	INIT_LIST_HEAD(&conf_server->purge_head);
+
+	/* unless attached to the reused item table */
+	if(conf_server->tab == NULL) {
+		conf_server->index = idx_pointer_add(&server_indexs, conf_server);
+		conf_server->tab = table_server_init(conf_server->index,
+				conf_server->listen_port, conf_server->listen_path);
+	}
 
 	/* other fields were set to zero, when malloc the conf_server */
 }
@@ -105,6 +187,9 @@ static void server_delete(ohc_server_t *s)
 {
 	s->deleted = 1;
 	server_listen_close(s);
+	if(s->listen_path[0]) {
+		unlink(s->listen_path);
+	}
 	list_del(&s->snode);
 	list_add(&s->snode, &deleted_servers);
 }
@@ -126,6 +211,10 @@ static void server_update(ohc_server_t *s, ohc_server_t *conf_server)
 	s->send_timeout = conf_server->send_timeout;
 	s->recv_timeout = conf_server->recv_timeout;
 	s->item_max_size = conf_server->item_max_size;
+	s->small_item_size = conf_server->small_item_size;
+	s->chunk_size = conf_server->chunk_size;
+	s->max_ranges = conf_server->max_ranges;
+	s->prefix_depth = conf_server->prefix_depth;
 	s->passby_enable = conf_server->passby_enable;
 	s->passby_begin_item_nr = conf_server->passby_begin_item_nr;
 	s->passby_begin_consumed = conf_server->passby_begin_consumed;
@@ -137,14 +226,18 @@ static void server_update(ohc_server_t *s, ohc_server_t *conf_server)
 	s->key_include_query = conf_server->key_include_query;
 	s->key_include_host = conf_server->key_include_host;
 	s->key_include_ohc_key = conf_server->key_include_ohc_key;
+	s->read_while_write = conf_server->read_while_write;
+	s->memcached = conf_server->memcached;
 	s->expire_default = conf_server->expire_default;
 	s->expire_force = conf_server->expire_force;
+	s->stale_while_revalidate = conf_server->stale_while_revalidate;
+	s->grace = conf_server->grace;
 	s->status_period = conf_server->status_period;
 	server_listen_update(s, conf_server);
 }
 
-static ohc_server_t *server_search_port(unsigned short port,
-		struct list_head *head, ohc_server_t *stop)
+static ohc_server_t *server_search_listen(unsigned short port,
+		const char *path, struct list_head *head, ohc_server_t *stop)
 {
 	struct list_head *p;
 	ohc_server_t *s;
@@ -154,21 +247,21 @@ static ohc_server_t *server_search_port(unsigned short port,
 		if(s == stop) {
 			return NULL;
 		}
-		if(s->listen_port == port) {
+		if(s->listen_port == port && strcmp(s->listen_path, path) == 0) {
 			return s;
 		}
 	}
 	return NULL;
 }
 
-ohc_server_t *server_by_port(unsigned short port)
+ohc_server_t *server_by_listen(unsigned short port, const char *path)
 {
-	return server_search_port(port, &servers, NULL);
+	return server_search_listen(port, path, &servers, NULL);
 }
 
 static ohc_server_t *server_check_same(struct list_head *head, ohc_server_t *s)
 {
-	return server_search_port(s->listen_port, head, s);
+	return server_search_listen(s->listen_port, s->listen_path, head, s);
 }
 
 int server_conf_check(ohc_conf_t *conf_cycle)
@@ -176,7 +269,7 @@ int server_conf_check(ohc_conf_t *conf_cycle)
 	struct list_head *p;
 	ohc_server_t *s, *s2;
 	const char *msg;
-	int count = 0;
+	int count = 0, unix_count = 0;
 
 	if(list_empty(&conf_cycle->servers)) {
 		log_error_admin(0, "you must set at least 1 server");
@@ -200,6 +293,10 @@ int server_conf_check(ohc_conf_t *conf_cycle)
 			msg = "too many servers";
 			goto fail;
 		}
+		if(s->listen_path[0] && ++unix_count > SERVER_UNIX_LIMIT) {
+			msg = "too many unix socket servers";
+			goto fail;
+		}
 
 		if(s->send_timeout <= 0) {
 			msg = "send_timeout must be positive";
@@ -213,6 +310,23 @@ int server_conf_check(ohc_conf_t *conf_cycle)
 			msg = "status_period must be positive";
 			goto fail;
 		}
+		if(s->small_item_size > OHC_PAGE_SIZE) {
+			msg = "small_item_size must not be larger than 4K";
+			goto fail;
+		}
+		if(s->chunk_size != 0 && (s->chunk_size < SERVER_CHUNK_MIN
+					|| s->chunk_size > SERVER_CHUNK_MAX)) {
+			msg = "chunk_size must be 0, or in [1M, 1G]";
+			goto fail;
+		}
+		if(s->max_ranges <= 0 || s->max_ranges > REQ_RANGES_LIMIT) {
+			msg = "max_ranges must be in [1, 32]";
+			goto fail;
+		}
+		if(s->prefix_depth > TAG_PREFIX_DEPTH_MAX) {
+			msg = "prefix_depth must not be larger than 8";
+			goto fail;
+		}
 		/* we don't check sndbuf and rcvbuf */
 
 		s2 = server_check_same(&servers, s);
@@ -231,7 +345,14 @@ int server_conf_check(ohc_conf_t *conf_cycle)
 				goto fail;
 			}
 
-			s->listen_fd = tcp_bind(s->listen_port);
+			/* taken from the old process, if upgrading */
+			s->listen_fd = upgrade_listen_fd(s->listen_port,
+					s->listen_path);
+			if(s->listen_fd < 0) {
+				s->listen_fd = s->listen_path[0]
+					? unix_bind(s->listen_path)
+					: tcp_bind(s->listen_port);
+			}
 			if(s->listen_fd < 0) {
 				msg = "error in bind port";
 				goto fail;
@@ -255,15 +376,62 @@ int server_conf_check(ohc_conf_t *conf_cycle)
 
 	return OHC_OK;
 fail:
-	log_error_admin(errno, "%s in server %d", msg, s->listen_port);
+	log_error_admin(errno, "%s in server %s", msg, s->listen_name);
 	return OHC_ERROR;
 }
 
+/* At the first loading, the servers in reused item table take their
+ * indexes back by listen port or path. Others there are not configured any
+ * more, so they are deleted, with their items. */
+static void server_table_attach(ohc_conf_t *conf_cycle)
+{
+	struct list_head *p;
+	ohc_server_t *s;
+	int index;
+
+	list_for_each(p, &conf_cycle->servers) {
+		s = list_entry(p, ohc_server_t, snode);
+		index = table_server_find(s->listen_port, s->listen_path);
+		if(index >= 0) {
+			s->index = index;
+			s->tab = table_server(index);
+			idx_pointer_set(&server_indexs, index, s);
+		}
+	}
+
+	for(index = 0; index < SERVERS_LIMIT; index++) {
+		if(!table_server(index)->inuse || server_by_index(index) != NULL) {
+			continue;
+		}
+
+		s = calloc(1, sizeof(ohc_server_t));
+		if(s == NULL) {
+			log_error_run(0, "NoMem for servers in item_table");
+			exit(1);
+		}
+		s->index = index;
+		s->tab = table_server(index);
+		server_set_listen(s, s->tab->port, s->tab->path);
+		s->listen_fd = -1;
+		s->deleted = 1;
+		INIT_LIST_HEAD(&s->passby_lru_head);
+		idx_pointer_set(&server_indexs, index, s);
+		list_add(&s->snode, &deleted_servers);
+	}
+}
+
 void server_conf_load(ohc_conf_t *conf_cycle)
 {
 	struct list_head *p, *safe;
 	ohc_server_t *s;
 
+	prewarm_items = conf_cycle->prewarm_items;
+
+	if(!server_attached) {
+		server_table_attach(conf_cycle);
+		server_attached = 1;
+	}
+
 	list_for_each_safe(p, safe, &servers) {
 		s = list_entry(p, ohc_server_t, snode);
 		if(s->conf == NULL) {
@@ -300,6 +468,19 @@ void server_conf_rollback(ohc_conf_t *conf_cycle)
 	}
 }
 
+/* get the servers into @list, for passing their listen sockets in
+ * upgrading. return the number */
+int server_listen_servers(ohc_server_t **list)
+{
+	struct list_head *p;
+	int n = 0;
+
+	list_for_each(p, &servers) {
+		list[n++] = list_entry(p, ohc_server_t, snode);
+	}
+	return n;
+}
+
 void server_stop_service(void)
 {
 	struct list_head *p;
@@ -308,24 +489,134 @@ void server_stop_service(void)
 	list_for_each(p, &servers) {
 		s = list_entry(p, ohc_server_t, snode);
 		server_listen_close(s);
+
+		/* the socket file belongs to the new process if upgrading */
+		if(s->listen_path[0] && !upgrade_started()) {
+			unlink(s->listen_path);
+		}
 	}
 }
 
-int server_clear(unsigned short port)
+/* clear the server by @listen, a port or "unix:/path" */
+int server_clear(const char *listen)
 {
-	ohc_server_t *s = server_by_port(port);
+	ohc_server_t *s;
+
+	if(strncmp(listen, "unix:", 5) == 0) {
+		s = server_by_listen(0, listen + 5);
+	} else {
+		s = server_by_listen((unsigned short)atoi(listen), "");
+	}
 	if(s == NULL) {
 		log_error_admin(0, "no matched server");
 		return OHC_ERROR;
 	}
 
-	s->clear++;
+	s->tab->clear++;
+	journal_checkpoint_force();
 	return OHC_OK;
 }
 
-static inline struct list_head *server_lru_head(ohc_server_t *s)
+static inline struct tlist_head *server_lru_head(ohc_server_t *s)
+{
+	return s->capacity ? &s->tab->lru_head : table_shared_lru();
+}
+
+/* get all LRU lists of items, into @heads. return the number */
+int server_lru_heads(struct tlist_head **heads)
+{
+	struct list_head *p;
+	ohc_server_t *s;
+	int n = 0;
+
+	list_for_each(p, &servers) {
+		s = list_entry(p, ohc_server_t, snode);
+		if(!tlist_empty(&s->tab->lru_head)) {
+			heads[n++] = &s->tab->lru_head;
+		}
+	}
+	list_for_each(p, &deleted_servers) {
+		s = list_entry(p, ohc_server_t, snode);
+		if(!tlist_empty(&s->tab->lru_head)) {
+			heads[n++] = &s->tab->lru_head;
+		}
+	}
+	heads[n++] = table_shared_lru();
+	return n;
+}
+
+static void server_load_delete(ohc_server_t *s, unsigned char *hash_id)
+{
+	ohc_load_deleted_t *ld;
+
+	if(s->load_deleted == NULL) {
+		s->load_deleted = hash_init();
+		if(s->load_deleted == NULL) {
+			return;
+		}
+		INIT_LIST_HEAD(&s->load_deleted_head);
+	}
+
+	if(hash_get_id(s->load_deleted, hash_id) != NULL) {
+		return;
+	}
+
+	ld = slab_alloc(&load_deleted_slab);
+	if(ld == NULL) {
+		return;
+	}
+	memcpy(ld->hnode.id, hash_id, 16);
+	hash_add(s->load_deleted, &ld->hnode, NULL, 0);
+	list_add(&ld->node, &s->load_deleted_head);
+}
+
+static void server_load_deleted_clean(ohc_server_t *s)
 {
-	return s->capacity ? &s->lru_head : &shared_lru_head;
+	ohc_load_deleted_t *ld;
+	struct list_head *p, *safe;
+
+	if(s->load_deleted == NULL) {
+		return;
+	}
+
+	list_for_each_safe(p, safe, &s->load_deleted_head) {
+		ld = list_entry(p, ohc_load_deleted_t, node);
+		slab_free(ld);
+	}
+	hash_destroy(s->load_deleted);
+	s->load_deleted = NULL;
+}
+
+static void server_load_rank_add(ohc_item_t *item, ohc_format_item_t *fm_item)
+{
+	ohc_load_rank_t *lr;
+
+	if(load_rank_nr == load_rank_size) {
+		load_rank_size = load_rank_size ? load_rank_size * 2 : 1024;
+		lr = realloc(load_ranks, load_rank_size * sizeof(ohc_load_rank_t));
+		if(lr == NULL) {
+			log_error_run(0, "NoMem for LRU order, ignore it");
+			load_rank_size = load_rank_nr;
+			return;
+		}
+		load_ranks = lr;
+	}
+
+	lr = &load_ranks[load_rank_nr++];
+	memcpy(lr->hash_id, fm_item->hash_id, 16);
+	lr->rank = fm_item->rank;
+	lr->server_index = item->server_index;
+	lr->device_index = item->device_index;
+	lr->offset = item->offset;
+	lr->hits = item->hits;
+}
+
+static int server_load_rank_cmp(const void *a, const void *b)
+{
+	const ohc_load_rank_t *x = a;
+	const ohc_load_rank_t *y = b;
+
+	return x->rank < y->rank ? -1 : (x->rank > y->rank);
 }
 
 /* @format module call this to add an item, when load an item from device */
@@ -333,422 +624,1524 @@ int server_load_fm_item(ohc_server_t *s, ohc_device_t *device,
 		ohc_format_item_t *fm_item)
 {
 	ohc_item_t *item;
-	size_t block_size;
+	size_t block_size = 0;
+
+	if(fm_item->flags & OHC_FM_PAGE) {
+		return page_load(s, device, fm_item->offset);
+	}
+
+	/* we are serving while loading, so the item may have been
+	 * stored again or deleted. */
+	if(table_hash_get(fm_item->hash_id, s->index) != NULL
+			|| hash_get_id(s->hash, fm_item->hash_id) != NULL) {
+		return OHC_DECLINE;
+	}
+	if(s->load_deleted != NULL
+			&& hash_get_id(s->load_deleted, fm_item->hash_id) != NULL) {
+		return OHC_DECLINE;
+	}
 
-	item = slab_alloc(&item_slab);
+	/* other fields are zero */
+	item = table_alloc();
 	if(item == NULL) {
 		return OHC_ERROR;
 	}
 
-	item->putting = 0;
-	item->badblock = 0;
-	item->deleted = 0;
-	item->used = 0;
-	item->clear = 0;
+	item->headless = !!(fm_item->flags & OHC_FM_HEADLESS);
 	item->server_index = s->index;
 	item->length = fm_item->length;
 	item->expire = fm_item->expire;
 	item->headers_len = fm_item->headers_len;
 	item->offset = fm_item->offset;
 	item->device_index = device->index;
-
-	block_size = device_cut_free_block(item);
-	if(block_size == 0) {
-		slab_free(item);
-		return OHC_ERROR;
+	item->hits = fm_item->hits;
+	item->etag = !!(fm_item->flags & OHC_FM_ETAG);
+	item->validator = fm_item->validator;
+	item->chunked = !!(fm_item->flags & OHC_FM_CHUNKED);
+
+	if(fm_item->flags & OHC_FM_PACKED) {
+		if(page_load_item(s, item) != OHC_OK) {
+			table_free(item);
+			return OHC_ERROR;
+		}
+	} else {
+		block_size = device_cut_free_block(item);
+		if(block_size == 0) {
+			table_free(item);
+			return OHC_ERROR;
+		}
 	}
 
 	memcpy(item->hnode.id, fm_item->hash_id, 16);
-	hash_add(s->hash, &item->hnode, NULL, 0);
-	list_add(&item->lru_node, server_lru_head(s));
+	table_hash_add(item);
+	tlist_add(&item->lru_node, server_lru_head(s));
+
+	if(fm_item->rank != OHC_FM_NO_RANK) {
+		server_load_rank_add(item, fm_item);
+	}
 
-	s->consumed += block_size;
-	s->content += item->length;
-	s->item_nr++;
+	s->tab->consumed += block_size;
+	s->tab->content += item->length;
+	s->tab->item_nr++;
 
 	return OHC_OK;
 }
 
-/* pass-by item. only ID(uri), but no data(body). */
+/* pass-by item. only ID(uri), but no data(body). They are in
+ * the server's hash, while items are in item table's. */
 typedef struct {
-	/* @hnode and @passby must be together, to
-	 * distinguish ohc_item_t and ohc_passby_item_t. */
 	ohc_hash_node_t		hnode;
-	unsigned		passby:1;
 
 	int32_t			expire;
 	struct list_head	lru_node;
 } ohc_passby_item_t;
 
-
-static void server_passby_item_delete(ohc_server_t *s,
-		ohc_passby_item_t *passby_item)
-{
-	hash_del(s->hash, &passby_item->hnode);
-	list_del(&passby_item->lru_node);
-	slab_free(passby_item);
-	s->passby_item_nr--;
-}
-
-void server_item_delete(ohc_item_t *item)
+/* re-order the LRU by @load_ranks. The ranked items are moved to the
+ * tail from the most recent, so the items stored or accessed while
+ * loading, and the items loaded without rank, are kept before them.
+ * return the number of ranks processed. */
+static long server_load_reorder(long batch)
 {
-	ohc_server_t *s = server_of_item(item);
-	size_t block_size;
+	ohc_load_rank_t *lr;
+	ohc_item_t *item;
+	ohc_server_t *s;
+	long end;
 
-	/* 1st time get in here for the @item */
-	if(item->deleted == 0) {
-		hash_del(s->hash, &item->hnode);
+	if(load_rank_done == 0) {
+		qsort(load_ranks, load_rank_nr, sizeof(ohc_load_rank_t),
+				server_load_rank_cmp);
 	}
 
-	/* if used, delete later */
-	if(item->used != 0 || item->putting) {
-		item->deleted = 1;
-		return;
+	end = load_rank_done + batch;
+	if(end > load_rank_nr) {
+		end = load_rank_nr;
 	}
 
-	/* delete the item actally */
-	list_del(&item->lru_node);
-	s->content -= item->length;
-	block_size = device_return_free_block(item);
-	s->consumed -= block_size;
-	s->item_nr--;
-	slab_free(item);
+	for(; load_rank_done < end; load_rank_done++) {
+		lr = &load_ranks[load_rank_done];
+
+		s = server_by_index(lr->server_index);
+		if(s == NULL) {
+			continue;
+		}
+		item = table_hash_get(lr->hash_id, lr->server_index);
+		if(item == NULL) {
+			continue;
+		}
+		if(item->device_index != lr->device_index
+				|| item->offset != lr->offset
+				|| item->hits != lr->hits) {
+			continue;
+		}
+
+		tlist_del(&item->lru_node);
+		tlist_add_tail(&item->lru_node, server_lru_head(s));
+	}
+	return end;
 }
 
-inline int server_item_valid(ohc_item_t *item)
+/* a block to read into page cache in prewarm */
+typedef struct {
+	int	fd;
+	off_t	offset;
+	size_t	length;
+} ohc_prewarm_t;
+
+typedef struct {
+	ohc_item_t	*item;
+	long		seq; /* position in LRU, smaller is more recent */
+} ohc_prewarm_item_t;
+
+/* whether @x is colder than @y: less hits, or less recent */
+static inline int server_prewarm_colder(ohc_prewarm_item_t *x,
+		ohc_prewarm_item_t *y)
 {
-	return !device_of_item(item)->deleted
-		&& !server_of_item(item)->deleted
-		&& item->clear == server_of_item(item)->clear
-		&& item->expire > timer_now(&master_timer);
+	return x->item->hits != y->item->hits
+		? x->item->hits < y->item->hits : x->seq > y->seq;
 }
 
-static void server_item_expire(ohc_server_t *s, size_t target)
+/* min-heap, with the coldest at top */
+static void server_prewarm_sift(ohc_prewarm_item_t *heap, long n, long i)
 {
-	ohc_item_t *item;
-	ohc_passby_item_t *passby_item;
-	struct list_head *p, *safe;
-	time_t now = timer_now(&master_timer);
-	size_t before = s->consumed;
-	int count = 0;
-
-	list_for_each_reverse_safe(p, safe, &s->lru_head) {
-		item = list_entry(p, ohc_item_t, lru_node);
+	ohc_prewarm_item_t tmp;
+	long c;
 
-		if(before - s->consumed >= target && server_item_valid(item)) {
-			break;
+	while((c = i * 2 + 1) < n) {
+		if(c + 1 < n && server_prewarm_colder(&heap[c + 1], &heap[c])) {
+			c++;
 		}
-
-		server_item_delete(item);
-
-		if(count++ >= LOOP_LIMIT) {
+		if(!server_prewarm_colder(&heap[c], &heap[i])) {
 			break;
 		}
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+		i = c;
 	}
+}
 
-	list_for_each_reverse_safe(p, safe, &s->passby_lru_head) {
-		passby_item = list_entry(p, ohc_passby_item_t, lru_node);
+static int server_prewarm_cmp(const void *a, const void *b)
+{
+	const ohc_prewarm_t *x = a;
+	const ohc_prewarm_t *y = b;
 
-		if(s->passby_enable && s->passby_item_nr < s->passby_limit_nr
-				&& passby_item->expire > now) {
-			break;
-		}
+	if(x->fd != y->fd) {
+		return x->fd - y->fd;
+	}
+	return x->offset < y->offset ? -1 : (x->offset > y->offset);
+}
 
-		server_passby_item_delete(s, passby_item);
+static void *server_prewarm_routine(void *arg)
+{
+	ohc_prewarm_t *blocks = arg;
+	long i;
 
-		if(count++ >= LOOP_LIMIT) {
-			break;
-		}
+	pthread_detach(pthread_self());
+
+	for(i = 0; blocks[i].length != 0; i++) {
+		posix_fadvise(blocks[i].fd, blocks[i].offset, blocks[i].length,
+				POSIX_FADV_WILLNEED);
 	}
+	free(blocks);
+	return NULL;
 }
 
-static void server_shared_expire(size_t target)
+/* read the hottest @prewarm_items items into page cache, in a thread
+ * in order of device and offset. Items are selected by hits, and the
+ * more recent wins in tie. */
+static void server_prewarm(void)
 {
+	struct tlist_head *heads[SERVERS_LIMIT + 1];
+	struct tlist_head *p;
+	ohc_prewarm_item_t *heap, pi;
+	ohc_prewarm_t *blocks;
 	ohc_item_t *item;
-	struct list_head *p, *safe;
-	size_t size = 0;
-	int count = 0;
+	pthread_t tid;
+	long n = 0, seq, i;
+	int h, hn;
 
-	list_for_each_reverse_safe(p, safe, &shared_lru_head) {
-		item = list_entry(p, ohc_item_t, lru_node);
+	if(prewarm_items <= 0) {
+		return;
+	}
 
-		if(size >= target && server_item_valid(item)) {
-			break;
+	heap = malloc(prewarm_items * sizeof(ohc_prewarm_item_t));
+	if(heap == NULL) {
+		log_error_run(0, "NoMem for prewarm");
+		return;
+	}
+
+	hn = server_lru_heads(heads);
+	for(h = 0; h < hn; h++) {
+		seq = 0;
+		tlist_for_each(p, heads[h]) {
+			item = tlist_entry(p, ohc_item_t, lru_node);
+			pi.item = item;
+			pi.seq = seq++;
+
+			if(n < prewarm_items) {
+				heap[n++] = pi;
+				if(n == prewarm_items) {
+					for(i = n / 2 - 1; i >= 0; i--) {
+						server_prewarm_sift(heap, n, i);
+					}
+				}
+			} else if(server_prewarm_colder(&heap[0], &pi)) {
+				heap[0] = pi;
+				server_prewarm_sift(heap, n, 0);
+			}
 		}
+	}
 
-		size += item->length;
-		server_item_delete(item);
+	if(n == 0) {
+		free(heap);
+		return;
+	}
 
-		if(count++ >= LOOP_LIMIT) {
-			break;
-		}
+	blocks = malloc((n + 1) * sizeof(ohc_prewarm_t));
+	if(blocks == NULL) {
+		log_error_run(0, "NoMem for prewarm");
+		free(heap);
+		return;
+	}
+	for(i = 0; i < n; i++) {
+		item = heap[i].item;
+		blocks[i].fd = device_of_item(item)->fd;
+		blocks[i].offset = item_block_offset(item);
+		blocks[i].length = item_block_length(item);
+	}
+	blocks[n].length = 0;
+	free(heap);
+
+	qsort(blocks, n, sizeof(ohc_prewarm_t), server_prewarm_cmp);
+
+	if(pthread_create(&tid, NULL, server_prewarm_routine, blocks) != 0) {
+		log_error_run(errno, "create prewarm thread");
+		free(blocks);
+		return;
 	}
+	log_error_run(0, "prewarm %ld items", n);
 }
 
-static ohc_hash_node_t *server_hash_get(ohc_request_t *r, unsigned char *hash_id)
+/* @device module call this after all devices are loaded, until it
+ * returns OHC_DONE. The LRU is re-ordered SERVER_REORDER_BATCH items
+ * each time, since we are serving. */
+int server_load_finish(void)
 {
-	ohc_server_t *s = r->server;
-	char key[REQ_BUF_SIZE]; /* REQ_BUF_SIZE is just enough */
-	ssize_t length;
+	struct list_head *p;
+	ohc_server_t *s;
 
-	/* key_include_query */
-	if(s->key_include_query) {
-		length = r->uri.len;
-	} else {
-		r->uri.base[r->uri.len] = '?';
-		length = strchr(r->uri.base, '?') - r->uri.base;
+	if(load_finished) {
+		return OHC_DONE;
 	}
-	length = http_decode_uri(r->uri.base, length, key);
 
-	/* key_include_host */
-	if(s->key_include_host && r->host.base) {
-		memcpy(key + length, r->host.base, r->host.len);
-		length += r->host.len;
+	if(server_load_reorder(SERVER_REORDER_BATCH) < load_rank_nr) {
+		return OHC_AGAIN;
 	}
+	free(load_ranks);
+	load_ranks = NULL;
+	load_rank_nr = load_rank_size = load_rank_done = 0;
 
-	/* key_include_ohc_key */
-	if(s->key_include_ohc_key && r->ohc_key.base) {
-		memcpy(key + length, r->ohc_key.base, r->ohc_key.len);
-		length += r->ohc_key.len;
+	list_for_each(p, &servers) {
+		s = list_entry(p, ohc_server_t, snode);
+		server_load_deleted_clean(s);
+	}
+	list_for_each(p, &deleted_servers) {
+		s = list_entry(p, ohc_server_t, snode);
+		server_load_deleted_clean(s);
 	}
 
-	return hash_get(s->hash, (unsigned char *)key, length, hash_id);
+	server_prewarm();
+	load_finished = 1;
+	return OHC_DONE;
 }
 
 
-/* request module call this, in a GET request, to get the item */
-int server_request_get_handler(ohc_request_t *r)
+static ohc_partial_t *server_partial_get(ohc_server_t *s, ohc_item_t *item)
 {
-	ohc_item_t *item;
-	ohc_passby_item_t *passby_item;
-	ohc_hash_node_t *hnode;
-	ohc_server_t *s = r->server;
+	ohc_hash_node_t *hnode = hash_get_id(s->partials, item->hnode.id);
 
-	s->gets++;
-	s->gets_current_period++;
+	return list_entry(hnode, ohc_partial_t, hnode);
+}
 
-	hnode = server_hash_get(r, NULL);
-	if(hnode == NULL) {
+/* called when the partial @item is deleted or completed */
+static void server_partial_delete(ohc_server_t *s, ohc_item_t *item)
+{
+	ohc_partial_t *partial = server_partial_get(s, item);
+
+	hash_del(s->partials, &partial->hnode);
+	slab_free(partial);
+}
+
+/* mark [@start, @end] of @item's body filled. Return OHC_DONE if the
+ * whole body is filled, or OHC_ERROR if the item is too fragmented. */
+static int server_partial_fill(ohc_partial_t *partial, ohc_item_t *item,
+		ssize_t start, ssize_t end)
+{
+	ssize_t body_len = item->length - item->headers_len;
+
+	partial->filled[partial->nr].start = start;
+	partial->filled[partial->nr].end = end;
+	partial->nr = http_ranges_settle(partial->filled, partial->nr + 1, body_len);
+	if(partial->nr > SERVER_PARTIAL_RANGES) {
 		return OHC_ERROR;
 	}
 
-	passby_item = list_entry(hnode, ohc_passby_item_t, hnode);
-	if(passby_item->passby) {
-		list_del(&passby_item->lru_node);
-		list_add(&passby_item->lru_node, &s->passby_lru_head);
-		s->passby_hits++;
+	return (partial->nr == 1 && partial->filled[0].start == 0
+			&& partial->filled[0].end == body_len - 1)
+		? OHC_DONE : OHC_OK;
+}
+
+/* whether the ranges of GET @r are all filled in the partial @item */
+static int server_partial_cover(ohc_request_t *r, ohc_item_t *item)
+{
+	ohc_partial_t *partial = server_partial_get(r->server, item);
+	ohc_range_t *range, *f;
+	int i;
+
+	/* the stored headers are not written before the creating PUT done */
+	if(!r->range_set || partial->creating) {
+		return OHC_DECLINE;
+	}
+
+	r->range_nr = http_ranges_settle(r->ranges, r->range_nr,
+			item->length - item->headers_len);
+	if(r->range_nr == 0) {
+		return OHC_DECLINE;
+	}
+
+	for(i = 0; i < r->range_nr; i++) {
+		range = &r->ranges[i];
+		for(f = partial->filled; f < partial->filled + partial->nr; f++) {
+			if(f->start <= range->start && range->end <= f->end) {
+				break;
+			}
+		}
+		if(f == partial->filled + partial->nr) {
+			return OHC_DECLINE;
+		}
+	}
+	return OHC_OK;
+}
+
+/* Items bigger than chunk_size are stored in chunks, which are normal
+ * items and may be in different devices. The head chunk is the item
+ * found by key, with the stored headers and the first chunk_size of
+ * body. The i'th chunk is keyed by MD5(head's ID, i), without stored
+ * headers, and its @validator is the number of chunks. */
+static void server_chunk_id(ohc_item_t *head, long index, unsigned char *id)
+{
+	unsigned char buf[16 + sizeof(long)];
+
+	memcpy(buf, head->hnode.id, 16);
+	memcpy(buf + 16, &index, sizeof(long));
+	MD5(buf, sizeof(buf), id);
+}
+
+static ohc_item_t *server_chunk_get(ohc_server_t *s, ohc_item_t *head, long index)
+{
+	unsigned char id[16];
+
+	server_chunk_id(head, index, id);
+	return table_hash_get(id, s->index);
+}
+
+/* delete the chunks of @head. Chunks after a missing one are deleted
+ * too if the number is known, otherwise they are left to LRU. */
+static void server_chunks_delete(ohc_server_t *s, ohc_item_t *head)
+{
+	ohc_item_t *chunk;
+	long i, n = 0;
+
+	for(i = 1; n == 0 || i < n; i++) {
+		chunk = server_chunk_get(s, head, i);
+		if(chunk == NULL) {
+			if(n == 0) {
+				break;
+			}
+			continue;
+		}
+		n = chunk->validator;
+		server_item_delete(chunk);
+	}
+}
+
+/* make the @item in putting by @r readable, if read_while_write */
+static void server_putting_add(ohc_request_t *r, ohc_item_t *item)
+{
+	ohc_server_t *s = r->server;
+	ohc_putting_t *putting;
+
+	if(s->puttings == NULL) {
+		s->puttings = hash_init();
+		if(s->puttings == NULL) {
+			return;
+		}
+	}
+	putting = slab_alloc(&putting_slab);
+	if(putting == NULL) {
+		return;
+	}
+
+	putting->size = 0;
+	putting->aborted = 0;
+	putting->refs = 1;
+	putting->hashed = 1;
+	memcpy(putting->hnode.id, item->hnode.id, 16);
+	hash_add(s->puttings, &putting->hnode, NULL, 0);
+	r->putting = putting;
+}
+
+/* called when the @item in putting is deleted or finished */
+static void server_putting_unhash(ohc_server_t *s, ohc_item_t *item)
+{
+	ohc_hash_node_t *hnode;
+	ohc_putting_t *putting;
+
+	if(s->puttings == NULL) {
+		return;
+	}
+	hnode = hash_get_id(s->puttings, item->hnode.id);
+	if(hnode == NULL) {
+		return;
+	}
+	putting = list_entry(hnode, ohc_putting_t, hnode);
+	hash_del(s->puttings, &putting->hnode);
+	putting->hashed = 0;
+}
+
+/* GET @r reads the @item in putting */
+static int server_putting_attach(ohc_request_t *r, ohc_item_t *item)
+{
+	ohc_server_t *s = r->server;
+	ohc_hash_node_t *hnode;
+	ohc_putting_t *putting;
+
+	if(s->puttings == NULL) {
+		return OHC_ERROR;
+	}
+	hnode = hash_get_id(s->puttings, item->hnode.id);
+	if(hnode == NULL) {
+		return OHC_ERROR;
+	}
+	putting = list_entry(hnode, ohc_putting_t, hnode);
+	putting->refs++;
+	r->putting = putting;
+
+	/* the whole item is responded, for simple */
+	r->range_set = 0;
+	return OHC_OK;
+}
+
+/* @r leaves the putting. If it's the PUT, tell the GETs whether the
+ * item is finished. */
+static void server_putting_release(ohc_request_t *r, int aborted)
+{
+	ohc_putting_t *putting = r->putting;
+
+	r->putting = NULL;
+	if(r->method == OHC_HTTP_METHOD_PUT || r->method == OHC_HTTP_METHOD_POST) {
+		putting->aborted = aborted;
+		if(aborted) {
+			/* the GETs waiting for this putting end */
+			__sync_synchronize();
+			worker_wake_waiting();
+		}
+		if(putting->hashed) {
+			hash_del(r->server->puttings, &putting->hnode);
+			putting->hashed = 0;
+		}
+	}
+	if(--putting->refs == 0) {
+		slab_free(putting);
+	}
+}
+
+static void server_passby_item_delete(ohc_server_t *s,
+		ohc_passby_item_t *passby_item)
+{
+	hash_del(s->hash, &passby_item->hnode);
+	list_del(&passby_item->lru_node);
+	slab_free(passby_item);
+	s->passby_item_nr--;
+}
+
+/* Items in use, in putting or partial are linked in item table's busy
+ * items, so they can be cleaned if the table is reused after restart,
+ * see server_table_recover(). */
+static inline int server_item_busy(ohc_item_t *item)
+{
+	return item->used != 0 || item->putting || item->partial;
+}
+
+void server_item_delete(ohc_item_t *item)
+{
+	ohc_server_t *s = server_of_item(item);
+	size_t block_size;
+
+	/* 1st time get in here for the @item */
+	if(item->deleted == 0) {
+		if(!item->shadow) {
+			table_hash_del(item);
+		}
+		if(item->partial) {
+			server_partial_delete(s, item);
+			item->partial = 0;
+			if(!server_item_busy(item)) {
+				tlist_del(&item->busy_node);
+			}
+		}
+		if(item->chunked) {
+			server_chunks_delete(s, item);
+		}
+		if(item->putting && !item->shadow) {
+			server_putting_unhash(s, item);
+		}
+	}
+
+	/* if used, delete later */
+	if(server_item_busy(item)) {
+		item->deleted = 1;
+		return;
+	}
+
+	/* delete the item actally */
+	tlist_del(&item->lru_node);
+	s->tab->content -= item->length;
+	block_size = device_return_free_block(item);
+	s->tab->consumed -= block_size;
+	s->tab->item_nr--;
+	table_free(item);
+}
+
+/* The item table is reused, but the requests using the busy items
+ * are gone. So the items in putting or partial are not finished, and
+ * deleted; and the deleted ones are freed now. */
+void server_table_recover(void)
+{
+	struct tlist_head *p, *safe;
+	ohc_item_t *item;
+	long count = 0;
+
+	tlist_for_each_safe(p, safe, table_busy_items()) {
+		item = tlist_entry(p, ohc_item_t, busy_node);
+		tlist_del(&item->busy_node);
+		item->used = 0;
+		if(item->putting || item->partial || item->deleted) {
+			item->putting = 0;
+			item->partial = 0;
+			server_item_delete(item);
+		}
+		count++;
+	}
+	if(count != 0) {
+		log_error_run(0, "clean %ld busy items in item_table", count);
+	}
+}
+
+/* expired items are kept for this long, and maybe served stale */
+inline time_t server_stale_time(ohc_server_t *s)
+{
+	return s->grace > s->stale_while_revalidate
+		? s->grace : s->stale_while_revalidate;
+}
+
+inline int server_item_valid(ohc_item_t *item)
+{
+	return !device_of_item(item)->deleted
+		&& !server_of_item(item)->deleted
+		&& item->clear == server_of_item(item)->tab->clear
+		&& item->expire + server_stale_time(server_of_item(item))
+			> timer_now(&master_timer);
+}
+
+/* Check whether the valid @item can be served for GET @r, and whether
+ * to hint the client to refresh it in background. The stale item is
+ * served in stale_while_revalidate after expire, or in grace if the
+ * client asks by OHC-Grace (e.g. the origin fails). Before expire,
+ * the client is hinted to refresh early at random, more likely nearer
+ * expire, to spread the refreshes. */
+static int server_item_stale(ohc_request_t *r, ohc_item_t *item)
+{
+	ohc_server_t *s = r->server;
+	time_t now = timer_now(&master_timer);
+	time_t left = item->expire - now;
+
+	if(left > 0) {
+		if(left < s->stale_while_revalidate
+				&& random() % s->stale_while_revalidate >= left) {
+			r->refresh = REQ_REFRESH_EARLY;
+		}
+		return OHC_OK;
+	}
+
+	if(-left < s->stale_while_revalidate || (r->grace && -left < s->grace)) {
+		r->refresh = REQ_REFRESH_STALE;
+		return OHC_OK;
+	}
+	return OHC_ERROR;
+}
+
+static void server_item_expire(ohc_server_t *s, size_t target)
+{
+	ohc_item_t *item;
+	ohc_passby_item_t *passby_item;
+	struct tlist_head *p, *safe;
+	struct list_head *q, *qsafe;
+	time_t now = timer_now(&master_timer);
+	size_t before = s->tab->consumed;
+	int count = 0, chunked;
+
+	tlist_for_each_reverse_safe(p, safe, &s->tab->lru_head) {
+		item = tlist_entry(p, ohc_item_t, lru_node);
+
+		if(before - s->tab->consumed >= target && server_item_valid(item)) {
+			break;
+		}
+
+		/* @safe may be deleted with the chunks, so restart */
+		chunked = item->chunked && !item->deleted;
+		server_item_delete(item);
+		if(chunked) {
+			safe = tlist_prev(&s->tab->lru_head);
+		}
+
+		if(count++ >= LOOP_LIMIT) {
+			break;
+		}
+	}
+
+	list_for_each_reverse_safe(q, qsafe, &s->passby_lru_head) {
+		passby_item = list_entry(q, ohc_passby_item_t, lru_node);
+
+		if(s->passby_enable && s->passby_item_nr < s->passby_limit_nr
+				&& passby_item->expire > now) {
+			break;
+		}
+
+		server_passby_item_delete(s, passby_item);
+
+		if(count++ >= LOOP_LIMIT) {
+			break;
+		}
+	}
+
+	/* deleting packed items does not return space, until their
+	 * pages are evicted */
+	page_reclaim();
+}
+
+static void server_shared_expire(size_t target)
+{
+	ohc_item_t *item;
+	struct tlist_head *p, *safe;
+	size_t size = 0;
+	int count = 0, chunked;
+
+	tlist_for_each_reverse_safe(p, safe, table_shared_lru()) {
+		item = tlist_entry(p, ohc_item_t, lru_node);
+
+		if(size >= target && server_item_valid(item)) {
+			break;
+		}
+
+		/* @safe may be deleted with the chunks, so restart */
+		size += item->length;
+		chunked = item->chunked && !item->deleted;
+		server_item_delete(item);
+		if(chunked) {
+			safe = tlist_prev(table_shared_lru());
+		}
+
+		if(count++ >= LOOP_LIMIT) {
+			break;
+		}
+	}
+}
+
+/* the key of @uri in @r, by the server's key_include_* */
+static ssize_t server_key(ohc_request_t *r, char *uri, ssize_t len, char *key)
+{
+	ohc_server_t *s = r->server;
+	ssize_t length;
+	char *q;
+
+	/* memcached key is used as is */
+	if(s->memcached) {
+		memcpy(key, uri, len);
+		return len;
+	}
+
+	/* key_include_query */
+	if(s->key_include_query || (q = memchr(uri, '?', len)) == NULL) {
+		length = len;
+	} else {
+		length = q - uri;
+	}
+	length = http_decode_uri(uri, length, key);
+
+	/* key_include_host */
+	if(s->key_include_host && r->host.base) {
+		memcpy(key + length, r->host.base, r->host.len);
+		length += r->host.len;
+	}
+
+	/* key_include_ohc_key */
+	if(s->key_include_ohc_key && r->ohc_key.base) {
+		memcpy(key + length, r->ohc_key.base, r->ohc_key.len);
+		length += r->ohc_key.len;
+	}
+	return length;
+}
+
+/* Get the MD5 @hash_id of request's key, and return the pass-by item
+ * if any. The items are got by table_hash_get() with @hash_id. */
+static ohc_passby_item_t *server_hash_get(ohc_request_t *r, unsigned char *hash_id)
+{
+	ohc_hash_node_t *hnode;
+	char key[REQ_BUF_SIZE]; /* REQ_BUF_SIZE is just enough */
+
+	hnode = hash_get(r->server->hash, (unsigned char *)key,
+			server_key(r, r->uri.base, r->uri.len, key), hash_id);
+	return hnode ? list_entry(hnode, ohc_passby_item_t, hnode) : NULL;
+}
+
+/* gather and hold the chunks of @head for GET @r. return OHC_ERROR if
+ * any chunk is missing, and then the item is broken. */
+static int server_chunks_get(ohc_request_t *r, ohc_item_t *head)
+{
+	ohc_server_t *s = r->server;
+	ohc_item_t *chunk;
+	long i, n;
+
+	chunk = server_chunk_get(s, head, 1);
+	if(chunk == NULL || chunk->putting || chunk->validator < 2) {
+		return OHC_ERROR;
+	}
+	n = chunk->validator;
+
+	r->chunks = malloc(n * sizeof(ohc_item_t *));
+	if(r->chunks == NULL) {
+		return OHC_ERROR;
+	}
+	r->chunks[0] = head;
+	for(i = 1; i < n; i++) {
+		chunk = server_chunk_get(s, head, i);
+		if(chunk == NULL || chunk->putting || !server_item_valid(chunk)) {
+			free(r->chunks);
+			r->chunks = NULL;
+			return OHC_ERROR;
+		}
+		r->chunks[i] = chunk;
+	}
+
+	/* hold them, and keep them together in LRU */
+	for(i = 1; i < n; i++) {
+		chunk = r->chunks[i];
+		if(chunk->used++ == 0) {
+			tlist_add(&chunk->busy_node, table_busy_items());
+		}
+		device_of_item(chunk)->used++;
+		tlist_del(&chunk->lru_node);
+		tlist_add(&chunk->lru_node, server_lru_head(s));
+	}
+	r->chunk_nr = n;
+	r->body_len = (n - 1) * (head->length - head->headers_len) + chunk->length;
+	return OHC_OK;
+}
+
+/* set @r->expire by the server's configure, if not set by the request's
+ * Cache-Control or Expires. return OHC_ERROR if expired already. */
+static int server_request_expire(ohc_request_t *r)
+{
+	ohc_server_t *s = r->server;
+	time_t now = timer_now(&master_timer);
+
+	if(s->expire_force != 0) {
+		r->expire = s->expire_force + now;
+
+	} else if(r->expire == 0) {
+		if(s->expire_default == 0) {
+			r->error_reason = "Expired";
+			return OHC_ERROR;
+		}
+		r->expire = s->expire_default + now;
+
+	} else {}
+	return OHC_OK;
+}
+
+/* request module call this, in a GET request, to get the item */
+int server_request_get_handler(ohc_request_t *r)
+{
+	ohc_item_t *item;
+	ohc_passby_item_t *passby_item;
+	ohc_server_t *s = r->server;
+	unsigned char hash_id[16];
+
+	s->gets++;
+	s->gets_current_period++;
+
+	passby_item = server_hash_get(r, hash_id);
+	if(passby_item != NULL) {
+		list_del(&passby_item->lru_node);
+		list_add(&passby_item->lru_node, &s->passby_lru_head);
+		s->passby_hits++;
 		s->passby_hits_current_period++;
 		return OHC_ERROR;
 	}
 
-	item = list_entry(hnode, ohc_item_t, hnode);
-	if(item->deleted || item->putting) {
+	item = table_hash_get(hash_id, s->index);
+	if(item == NULL || item->deleted) {
 		return OHC_ERROR;
 	}
 	if(!server_item_valid(item)) {
 		server_item_delete(item);
 		return OHC_ERROR;
 	}
+	if(server_item_stale(r, item) != OHC_OK) {
+		return OHC_ERROR;
+	}
+	if(item->putting && server_putting_attach(r, item) != OHC_OK) {
+		return OHC_ERROR;
+	}
+	if(item->partial && server_partial_cover(r, item) != OHC_OK) {
+		return OHC_ERROR;
+	}
+	r->body_len = item->length - item->headers_len;
+	if(item->chunked && server_chunks_get(r, item) != OHC_OK) {
+		server_item_delete(item);
+		return OHC_ERROR;
+	}
 
 	s->hits++;
 	s->hits_current_period++;
 	device_of_item(item)->used++;
 
+	if(!server_item_busy(item)) {
+		tlist_add(&item->busy_node, table_busy_items());
+	}
 	item->used++;
+	if(item->hits != USHRT_MAX) {
+		item->hits++;
+	}
 	r->item = item;
 
 	/* update LRU */
-	list_del(&item->lru_node);
-	list_add(&item->lru_node, server_lru_head(s));
+	tlist_del(&item->lru_node);
+	tlist_add(&item->lru_node, server_lru_head(s));
+
+	return OHC_OK;
+}
+
+static int server_passby_store(ohc_server_t *s, unsigned char *hash_id)
+{
+	static ohc_slab_t passby_item_slab = OHC_SLAB_INIT(ohc_passby_item_t);
+
+	ohc_passby_item_t *passby_item;
+
+	if(!s->passby_enable || s->tab->item_nr < s->passby_begin_item_nr
+			     || s->tab->consumed < s->passby_begin_consumed) {
+		return OHC_DECLINE;
+	}
 
+	passby_item = slab_alloc(&passby_item_slab);
+	if(passby_item == NULL) {
+		log_error_run(0, "NoMem");
+		return OHC_ERROR;
+	}
+
+	passby_item->expire = timer_now(&master_timer) + s->passby_expire;
+	memcpy(passby_item->hnode.id, hash_id, 16);
+	hash_add(s->hash, &passby_item->hnode, NULL, 0);
+	list_add(&passby_item->lru_node, &s->passby_lru_head);
+	s->passby_item_nr++;
+	s->passby_stores++;
+	s->passby_stores_current_period++;
+
+	return OHC_OK;
+}
+
+/* @request module call this, in a PUT request, to put an item */
+/* allocate space for @item by its length, and set @block_size.
+ * return OHC_ERROR if fail. */
+static int server_item_alloc(ohc_server_t *s, ohc_item_t *item,
+		size_t *block_size)
+{
+	int try = 0;
+	int rc;
+
+try_again:
+	if(item->length <= s->small_item_size
+			&& item_block_length(item) <= OHC_PAGE_SIZE) {
+		/* the page's block is accounted in page_get_slot() */
+		*block_size = 0;
+		rc = page_get_slot(s, item);
+	} else {
+		*block_size = device_get_free_block(item);
+		rc = *block_size ? OHC_OK : OHC_ERROR;
+	}
+	if(rc != OHC_OK) {
+		/* If fails in getting free block, expire some items and try again.
+		 * The following expire order is complicated, and there is no
+		 * specific reason for the order. Just feeling. */
+		if(try++ < 2 && !tlist_empty(&s->tab->lru_head)
+				&& s->tab->consumed + item->length*2 > s->capacity) {
+			server_item_expire(s, item->length * 2);
+			goto try_again;
+		}
+		if(try++ < 5 && !tlist_empty(table_shared_lru())) {
+			server_shared_expire(item->length * 2);
+			goto try_again;
+		}
+		if(try++ < 9 && !tlist_empty(&s->tab->lru_head)) {
+			server_item_expire(s, item->length * 2);
+			goto try_again;
+		}
+		if(try++ < 12) {
+			device_free_block_extend(item->length);
+			goto try_again;
+		}
+		return OHC_ERROR;
+	}
 	return OHC_OK;
 }
 
-static int server_passby_store(ohc_server_t *s, unsigned char *hash_id)
+/* add the allocated @item in putting into server @s. The shadow item
+ * is added into hash when stored, see server_item_replace(). */
+static void server_item_add(ohc_server_t *s, ohc_item_t *item,
+		unsigned char *hash_id, time_t expire, size_t block_size)
 {
-	static ohc_slab_t passby_item_slab = OHC_SLAB_INIT(ohc_passby_item_t);
+	item->putting = 1;
+	item->partial = 0;
+	item->badblock = 0;
+	item->deleted = 0;
+	item->used = 0;
+	item->hits = 0;
+	item->clear = s->tab->clear;
+	item->expire = expire;
+	item->server_index = s->index;
+	memcpy(item->hnode.id, hash_id, 16);
+	if(!item->shadow) {
+		table_hash_add(item);
+	}
+	tlist_add(&item->lru_node, server_lru_head(s));
+	tlist_add(&item->busy_node, table_busy_items());
 
-	ohc_passby_item_t *passby_item;
+	s->tab->consumed += block_size;
+	s->tab->content += item->length;
+	s->tab->item_nr++;
+	device_of_item(item)->used++;
+}
 
-	if(!s->passby_enable || s->item_nr < s->passby_begin_item_nr
-			     || s->consumed < s->passby_begin_consumed) {
-		return OHC_DECLINE;
-	}
+/* allocate the chunks besides the @head for PUT @r, see server_chunk_get().
+ * The chunks are in putting as the head, and their heads on disk are
+ * written by worker. */
+static int server_chunks_put(ohc_request_t *r, ohc_item_t *head)
+{
+	ohc_server_t *s = r->server;
+	ohc_item_t *chunk;
+	unsigned char id[16];
+	size_t block_size;
+	long i, n;
 
-	passby_item = slab_alloc(&passby_item_slab);
-	if(passby_item == NULL) {
+	n = (r->body_len + s->chunk_size - 1) / s->chunk_size;
+	r->chunks = malloc(n * sizeof(ohc_item_t *));
+	r->chunk_heads = malloc(n * sizeof(ohc_item_head_t));
+	if(r->chunks == NULL || r->chunk_heads == NULL) {
 		log_error_run(0, "NoMem");
+		free(r->chunks);
+		free(r->chunk_heads);
+		r->chunks = NULL;
+		r->chunk_heads = NULL;
 		return OHC_ERROR;
 	}
+	r->chunks[0] = head;
+	r->chunk_nr = 1;
+
+	for(i = 1; i < n; i++) {
+		chunk = table_alloc();
+		if(chunk == NULL) {
+			log_error_run(0, "NoMem");
+			return OHC_ERROR;
+		}
+		chunk->length = i < n - 1 ? s->chunk_size
+				: r->body_len - i * s->chunk_size;
+		chunk->headers_len = 0;
+		if(server_item_alloc(s, chunk, &block_size) != OHC_OK) {
+			log_error_run(0, "space(%ld) alloc fail in server %s",
+					chunk->length, s->listen_name);
+			table_free(chunk);
+			return OHC_ERROR;
+		}
 
-	passby_item->passby = 1;
-	passby_item->expire = timer_now(&master_timer) + s->passby_expire;
-	memcpy(passby_item->hnode.id, hash_id, 16);
-	hash_add(s->hash, &passby_item->hnode, NULL, 0);
-	list_add(&passby_item->lru_node, &s->passby_lru_head);
-	s->passby_item_nr++;
-	s->passby_stores++;
-	s->passby_stores_current_period++;
-
+		server_chunk_id(head, i, id);
+		chunk->validator = n;
+		server_item_add(s, chunk, id, head->expire, block_size);
+		format_item_head(&r->chunk_heads[i], chunk, OHC_IH_PUTTING);
+		r->chunks[r->chunk_nr++] = chunk;
+	}
 	return OHC_OK;
 }
 
-/* @request module call this, in a PUT request, to put an item */
 int server_request_put_handler(ohc_request_t *r)
 {
 	ohc_item_t *item;
 	ohc_passby_item_t *passby_item;
-	ohc_hash_node_t *hnode;
+	ohc_partial_t *partial = NULL;
 	ohc_server_t *s;
 	unsigned char hash_id[16];
 	size_t block_size;
+	ssize_t body_len;
 	time_t now;
-	int try = 0;
+	int chunked, shadow = 0;
 
 	s = r->server;
 	s->puts++;
 	s->puts_current_period++;
 
+	/* the whole body, for PUT with Content-Range */
+	body_len = r->range_put ? r->range_total : r->content_length;
+
 	/* check size */
-	if(s->item_max_size != 0 && r->content_length > s->item_max_size) {
+	if(s->item_max_size != 0 && body_len > s->item_max_size) {
 		r->error_reason = "TooBigItem1";
 		return OHC_DECLINE;
 	}
-	if(s->capacity != 0 && r->content_length + r->put_header_length > s->capacity) {
+	if(s->capacity != 0 && body_len + r->put_header_length > s->capacity) {
 		r->error_reason = "TooBigItem2";
 		return OHC_DECLINE;
 	}
+	chunked = s->chunk_size != 0 && !r->range_put && body_len > s->chunk_size;
+	if(!chunked && body_len + r->put_header_length > UINT32_MAX) {
+		r->error_reason = "TooBigItem3";
+		return OHC_DECLINE;
+	}
 
 	/* check expire */
 	now = timer_now(&master_timer);
-	if(s->expire_force != 0) {
-		r->expire = s->expire_force + now;
-
-	} else if(r->expire == 0) {
-		if(s->expire_default == 0) {
-			r->error_reason = "Expired";
-			return OHC_DECLINE;
-		}
-		r->expire = s->expire_default + now;
+	if(server_request_expire(r) != OHC_OK) {
+		return OHC_DECLINE;
+	}
 
-	} else {}
+	/* e.g. all devices are loading. Do not expire items for nothing */
+	if(!device_available()) {
+		r->error_reason = "NoDevice";
+		return OHC_DECLINE;
+	}
 
 	/* check exist */
-	hnode = server_hash_get(r, hash_id);
-	if(hnode == NULL) {
+	passby_item = server_hash_get(r, hash_id);
+	item = table_hash_get(hash_id, s->index);
+	if(passby_item != NULL) {
+		server_passby_item_delete(s, passby_item);
+
+	} else if(item == NULL) {
 		if(server_passby_store(s, hash_id) == OHC_OK) {
 			r->error_reason = "StorePassby";
 			return OHC_DECLINE;
 		}
-	} else {
-		passby_item = list_entry(hnode, ohc_passby_item_t, hnode);
-		item = list_entry(hnode, ohc_item_t, hnode);
-		if(passby_item->passby) {
-			server_passby_item_delete(s, passby_item);
-
-		} else if(r->method == OHC_HTTP_METHOD_PUT || !server_item_valid(item)) {
-			server_item_delete(item);
 
-		} else {
+	} else if(r->range_put && !item->putting && server_item_valid(item)
+			&& item->length - item->headers_len == body_len) {
+		/* fill the partial item */
+		if(!item->partial) {
 			r->error_reason = "Exist";
 			return OHC_DECLINE;
 		}
+		item->used++;
+		device_of_item(item)->used++;
+		r->item = item;
+		return OHC_OK;
+
+	} else if((r->method == OHC_HTTP_METHOD_PUT || item->expire <= now)
+			&& !r->range_put && server_item_valid(item)
+			&& !item->putting && !item->partial
+			&& !(chunked && item->chunked)) {
+		/* keep serving it until the new one is stored. POST
+		 * refreshes the stale item too. */
+		shadow = 1;
+
+	} else if(r->method == OHC_HTTP_METHOD_PUT || item->expire <= now
+			|| !server_item_valid(item)) {
+		server_item_delete(item);
+
+	} else {
+		r->error_reason = "Exist";
+		return OHC_DECLINE;
 	}
 
 	/* check done, store the item now */
 
-	item = slab_alloc(&item_slab);
+	if(r->range_put) {
+		if(s->partials == NULL) {
+			s->partials = hash_init();
+		}
+		partial = s->partials ? slab_alloc(&partial_slab) : NULL;
+		if(partial == NULL) {
+			log_error_run(0, "NoMem");
+			return OHC_ERROR;
+		}
+	}
+
+	item = table_alloc();
 	if(item == NULL) {
 		log_error_run(0, "NoMem");
+		if(partial) {
+			slab_free(partial);
+		}
 		return OHC_ERROR;
 	}
-	item->length = r->content_length + r->put_header_length;
+	item->seq = ++item_seq;
+	item->length = (chunked ? s->chunk_size : body_len) + r->put_header_length;
 	item->headers_len = r->put_header_length;
 
-try_again:
-	block_size = device_get_free_block(item);
-	if(block_size == 0) {
-		/* If fails in getting free block, expire some items and try again.
-		 * The following expire order is complicated, and there is no
-		 * specific reason for the order. Just feeling. */
-		if(try++ < 2 && !list_empty(&s->lru_head)
-				&& s->consumed + item->length*2 > s->capacity) {
-			server_item_expire(s, item->length * 2);
-			goto try_again;
-		}
-		if(try++ < 5 && !list_empty(&shared_lru_head)) {
-			server_shared_expire(item->length * 2);
-			goto try_again;
-		}
-		if(try++ < 9 && !list_empty(&s->lru_head)) {
-			server_item_expire(s, item->length * 2);
-			goto try_again;
-		}
-		if(try++ < 12) {
-			device_free_block_extend(item->length);
-			goto try_again;
+	if(server_item_alloc(s, item, &block_size) != OHC_OK) {
+		if(partial) {
+			slab_free(partial);
 		}
-
-		slab_free(item);
 		r->error_reason = "NoSpace";
-		log_error_run(0, "space(%ld) alloc fail in server %d",
-				item->length, s->listen_port);
+		log_error_run(0, "space(%ld) alloc fail in server %s",
+				item->length, s->listen_name);
+		table_free(item);
 		return OHC_ERROR;
 	}
 
 	/* done. update something */
 	r->item = item;
-	item->putting = 1;
-	item->badblock = 0;
-	item->deleted = 0;
-	item->used = 0;
-	item->clear = s->clear;
-	item->expire = r->expire;
-	item->server_index = s->index;
-	memcpy(item->hnode.id, hash_id, 16);
-	hash_add(s->hash, &item->hnode, NULL, 0);
-	list_add(&item->lru_node, server_lru_head(s));
-	s->consumed += block_size;
-	s->content += item->length;
-	s->item_nr++;
+	r->body_len = body_len;
+	item->chunked = chunked;
+	item->shadow = shadow;
+	item->etag = r->validator_etag;
+	item->validator = r->validator;
+	server_item_add(s, item, hash_id, r->expire, block_size);
+	format_item_head(&r->item_head, item, OHC_IH_PUTTING);
+
+	/* a partial item is not in putting, and the PUTs filling it hold
+	 * it as GETs do. The creating one writes the stored headers. */
+	if(partial) {
+		item->putting = 0;
+		item->partial = 1;
+		item->used = 1;
+		partial->creating = 1;
+		partial->nr = 0;
+		memcpy(partial->hnode.id, hash_id, 16);
+		hash_add(s->partials, &partial->hnode, NULL, 0);
+		r->range_create = 1;
+	}
+
 	s->stores++;
 	s->stores_current_period++;
-	device_of_item(item)->used++;
 
+	/* the head is deleted in server_request_finalize() if fails */
+	if(chunked && server_chunks_put(r, item) != OHC_OK) {
+		r->error_reason = "NoSpace";
+		return OHC_ERROR;
+	}
+
+	/* chunked items are not read while written, for simple */
+	if(s->read_while_write && !partial && !chunked && !shadow) {
+		server_putting_add(r, item);
+	}
 	return OHC_OK;
 }
 
-/* @request module call this, in a DELETE request, to delete an item */
-int server_request_delete_handler(ohc_request_t *r)
+/* delete the item or the pass-by item @passby_item, by @hash_id */
+static int server_delete_id(ohc_server_t *s, ohc_passby_item_t *passby_item,
+		unsigned char *hash_id)
 {
-	ohc_hash_node_t *hnode;
 	ohc_item_t *item;
-	ohc_passby_item_t *passby_item;
-	ohc_server_t *s = r->server;
 
 	s->deletes++;
 	s->deletes_current_period++;
 
-	hnode = server_hash_get(r, NULL);
-	if(hnode == NULL) {
+	if(device_loading()) {
+		server_load_delete(s, hash_id);
+	}
+	if(passby_item != NULL) {
+		server_passby_item_delete(s, passby_item);
+		return OHC_OK;
+	}
+
+	item = table_hash_get(hash_id, s->index);
+	if(item == NULL) {
 		return OHC_ERROR;
 	}
+	server_item_delete(item);
+	return OHC_OK;
+}
 
-	passby_item = list_entry(hnode, ohc_passby_item_t, hnode);
-	if(passby_item->passby) {
-		server_passby_item_delete(s, passby_item);
-	} else {
-		item = list_entry(hnode, ohc_item_t, hnode);
+/* @request module call this, in a DELETE request, to delete an item */
+int server_request_delete_handler(ohc_request_t *r)
+{
+	unsigned char hash_id[16];
+	ohc_passby_item_t *passby_item = server_hash_get(r, hash_id);
+
+	return server_delete_id(r->server, passby_item, hash_id);
+}
+
+/* update @item's expire in memory, journal, and its head on disk */
+static void server_item_touch(ohc_item_t *item, time_t expire)
+{
+	item->expire = expire;
+	journal_add_item(item);
+	format_item_touch(item);
+}
+
+/* set the expire of the item by @hash_id to @r->expire, unless it's
+ * pass-by. The chunks are updated too, since they expire alone. */
+static int server_touch(ohc_request_t *r, ohc_passby_item_t *passby_item,
+		unsigned char *hash_id)
+{
+	ohc_item_t *item, *chunk;
+	ohc_server_t *s = r->server;
+	long i, n;
+
+	if(passby_item != NULL) {
+		return OHC_ERROR;
+	}
+
+	item = table_hash_get(hash_id, s->index);
+	if(item == NULL) {
+		return OHC_ERROR;
+	}
+	if(item->deleted || item->putting || item->partial) {
+		r->error_reason = "NotStored";
+		return OHC_ERROR;
+	}
+	if(!server_item_valid(item)) {
 		server_item_delete(item);
+		return OHC_ERROR;
+	}
+
+	if(item->chunked) {
+		/* check all chunks first, see server_chunks_get() */
+		chunk = server_chunk_get(s, item, 1);
+		n = (chunk && !chunk->putting) ? chunk->validator : 0;
+		for(i = 1; i < n; i++) {
+			chunk = server_chunk_get(s, item, i);
+			if(chunk == NULL || chunk->putting || !server_item_valid(chunk)) {
+				break;
+			}
+		}
+		if(n < 2 || i < n) {
+			server_item_delete(item);
+			return OHC_ERROR;
+		}
+		for(i = 1; i < n; i++) {
+			server_item_touch(server_chunk_get(s, item, i), r->expire);
+		}
 	}
+
+	server_item_touch(item, r->expire);
 	return OHC_OK;
 }
 
+/* @request module call this, in a TOUCH request, to update the expire
+ * of an item, e.g. after it's revalidated. The body and headers are
+ * not changed. */
+int server_request_touch_handler(ohc_request_t *r)
+{
+	unsigned char hash_id[16];
+
+	if(server_request_expire(r) != OHC_OK) {
+		return OHC_ERROR;
+	}
+	return server_touch(r, server_hash_get(r, hash_id), hash_id);
+}
+
+/* the body length of @item if it's readable, or -1 */
+static ssize_t server_exists(ohc_server_t *s, ohc_item_t *item)
+{
+	ohc_item_t *first, *last;
+
+	if(item == NULL || item->deleted || item->putting || item->partial
+			|| !server_item_valid(item)) {
+		return -1;
+	}
+	if(!item->chunked) {
+		return item->length - item->headers_len;
+	}
+
+	/* see server_chunks_get() */
+	first = server_chunk_get(s, item, 1);
+	if(first == NULL || first->validator < 2) {
+		return -1;
+	}
+	last = server_chunk_get(s, item, first->validator - 1);
+	if(last == NULL || last->putting) {
+		return -1;
+	}
+	return (first->validator - 1) * (item->length - item->headers_len)
+		+ last->length;
+}
+
+/* @request module call this, in a BATCH request. @keys are URIs
+ * separated by line, and the result of each one is written into
+ * @output by line, SERVER_BATCH_LINE at most: "size expire" or "-"
+ * for exists, "1" or "0" for delete and touch. The MD5s of all keys
+ * are computed first, and then the buckets are prefetched ahead of
+ * searching. return the length of @output, or -1 if fails. */
+ssize_t server_request_batch_handler(ohc_request_t *r, char *keys,
+		ssize_t len, char *output)
+{
+	ohc_server_t *s = r->server;
+	ohc_hash_node_t *hnode;
+	ohc_passby_item_t *passby_item;
+	ohc_item_t *item;
+	unsigned char (*ids)[16];
+	char key[REQ_BUF_SIZE * 2]; /* with Host and OHC-Key */
+	char *p, *end, *q, *out = output;
+	ssize_t size, klen;
+	long i, nr = 1;
+
+	if(r->batch == REQ_BATCH_TOUCH && server_request_expire(r) != OHC_OK) {
+		return -1;
+	}
+
+	end = keys + len;
+	for(p = keys; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+		nr++;
+	}
+	ids = malloc(nr * 16);
+	if(ids == NULL) {
+		r->error_reason = "NoMem";
+		return -1;
+	}
+
+	/* MD5 of keys. Too long key is not found, as an empty key. */
+	for(p = keys, i = 0; p < end; p = q + 1, i++) {
+		q = memchr(p, '\n', end - p);
+		if(q == NULL) {
+			q = end;
+		}
+		klen = q - p;
+		if(klen > 0 && p[klen - 1] == '\r') {
+			klen--;
+		}
+		if(klen > REQ_BUF_SIZE) {
+			klen = 0;
+		}
+		MD5((unsigned char *)key, server_key(r, p, klen, key), ids[i]);
+	}
+	nr = i;
+
+	for(i = 0; i < nr; i++) {
+		if(i + 2 * SERVER_BATCH_PREFETCH < nr) {
+			table_hash_prefetch(ids[i + 2 * SERVER_BATCH_PREFETCH], 0);
+		}
+		if(i + SERVER_BATCH_PREFETCH < nr) {
+			table_hash_prefetch(ids[i + SERVER_BATCH_PREFETCH], 1);
+		}
+		hnode = hash_get_id(s->hash, ids[i]);
+		passby_item = hnode ? list_entry(hnode, ohc_passby_item_t, hnode) : NULL;
+
+		switch(r->batch) {
+		case REQ_BATCH_EXISTS:
+			item = passby_item ? NULL : table_hash_get(ids[i], s->index);
+			size = server_exists(s, item);
+			if(size < 0) {
+				out += sprintf(out, "-\n");
+			} else {
+				out += sprintf(out, "%ld %d\n", size, item->expire);
+			}
+			break;
+		case REQ_BATCH_DELETE:
+			out += sprintf(out, "%d\n", server_delete_id(s, passby_item,
+						ids[i]) == OHC_OK);
+			break;
+		case REQ_BATCH_TOUCH:
+			out += sprintf(out, "%d\n", server_touch(r, passby_item,
+						ids[i]) == OHC_OK);
+			break;
+		}
+	}
+
+	free(ids);
+	return out - output;
+}
+
+/* a PUT with Content-Range finishs. The item is complete if all ranges
+ * are filled, and the creating PUT is done. */
+static void server_partial_finalize(ohc_request_t *r, ohc_item_t *item)
+{
+	ohc_server_t *s = r->server;
+	ohc_partial_t *partial;
+
+	if(r->disk_error) {
+		item->badblock = 1;
+		server_item_delete(item);
+		return;
+	}
+	if(item->deleted) {
+		server_item_delete(item);
+		return;
+	}
+
+	if(r->process_size < r->content_length + r->put_header_length) {
+		/* the stored headers may be not written */
+		if(r->range_create) {
+			server_item_delete(item);
+		}
+		return;
+	}
+
+	partial = server_partial_get(s, item);
+	if(r->range_create) {
+		partial->creating = 0;
+	}
+
+	switch(server_partial_fill(partial, item, r->range_start, r->range_end)) {
+	case OHC_ERROR:
+		r->error_reason = "TooFragmented";
+		server_item_delete(item);
+		break;
+	case OHC_DONE:
+		if(!partial->creating) {
+			server_partial_delete(s, item);
+			item->partial = 0;
+			if(!server_item_busy(item)) {
+				tlist_del(&item->busy_node);
+			}
+			format_item_complete(item);
+			journal_add_item(item);
+		}
+		break;
+	default:
+		;
+	}
+}
+
+/* release the chunks of @r besides the head. The chunks of a @stored
+ * item are journaled. return OHC_ERROR if any chunk is deleted, and
+ * then the item is broken. */
+static int server_chunks_finalize(ohc_request_t *r, int stored)
+{
+	ohc_item_t *chunk;
+	int i, putting, rc = OHC_OK;
+
+	for(i = 1; i < r->chunk_nr; i++) {
+		if(r->chunks[i]->deleted) {
+			rc = OHC_ERROR;
+			stored = 0;
+			break;
+		}
+	}
+
+	for(i = 1; i < r->chunk_nr; i++) {
+		chunk = r->chunks[i];
+		device_of_item(chunk)->used--;
+
+		putting = chunk->putting;
+		if(putting) {
+			chunk->putting = 0;
+		} else {
+			chunk->used--;
+		}
+		if(!server_item_busy(chunk)) {
+			tlist_del(&chunk->busy_node);
+		}
+
+		if(chunk->deleted || (putting && !stored)) {
+			server_item_delete(chunk);
+		} else if(putting) {
+			journal_add_item(chunk);
+		}
+	}
+
+	free(r->chunks);
+	free(r->chunk_heads);
+	r->chunks = NULL;
+	r->chunk_heads = NULL;
+	r->chunk_nr = 0;
+	return rc;
+}
+
+/* the shadow @item is stored, so replace the item in hash by it */
+static void server_item_replace(ohc_item_t *item)
+{
+	ohc_server_t *s = server_of_item(item);
+	ohc_hash_node_t *hnode;
+	ohc_item_t *old;
+
+	hnode = hash_get_id(s->hash, item->hnode.id);
+	if(hnode != NULL) {
+		server_passby_item_delete(s,
+				list_entry(hnode, ohc_passby_item_t, hnode));
+	}
+	old = table_hash_get(item->hnode.id, s->index);
+	if(old != NULL) {
+		server_item_delete(old);
+	}
+
+	item->shadow = 0;
+	table_hash_add(item);
+}
+
 /* @request module call this, when a request finishs */
 void server_request_finalize(ohc_request_t *r)
 {
 	ohc_item_t *item = r->item;
-	int not_finish = 0;
+	int not_finish = 0, stored = 0;
 
 	if(item == NULL) {
 		return;
@@ -757,16 +2150,38 @@ void server_request_finalize(ohc_request_t *r)
 
 	device_of_item(item)->used--;
 
-	if(item->putting) {
+	/* GETs may read the item in putting, see ohc_putting_t */
+	if(item->putting && (r->method == OHC_HTTP_METHOD_PUT
+				|| r->method == OHC_HTTP_METHOD_POST)) {
 		item->putting = 0;
 
-		if(r->process_size < item->length) {
+		if(r->process_size < item->headers_len + r->body_len) {
 			not_finish = 1;
+		} else {
+			stored = 1;
 		}
 
 	} else {
 		item->used--;
 	}
+	if(!server_item_busy(item)) {
+		tlist_del(&item->busy_node);
+	}
+
+	if(r->range_put) {
+		server_partial_finalize(r, item);
+		return;
+	}
+
+	if(r->chunks && server_chunks_finalize(r, stored && !r->disk_error
+				&& !item->deleted) != OHC_OK) {
+		not_finish = 1;
+		stored = 0;
+	}
+
+	if(r->putting) {
+		server_putting_release(r, not_finish || r->disk_error);
+	}
 
 	if(r->disk_error) {
 		item->badblock = 1;
@@ -774,6 +2189,13 @@ void server_request_finalize(ohc_request_t *r)
 
 	} else if(item->deleted || not_finish) {
 		server_item_delete(item);
+
+	} else if(stored) {
+		if(item->shadow) {
+			server_item_replace(item);
+		}
+		journal_add_item(item);
+		tag_add_item(r, item);
 	}
 }
 
@@ -789,7 +2211,7 @@ void server_listen_handler(ohc_server_t *s)
 			if(errno == EAGAIN) {
 				return;
 			}
-			log_error_run(errno, "accept in server %d", s->listen_port);
+			log_error_run(errno, "accept in server %s", s->listen_name);
 			return;
 		}
 
@@ -802,15 +2224,32 @@ static void server_destroy(ohc_server_t *s)
 	/* If s->capacity==0, server_item_expire() does not works, because
 	 * the items are linked on shared_lru_head.
 	 * So maybe we need hash_pop()? */
-	server_item_expire(s, s->consumed);
+	server_item_expire(s, s->tab->consumed);
+	page_close(s);
 
-	if(s->item_nr != 0 || s->passby_item_nr != 0) {
+	if(s->tab->item_nr != 0 || s->passby_item_nr != 0) {
 		return;
 	}
 
 	list_del(&s->snode);
-	hash_destroy(s->hash);
-	fclose(s->access_filp);
+	server_load_deleted_clean(s);
+
+	/* not set for the servers left in item table */
+	if(s->hash) {
+		hash_destroy(s->hash);
+	}
+	if(s->partials) {
+		hash_destroy(s->partials);
+	}
+	if(s->puttings) {
+		hash_destroy(s->puttings);
+	}
+	tag_destroy(s);
+	if(s->access_filp) {
+		fclose(s->access_filp);
+	}
+
+	s->tab->inuse = 0;
 	idx_pointer_delete(&server_indexs, s->index);
 	free(s);
 }
@@ -854,7 +2293,10 @@ void server_routine(void)
 		}
 
 		/* expire item if over-size */
-		server_item_expire(s, s->consumed > s->capacity ? s->consumed - s->capacity : 0);
+		server_item_expire(s, s->tab->consumed > s->capacity
+				? s->tab->consumed - s->capacity : 0);
+
+		tag_routine(s);
 
 		fflush(s->access_filp);
 	}
@@ -882,14 +2324,15 @@ void server_status(FILE *filp)
 
 	list_for_each(p, &servers) {
 		s = list_entry(p, ohc_server_t, snode);
-		fprintf(filp, "-- %d %ld %ld "
+		fprintf(filp, "-- %s %ld %ld "
 				"| %ld %ld %ld %ld %d "
 				"| %ld %ld %ld %ld %ld %ld "
 				"| %ld %ld %ld %ld %ld %ld "
 				"| %ld %ld "
 				"| %ld %ld\n",
-				s->listen_port, s->capacity, s->status_period,
-				s->consumed, s->content, s->item_nr, s->passby_item_nr, s->connections,
+				s->listen_name, s->capacity, s->status_period,
+				s->tab->consumed, s->tab->content, s->tab->item_nr,
+				s->passby_item_nr, s->connections,
 				s->gets, s->gets_last_period, s->hits, s->hits_last_period,
 				s->passby_hits, s->passby_hits_last_period,
 				s->puts, s->puts_last_period, s->stores, s->stores_last_period,
@@ -14,25 +14,42 @@
 struct ohc_server_s {
 	struct list_head	snode;
 
-	struct list_head	lru_head;
+	/* the part kept in item table, with LRU and counters */
+	ohc_table_server_t	*tab;
+
 	struct list_head	passby_lru_head;
 
+	/* TCP port, or unix socket path with port 0. @listen_name is
+	 * the one of them shown in logs and status. */
 	unsigned short	listen_port;
+	char		listen_path[SERVER_PATH_MAX];
+	char		listen_name[SERVER_PATH_MAX + 5];
 	int		listen_fd;
 
+	/* pass-by items. Items are in the hash of item table. */
 	ohc_hash_t	*hash;
 
+	/* items filled by PUTs with Content-Range, see ohc_partial_t */
+	ohc_hash_t	*partials;
+
+	/* items in putting and readable, see ohc_putting_t */
+	ohc_hash_t	*puttings;
+
+	/* items by tag and URI prefix, see tag.c */
+	ohc_hash_t		*tags;
+	struct list_head	tag_head;
+	struct list_head	purge_head;
+
+	/* IDs deleted while loading items from devices */
+	ohc_hash_t		*load_deleted;
+	struct list_head	load_deleted_head;
+
 	size_t		capacity;
-	size_t		consumed;
-	size_t		content;
-	long		item_nr;
 
 	ohc_server_t	*conf;
 
 	int		index;
 
-	unsigned short	clear;
-
 	unsigned	deleted:1;
 
 	ohc_flag_t	server_dump;
@@ -40,6 +57,8 @@ struct ohc_server_s {
 	ohc_flag_t	key_include_host;
 	ohc_flag_t	key_include_ohc_key;
 	ohc_flag_t	key_include_query;
+	ohc_flag_t	read_while_write;
+	ohc_flag_t	memcached;
 
 	ohc_flag_t	passby_enable;
 	long		passby_begin_item_nr;
@@ -60,8 +79,14 @@ struct ohc_server_s {
 	char		access_log[PATH_LENGTH];
 	FILE		*access_filp;
 	size_t		item_max_size;
+	size_t		small_item_size;
+	size_t		chunk_size; /* 0 for not chunking big items */
+	int		max_ranges;
+	int		prefix_depth; /* URI prefix levels indexed, see tag.c */
 	time_t		expire_default;
 	time_t		expire_force;
+	int		stale_while_revalidate;
+	int		grace;
 
 	/* statistics */
 	long		gets;
@@ -97,10 +122,39 @@ struct ohc_server_s {
 	time_t		status_period;
 };
 
+/* node in item table's hash, see table_hash_add() */
+typedef struct {
+	unsigned char	id[16];
+	tpos_t		next;
+} ohc_table_hnode_t;
+
+/* Items are in the item table, and linked by positions in it. */
 struct ohc_item_s {
-	ohc_hash_node_t		hnode;
-	struct list_head	order_node;
-	struct list_head	lru_node;
+	ohc_table_hnode_t	hnode;
+
+	/* the page that a packed item is in, 0 if not packed */
+	tpos_t			page;
+
+	/* @order_node must be followed by @fblock and @is_page,
+	 * see ohc_free_block_t. */
+	struct tlist_head	order_node;
+	unsigned		fblock:1;
+	unsigned		is_page:1;
+
+	unsigned		putting:1;
+	unsigned		deleted:1;
+	unsigned		badblock:1;
+	unsigned		packed:1;
+	unsigned		headless:1; /* loaded from old dump */
+	unsigned		etag:1; /* @validator is ETag or Last-Modified */
+	unsigned		partial:1; /* filled by PUTs with Content-Range */
+	unsigned		chunked:1; /* the head of a chunked item */
+	unsigned		shadow:1; /* replacing, not in hash until stored */
+
+	/* sequence of stored items, to tell a new item from a freed one
+	 * in the same slot, e.g. in tag entries. It wraps around, but a
+	 * slot is hardly reused by the same key just 2M stores later. */
+	unsigned		seq:21;
 
 	/* since the number of items is huge, so we try our
 	 * best to minimize the size of ohc_item_s. */
@@ -108,47 +162,116 @@ struct ohc_item_s {
 	/* we supports 4G at most */
 	uint32_t		length;
 
+	struct tlist_head	lru_node;
+
+	/* linked in table's busy items if in use or in putting */
+	struct tlist_head	busy_node;
+
 	/* 2038 is enough... */
 	int32_t			expire;
 
-	/* since sendfile(2) supports only 0x4020010000, so 40bits is enough */
-	unsigned long		offset:40;
+	/* hash of ETag, or Last-Modified time, 0 for none */
+	uint32_t		validator;
 
-	unsigned		putting:1;
-	unsigned		deleted:1;
-	unsigned		badblock:1;
-
-	short			server_index;
-	short			device_index;
+	/* since sendfile(2) supports only 0x4020010000, so 40bits is enough.
+	 * The indexes are less than IPT_ARRAY_SIZE, so 12bits. */
+	unsigned long		offset:40;
+	unsigned long		server_index:12;
+	unsigned long		device_index:12;
 
 	unsigned short		headers_len;
 	unsigned short		used;
 	unsigned short		clear;
+	unsigned short		hits; /* saturated, kept in dump */
 };
 
+/* @offset is where the response headers begin, and the item's block
+ * begins with the ohc_item_head_t before it. */
+static inline size_t item_head_size(ohc_item_t *item)
+{
+	return item->headless ? 0 : OHC_ITEM_HEAD_SIZE;
+}
+
+static inline off_t item_block_offset(ohc_item_t *item)
+{
+	return item->offset - item_head_size(item);
+}
+
+static inline size_t item_block_length(ohc_item_t *item)
+{
+	return item->length + item_head_size(item);
+}
+
 #define SERVERS_LIMIT IPT_ARRAY_SIZE
 
-void server_dump_ports(unsigned short *ports);
+/* at most servers listening on unix sockets */
+#define SERVER_UNIX_LIMIT	16
+
+/* listens of servers by index, in dumps and checkpoints. The few
+ * unix socket servers are with port 0 in @ports, and in @unixes. */
+struct ohc_server_listens_s {
+	unsigned short	ports[SERVERS_LIMIT];
+	struct {
+		short	index;
+		char	path[SERVER_PATH_MAX]; /* empty for unused */
+	} unixes[SERVER_UNIX_LIMIT];
+};
+
+/* the written size of an item in putting, shared by the PUT and the
+ * GETs reading the item while it's written, which may be in different
+ * worker threads. In the server's @puttings, by the item's ID, until
+ * the PUT finishs. Freed by master when no request refers it. */
+struct ohc_putting_s {
+	ohc_hash_node_t	hnode;
+	volatile size_t	size; /* updated by the PUT's worker */
+	volatile int	aborted; /* set by master if the PUT fails */
+	int		refs;
+	unsigned	hashed:1;
+};
+
+/* at most ranges filled apart in a partial item */
+#define SERVER_PARTIAL_RANGES	64
+
+/* see server_request_batch_handler() */
+#define SERVER_BATCH_LINE	32
+#define SERVER_BATCH_PREFETCH	8
+
+/* range of chunk_size, see server_chunks_put() */
+#define SERVER_CHUNK_MIN	(1 << 20)
+#define SERVER_CHUNK_MAX	(1 << 30)
+
+void server_dump_listens(ohc_server_listens_t *listens);
+void server_set_listen(ohc_server_t *s, unsigned short port,
+		const char *path);
 ohc_server_t *server_of_item(ohc_item_t *item);
-ohc_server_t *server_by_port(unsigned short port);
+ohc_server_t *server_by_listen(unsigned short port, const char *path);
+ohc_server_t *server_by_index(int index);
 
 int server_conf_check(ohc_conf_t *conf_cycle);
 void server_conf_load(ohc_conf_t *conf_cycle);
 void server_conf_rollback(ohc_conf_t *conf_cycle);
 
-int server_clear(unsigned short port);
+int server_clear(const char *listen);
+int server_listen_servers(ohc_server_t **list);
 void server_stop_service(void);
 
 int server_request_get_handler(ohc_request_t *r);
 int server_request_put_handler(ohc_request_t *r);
 int server_request_delete_handler(ohc_request_t *r);
+int server_request_touch_handler(ohc_request_t *r);
+ssize_t server_request_batch_handler(ohc_request_t *r, char *keys,
+		ssize_t len, char *output);
 void server_request_finalize(ohc_request_t *r);
 
 int server_item_valid(ohc_item_t *item);
+time_t server_stale_time(ohc_server_t *s);
+int server_lru_heads(struct tlist_head **heads);
+int server_load_finish(void);
 int server_load_fm_item(ohc_server_t *s, ohc_device_t *d,
 		ohc_format_item_t *fm_item);
 
 void server_item_delete(ohc_item_t *item);
+void server_table_recover(void);
 
 void server_listen_handler(ohc_server_t *s);
 
@@ -0,0 +1,524 @@
+/*
+ * Item table. Items, pages and free blocks are allocated in slots of
+ * one big mapping, and linked by their positions in it but not by
+ * pointers, see utils/tlist.h. The hash of items, the LRU lists, and
+ * the lists and counters of servers and devices are in it too.
+ *
+ * The layout of the table:
+ *
+ *     ohc_table_header_t, with servers' and devices' parts
+ *     buckets of hash, in tpos_t
+ *     slots
+ *
+ * If item_table is set, the mapping is of the file, and it is reused
+ * by the next start, so the items are not loaded from devices again.
+ * It's reused if it was closed cleanly, or the master thread was not
+ * changing it when the process crashed in the same boot. The file is
+ * sparse, and only the touched parts take space.
+ *
+ */
+
+#include <sys/mman.h>
+#include <sys/file.h>
+#include "table.h"
+#include "upgrade.h"
+
+#define TABLE_MAGIC	0x454c42415443484fL /* OHCTABLE */
+#define TABLE_VERSION	3 /* 2: add ohc_item_t.validator
+				   3: add ohc_table_server_t.path */
+
+#define TABLE_SIZE_MAX	(TPOS_LIMIT - 4096)
+/* the anonymous table is halved if fail to map, until this */
+#define TABLE_SIZE_MIN	((size_t)1 << 28)
+
+/* buckets of hash take 1/40 of table, that is about 1 bucket for
+ * 2 slots. The hash grows from TABLE_HASH_BEGIN buckets, when
+ * there are TABLE_HASH_LOAD items in each bucket on average. */
+#define TABLE_HASH_SHARE	40
+#define TABLE_HASH_BEGIN	1024
+#define TABLE_HASH_LOAD		2
+
+#define TABLE_BOOT_ID	"/proc/sys/kernel/random/boot_id"
+
+typedef union {
+	ohc_item_t		item;
+	ohc_page_t		page;
+	ohc_free_block_t	fblock;
+} ohc_table_slot_t;
+
+typedef struct {
+	uint64_t	magic;
+	int		version;
+	int		slot_size;
+	size_t		header_size;
+	size_t		size;
+
+	/* closed cleanly, or being changed by master thread */
+	int		clean;
+	int		busy;
+	char		boot_id[40];
+
+	/* free slots are linked by their first tpos_t */
+	tpos_t		free_slot;
+	tpos_t		slot_end; /* never used since */
+	long		slot_nr;
+
+	/* linear hashing. Bucket i < @bucket_nr is valid. @bucket_level
+	 * is a power of 2, with bucket_level <= bucket_nr < 2*bucket_level */
+	size_t		buckets_offset;
+	uint32_t	bucket_nr;
+	uint32_t	bucket_level;
+	uint32_t	bucket_max;
+	long		hash_items;
+
+	struct tlist_head	shared_lru_head;
+	struct tlist_head	sparse_pages;
+
+	/* items in use or in putting, see server_table_recover() */
+	struct tlist_head	busy_items;
+
+	ohc_table_server_t	servers[SERVERS_LIMIT];
+	ohc_table_device_t	devices[DEVICES_LIMIT];
+} ohc_table_header_t;
+
+char *tlist_base = NULL;
+
+static ohc_table_header_t *table = NULL;
+static tpos_t *table_buckets;
+
+static char table_path[PATH_LENGTH];
+static int table_fd = -1;
+
+static inline size_t table_align(size_t size)
+{
+	return (size + 4095) & ~4095UL;
+}
+
+static void table_boot_id(char *boot_id)
+{
+	FILE *filp;
+
+	boot_id[0] = '\0';
+	filp = fopen(TABLE_BOOT_ID, "r");
+	if(filp == NULL) {
+		return;
+	}
+	if(fgets(boot_id, 40, filp) == NULL) {
+		boot_id[0] = '\0';
+	}
+	fclose(filp);
+}
+
+static void table_init(size_t size)
+{
+	size_t buckets_size;
+
+	table->magic = TABLE_MAGIC;
+	table->version = TABLE_VERSION;
+	table->slot_size = sizeof(ohc_table_slot_t);
+	table->header_size = table_align(sizeof(ohc_table_header_t));
+	table->size = size;
+
+	buckets_size = table_align((size - table->header_size) / TABLE_HASH_SHARE);
+	table->buckets_offset = table->header_size;
+	table->bucket_nr = TABLE_HASH_BEGIN;
+	table->bucket_level = TABLE_HASH_BEGIN;
+	table->bucket_max = buckets_size / sizeof(tpos_t);
+	table->hash_items = 0;
+
+	table->free_slot = 0;
+	table->slot_end = (table->buckets_offset + buckets_size) >> TPOS_SHIFT;
+	table->slot_nr = 0;
+
+	INIT_TLIST_HEAD(&table->shared_lru_head);
+	INIT_TLIST_HEAD(&table->sparse_pages);
+	INIT_TLIST_HEAD(&table->busy_items);
+
+	/* other fields are zero, as new file or anonymous memory */
+}
+
+/* whether the mapped file is a table to reuse */
+static int table_check(size_t size, char *boot_id)
+{
+	if(table->magic != TABLE_MAGIC || table->version != TABLE_VERSION
+			|| table->slot_size != sizeof(ohc_table_slot_t)
+			|| table->header_size != table_align(sizeof(ohc_table_header_t))
+			|| table->size != size) {
+		return 0;
+	}
+	if(table->clean) {
+		return 1;
+	}
+
+	/* crashed. The memory is still in page cache if in the same boot. */
+	if(table->busy) {
+		log_error_run(0, "item_table was being changed when crashed");
+		return 0;
+	}
+	if(boot_id[0] == '\0' || strcmp(boot_id, table->boot_id) != 0) {
+		log_error_run(0, "item_table was not closed, and rebooted");
+		return 0;
+	}
+	return 1;
+}
+
+/* lock the file exclusively. Wait for the lock if @wait is set,
+ * e.g. the old process holds it until quiting in upgrading. */
+static int table_open_file(const char *path, int wait)
+{
+	char boot_id[40];
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(fd < 0) {
+		log_error_admin(errno, "open item_table %s", path);
+		return OHC_ERROR;
+	}
+	if(flock(fd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) < 0) {
+		log_error_admin(errno, "lock item_table %s", path);
+		goto fail;
+	}
+	if(fstat(fd, &st) < 0
+			|| (st.st_size != TABLE_SIZE_MAX
+				&& (ftruncate(fd, 0) < 0
+					|| ftruncate(fd, TABLE_SIZE_MAX) < 0))) {
+		log_error_admin(errno, "size item_table %s", path);
+		goto fail;
+	}
+
+	table = mmap(NULL, TABLE_SIZE_MAX, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if(table == MAP_FAILED) {
+		table = NULL;
+		log_error_admin(errno, "map item_table %s", path);
+		goto fail;
+	}
+	tlist_base = (char *)table;
+
+	table_boot_id(boot_id);
+	if(table_check(TABLE_SIZE_MAX, boot_id)) {
+		log_error_run(0, "reuse item_table with %ld slots", table->slot_nr);
+	} else {
+		/* clear it all at once */
+		if(ftruncate(fd, 0) < 0 || ftruncate(fd, TABLE_SIZE_MAX) < 0) {
+			log_error_admin(errno, "clear item_table %s", path);
+			munmap(table, TABLE_SIZE_MAX);
+			table = NULL;
+			goto fail;
+		}
+		table_init(TABLE_SIZE_MAX);
+	}
+
+	/* it's not clean since now, and busy until the master thread
+	 * starts waiting for events, see table_busy() */
+	table->clean = 0;
+	table->busy = 1;
+	strcpy(table->boot_id, boot_id);
+	msync(table, table->header_size, MS_SYNC);
+
+	table_fd = fd;
+	return OHC_OK;
+
+fail:
+	close(fd);
+	return OHC_ERROR;
+}
+
+static int table_open_anonymous(void)
+{
+	size_t size = TABLE_SIZE_MAX;
+
+	/* MAP_PRIVATE, to be copied in fork(), see journal_checkpoint_start() */
+	while((table = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			-1, 0)) == MAP_FAILED) {
+		if(size / 2 < TABLE_SIZE_MIN) {
+			table = NULL;
+			log_error_admin(errno, "map item table");
+			return OHC_ERROR;
+		}
+		size /= 2;
+	}
+	tlist_base = (char *)table;
+	table_init(size);
+	return OHC_OK;
+}
+
+int table_conf_check(ohc_conf_t *conf_cycle)
+{
+	int rc;
+
+	if(conf_cycle->item_table[0] != '\0' && conf_cycle->journal_dir[0] != '\0') {
+		log_error_admin(0, "item_table and journal_dir can not be set together");
+		return OHC_ERROR;
+	}
+
+	if(table != NULL) {
+		if(strcmp(conf_cycle->item_table, table_path) != 0) {
+			log_error_admin(0, "item_table can not be changed by reload");
+			return OHC_ERROR;
+		}
+		return OHC_OK;
+	}
+
+	/* open it at the first time */
+	if(conf_cycle->item_table[0] == '\0') {
+		rc = table_open_anonymous();
+	} else {
+		rc = table_open_file(conf_cycle->item_table, upgrade_wait_old());
+	}
+	if(rc == OHC_OK) {
+		table_buckets = (tpos_t *)((char *)table + table->buckets_offset);
+		strcpy(table_path, conf_cycle->item_table);
+	}
+	return rc;
+}
+
+/* whether the table is kept in file. If so, no dump is needed. */
+int table_persistent(void)
+{
+	return table_fd >= 0;
+}
+
+/* master thread sets it while changing the table. The table is not
+ * reused, if crashed when it's set. */
+void table_busy(int busy)
+{
+	table->busy = busy;
+}
+
+/* at quiting, flush the table so it's reused next time */
+void table_close(void)
+{
+	if(table_fd < 0) {
+		return;
+	}
+
+	table->busy = 0;
+	if(msync(table, table->size, MS_SYNC) < 0) {
+		log_error_run(errno, "sync item_table");
+		return;
+	}
+	table->clean = 1;
+	msync(table, table->header_size, MS_SYNC);
+}
+
+/* allocate a zeroed slot for an item, page or free block */
+void *table_alloc(void)
+{
+	void *slot;
+
+	if(table->free_slot != 0) {
+		slot = tpos_ptr(table->free_slot);
+		table->free_slot = *(tpos_t *)slot;
+
+	} else if(((size_t)table->slot_end << TPOS_SHIFT)
+			+ sizeof(ohc_table_slot_t) <= table->size) {
+		slot = tpos_ptr(table->slot_end);
+		table->slot_end += sizeof(ohc_table_slot_t) >> TPOS_SHIFT;
+
+	} else {
+		return NULL;
+	}
+
+	table->slot_nr++;
+	bzero(slot, sizeof(ohc_table_slot_t));
+	return slot;
+}
+
+void table_free(void *slot)
+{
+	*(tpos_t *)slot = table->free_slot;
+	table->free_slot = tpos_of(slot);
+	table->slot_nr--;
+}
+
+static inline int table_md5_equal(unsigned char *id1, unsigned char *id2)
+{
+	uint64_t *p = (uint64_t *)id1;
+	uint64_t *q = (uint64_t *)id2;
+	return (*p == *q) && (*(p+1) == *(q+1));
+}
+
+static inline tpos_t *table_bucket(unsigned char *id)
+{
+	uint64_t *p = (uint64_t *)id;
+	uint64_t h = *p ^ *(p+1);
+	uint32_t index;
+
+	index = h & (table->bucket_level * 2 - 1);
+	if(index >= table->bucket_nr) {
+		index = h & (table->bucket_level - 1);
+	}
+	return &table_buckets[index];
+}
+
+/* linear hashing: add a bucket, by splitting its buddy */
+static void table_hash_split(void)
+{
+	ohc_item_t *item;
+	tpos_t pos, next, *bucket;
+	uint32_t split;
+
+	if(table->hash_items < (long)table->bucket_nr * TABLE_HASH_LOAD
+			|| table->bucket_nr >= table->bucket_max) {
+		return;
+	}
+
+	split = table->bucket_nr - table->bucket_level;
+	pos = table_buckets[split];
+	table_buckets[split] = 0;
+	table->bucket_nr++;
+
+	for(; pos != 0; pos = next) {
+		item = tpos_ptr(pos);
+		next = item->hnode.next;
+
+		bucket = table_bucket(item->hnode.id);
+		item->hnode.next = *bucket;
+		*bucket = pos;
+	}
+
+	if(table->bucket_nr == table->bucket_level * 2) {
+		table->bucket_level *= 2;
+	}
+}
+
+void table_hash_add(ohc_item_t *item)
+{
+	tpos_t *bucket = table_bucket(item->hnode.id);
+
+	item->hnode.next = *bucket;
+	*bucket = tpos_of(item);
+
+	table->hash_items++;
+	table_hash_split();
+}
+
+/* search by MD5 @id, in the server of @server_index */
+ohc_item_t *table_hash_get(unsigned char *id, short server_index)
+{
+	ohc_item_t *item;
+	tpos_t pos;
+
+	for(pos = *table_bucket(id); pos != 0; pos = item->hnode.next) {
+		item = tpos_ptr(pos);
+		if(table_md5_equal(item->hnode.id, id)
+				&& item->server_index == server_index) {
+			return item;
+		}
+	}
+	return NULL;
+}
+
+/* prefetch the bucket of @id, or its first item if @node, before
+ * searching a batch of IDs. The bucket should be prefetched earlier
+ * than the item. */
+void table_hash_prefetch(unsigned char *id, int node)
+{
+	tpos_t *bucket = table_bucket(id);
+
+	if(!node) {
+		__builtin_prefetch(bucket);
+	} else if(*bucket != 0) {
+		__builtin_prefetch(tpos_ptr(*bucket));
+	}
+}
+
+void table_hash_del(ohc_item_t *item)
+{
+	tpos_t *link = table_bucket(item->hnode.id);
+	tpos_t pos = tpos_of(item);
+	ohc_item_t *prev;
+
+	while(*link != pos) {
+		prev = tpos_ptr(*link);
+		link = &prev->hnode.next;
+	}
+	*link = item->hnode.next;
+	table->hash_items--;
+}
+
+struct tlist_head *table_shared_lru(void)
+{
+	return &table->shared_lru_head;
+}
+
+struct tlist_head *table_sparse_pages(void)
+{
+	return &table->sparse_pages;
+}
+
+struct tlist_head *table_busy_items(void)
+{
+	return &table->busy_items;
+}
+
+ohc_table_server_t *table_server(int index)
+{
+	return &table->servers[index];
+}
+
+/* the index of the server listening @port or @path in a reused
+ * table, or -1 if none */
+int table_server_find(unsigned short port, const char *path)
+{
+	int i;
+
+	for(i = 0; i < SERVERS_LIMIT; i++) {
+		if(table->servers[i].inuse && table->servers[i].port == port
+				&& strcmp(table->servers[i].path, path) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+ohc_table_server_t *table_server_init(int index, unsigned short port,
+		const char *path)
+{
+	ohc_table_server_t *ts = &table->servers[index];
+
+	bzero(ts, sizeof(ohc_table_server_t));
+	ts->inuse = 1;
+	ts->port = port;
+	strcpy(ts->path, path);
+	INIT_TLIST_HEAD(&ts->lru_head);
+	return ts;
+}
+
+ohc_table_device_t *table_device(int index)
+{
+	return &table->devices[index];
+}
+
+/* the index of the loaded device in a reused table, or -1 if none */
+int table_device_find(dev_t dev, ino_t inode, size_t capacity)
+{
+	ohc_table_device_t *td;
+	int i;
+
+	for(i = 0; i < DEVICES_LIMIT; i++) {
+		td = &table->devices[i];
+		if(td->inuse && td->ready && td->dev == dev
+				&& td->inode == inode && td->capacity == capacity) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+ohc_table_device_t *table_device_init(int index, ohc_device_t *device)
+{
+	ohc_table_device_t *td = &table->devices[index];
+
+	bzero(td, sizeof(ohc_table_device_t));
+	td->inuse = 1;
+	td->dev = device->dev;
+	td->inode = device->inode;
+	td->capacity = device->capacity;
+	INIT_TLIST_HEAD(&td->order_head);
+	ipbucket_init(&td->free_blocks);
+	return td;
+}
@@ -0,0 +1,80 @@
+/*
+ * Item table. Items, pages and free blocks are allocated in slots of
+ * one big mapping, and linked by their positions in it but not by
+ * pointers, see utils/tlist.h. The hash of items, the LRU lists, and
+ * the lists and counters of servers and devices are in it too.
+ *
+ * If item_table is set, the mapping is of the file, and it is reused
+ * by the next start, so the items are not loaded from devices again.
+ * Otherwise it's anonymous memory.
+ *
+ */
+
+#ifndef _OHC_TABLE_H_
+#define _OHC_TABLE_H_
+
+#include "olivehc.h"
+
+/* the part of a server kept in table, with the same index */
+struct ohc_table_server_s {
+	unsigned		inuse:1;
+	unsigned short		port;
+	unsigned short		clear;
+	char			path[SERVER_PATH_MAX]; /* unix socket */
+	tpos_t			open_page;
+	struct tlist_head	lru_head;
+
+	size_t			consumed;
+	size_t			content;
+	long			item_nr;
+};
+
+/* the part of a device kept in table, with the same index */
+struct ohc_table_device_s {
+	unsigned		inuse:1;
+	unsigned		ready:1; /* loaded */
+	dev_t			dev;
+	ino_t			inode;
+	size_t			capacity;
+
+	/* key of the items' heads checksum, so the data in items'
+	 * bodies can not forge heads for scanning. Kept in the dump
+	 * and the mark of device in use. */
+	uint64_t		secret;
+
+	long			item_nr;
+	long			fblock_nr;
+	size_t			consumed;
+	size_t			badblock;
+
+	struct tlist_head	order_head;
+	ohc_ipbucket_t		free_blocks;
+};
+
+int table_conf_check(ohc_conf_t *conf_cycle);
+int table_persistent(void);
+void table_busy(int busy);
+void table_close(void);
+
+void *table_alloc(void);
+void table_free(void *slot);
+
+void table_hash_add(ohc_item_t *item);
+ohc_item_t *table_hash_get(unsigned char *id, short server_index);
+void table_hash_prefetch(unsigned char *id, int node);
+void table_hash_del(ohc_item_t *item);
+
+struct tlist_head *table_shared_lru(void);
+struct tlist_head *table_sparse_pages(void);
+struct tlist_head *table_busy_items(void);
+
+ohc_table_server_t *table_server(int index);
+int table_server_find(unsigned short port, const char *path);
+ohc_table_server_t *table_server_init(int index, unsigned short port,
+		const char *path);
+
+ohc_table_device_t *table_device(int index);
+int table_device_find(dev_t dev, ino_t inode, size_t capacity);
+ohc_table_device_t *table_device_init(int index, ohc_device_t *device);
+
+#endif
@@ -0,0 +1,350 @@
+/*
+ * Index items by tag and by URI prefix, to purge them together.
+ *
+ * Items are tagged by the OHC-Tag or Surrogate-Key header in PUT, with
+ * tags separated by space. If prefix_depth is set, items are indexed
+ * by the first levels of directories in their URI too, e.g. "/a/" and
+ * "/a/b/" for "/a/b/c.jpg".
+ *
+ * Each tag keeps an array of its items' ID, pointer and allocation
+ * sequence, which is not updated when the items are deleted or replaced.
+ * So an entry is alive only if the item in hash by the ID is the pointer
+ * with the same sequence. The dead entries are compacted in routine.
+ *
+ * PURGE with OHC-Tag, or with OHC-Prefix for a directory URI, takes
+ * the tags out of the index, and deletes their items batch by batch.
+ *
+ * The index is in memory only, and lost after restart.
+ *
+ */
+
+#include "tag.h"
+
+typedef struct {
+	unsigned char		id[16];
+	ohc_item_t		*item;
+	uint32_t		seq;
+} ohc_tag_entry_t;
+
+/* a tag or a URI prefix. In server's @tags and @tag_head, or only in
+ * @purge_head after purged. */
+typedef struct {
+	ohc_hash_node_t		hnode;
+	struct list_head	node;
+	int			nr;
+	int			size;
+	ohc_tag_entry_t		*entries;
+} ohc_tag_t;
+
+static ohc_slab_t tag_slab = OHC_SLAB_INIT(ohc_tag_t);
+
+/* the decoded path of @r's URI, without query */
+static ssize_t tag_path(ohc_request_t *r, char *path)
+{
+	char *q = memchr(r->uri.base, '?', r->uri.len);
+
+	return http_decode_uri(r->uri.base, q ? q - r->uri.base : r->uri.len, path);
+}
+
+/* the key of a prefix is 'p', the prefix of @path, and Host if
+ * key_include_host. The key of a tag is 't' and the tag. */
+static ssize_t tag_prefix_key(ohc_request_t *r, char *path, ssize_t len, char *key)
+{
+	key[0] = 'p';
+	memcpy(key + 1, path, len);
+	len++;
+
+	if(r->server->key_include_host && r->host.base) {
+		memcpy(key + len, r->host.base, r->host.len);
+		len += r->host.len;
+	}
+	return len;
+}
+
+/* the next tag in [*p, end), which are separated by space. return
+ * its length, or 0 if no more. */
+static ssize_t tag_next(char **p, char *end, char **tag)
+{
+	char *q;
+
+	while(*p < end && **p == ' ') {
+		(*p)++;
+	}
+	if(*p == end) {
+		return 0;
+	}
+
+	*tag = *p;
+	q = memchr(*p, ' ', end - *p);
+	*p = q ? q : end;
+	return *p - *tag;
+}
+
+static ohc_tag_t *tag_get(ohc_server_t *s, char *key, ssize_t len, int create)
+{
+	ohc_hash_node_t *hnode;
+	ohc_tag_t *tag;
+	unsigned char id[16];
+
+	if(s->tags == NULL) {
+		if(!create || (s->tags = hash_init()) == NULL) {
+			return NULL;
+		}
+	}
+
+	hnode = hash_get(s->tags, (unsigned char *)key, len, id);
+	if(hnode != NULL) {
+		return list_entry(hnode, ohc_tag_t, hnode);
+	}
+	if(!create) {
+		return NULL;
+	}
+
+	tag = slab_alloc(&tag_slab);
+	if(tag == NULL) {
+		log_error_run(0, "NoMem");
+		return NULL;
+	}
+	tag->nr = 0;
+	tag->size = 0;
+	tag->entries = NULL;
+	memcpy(tag->hnode.id, id, 16);
+	hash_add(s->tags, &tag->hnode, NULL, 0);
+	list_add_tail(&tag->node, &s->tag_head);
+	return tag;
+}
+
+static void tag_free(ohc_tag_t *tag)
+{
+	list_del(&tag->node);
+	free(tag->entries);
+	slab_free(tag);
+}
+
+static void tag_entry_add(ohc_tag_t *tag, ohc_item_t *item)
+{
+	ohc_tag_entry_t *entries;
+
+	if(tag == NULL) {
+		return;
+	}
+
+	/* e.g. the same tag twice in header */
+	if(tag->nr != 0 && tag->entries[tag->nr - 1].item == item
+			&& tag->entries[tag->nr - 1].seq == item->seq) {
+		return;
+	}
+
+	if(tag->nr == tag->size) {
+		entries = realloc(tag->entries, (tag->size ? tag->size * 2 : 4)
+				* sizeof(ohc_tag_entry_t));
+		if(entries == NULL) {
+			log_error_run(0, "NoMem");
+			return;
+		}
+		tag->entries = entries;
+		tag->size = tag->size ? tag->size * 2 : 4;
+	}
+
+	memcpy(tag->entries[tag->nr].id, item->hnode.id, 16);
+	tag->entries[tag->nr].item = item;
+	tag->entries[tag->nr].seq = item->seq;
+	tag->nr++;
+}
+
+/* return the item of @entry, or NULL if it's dead. The freed item's
+ * slot may be reused by a new item of the same key, which is told
+ * by @seq. */
+static ohc_item_t *tag_entry_item(ohc_server_t *s, ohc_tag_entry_t *entry)
+{
+	ohc_item_t *item = table_hash_get(entry->id, s->index);
+
+	if(item != entry->item || item->seq != entry->seq) {
+		return NULL;
+	}
+	return item;
+}
+
+/* @server module call this, when @item is stored by PUT @r */
+void tag_add_item(ohc_request_t *r, ohc_item_t *item)
+{
+	ohc_server_t *s = r->server;
+	char key[REQ_BUF_SIZE + 1], path[REQ_BUF_SIZE];
+	char *p, *end, *tag;
+	ssize_t len;
+	int i, n;
+
+	/* tags */
+	if(r->tags.base) {
+		p = r->tags.base;
+		end = p + r->tags.len;
+		for(n = 0; n < TAG_ITEM_LIMIT; n++) {
+			len = tag_next(&p, end, &tag);
+			if(len == 0) {
+				break;
+			}
+			key[0] = 't';
+			memcpy(key + 1, tag, len);
+			tag_entry_add(tag_get(s, key, len + 1, 1), item);
+		}
+	}
+
+	/* prefixes, without the root */
+	if(s->prefix_depth) {
+		len = tag_path(r, path);
+		for(i = 1, n = 0; i < len && n < s->prefix_depth; i++) {
+			if(path[i] == '/') {
+				tag_entry_add(tag_get(s, key,
+						tag_prefix_key(r, path, i + 1, key), 1), item);
+				n++;
+			}
+		}
+	}
+}
+
+/* delete the items of the purged tags, @budget entries at most */
+static void tag_purge_step(ohc_server_t *s, int budget)
+{
+	ohc_tag_t *tag;
+	ohc_item_t *item;
+
+	while(budget > 0 && !list_empty(&s->purge_head)) {
+		tag = list_entry(s->purge_head.next, ohc_tag_t, node);
+
+		while(budget > 0 && tag->nr > 0) {
+			item = tag_entry_item(s, &tag->entries[--tag->nr]);
+			if(item != NULL) {
+				server_item_delete(item);
+			}
+			budget--;
+		}
+
+		if(tag->nr == 0) {
+			tag_free(tag);
+		}
+	}
+}
+
+static int tag_purge_one(ohc_server_t *s, char *key, ssize_t len)
+{
+	ohc_tag_t *tag = tag_get(s, key, len, 0);
+
+	if(tag == NULL) {
+		return 0;
+	}
+	hash_del(s->tags, &tag->hnode);
+	list_del(&tag->node);
+	list_add_tail(&tag->node, &s->purge_head);
+	return 1;
+}
+
+/* @request module call this, in a PURGE with OHC-Tag or OHC-Prefix.
+ * The tags are taken out of the index at once, and their items are
+ * deleted here for the first batch, and in routine for the left.
+ * return OHC_ERROR if no tag is found. */
+int tag_purge(ohc_request_t *r)
+{
+	ohc_server_t *s = r->server;
+	char key[REQ_BUF_SIZE + 1], path[REQ_BUF_SIZE];
+	char *p, *end, *tag;
+	ssize_t len;
+	int found = 0;
+
+	if(r->tags.base) {
+		p = r->tags.base;
+		end = p + r->tags.len;
+		while((len = tag_next(&p, end, &tag)) != 0) {
+			key[0] = 't';
+			memcpy(key + 1, tag, len);
+			found += tag_purge_one(s, key, len + 1);
+		}
+	}
+
+	if(r->purge_prefix) {
+		len = tag_path(r, path);
+		if(len < 2 || path[len - 1] != '/') {
+			r->error_reason = "InvalidPrefix";
+			return OHC_ERROR;
+		}
+		found += tag_purge_one(s, key, tag_prefix_key(r, path, len, key));
+	}
+
+	if(found == 0) {
+		return OHC_ERROR;
+	}
+
+	tag_purge_step(s, LOOP_LIMIT);
+	return OHC_OK;
+}
+
+/* remove the dead entries of tags in turn, @budget entries at most.
+ * The empty tags are freed. */
+static void tag_compact(ohc_server_t *s, int budget)
+{
+	ohc_tag_entry_t *entries;
+	ohc_tag_t *tag, *first = NULL;
+	int i, n;
+
+	while(budget > 0 && !list_empty(&s->tag_head)) {
+		tag = list_entry(s->tag_head.next, ohc_tag_t, node);
+		if(tag == first) {
+			break;
+		}
+		if(first == NULL) {
+			first = tag;
+		}
+
+		for(i = 0, n = 0; i < tag->nr; i++) {
+			if(tag_entry_item(s, &tag->entries[i])) {
+				tag->entries[n++] = tag->entries[i];
+			}
+		}
+		budget -= tag->nr;
+		tag->nr = n;
+
+		if(n == 0) {
+			hash_del(s->tags, &tag->hnode);
+			tag_free(tag);
+			continue;
+		}
+
+		if(tag->size > 16 && n < tag->size / 4) {
+			entries = realloc(tag->entries, tag->size / 2 * sizeof(ohc_tag_entry_t));
+			if(entries != NULL) {
+				tag->entries = entries;
+				tag->size /= 2;
+			}
+		}
+		list_del(&tag->node);
+		list_add_tail(&tag->node, &s->tag_head);
+	}
+}
+
+/* regular routine, called by @server module */
+void tag_routine(ohc_server_t *s)
+{
+	if(s->tags == NULL) {
+		return;
+	}
+	tag_purge_step(s, TAG_PURGE_BATCH);
+	tag_compact(s, TAG_COMPACT_BATCH);
+}
+
+void tag_destroy(ohc_server_t *s)
+{
+	ohc_tag_t *tag;
+
+	if(s->tags == NULL) {
+		return;
+	}
+	while(!list_empty(&s->tag_head)) {
+		tag = list_entry(s->tag_head.next, ohc_tag_t, node);
+		tag_free(tag);
+	}
+	while(!list_empty(&s->purge_head)) {
+		tag = list_entry(s->purge_head.next, ohc_tag_t, node);
+		tag_free(tag);
+	}
+	hash_destroy(s->tags);
+	s->tags = NULL;
+}
@@ -0,0 +1,26 @@
+/*
+ * Index items by tag and by URI prefix, to purge them together.
+ *
+ */
+
+#ifndef _OHC_TAG_H_
+#define _OHC_TAG_H_
+
+#include "olivehc.h"
+
+/* tags of an item at most, more are ignored */
+#define TAG_ITEM_LIMIT		16
+
+/* URI prefix levels indexed at most, see prefix_depth */
+#define TAG_PREFIX_DEPTH_MAX	8
+
+/* items deleted, and entries compacted, in each routine */
+#define TAG_PURGE_BATCH		10000
+#define TAG_COMPACT_BATCH	10000
+
+void tag_add_item(ohc_request_t *r, ohc_item_t *item);
+int tag_purge(ohc_request_t *r);
+void tag_routine(ohc_server_t *s);
+void tag_destroy(ohc_server_t *s);
+
+#endif
@@ -0,0 +1,499 @@
+/*
+ * Upgrade the binary without stopping service.
+ *
+ * The old process forks and execs the new binary, with a unix socket
+ * as channel. The listen sockets of servers and the admin port are
+ * passed to the new process over the channel by SCM_RIGHTS, so they
+ * are never closed. When the new process loads the configure and is
+ * ready to serve, the old process stops accepting, and drains its
+ * requests as quiting. The old process waits for it in the master's
+ * epoll, so it keeps serving meanwhile. Then it sends the items of each device over
+ * the channel in dump format, instead of dumping into device.
+ *
+ * The new process serves at once, and loads the items from channel
+ * as loading dumps. Before that, all devices are in loading, so the
+ * items are missed and no item is stored.
+ *
+ */
+
+#include <sys/wait.h>
+#include "upgrade.h"
+
+/* old process: to exec the new binary, in the original directory */
+static char **upgrade_argv;
+static char upgrade_cwd[PATH_LENGTH];
+
+/* the channel's fd in the new process, see upgrade_exec() */
+#define UPGRADE_CHANNEL_FD	3
+
+extern char **environ;
+
+/* the channel between the old and new processes */
+static int upgrade_fd = -1;
+
+/* old process: the new process, until it's ready */
+static pid_t upgrade_pid = 0;
+static time_t upgrade_deadline;
+
+/* the listen of a socket passed, see upgrade_send_fd(). The admin
+ * port is with port 0 and empty path. */
+typedef struct {
+	unsigned short	port;
+	char		path[SERVER_PATH_MAX];
+} ohc_upgrade_listen_t;
+
+/* new process: the listen sockets from the old process */
+static int upgrade_listen_nr = 0;
+static int *upgrade_listen_fds;
+static ohc_upgrade_listen_t *upgrade_listens;
+
+/* send @fd with its @port and @path over @sock */
+static int upgrade_send_fd(int sock, unsigned short port, const char *path,
+		int fd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	ohc_upgrade_listen_t addr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+
+	bzero(&addr, sizeof(addr));
+	addr.port = port;
+	strcpy(addr.path, path);
+	iov.iov_base = &addr;
+	iov.iov_len = sizeof(addr);
+
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	return sendmsg(sock, &msg, 0) == sizeof(addr) ? OHC_OK : OHC_ERROR;
+}
+
+/* receive a fd and its @addr, see upgrade_send_fd(). The old binary
+ * before unix sockets sends the port only, as @size. return the fd,
+ * or -1 if fail. */
+static int upgrade_recv_fd(int sock, ohc_upgrade_listen_t *addr,
+		size_t size)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	int fd;
+
+	bzero(addr, sizeof(*addr));
+	iov.iov_base = addr;
+	iov.iov_len = size;
+
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if(recvmsg(sock, &msg, MSG_WAITALL) != size) {
+		return -1;
+	}
+	addr->path[SERVER_PATH_MAX - 1] = '\0';
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+			|| cmsg->cmsg_type != SCM_RIGHTS) {
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+/* exec the new binary @path in child process, with the channel @sock
+ * only. Only async-signal-safe calls here, since the old process has
+ * threads. @envp is made before fork(). */
+static void upgrade_exec(int sock, char *path, char **envp)
+{
+	long fd, max;
+	int null;
+
+	/* fds 0-2 may be sockets, e.g. the admin connection, since
+	 * stderr is closed after loading configure */
+	if(sock != UPGRADE_CHANNEL_FD) {
+		if(dup2(sock, UPGRADE_CHANNEL_FD) < 0) {
+			_exit(1);
+		}
+	}
+	null = open("/dev/null", O_RDWR);
+	if(null < 0) {
+		_exit(1);
+	}
+	for(fd = 0; fd <= 2; fd++) {
+		if(fd != null) {
+			dup2(null, fd);
+		}
+	}
+
+	max = sysconf(_SC_OPEN_MAX);
+	for(fd = UPGRADE_CHANNEL_FD + 1; fd < max; fd++) {
+		close(fd);
+	}
+
+	if(chdir(upgrade_cwd) < 0) {
+		_exit(1);
+	}
+	execve(path, upgrade_argv, envp);
+	_exit(1);
+}
+
+/* old process: the environment of the new process, the same as ours
+ * but with @channel_env. */
+static char **upgrade_make_envp(char *channel_env)
+{
+	size_t len = strlen(UPGRADE_ENV);
+	char **envp;
+	int nr, i, j;
+
+	for(nr = 0; environ[nr] != NULL; nr++);
+
+	envp = malloc(sizeof(char *) * (nr + 2));
+	if(envp == NULL) {
+		return NULL;
+	}
+	for(i = j = 0; i < nr; i++) {
+		if(strncmp(environ[i], UPGRADE_ENV, len) != 0
+				|| environ[i][len] != '=') {
+			envp[j++] = environ[i];
+		}
+	}
+	envp[j++] = channel_env;
+	envp[j] = NULL;
+	return envp;
+}
+
+/* old process: make @path absolute in the original directory */
+static int upgrade_absolute_path(char *path, size_t size, char *name, int len)
+{
+	int rc;
+
+	if(name[0] == '/') {
+		rc = snprintf(path, size, "%.*s", len, name);
+	} else {
+		rc = snprintf(path, size, "%s/%.*s", upgrade_cwd, len, name);
+	}
+	return (rc < 0 || rc >= size) ? OHC_ERROR : OHC_OK;
+}
+
+/* old process: find the new binary as execvp(3) does, before fork() */
+static int upgrade_find_binary(char *path, size_t size)
+{
+	char *name = upgrade_argv[0];
+	char dir[PATH_LENGTH * 2];
+	char *p, *end;
+
+	if(strchr(name, '/') != NULL) {
+		return upgrade_absolute_path(path, size, name, strlen(name));
+	}
+
+	p = getenv("PATH");
+	if(p == NULL) {
+		p = "/bin:/usr/bin";
+	}
+	while(1) {
+		end = strchr(p, ':');
+		if(end == NULL) {
+			end = p + strlen(p);
+		}
+		if(upgrade_absolute_path(dir, sizeof(dir), p, end - p) == OHC_OK
+				&& snprintf(path, size, "%s/%s", dir, name) < size
+				&& access(path, X_OK) == 0) {
+			return OHC_OK;
+		}
+		if(*end == '\0') {
+			return OHC_ERROR;
+		}
+		p = end + 1;
+	}
+}
+
+/* old process: save the arguments before changing directory */
+int upgrade_prepare(char **argv)
+{
+	upgrade_argv = argv;
+	if(getcwd(upgrade_cwd, PATH_LENGTH) == NULL) {
+		return OHC_ERROR;
+	}
+	return OHC_OK;
+}
+
+/* old process: start the new binary, and pass @admin_fd and the listen
+ * sockets to it. The channel is added into master's epoll, to wait for
+ * the new process to be ready, see upgrade_handler(). */
+int upgrade_start(int admin_fd)
+{
+	ohc_server_t *listens[SERVERS_LIMIT];
+	char path[PATH_LENGTH * 3];
+	char channel_env[sizeof(UPGRADE_ENV) + 20];
+	char **envp;
+	int sv[2], nr, i;
+	pid_t pid;
+
+	if(upgrade_fd != -1) {
+		log_error_admin(0, "already in upgrading");
+		return OHC_ERROR;
+	}
+
+	if(upgrade_find_binary(path, sizeof(path)) != OHC_OK) {
+		log_error_admin(0, "find new binary %s", upgrade_argv[0]);
+		return OHC_ERROR;
+	}
+	sprintf(channel_env, UPGRADE_ENV "=%d", UPGRADE_CHANNEL_FD);
+	envp = upgrade_make_envp(channel_env);
+	if(envp == NULL) {
+		log_error_admin(0, "make environment of new process [NOMEM]");
+		return OHC_ERROR;
+	}
+
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		log_error_admin(errno, "create upgrade channel");
+		free(envp);
+		return OHC_ERROR;
+	}
+
+	pid = fork();
+	if(pid < 0) {
+		log_error_admin(errno, "fork new process");
+		close(sv[0]);
+		close(sv[1]);
+		free(envp);
+		return OHC_ERROR;
+	}
+	if(pid == 0) {
+		upgrade_exec(sv[1], path, envp);
+	}
+	close(sv[1]);
+	free(envp);
+
+	/* listen sockets. The number is negative, so the binary before
+	 * unix sockets refuses them, see upgrade_init(). */
+	nr = server_listen_servers(listens);
+	i = -(nr + 1);
+	if(write(sv[0], &i, sizeof(i)) != sizeof(i)
+			|| upgrade_send_fd(sv[0], 0, "", admin_fd) != OHC_OK) {
+		goto fail;
+	}
+	for(i = 0; i < nr; i++) {
+		if(upgrade_send_fd(sv[0], listens[i]->listen_port,
+					listens[i]->listen_path,
+					listens[i]->listen_fd) != OHC_OK) {
+			goto fail;
+		}
+	}
+
+	/* wait for the new process to load configure */
+	if(epoll_add_read(master_epoll_fd, sv[0], (void *)EVENT_TYPE_UPGRADE) < 0) {
+		goto fail;
+	}
+	upgrade_fd = sv[0];
+	upgrade_pid = pid;
+	upgrade_deadline = timer_now(&master_timer) + UPGRADE_TIMEOUT;
+	return OHC_OK;
+
+fail:
+	log_error_admin(errno, "new process fails");
+	close(sv[0]);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return OHC_ERROR;
+}
+
+/* old process: stop the new process which is not ready */
+static void upgrade_kill(void)
+{
+	epoll_del(master_epoll_fd, upgrade_fd);
+	close(upgrade_fd);
+	upgrade_fd = -1;
+
+	kill(upgrade_pid, SIGKILL);
+	waitpid(upgrade_pid, NULL, 0);
+	upgrade_pid = 0;
+}
+
+/* old process: handler of the channel, when the new process is ready,
+ * or fails. return OHC_OK if ready. */
+int upgrade_handler(void)
+{
+	char ready;
+
+	if(read(upgrade_fd, &ready, 1) != 1) {
+		log_error_run(errno, "new process fails");
+		upgrade_kill();
+		return OHC_ERROR;
+	}
+
+	log_error_run(0, "upgrade to new process %d", upgrade_pid);
+	epoll_del(master_epoll_fd, upgrade_fd);
+	upgrade_pid = 0;
+	return OHC_OK;
+}
+
+/* old process: give up if the new process is not ready in time */
+void upgrade_routine(void)
+{
+	if(upgrade_pid != 0
+			&& timer_now(&master_timer) >= upgrade_deadline) {
+		log_error_run(0, "new process is not ready in %d seconds",
+				UPGRADE_TIMEOUT);
+		upgrade_kill();
+	}
+}
+
+/* old process: stop the new process if it's not ready, e.g. quiting */
+void upgrade_abort(void)
+{
+	if(upgrade_pid != 0) {
+		upgrade_kill();
+	}
+}
+
+/* old process: whether the new process is ready */
+int upgrade_started(void)
+{
+	return upgrade_fd != -1 && upgrade_pid == 0;
+}
+
+/* old process: send items to the new process, instead of dumping */
+void upgrade_handoff(void)
+{
+	device_format_handoff(upgrade_fd);
+	close(upgrade_fd);
+}
+
+/* new process: receive the admin port and listen sockets, if started
+ * by upgrade. return OHC_DECLINE if not. */
+int upgrade_init(int *admin_fd)
+{
+	char *env = getenv(UPGRADE_ENV);
+	ohc_upgrade_listen_t *addr;
+	size_t size = sizeof(ohc_upgrade_listen_t);
+	int nr, fd, i;
+
+	if(env == NULL) {
+		return OHC_DECLINE;
+	}
+	upgrade_fd = atoi(env);
+	unsetenv(UPGRADE_ENV);
+
+	if(read(upgrade_fd, &nr, sizeof(nr)) != sizeof(nr) || nr == 0) {
+		return OHC_ERROR;
+	}
+
+	/* positive from the old binary, with ports only */
+	if(nr > 0) {
+		size = sizeof(unsigned short);
+	} else {
+		nr = -nr;
+	}
+	upgrade_listen_fds = malloc(nr * sizeof(int));
+	upgrade_listens = malloc(nr * sizeof(ohc_upgrade_listen_t));
+	if(upgrade_listen_fds == NULL || upgrade_listens == NULL) {
+		return OHC_ERROR;
+	}
+
+	*admin_fd = -1;
+	for(i = 0; i < nr; i++) {
+		addr = &upgrade_listens[upgrade_listen_nr];
+		fd = upgrade_recv_fd(upgrade_fd, addr, size);
+		if(fd < 0) {
+			return OHC_ERROR;
+		}
+		if(addr->port == 0 && addr->path[0] == '\0') {
+			*admin_fd = fd;
+		} else {
+			upgrade_listen_fds[upgrade_listen_nr++] = fd;
+		}
+	}
+	return *admin_fd == -1 ? OHC_ERROR : OHC_OK;
+}
+
+/* new process: take the listen socket of @port and @path from the old
+ * process. return -1 if none. */
+int upgrade_listen_fd(unsigned short port, const char *path)
+{
+	int i, fd;
+
+	for(i = 0; i < upgrade_listen_nr; i++) {
+		if(upgrade_listens[i].port == port
+				&& strcmp(upgrade_listens[i].path, path) == 0
+				&& upgrade_listen_fds[i] != -1) {
+			fd = upgrade_listen_fds[i];
+			upgrade_listen_fds[i] = -1;
+			return fd;
+		}
+	}
+	return -1;
+}
+
+/* new process: tell the old process we are ready to serve. The listen
+ * sockets not in configure are closed. */
+void upgrade_ready(void)
+{
+	char ready = 1;
+	int i;
+
+	if(upgrade_fd == -1) {
+		return;
+	}
+
+	for(i = 0; i < upgrade_listen_nr; i++) {
+		if(upgrade_listen_fds[i] != -1) {
+			close(upgrade_listen_fds[i]);
+		}
+	}
+	free(upgrade_listen_fds);
+	free(upgrade_listens);
+	upgrade_listen_fds = NULL;
+	upgrade_listens = NULL;
+	upgrade_listen_nr = 0;
+
+	if(write(upgrade_fd, &ready, 1) != 1) {
+		log_error_run(errno, "notify the old process");
+	}
+}
+
+/* new process: wait for the old process to quit, to take over what
+ * it holds until then, e.g. the item table file. The old process is
+ * told ready here, so call this at the end of loading configure.
+ * Nothing is received then. return 1 if waited. */
+int upgrade_wait_old(void)
+{
+	char buffer[4096];
+	ssize_t rc;
+
+	if(upgrade_fd == -1) {
+		return 0;
+	}
+	upgrade_ready();
+
+	/* the old process closes the channel when quiting */
+	do {
+		rc = read(upgrade_fd, buffer, sizeof(buffer));
+	} while(rc > 0 || (rc < 0 && errno == EINTR));
+	close(upgrade_fd);
+	upgrade_fd = -1;
+	return 1;
+}
+
+/* new process: the channel to receive items, which is owned by the
+ * caller since now. return -1 if not upgrading. */
+int upgrade_channel(void)
+{
+	int fd = upgrade_fd;
+
+	upgrade_fd = -1;
+	return fd;
+}
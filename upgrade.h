@@ -0,0 +1,33 @@
+/*
+ * Upgrade the binary without stopping service.
+ *
+ */
+
+#ifndef _OHC_UPGRADE_H_
+#define _OHC_UPGRADE_H_
+
+#include "olivehc.h"
+
+/* the environment variable to the new process, with the fd of channel */
+#define UPGRADE_ENV	"OLIVEHC_UPGRADE"
+
+/* seconds to wait for the new process to be ready */
+#define UPGRADE_TIMEOUT	10
+
+/* old process */
+int upgrade_prepare(char **argv);
+int upgrade_start(int admin_fd);
+int upgrade_handler(void);
+void upgrade_routine(void);
+void upgrade_abort(void);
+int upgrade_started(void);
+void upgrade_handoff(void);
+
+/* new process */
+int upgrade_init(int *admin_fd);
+int upgrade_listen_fd(unsigned short port, const char *path);
+void upgrade_ready(void);
+int upgrade_wait_old(void);
+int upgrade_channel(void);
+
+#endif
@@ -119,6 +119,64 @@ static void hash_expansion(ohc_hash_t *hash)
 	}
 }
 
+static void hash_move_bucket(ohc_hash_t *hash, struct hlist_head *bucket,
+		struct hlist_head *newb)
+{
+	ohc_hash_node_t *hnode;
+	struct hlist_node *p, *safe;
+
+	for(p = bucket->first; p; p = safe) {
+		safe = p->next;
+		hlist_del(p);
+
+		hnode = list_entry(p, ohc_hash_node_t, node);
+		hlist_add_head(p, &newb[hash_index(hash, hnode->id)]);
+	}
+}
+
+/* pre-size the buckets for @items more items at once, to avoid
+ * the expansions one by one, e.g. before loading many items. */
+void hash_reserve(ohc_hash_t *hash, long items)
+{
+	struct hlist_head *oldb, *newb;
+	hindex_t size = hash->bucket_size;
+	hindex_t old_size = hash->bucket_size;
+	long total = hash->items + items;
+	hindex_t i;
+
+	while(total / size >= HASH_COLLISIONS && size < HASH_BUCKET_SIZE_MAX) {
+		size *= 2;
+	}
+	if(size == old_size) {
+		return;
+	}
+
+	newb = calloc(size, sizeof(struct hlist_head));
+	if(newb == NULL) {
+		/* if calloc fails, expand one by one later */
+		return;
+	}
+
+	oldb = hash->buckets;
+	hash->bucket_size = size;
+	for(i = 0; i < old_size; i++) {
+		hash_move_bucket(hash, &oldb[i], newb);
+	}
+	free(oldb);
+
+	/* the un-split buckets in expansion */
+	if(hash->prev_buckets != NULL) {
+		for(i = hash->split; i < old_size / 2; i++) {
+			hash_move_bucket(hash, &hash->prev_buckets[i], newb);
+		}
+		free(hash->prev_buckets);
+		hash->prev_buckets = NULL;
+		hash->split = 0;
+	}
+
+	hash->buckets = newb;
+}
+
 void hash_add(ohc_hash_t *hash, ohc_hash_node_t *hnode, unsigned char *str, int len)
 {
 	if(str) {
@@ -150,14 +208,21 @@ ohc_hash_node_t *hash_get(ohc_hash_t *hash, unsigned char *str, int len, unsigne
 {
 	unsigned char id_buf[16];
 	unsigned char *id;
-	hindex_t index;
-	hindex_t pbsize;
-	ohc_hash_node_t *ret;
 
 	hash_expansion(hash);
 
 	id = hash_id ? hash_id : id_buf;
 	MD5(str, len, id);
+	return hash_get_id(hash, id);
+}
+
+/* search by MD5 @id */
+ohc_hash_node_t *hash_get_id(ohc_hash_t *hash, unsigned char *id)
+{
+	hindex_t index;
+	hindex_t pbsize;
+	ohc_hash_node_t *ret;
+
 	index = hash_index(hash, id);
 
 	ret = hash_search(&hash->buckets[index], id);
@@ -19,9 +19,11 @@ typedef struct {
 
 ohc_hash_t *hash_init();
 void hash_destroy(ohc_hash_t *hash);
+void hash_reserve(ohc_hash_t *hash, long items);
 
 void hash_add(ohc_hash_t *hash, ohc_hash_node_t *hnode, unsigned char *str, int len);
 ohc_hash_node_t *hash_get(ohc_hash_t *hash, unsigned char *str, int len, unsigned char *hash_id);
+ohc_hash_node_t *hash_get_id(ohc_hash_t *hash, unsigned char *id);
 void hash_del(ohc_hash_t *hash, ohc_hash_node_t *hnode);
 
 #endif
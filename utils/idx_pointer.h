@@ -40,6 +40,12 @@ static inline short idx_pointer_add(idx_pointer_t *ipt, void *pointer)
 	return index;
 }
 
+/* set @pointer at @index, which must be free */
+static inline void idx_pointer_set(idx_pointer_t *ipt, short index, void *pointer)
+{
+	ipt->array[index] = pointer;
+}
+
 static inline void idx_pointer_delete(idx_pointer_t *ipt, short index)
 {
 	ipt->array[index] = NULL;
@@ -11,7 +11,7 @@
 #ifndef _OHC_IPBUCKET_H_
 #define _OHC_IPBUCKET_H_
 
-#include "list.h"
+#include "tlist.h"
 #include "string.h"
 
 /* we define ohc_item_t.length as uint32_t for saving memory,
@@ -27,7 +27,7 @@
 #define IPB_4TH	(IPB_1ST * 4)
 
 typedef struct {
-	struct list_head	queue[IPB_BUCKETS];
+	struct tlist_head	queue[IPB_BUCKETS];
 } ohc_ipbucket_t;
 
 
@@ -35,7 +35,7 @@ static inline void ipbucket_init(ohc_ipbucket_t *ipb)
 {
 	int i;
 	for(i = 0; i < IPB_BUCKETS; i++) {
-		INIT_LIST_HEAD(&ipb->queue[i]);
+		INIT_TLIST_HEAD(&ipb->queue[i]);
 	}
 }
 
@@ -45,7 +45,7 @@ static inline void ipbucket_destory(ohc_ipbucket_t *ipb)
 	/* only delete the list-heads from list, and
 	 * the caller should handle the list-nodes. */
 	for(i = 0; i < IPB_BUCKETS; i++) {
-		list_del(&ipb->queue[i]);
+		tlist_del(&ipb->queue[i]);
 	}
 }
 
@@ -104,33 +104,33 @@ static inline int ipbucket_index(size_t size, int up)
 	return index + subidx + tail;
 }
 
-static inline void ipbucket_add(ohc_ipbucket_t *ipb, struct list_head *node, size_t size)
+static inline void ipbucket_add(ohc_ipbucket_t *ipb, struct tlist_head *node, size_t size)
 {
-	struct list_head *p = &ipb->queue[ipbucket_index(size, 0)];
+	struct tlist_head *p = &ipb->queue[ipbucket_index(size, 0)];
 
 	if(size == ipbucket_block_size(size)) {
-		list_add(node, p);
+		tlist_add(node, p);
 	} else {
-		list_add_tail(node, p);
+		tlist_add_tail(node, p);
 	}
 }
 
-static inline void ipbucket_del(struct list_head *node)
+static inline void ipbucket_del(struct tlist_head *node)
 {
 	if(node->prev) {
-		list_del(node);
+		tlist_del(node);
 	}
 }
 
-static inline void ipbucket_update(ohc_ipbucket_t *ipb, struct list_head *node, size_t size)
+static inline void ipbucket_update(ohc_ipbucket_t *ipb, struct tlist_head *node, size_t size)
 {
-	list_del(node);
+	tlist_del(node);
 	ipbucket_add(ipb, node, size);
 }
 
-static inline struct list_head *ipbucket_get(ohc_ipbucket_t *ipb, size_t size)
+static inline struct tlist_head *ipbucket_get(ohc_ipbucket_t *ipb, size_t size)
 {
-	struct list_head *p;
+	struct tlist_head *p;
 	int index = ipbucket_index(size, 1);
 
 	if(index == -1) {
@@ -138,22 +138,39 @@ static inline struct list_head *ipbucket_get(ohc_ipbucket_t *ipb, size_t size)
 	}
 
 	for(; index < IPB_BUCKETS; index++) {
-		if(!list_empty(&ipb->queue[index])) {
-			p = ipb->queue[index].next;
-			list_del(p);
+		if(!tlist_empty(&ipb->queue[index])) {
+			p = tlist_next(&ipb->queue[index]);
+			tlist_del(p);
 			return p;
 		}
 	}
 	return NULL;
 }
 
+/* return a block not smaller than @size, but don't unlink it. */
+static inline struct tlist_head *ipbucket_fit(ohc_ipbucket_t *ipb, size_t size)
+{
+	int index = ipbucket_index(size, 1);
+
+	if(index == -1) {
+		return NULL;
+	}
+
+	for(; index < IPB_BUCKETS; index++) {
+		if(!tlist_empty(&ipb->queue[index])) {
+			return tlist_next(&ipb->queue[index]);
+		}
+	}
+	return NULL;
+}
+
 /* return an almost biggest block, but don't unlink it. */
-static inline struct list_head *ipbucket_biggest(ohc_ipbucket_t *ipb)
+static inline struct tlist_head *ipbucket_biggest(ohc_ipbucket_t *ipb)
 {
 	int index;
 	for(index = IPB_BUCKETS - 1; index >= 0; index--) {
-		if(!list_empty(&ipb->queue[index])) {
-			return ipb->queue[index].prev;
+		if(!tlist_empty(&ipb->queue[index])) {
+			return tlist_prev(&ipb->queue[index]);
 		}
 	}
 	return NULL;
@@ -19,6 +19,8 @@
 #include <strings.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
 
 #include "socktcp.h"
 
@@ -142,6 +144,51 @@ int tcp_bind(unsigned short port)
     return fd;
 }
 
+/* The socket file left by a dead process is removed, but not the
+ * one still being listened on. */
+int unix_bind(const char *path)
+{
+    int fd;
+    struct sockaddr_un servaddr;
+    struct stat st;
+
+    if(strlen(path) >= sizeof(servaddr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sun_family = AF_UNIX;
+    strcpy(servaddr.sun_path, path);
+
+    if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) {
+            return -1;
+        }
+        if(connect(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0
+                && errno == ECONNREFUSED) {
+            unlink(path);
+        }
+        close(fd);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        return -1;
+    }
+    if(set_nonblock(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
 int tcp_listen(int fd)
 {
     if(idle_fd == -1) {
@@ -9,6 +9,7 @@
 #define _OHC_SOCKTCP_H_
 
 int tcp_bind(unsigned short port);
+int unix_bind(const char *path);
 int tcp_listen(int fd);
 int tcp_accept(int fd, struct sockaddr_in *client);
 
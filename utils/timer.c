@@ -12,19 +12,33 @@
 #include <string.h>
 #include <stdlib.h>
 
-struct ohc_timer_group_s {
-	struct list_head	tnode_head;
-	struct list_head	tgroup_node;
-
-	time_t			timeout;
-	ohc_timer_t		*timer;
-};
+/**
+ * The timers are in a hierarchical timing wheel, as Linux kernel's.
+ * @jiffies is the next ms to process. A node expiring in the next
+ * TIMER_WHEEL_SIZE0 ms is in the level-0 slot of its expire time,
+ * and the later ones are in the upper levels by the distance. When
+ * level 0 goes a round, the next slot of the upper level is cascaded,
+ * i.e. its nodes are placed again, to the lower levels.
+ * So add, delete and update are O(1).
+ */
 
 void timer_init(ohc_timer_t *timer)
 {
-	INIT_LIST_HEAD(&timer->tgroup_head);
+	int i, j;
+
+	for(i = 0; i < TIMER_WHEEL_SIZE0; i++) {
+		INIT_LIST_HEAD(&timer->wheel0[i]);
+	}
+	for(i = 0; i < TIMER_WHEEL_LEVELS - 1; i++) {
+		for(j = 0; j < TIMER_WHEEL_SIZE; j++) {
+			INIT_LIST_HEAD(&timer->wheel[i][j]);
+		}
+	}
 	INIT_LIST_HEAD(&timer->expires);
+	timer->nr = 0;
+	timer->now = 0;
 	timer_refresh(timer);
+	timer->jiffies = timer->msec;
 }
 
 static char *month_str[] = {
@@ -34,23 +48,45 @@ static char *week_str[] = {
 	"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
 };
 
-/* parse RFC1123 time string */
+/* days since 1970-01-01, @mon in [0, 11] */
+static long timer_days_from_civil(int year, int mon, int mday)
+{
+	long era, yoe, doy;
+
+	/* the year starts from March, so Feb 29 is the last day */
+	if(mon < 2) {
+		year--;
+		mon += 10;
+	} else {
+		mon -= 2;
+	}
+	era = year / 400;
+	yoe = year - era * 400;
+	doy = (153 * mon + 2) / 5 + mday - 1;
+	return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/* parse RFC1123 time string. It's GMT, so we count the seconds
+ * directly, but not by mktime() which is slow with timezone. */
 time_t timer_parse_rfc1123(char *p)
 {
-	struct tm t;
-	int i;
-	time_t ret;
+	int i, year, mday, hour, min, sec;
 #define D2(p) ((*(p)-'0')*10 + *((p)+1)-'0')
 #define INVALID_TIME (time_t)-1
 
 	if(strncmp(p + 25, " GMT", 4)) {
 		return INVALID_TIME;
 	}
-	t.tm_mday = D2(p + 5);
-	t.tm_year = D2(p + 12) * 100 + D2(p + 14) - 1900;
-	t.tm_hour = D2(p + 17);
-	t.tm_min  = D2(p + 20);
-	t.tm_sec  = D2(p + 23);
+	mday = D2(p + 5);
+	year = D2(p + 12) * 100 + D2(p + 14);
+	hour = D2(p + 17);
+	min  = D2(p + 20);
+	sec  = D2(p + 23);
+	if(year < 1970 || year > 9999 || mday < 1 || mday > 31
+			|| hour < 0 || hour > 23 || min < 0 || min > 59
+			|| sec < 0 || sec > 60) {
+		return INVALID_TIME;
+	}
 	for(i = 0; i < 12; i++) {
 		if(strncmp(p + 8, month_str[i], 3) == 0) {
 			break;
@@ -59,12 +95,9 @@ time_t timer_parse_rfc1123(char *p)
 	if(i == 12) {
 		return INVALID_TIME;
 	}
-	t.tm_mon = i;
-	ret = mktime(&t);
-	if(ret == INVALID_TIME) {
-		return INVALID_TIME;
-	}
-	return ret + t.tm_gmtoff;
+
+	return timer_days_from_civil(year, i, mday) * 86400
+		+ hour * 3600 + min * 60 + sec;
 }
 
 /* return RFC1123 time string */
@@ -97,121 +130,147 @@ char *timer_format_log(ohc_timer_t *timer)
 	return timer->format_log;
 }
 
-/* return the closest timer's timeout (return a big time if no timer) */
-time_t timer_closest(ohc_timer_t *timer)
+/* the bits of expire time as slot index, in @level of upper levels */
+#define TIMER_WHEEL_SHIFT(level)	(TIMER_WHEEL_BITS0 + TIMER_WHEEL_BITS * (level))
+
+/* put @tnode into the slot by its expire time */
+static void timer_place(ohc_timer_t *timer, ohc_timer_node_t *tnode)
 {
-	time_t closest = BIG_TIME;
-	struct list_head *p, *safe;
-	ohc_timer_group_t *tgroup;
-	ohc_timer_node_t *tnode;
+	uint64_t expire;
+	struct list_head *slot;
+	int level;
+
+	/* @jiffies may be behind @msec */
+	if(tnode->expire > timer->jiffies + TIMER_TIMEOUT_MAX) {
+		tnode->expire = timer->jiffies + TIMER_TIMEOUT_MAX;
+	}
+	expire = tnode->expire;
 
-	list_for_each_safe(p, safe, &timer->tgroup_head) {
+	if(expire < timer->jiffies) {
+		/* expired already, e.g. cascaded late */
+		slot = &timer->wheel0[timer->jiffies & (TIMER_WHEEL_SIZE0 - 1)];
 
-		tgroup = list_entry(p, ohc_timer_group_t, tgroup_node);
-		if(list_empty(&tgroup->tnode_head)) {
-			list_del(&tgroup->tgroup_node);
-			free(tgroup);
-			continue;
-		}
+	} else if(expire - timer->jiffies < TIMER_WHEEL_SIZE0) {
+		slot = &timer->wheel0[expire & (TIMER_WHEEL_SIZE0 - 1)];
 
-		tnode = list_entry(tgroup->tnode_head.next,
-				ohc_timer_node_t, tnode_node);
-		if(tnode->timeout < closest) {
-			closest = tnode->timeout;
+	} else {
+		for(level = 0; level < TIMER_WHEEL_LEVELS - 2; level++) {
+			if(expire - timer->jiffies < 1UL << TIMER_WHEEL_SHIFT(level + 1)) {
+				break;
+			}
 		}
+		slot = &timer->wheel[level][(expire >> TIMER_WHEEL_SHIFT(level))
+				& (TIMER_WHEEL_SIZE - 1)];
 	}
 
-	timer_refresh(timer);
-	return (closest <= timer->now) ? 0 : closest - timer->now;
+	list_add_tail(&tnode->tnode_node, slot);
 }
 
-/* find expired nodes, delete them, and return them by a list. */
-struct list_head *timer_expire(ohc_timer_t *timer)
+/* place the nodes in a slot of upper @level again */
+static void timer_cascade(ohc_timer_t *timer, int level)
 {
-	struct list_head *p, *q, *safeq;
-	ohc_timer_group_t *tgroup;
-	ohc_timer_node_t *tnode;
+	LIST_HEAD(cascade);
+	struct list_head *p, *safe;
+	struct list_head *slot = &timer->wheel[level][(timer->jiffies
+			>> TIMER_WHEEL_SHIFT(level)) & (TIMER_WHEEL_SIZE - 1)];
 
-	timer_refresh(timer);
-	list_for_each(p, &timer->tgroup_head) {
-		tgroup = list_entry(p, ohc_timer_group_t, tgroup_node);
-		list_for_each_safe(q, safeq, &tgroup->tnode_head) {
+	list_splice(slot, &cascade);
+	INIT_LIST_HEAD(slot);
 
-			tnode = list_entry(q, ohc_timer_node_t, tnode_node);
-			if(tnode->timeout > timer->now) {
-				break;
-			}
+	list_for_each_safe(p, safe, &cascade) {
+		timer_place(timer, list_entry(p, ohc_timer_node_t, tnode_node));
+	}
+}
+
+/* return the ms to wait for the closest timer, @max at most. */
+int timer_closest(ohc_timer_t *timer, int max)
+{
+	uint64_t j;
+
+	if(timer->nr == 0) {
+		return max;
+	}
 
-			list_del(q);
-			list_add_tail(q, &timer->expires);
+	/* stop at the start of level-0 round too, where cascade happens */
+	for(j = timer->jiffies; j < timer->msec + max; j++) {
+		if((j & (TIMER_WHEEL_SIZE0 - 1)) == 0
+				|| !list_empty(&timer->wheel0[j & (TIMER_WHEEL_SIZE0 - 1)])) {
+			break;
 		}
 	}
 
-	return &timer->expires;
+	if(j <= timer->msec) {
+		return 0;
+	}
+	return (j - timer->msec > max) ? max : j - timer->msec;
 }
 
-/* add a timer */
-int timer_add(ohc_timer_t *timer, ohc_timer_node_t *tnode, time_t timeout)
+/* find expired nodes, and return them by a list.
+ * The caller should delete them from the list. */
+struct list_head *timer_expire(ohc_timer_t *timer)
 {
-	struct list_head *p;
-	ohc_timer_group_t *tgroup;
+	struct list_head *slot;
+	int index, level;
 
-	/* search for the timer_group with @timeout */
-	list_for_each(p, &timer->tgroup_head) {
-		tgroup = list_entry(p, ohc_timer_group_t, tgroup_node);
-		if(tgroup->timeout == timeout) {
-			break;
-		}
+	timer_refresh(timer);
+
+	/* nothing to cascade or expire */
+	if(timer->nr == 0) {
+		timer->jiffies = timer->msec + 1;
+		return &timer->expires;
 	}
 
-	/* not found, create one */
-	if(p == &timer->tgroup_head) {
-		tgroup = (ohc_timer_group_t *)malloc(sizeof(ohc_timer_group_t));
-		if(tgroup == NULL) {
-			return 1;
+	while(timer->jiffies <= timer->msec) {
+		index = timer->jiffies & (TIMER_WHEEL_SIZE0 - 1);
+		if(index == 0) {
+			for(level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+				timer_cascade(timer, level);
+				if(((timer->jiffies >> TIMER_WHEEL_SHIFT(level))
+						& (TIMER_WHEEL_SIZE - 1)) != 0) {
+					break;
+				}
+			}
 		}
 
-		tgroup->timeout = timeout;
-		tgroup->timer = timer;
-		INIT_LIST_HEAD(&tgroup->tnode_head);
-		list_add(&tgroup->tgroup_node, &timer->tgroup_head);
+		slot = &timer->wheel0[index];
+		list_splice(slot, &timer->expires);
+		INIT_LIST_HEAD(slot);
+		timer->jiffies++;
 	}
 
-	/* add timer */
-	list_add_tail(&tnode->tnode_node, &tgroup->tnode_head);
-	tnode->timeout = timer->now + timeout;
-	tnode->group = tgroup;
+	return &timer->expires;
+}
 
-	return 0;
+/* add a timer, expiring after @timeout ms */
+void timer_add(ohc_timer_t *timer, ohc_timer_node_t *tnode, long timeout)
+{
+	if(timeout > TIMER_TIMEOUT_MAX) {
+		timeout = TIMER_TIMEOUT_MAX;
+	}
+	tnode->timeout = timeout;
+	tnode->timer = timer;
+	tnode->expire = timer->msec + timeout;
+	timer_place(timer, tnode);
+	timer->nr++;
 }
 
 /* delete a timer */
 void timer_del(ohc_timer_node_t *tnode)
 {
 	list_del(&tnode->tnode_node);
+	tnode->timer->nr--;
 }
 
 /* update a timer with new timeout (if @timeout==0, use previous timeout) */
-int timer_update(ohc_timer_node_t *tnode, time_t timeout)
+void timer_update(ohc_timer_node_t *tnode, long timeout)
 {
-	ohc_timer_group_t *tgroup = tnode->group;
+	ohc_timer_t *timer = tnode->timer;
 
-	if(timeout == 0 || timeout == tgroup->timeout) {
-		tnode->timeout = tgroup->timer->now + tgroup->timeout;
-		list_del(&tnode->tnode_node);
-		list_add_tail(&tnode->tnode_node, &tgroup->tnode_head);
-		return 0;
-	} else {
-		timer_del(tnode);
-		return timer_add(tgroup->timer, tnode, timeout);
-	}
+	timer_del(tnode);
+	timer_add(timer, tnode, timeout ? timeout : tnode->timeout);
 }
 
-/* destroy */
 void timer_destroy(ohc_timer_t *timer)
 {
-	struct list_head *p;
-	list_for_each(p, &timer->tgroup_head) {
-		free(list_entry(p, ohc_timer_group_t, tgroup_node));
-	}
+	/* nothing allocated */
 }
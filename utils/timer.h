@@ -9,36 +9,53 @@
 #define _OHC_TIMER_H_
 
 #include <time.h>
+#include <stdint.h>
 #include "list.h"
 
 #define LEN_TIME_FARMAT_RFC1123	sizeof("Sun, 06 Nov 1994 08:49:23 GMT")
 #define LEN_TIME_FARMAT_LOG	sizeof("1994-11-06 08:49:23")
 
-#define BIG_TIME 3638880000
+/* the timing wheel: 1ms per slot in level 0, and each slot of the
+ * upper levels covers a whole round of the lower level. */
+#define TIMER_WHEEL_LEVELS	5
+#define TIMER_WHEEL_BITS0	8
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SIZE0	(1 << TIMER_WHEEL_BITS0)
+#define TIMER_WHEEL_SIZE	(1 << TIMER_WHEEL_BITS)
+
+/* the longest timeout in ms, about 49 days */
+#define TIMER_TIMEOUT_MAX	((1L << (TIMER_WHEEL_BITS0 + \
+		TIMER_WHEEL_BITS * (TIMER_WHEEL_LEVELS - 1))) - 1)
+
+#define TIMER_INFINITE	UINT64_MAX
 
 typedef struct {
-	struct list_head	tgroup_head;
+	struct list_head	wheel0[TIMER_WHEEL_SIZE0];
+	struct list_head	wheel[TIMER_WHEEL_LEVELS - 1][TIMER_WHEEL_SIZE];
 	struct list_head	expires;
+	uint64_t		jiffies;
+	int			nr;
 
+	uint64_t	msec;
 	time_t		now;
 	char		format_rfc1123[LEN_TIME_FARMAT_RFC1123];
 	char		format_log[LEN_TIME_FARMAT_LOG];
 } ohc_timer_t;
 
-typedef struct ohc_timer_group_s ohc_timer_group_t;
 typedef struct {
 	struct list_head	tnode_node;
-	time_t			timeout;
-	ohc_timer_group_t	*group;
+	uint64_t		expire;
+	long			timeout;
+	ohc_timer_t		*timer;
 } ohc_timer_node_t;
 
 time_t timer_parse_rfc1123(char *p);
 void timer_destroy(ohc_timer_t *timer);
-time_t timer_closest(ohc_timer_t *timer);
+int timer_closest(ohc_timer_t *timer, int max);
 struct list_head *timer_expire(ohc_timer_t *timer);
-int timer_add(ohc_timer_t *timer, ohc_timer_node_t *tnode, time_t timeout);
+void timer_add(ohc_timer_t *timer, ohc_timer_node_t *tnode, long timeout);
 void timer_del(ohc_timer_node_t *tnode);
-int timer_update(ohc_timer_node_t *tnode, time_t timeout);
+void timer_update(ohc_timer_node_t *tnode, long timeout);
 void timer_init(ohc_timer_t *timer);
 char *timer_format_rfc1123(ohc_timer_t *timer);
 char *timer_format_log(ohc_timer_t *timer);
@@ -48,12 +65,27 @@ static inline time_t timer_now(ohc_timer_t *timer)
 	return timer->now;
 }
 
+/* the monotonic time in ms, for timeouts */
+static inline uint64_t timer_msec(ohc_timer_t *timer)
+{
+	return timer->msec;
+}
+
+/* @now is the wall time, for items' expire, logs and headers */
 static inline time_t timer_refresh(ohc_timer_t *timer)
 {
-	timer->now = time(NULL);
-	timer->format_rfc1123[0] = '\0';
-	timer->format_log[0] = '\0';
+	struct timespec ts;
+	time_t now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	timer->msec = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 
+	now = time(NULL);
+	if(now != timer->now) {
+		timer->now = now;
+		timer->format_rfc1123[0] = '\0';
+		timer->format_log[0] = '\0';
+	}
 	return timer->now;
 }
 
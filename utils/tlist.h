@@ -0,0 +1,107 @@
+/**
+ *
+ * Double linked list as list.h, but linked by positions in a
+ * region based at @tlist_base, instead of pointers. So the lists
+ * can be kept in a file mapping, which may be mapped at another
+ * address next time.
+ *
+ * A position is in 8 bytes, so the region is 32G at most, and
+ * the nodes must be aligned by 8. Position 0 is NULL.
+ *
+ **/
+
+#ifndef _OHC_TLIST_H_
+#define _OHC_TLIST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint32_t tpos_t;
+
+#define TPOS_SHIFT	3
+#define TPOS_LIMIT	((size_t)1 << (32 + TPOS_SHIFT))
+
+extern char *tlist_base;
+
+struct tlist_head {
+	tpos_t	next, prev;
+} __attribute__((aligned(8)));
+
+static inline void *tpos_ptr(tpos_t pos)
+{
+	return pos ? tlist_base + ((size_t)pos << TPOS_SHIFT) : NULL;
+}
+
+static inline tpos_t tpos_of(void *p)
+{
+	return p ? ((char *)p - tlist_base) >> TPOS_SHIFT : 0;
+}
+
+#define tlist_next(ptr) ((struct tlist_head *)tpos_ptr((ptr)->next))
+#define tlist_prev(ptr) ((struct tlist_head *)tpos_ptr((ptr)->prev))
+
+#define INIT_TLIST_HEAD(ptr) do { \
+	(ptr)->next = (ptr)->prev = tpos_of(ptr); \
+} while (0)
+
+static inline void __tlist_add(struct tlist_head *nnew,
+		struct tlist_head *prev, struct tlist_head *next)
+{
+	tpos_t pos = tpos_of(nnew);
+
+	next->prev = pos;
+	nnew->next = tpos_of(next);
+	nnew->prev = tpos_of(prev);
+	prev->next = pos;
+}
+
+/* insert @nnew after @head */
+static inline void tlist_add(struct tlist_head *nnew, struct tlist_head *head)
+{
+	__tlist_add(nnew, head, tlist_next(head));
+}
+
+/* insert @nnew before @head */
+static inline void tlist_add_tail(struct tlist_head *nnew, struct tlist_head *head)
+{
+	__tlist_add(nnew, tlist_prev(head), head);
+}
+
+static inline void __tlist_del(struct tlist_head *prev, struct tlist_head *next)
+{
+	next->prev = tpos_of(prev);
+	prev->next = tpos_of(next);
+}
+
+static inline void tlist_del(struct tlist_head *entry)
+{
+	__tlist_del(tlist_prev(entry), tlist_next(entry));
+	entry->next = entry->prev = 0;
+}
+
+static inline void tlist_del_init(struct tlist_head *entry)
+{
+	__tlist_del(tlist_prev(entry), tlist_next(entry));
+	INIT_TLIST_HEAD(entry);
+}
+
+static inline int tlist_empty(struct tlist_head *head)
+{
+	return head->next == tpos_of(head);
+}
+
+#define tlist_entry(ptr, type, member) \
+	((type *)((char *)(ptr)-(unsigned long)(&((type *)0)->member)))
+
+#define tlist_for_each(pos, head) \
+	for (pos = tlist_next(head); pos != (head); pos = tlist_next(pos))
+
+#define tlist_for_each_safe(pos, n, head) \
+	for (pos = tlist_next(head), n = tlist_next(pos); pos != (head); \
+		pos = n, n = tlist_next(pos))
+
+#define tlist_for_each_reverse_safe(pos, n, head) \
+	for (pos = tlist_prev(head), n = tlist_prev(pos); pos != (head); \
+		pos = n, n = tlist_prev(pos))
+
+#endif
@@ -5,6 +5,7 @@
  *
  */
 
+#include <sys/eventfd.h>
 #include "worker.h"
 
 static struct list_head *current_worker = NULL;
@@ -12,8 +13,36 @@ static struct list_head *current_worker = NULL;
 static int workers = 0;
 static int new_workers = 0;
 
+/* workers with waiting requests, woken by worker_wake_waiting() */
+static LIST_HEAD(waiting_workers);
+static pthread_mutex_t waiting_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int waiting_workers_nr = 0;
+
+static void worker_wait_register(ohc_worker_t *worker)
+{
+	pthread_mutex_lock(&waiting_workers_lock);
+	list_add(&worker->wait_node, &waiting_workers);
+	__sync_fetch_and_add(&waiting_workers_nr, 1);
+	pthread_mutex_unlock(&waiting_workers_lock);
+	worker->wait_registered = 1;
+}
+
+static void worker_wait_unregister(ohc_worker_t *worker)
+{
+	pthread_mutex_lock(&waiting_workers_lock);
+	list_del(&worker->wait_node);
+	__sync_fetch_and_sub(&waiting_workers_nr, 1);
+	pthread_mutex_unlock(&waiting_workers_lock);
+	worker->wait_registered = 0;
+}
+
 static void worker_destory(ohc_worker_t *worker)
 {
+	if(worker->wait_registered) {
+		worker_wait_unregister(worker);
+	}
+	epoll_del(worker->epoll_fd, worker->wake_fd);
+	close(worker->wake_fd);
 	epoll_del(worker->epoll_fd, worker->receive_fd);
 	epoll_del(master_epoll_fd, worker->recycle_fd);
 	close(worker->receive_fd);
@@ -30,12 +59,31 @@ static void worker_destory(ohc_worker_t *worker)
 
 static int worker_check_quit(ohc_worker_t *worker)
 {
-	if(worker->quit_time <= timer_now(&worker->timer)) {
+	if(worker->quit_time <= timer_msec(&worker->timer)) {
 		request_clean(&worker->working_requests, 0);
+		request_clean(&worker->waiting_requests, 0);
 	}
 	return worker->request_nr == 0;
 }
 
+/* call the waiting requests' handlers, see worker_request_wait() */
+static void worker_request_wake(ohc_worker_t *worker)
+{
+	LIST_HEAD(waiting);
+	struct list_head *p, *safe;
+	ohc_request_t *r;
+
+	list_splice(&worker->waiting_requests, &waiting);
+	INIT_LIST_HEAD(&worker->waiting_requests);
+
+	list_for_each_safe(p, safe, &waiting) {
+		r = list_entry(p, ohc_request_t, rnode);
+		list_del(&r->rnode);
+		list_add(&r->rnode, &worker->working_requests);
+		r->event_handler(r);
+	}
+}
+
 static void *worker_entry(void *data)
 {
 #define MAX_EVENTS 512
@@ -51,7 +99,12 @@ static void *worker_entry(void *data)
 
 	while(worker->quit_time == 0 || !worker_check_quit(worker)) {
 
-		rc = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, 1000);
+		if(worker->wait_registered && list_empty(&worker->waiting_requests)) {
+			worker_wait_unregister(worker);
+		}
+
+		rc = epoll_wait(worker->epoll_fd, events, MAX_EVENTS,
+				timer_closest(&worker->timer, 1000));
 		if(rc == -1) {
 			log_error_run(errno, "worker epoll_wait");
 		}
@@ -68,16 +121,28 @@ static void *worker_entry(void *data)
 			ptr = (void *)(((uintptr_t)ptr) & ~EVENT_TYPE_MASK);
 
 			/* @receive_fd is ready */
-			if(type == EVENT_TYPE_PIPE) {
+			if(type == EVENT_TYPE_PIPE && ptr == NULL) {
 				worker_request_receive(worker);
 
+			/* @wake_fd is ready, the waiting requests are
+			 * checked below */
+			} else if(type == EVENT_TYPE_PIPE) {
+				eventfd_t value;
+				eventfd_read(worker->wake_fd, &value);
+
 			/* ready requests */
 			} else {
-				r = ptr;
-				r->event_handler(r);
+				event_process(ptr, events[i].events);
 			}
 		}
 
+		/* check the waiting requests. After the ready events, so the
+		 * requests which begin waiting in this loop are checked too,
+		 * since they may miss the wake before registered. Besides,
+		 * the woken requests may be returned to master, while they
+		 * are still registered here. */
+		worker_request_wake(worker);
+
 		/* timeout requests */
 		expires = timer_expire(&worker->timer);
 		list_for_each_safe(p, safep, expires) {
@@ -122,19 +187,28 @@ static int worker_create(void)
 		goto fail3;
 	}
 
+	worker->wake_fd = eventfd(0, EFD_NONBLOCK);
+	if(worker->wake_fd < 0) {
+		goto fail3;
+	}
+
 	/* create epoll, and add recycle_fd */
 	worker->epoll_fd = epoll_create(100);
 	if(worker->epoll_fd < 0) {
-		goto fail3;
+		goto fail4;
 	}
 
 	if(epoll_add_read(worker->epoll_fd, worker->receive_fd,
 			(void *)EVENT_TYPE_PIPE) < 0) {
-		goto fail4;
+		goto fail5;
+	}
+	if(epoll_add_read(worker->epoll_fd, worker->wake_fd,
+			(void *)((uintptr_t)worker | EVENT_TYPE_PIPE)) < 0) {
+		goto fail6;
 	}
 	if(epoll_add_read(master_epoll_fd, worker->recycle_fd,
 			(void *)((uintptr_t)worker | EVENT_TYPE_PIPE))) {
-		goto fail5;
+		goto fail7;
 	}
 
 	/* each worker thread has its own timer */
@@ -144,6 +218,8 @@ static int worker_create(void)
 	worker->request_nr = 0;
 	INIT_LIST_HEAD(&worker->working_requests);
 	INIT_LIST_HEAD(&worker->blocked_requests);
+	INIT_LIST_HEAD(&worker->waiting_requests);
+	worker->wait_registered = 0;
 
 	/* no head in worker-list, used in worker_request_dispatch() */
 	if(current_worker == NULL) {
@@ -158,20 +234,24 @@ static int worker_create(void)
 	  * arg: worker 
            */
 	if(pthread_create(&worker->tid, NULL, worker_entry, worker) != 0) {
-		goto fail6;
+		goto fail8;
 	}
 
 	workers++;
 	return OHC_OK;
 
-fail6:
+fail8:
 	list_del(&worker->wnode);
 	timer_destroy(&worker->timer);
 	epoll_del(master_epoll_fd, worker->recycle_fd);
-fail5:
+fail7:
+	epoll_del(worker->epoll_fd, worker->wake_fd);
+fail6:
 	epoll_del(worker->epoll_fd, worker->receive_fd);
-fail4:
+fail5:
 	close(worker->epoll_fd);
+fail4:
+	close(worker->wake_fd);
 fail3:
 	close(worker->recycle_fd);
 	close(worker->return_fd);
@@ -193,7 +273,7 @@ fail0:
  * call worker_create() to add new workers behind @current_worker,
  * and worker_conf_rollback() call worker_delete() to delete
  * the new workers. */
-static void worker_delete(int num, time_t quit_time)
+static void worker_delete(int num, uint64_t quit_time)
 {
 	ohc_worker_t *worker;
 	int i;
@@ -201,7 +281,7 @@ static void worker_delete(int num, time_t quit_time)
 	for(i = 0; i < num; i++) {
 		worker = list_entry(current_worker->next, ohc_worker_t, wnode);
 		list_del(&worker->wnode);
-		worker->quit_time = quit_time ? quit_time : BIG_TIME;
+		worker->quit_time = quit_time ? quit_time : TIMER_INFINITE;
 		workers--;
 	}
 }
@@ -242,7 +322,7 @@ void worker_conf_rollback(ohc_conf_t *conf_cycle)
 	worker_delete(new_workers, 0);
 }
 
-void worker_quit(time_t quit_time)
+void worker_quit(uint64_t quit_time)
 {
 	worker_delete(workers, quit_time);
 }
@@ -342,6 +422,43 @@ void worker_request_recycle(ohc_worker_t *worker)
 	worker->request_nr -= count;
 }
 
+/* worker call this, to call @handler of @r again after worker_wake_waiting()
+ * is called, without any event. E.g. a GET waits for the item in putting
+ * to be written. */
+void worker_request_wait(ohc_request_t *r, req_handler_f *handler)
+{
+	ohc_worker_t *worker = r->worker_thread;
+
+	event_cancel(r);
+	r->event_handler = handler;
+	list_del(&r->rnode);
+	list_add_tail(&r->rnode, &worker->waiting_requests);
+
+	if(!worker->wait_registered) {
+		worker_wait_register(worker);
+	}
+}
+
+/* wake the workers with waiting requests, after the condition they wait
+ * for changes. E.g. a PUT writes more of the item in putting, or aborts.
+ * The caller should make the change visible before calling this. */
+void worker_wake_waiting(void)
+{
+	ohc_worker_t *worker;
+	struct list_head *p;
+
+	if(waiting_workers_nr == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&waiting_workers_lock);
+	list_for_each(p, &waiting_workers) {
+		worker = list_entry(p, ohc_worker_t, wait_node);
+		eventfd_write(worker->wake_fd, 1);
+	}
+	pthread_mutex_unlock(&waiting_workers_lock);
+}
+
 /* worker call this to receive a request from master */
 void worker_request_receive(ohc_worker_t *worker)
 {
@@ -14,9 +14,10 @@ struct ohc_worker_s {
 	struct list_head	wnode;
 	struct list_head	working_requests;
 	struct list_head	blocked_requests;
+	struct list_head	waiting_requests;
 	ohc_timer_t		timer;
 
-	time_t		quit_time;
+	uint64_t	quit_time;
 	pthread_t	tid;
 	int		epoll_fd;
 
@@ -35,13 +36,18 @@ struct ohc_worker_s {
 	int		receive_fd;
 	int		return_fd;
 
+	/* eventfd to wake the waiting requests, see worker_wake_waiting().
+	 * The worker is in the waiting-workers list if @wait_registered. */
+	int			wake_fd;
+	int			wait_registered;
+	struct list_head	wait_node;
 };
 
 int worker_conf_check(ohc_conf_t *conf_cycle);
 void worker_conf_load(ohc_conf_t *conf_cycle);
 void worker_conf_rollback(ohc_conf_t *conf_cycle);
 
-void worker_quit(time_t quit_time);
+void worker_quit(uint64_t quit_time);
 
 /* master calls */
 int worker_request_dispatch(ohc_request_t *r, req_handler_f *handler);
@@ -50,5 +56,9 @@ void worker_request_recycle(ohc_worker_t *worker);
 /* worker calls */
 int worker_request_return(ohc_request_t *r, req_handler_f *handler);
 void worker_request_receive(ohc_worker_t *worker);
+void worker_request_wait(ohc_request_t *r, req_handler_f *handler);
+
+/* worker or master calls */
+void worker_wake_waiting(void);
 
 #endif